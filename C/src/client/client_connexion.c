@@ -0,0 +1,494 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "openssl/err.h"
+
+#include "client_connexion.h"
+#include "../conf.c"
+
+/**
+ * New session callback keeping the last ticket of the server in the context
+ * @param ssl       The connection
+ * @param session   The session, with a reference for the callback
+ * @return          1 as the reference is kept
+ */
+static int on_new_session(SSL *ssl, SSL_SESSION *session);
+
+/**
+ * Handle a frame received from the server
+ * @param c         The connection
+ * @param header    The header of the frame
+ * @param payload   The payload of the frame
+ * @return          0 on success, -1 on error
+ */
+static int handle_frame(client_connexion *c, const frame_header *header, const uint8_t *payload);
+
+/**
+ * Hand a message to the oldest request of its stream, or to the handler
+ * @param c         The connection
+ * @param stream    The stream of the message
+ * @param data      The message, NULL if the stream closed
+ * @param length    The size of the message
+ * @param last      0 while more chunks of a bulk transfer follow
+ */
+static void deliver(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length, int last);
+
+/**
+ * Tell the requests of a stream that no response will come
+ * @param c         The connection
+ * @param stream    The stream, -1 for every stream
+ */
+static void fail_requests(client_connexion *c, int stream);
+
+
+int client_context_init(client_context *cc, const char *host, int port, const char *ca_file, int options)
+{
+    memset(cc, 0, sizeof(*cc));
+    cc->addr.sin_family = AF_INET;
+    cc->addr.sin_port = htons((uint16_t)port);
+
+    // Kept to check the certificate of the server at each handshake
+    if (strlen(host) >= sizeof(cc->host)) {
+        fprintf(stderr, "Host name too long: %s\n", host);
+        return -1;
+    }
+    strcpy(cc->host, host);
+
+    // A name is resolved once, the connections of a pool then reach the same server
+    cc->host_is_address = inet_pton(AF_INET, host, &cc->addr.sin_addr) == 1;
+    if (!cc->host_is_address) {
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+        struct addrinfo *result;
+        int error = getaddrinfo(host, NULL, &hints, &result);
+        if (error != 0) {
+            fprintf(stderr, "Impossible to resolve %s: %s\n", host, gai_strerror(error));
+            return -1;
+        }
+        cc->addr.sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
+    }
+
+    cc->ctx = SSL_CTX_new(TLS_client_method());
+    if (cc->ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    if (!(options & CLIENT_NO_VERIFY)) {
+        int loaded = ca_file != NULL
+                     ? SSL_CTX_load_verify_locations(cc->ctx, ca_file, NULL)
+                     : SSL_CTX_set_default_verify_paths(cc->ctx);
+        if (loaded != 1) {
+            ERR_print_errors_fp(stderr);
+            SSL_CTX_free(cc->ctx);
+            return -1;
+        }
+        SSL_CTX_set_verify(cc->ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    // Only the last ticket is kept, by the context rather than by the internal cache
+    SSL_CTX_set_session_cache_mode(cc->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(cc->ctx, on_new_session);
+    SSL_CTX_set_app_data(cc->ctx, cc);
+    pthread_mutex_init(&cc->lock, NULL);
+    return 0;
+}
+
+void client_context_free(client_context *cc)
+{
+    if (cc->session != NULL) {
+        SSL_SESSION_free(cc->session);
+        cc->session = NULL;
+    }
+    SSL_CTX_free(cc->ctx);
+    cc->ctx = NULL;
+    pthread_mutex_destroy(&cc->lock);
+}
+
+int client_connexion_open(client_connexion *c, client_context *cc)
+{
+    c->context = cc;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1 || connect(c->fd, (struct sockaddr *)&cc->addr, sizeof(cc->addr)) == -1) {
+        perror("connect");
+        if (c->fd != -1) {
+            close(c->fd);
+        }
+        return -1;
+    }
+
+    // The pipelined frames are flushed together, none waits for the acknowledgment of the previous one
+    int enable = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+int client_connexion_handshake(client_connexion *c, int timeout)
+{
+    frame_reader_reset(&c->reader);
+    heartbeat_init(&c->heartbeat);
+    stream_table_reset(&c->streams);
+    c->pending_head = 0;
+    c->pending_count = 0;
+    c->handler = NULL;
+    c->handler_arg = NULL;
+    c->frames_received = 0;
+    c->bytes_received = 0;
+    if (tls_engine_new(&c->tls, c->context->ctx, 0) == -1) {
+        close(c->fd);
+        return -1;
+    }
+
+    // Any certificate of the authorities is not enough, it must be issued for the server
+    const char *host = c->context->host;
+    int named = c->context->host_is_address
+                ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(c->tls.ssl), host)
+                : SSL_set_tlsext_host_name(c->tls.ssl, host) && SSL_set1_host(c->tls.ssl, host);
+    if (named != 1) {
+        ERR_print_errors_fp(stderr);
+        tls_engine_free(&c->tls);
+        close(c->fd);
+        return -1;
+    }
+
+    // Resume the last session, the server skips the key exchange and the certificate
+    pthread_mutex_lock(&c->context->lock);
+    if (c->context->session != NULL) {
+        SSL_set_session(c->tls.ssl, c->context->session);
+    }
+    pthread_mutex_unlock(&c->context->lock);
+
+    // Each flight of the client is sent, then the answer of the server is awaited
+    uint64_t deadline_us = heartbeat_now_us() + (uint64_t)timeout * 1000;
+    int result;
+    while ((result = tls_engine_handshake(&c->tls)) == 0 && client_connexion_flush(c) == 0) {
+        struct pollfd fd = {.fd = c->fd, .events = POLLIN};
+        uint8_t buffer[FRAME_MAX_PAYLOAD];
+        ssize_t length;
+
+        if (heartbeat_now_us() > deadline_us || poll(&fd, 1, timeout) <= 0 ||
+            (length = read(c->fd, buffer, sizeof(buffer))) <= 0 ||
+            tls_engine_feed(&c->tls, buffer, (size_t)length) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    if (result != 1 || client_connexion_flush(c) == -1) {
+        ERR_print_errors_fp(stderr);
+        tls_engine_free(&c->tls);
+        close(c->fd);
+        return -1;
+    }
+
+    c->context->handshakes++;
+    if (SSL_session_reused(c->tls.ssl)) {
+        c->context->resumptions++;
+    }
+    return 0;
+}
+
+int client_connexion_connect(client_connexion *c, client_context *cc, int timeout)
+{
+    if (client_connexion_open(c, cc) == -1) {
+        return -1;
+    }
+    return client_connexion_handshake(c, timeout);
+}
+
+void client_connexion_set_handler(client_connexion *c, client_handler handler, void *arg)
+{
+    c->handler = handler;
+    c->handler_arg = arg;
+}
+
+int client_connexion_write_frame(client_connexion *c, uint8_t type, uint16_t stream, const uint8_t *payload,
+                                 size_t length)
+{
+    if (length > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Message too long: %zu bytes\n", length);
+        return -1;
+    }
+
+    // Header and payload in a single record
+    frame_encode_header(c->buffer, type, 0, stream, (uint32_t)length);
+    memcpy(c->buffer + FRAME_HEADER_SIZE, payload, length);
+    return tls_engine_write(&c->tls, c->buffer, FRAME_HEADER_SIZE + length) == -1 ? -1 : 0;
+}
+
+int client_connexion_send(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length)
+{
+    ssize_t window = stream_send_window(&c->streams, stream);
+    if (window < 0 || (size_t)window < length) {
+        return -1;
+    }
+    if (client_connexion_write_frame(c, FRAME_DATA, stream, data, length) == -1) {
+        return -1;
+    }
+    stream_sent(&c->streams, stream, length);
+    return 0;
+}
+
+int client_connexion_request(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length,
+                             client_handler callback, void *arg)
+{
+    if (c->pending_count == CLIENT_PIPELINE_DEPTH || client_connexion_send(c, stream, data, length) == -1) {
+        return -1;
+    }
+
+    client_request *request = &c->pending[(c->pending_head + c->pending_count) % CLIENT_PIPELINE_DEPTH];
+    request->stream = stream;
+    request->callback = callback;
+    request->arg = arg;
+    c->pending_count++;
+    return 0;
+}
+
+int client_connexion_open_stream(client_connexion *c, uint16_t stream)
+{
+    uint8_t window[STREAM_WINDOW_SIZE];
+    frame_put_u32(window, STREAM_INITIAL_WINDOW);
+    return client_connexion_write_frame(c, FRAME_STREAM_OPEN, stream, window, sizeof(window));
+}
+
+int client_connexion_ping(client_connexion *c)
+{
+    uint8_t payload[HEARTBEAT_PAYLOAD_SIZE];
+    if (heartbeat_ping(&c->heartbeat, payload, heartbeat_now_us()) >= HEARTBEAT_MAX_MISSES) {
+        return -1;
+    }
+    return client_connexion_write_frame(c, FRAME_PING, STREAM_DEFAULT, payload, sizeof(payload));
+}
+
+int client_connexion_flush(client_connexion *c)
+{
+    uint8_t buffer[FRAME_MAX_PAYLOAD];
+    size_t length;
+    uint64_t deadline_us = heartbeat_now_us() + (uint64_t)WRITE_TIMEOUT_MS * 1000;
+
+    while ((length = tls_engine_take(&c->tls, buffer, sizeof(buffer))) > 0) {
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t sent = send(c->fd, buffer + offset, length - offset, MSG_NOSIGNAL);
+            if (sent >= 0) {
+                offset += (size_t)sent;
+                continue;
+            }
+
+            // The server does not read fast enough, a server which stopped reading is given up
+            uint64_t now_us = heartbeat_now_us();
+            struct pollfd fd = {.fd = c->fd, .events = POLLOUT};
+            if ((errno != EAGAIN && errno != EINTR) || now_us >= deadline_us
+                || poll(&fd, 1, (int)((deadline_us - now_us + 999) / 1000)) <= 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int client_connexion_poll(client_connexion *c, int timeout)
+{
+    if (client_connexion_flush(c) == -1) {
+        return -1;
+    }
+
+    struct pollfd fd = {.fd = c->fd, .events = POLLIN};
+    int ready = poll(&fd, 1, timeout);
+    if (ready <= 0) {
+        return ready == -1 && errno != EINTR ? -1 : 0;
+    }
+
+    uint8_t buffer[FRAME_MAX_PAYLOAD];
+    ssize_t length = read(c->fd, buffer, sizeof(buffer));
+    if (length == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (length <= 0 || tls_engine_feed(&c->tls, buffer, (size_t)length) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        size_t available;
+        uint8_t *space = frame_reader_space(&c->reader, &available);
+        ssize_t bytes_read = tls_engine_read(&c->tls, space, available);
+        if (bytes_read == 0) {
+            break;
+        } else if (bytes_read < 0) {
+            return -1;
+        }
+        frame_reader_commit(&c->reader, (size_t)bytes_read);
+
+        frame_header header;
+        const uint8_t *payload;
+        int status;
+        while ((status = frame_reader_next(&c->reader, &header, &payload)) == 1) {
+            int result = handle_frame(c, &header, payload);
+            frame_reader_consume(&c->reader, &header);
+            if (result == -1) {
+                return -1;
+            }
+        }
+        if (status == -1) {
+            return -1;
+        }
+    }
+
+    // Pongs and windows leave now rather than with the next request
+    return client_connexion_flush(c);
+}
+
+void client_connexion_cancel(client_connexion *c)
+{
+    fail_requests(c, -1);
+}
+
+void client_connexion_close(client_connexion *c)
+{
+    client_connexion_cancel(c);
+    tls_engine_shutdown(&c->tls);
+    client_connexion_flush(c);
+    tls_engine_free(&c->tls);
+    close(c->fd);
+}
+
+static int on_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    client_context *cc = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    pthread_mutex_lock(&cc->lock);
+    SSL_SESSION *previous = cc->session;
+    cc->session = session;
+    pthread_mutex_unlock(&cc->lock);
+
+    if (previous != NULL) {
+        SSL_SESSION_free(previous);
+    }
+    return 1;
+}
+
+static int handle_frame(client_connexion *c, const frame_header *header, const uint8_t *payload)
+{
+    switch (header->type) {
+        case FRAME_PING: {
+            uint8_t pong[HEARTBEAT_PAYLOAD_SIZE] = {0};
+            memcpy(pong, payload, header->length < sizeof(pong) ? header->length : sizeof(pong));
+            return client_connexion_write_frame(c, FRAME_PONG, STREAM_DEFAULT, pong, sizeof(pong));
+        }
+
+        case FRAME_PONG:
+            heartbeat_pong(&c->heartbeat, payload, header->length, heartbeat_now_us());
+            return 0;
+
+        case FRAME_DATA:
+        case FRAME_BULK: {
+            c->frames_received++;
+            c->bytes_received += header->length;
+            // The server ignored the window or the stream: the connection can not be trusted anymore
+            if (stream_receive(&c->streams, header->stream, header->length) == -1) {
+                fprintf(stderr, "Window exceeded on stream %u\n", header->stream);
+                return -1;
+            }
+            deliver(c, header->stream, payload, header->length,
+                    header->type == FRAME_DATA || !(header->flags & FRAME_FLAG_MORE));
+
+            // The message is consumed, the server may send as much again
+            uint32_t increment = stream_consume(&c->streams, header->stream, header->length);
+            if (increment > 0) {
+                uint8_t window[STREAM_WINDOW_SIZE];
+                frame_put_u32(window, increment);
+                return client_connexion_write_frame(c, FRAME_WINDOW, header->stream, window, sizeof(window));
+            }
+            return 0;
+        }
+
+        case FRAME_STREAM_OPEN:
+            // The server accepted the stream and gives its window
+            if (header->length < STREAM_WINDOW_SIZE
+                || stream_open(&c->streams, header->stream, frame_get_u32(payload)) == -1) {
+                fprintf(stderr, "Invalid stream %u opened\n", header->stream);
+            }
+            return 0;
+
+        case FRAME_STREAM_CLOSE:
+            stream_close(&c->streams, header->stream);
+            fail_requests(c, header->stream);
+            return 0;
+
+        case FRAME_WINDOW:
+            if (header->length < STREAM_WINDOW_SIZE
+                || stream_grant(&c->streams, header->stream, frame_get_u32(payload)) == -1) {
+                fprintf(stderr, "Invalid window received\n");
+            }
+            return 0;
+
+        default:
+            // Frames of newer protocol versions are ignored
+            return 0;
+    }
+}
+
+static void deliver(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length, int last)
+{
+    // The server answers the requests of a stream in order
+    for (size_t i = 0; i < c->pending_count; ++i) {
+        client_request *request = &c->pending[(c->pending_head + i) % CLIENT_PIPELINE_DEPTH];
+        if (request->stream != stream) {
+            continue;
+        }
+
+        client_request answered = *request;
+        if (last) {
+            // Close the gap left by the request, the order of the others is kept
+            for (size_t j = i; j > 0; --j) {
+                c->pending[(c->pending_head + j) % CLIENT_PIPELINE_DEPTH] =
+                        c->pending[(c->pending_head + j - 1) % CLIENT_PIPELINE_DEPTH];
+            }
+            c->pending_head = (c->pending_head + 1) % CLIENT_PIPELINE_DEPTH;
+            c->pending_count--;
+        }
+        if (answered.callback != NULL) {
+            answered.callback(answered.arg, stream, data, length, last);
+        }
+        return;
+    }
+
+    if (c->handler != NULL) {
+        c->handler(c->handler_arg, stream, data, length, last);
+    }
+}
+
+static void fail_requests(client_connexion *c, int stream)
+{
+    client_request failed[CLIENT_PIPELINE_DEPTH];
+    size_t failed_count = 0;
+    size_t kept = 0;
+
+    // The requests are removed first, the callbacks may queue new ones
+    for (size_t i = 0; i < c->pending_count; ++i) {
+        client_request request = c->pending[(c->pending_head + i) % CLIENT_PIPELINE_DEPTH];
+        if (stream == -1 || request.stream == (uint16_t)stream) {
+            failed[failed_count++] = request;
+        } else {
+            c->pending[(c->pending_head + kept++) % CLIENT_PIPELINE_DEPTH] = request;
+        }
+    }
+    c->pending_count = kept;
+
+    for (size_t i = 0; i < failed_count; ++i) {
+        if (failed[i].callback != NULL) {
+            failed[i].callback(failed[i].arg, failed[i].stream, NULL, 0, 1);
+        }
+    }
+}
@@ -0,0 +1,227 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_CONNEXION_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_CONNEXION_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "openssl/ssl.h"
+
+#include "../connexion/heartbeat.h"
+#include "../connexion/stream.h"
+#include "../frame/frame.h"
+#include "../tls/tls_engine.h"
+
+/**
+ * Client side of the connexion, for the peers of the robot and the tools
+ * driving a server. A connection runs the TLS engine over a non-blocking
+ * socket and speaks the frames of the server: pings are answered, streams
+ * are opened and their windows respected.
+ * Frames are queued in the engine and sent together by the next flush or
+ * poll: several requests are written before the first response comes back,
+ * and the responses of a stream complete its requests in order.
+ * The session tickets given by the server are kept by the context, so the
+ * next connection resumes the session instead of running a full handshake.
+ */
+
+// Requests of a connection waiting for their response
+#define CLIENT_PIPELINE_DEPTH 64
+
+// Longest name of a server, as in the DNS
+#define CLIENT_MAX_HOST_SIZE 254
+
+/**
+ * Options of a context, used as a bit mask
+ */
+#define CLIENT_NO_VERIFY 0x01
+
+/**
+ * Function receiving a message
+ * @param arg       The argument given with the function
+ * @param stream    The stream of the message
+ * @param data      The message, a chunk of it for a bulk transfer; NULL if the connection or the stream closed
+ * @param length    The size of the message
+ * @param last      0 while more chunks of a bulk transfer follow, 1 otherwise
+ */
+typedef void (*client_handler)(void *arg, uint16_t stream, const uint8_t *data, size_t length, int last);
+
+/**
+ * Settings shared by the connections to a server, and the session they resume
+ */
+typedef struct client_context {
+    SSL_CTX *ctx;
+    struct sockaddr_in addr;
+    char host[CLIENT_MAX_HOST_SIZE];
+    int host_is_address;
+    SSL_SESSION *session;
+    pthread_mutex_t lock;
+    atomic_ulong handshakes;
+    atomic_ulong resumptions;
+} client_context;
+
+/**
+ * A request waiting for its response
+ */
+typedef struct client_request {
+    uint16_t stream;
+    client_handler callback;
+    void *arg;
+} client_request;
+
+/**
+ * A connection to the server, used by one thread at a time
+ */
+typedef struct client_connexion {
+    int fd;
+    tls_engine tls;
+    frame_reader reader;
+    heartbeat heartbeat;
+    stream_table streams;
+    client_context *context;
+    client_request pending[CLIENT_PIPELINE_DEPTH];
+    size_t pending_head;
+    size_t pending_count;
+    client_handler handler;
+    void *handler_arg;
+    unsigned long frames_received;
+    unsigned long bytes_received;
+    uint8_t buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+} client_connexion;
+
+/**
+ * Prepare the connections to a server. Its certificate must be signed by the
+ * authorities and issued for the host, a name or an address, unless
+ * CLIENT_NO_VERIFY is given: only the local test tools do so.
+ * @param cc        The context
+ * @param host      The address or name of the server
+ * @param port      The port of the server
+ * @param ca_file   The PEM file of the authorities signing the certificate of the server, NULL for the ones of the system
+ * @param options   CLIENT_NO_VERIFY not to verify the certificate, 0 otherwise
+ * @return          0 on success, -1 on error
+ */
+int client_context_init(client_context *cc, const char *host, int port, const char *ca_file, int options);
+
+/**
+ * Free a context, once its connections are closed
+ * @param cc        The context
+ */
+void client_context_free(client_context *cc);
+
+/**
+ * Open a TCP connection to the server, without TLS
+ * @param c         The connection
+ * @param cc        The context
+ * @return          0 on success, -1 on error
+ */
+int client_connexion_open(client_connexion *c, client_context *cc);
+
+/**
+ * Run the TLS handshake on an opened connection, resuming the last session of the context if any
+ * @param c         The connection
+ * @param timeout   The maximum duration of the handshake in milliseconds
+ * @return          0 on success, -1 on error, the connection is then closed
+ */
+int client_connexion_handshake(client_connexion *c, int timeout);
+
+/**
+ * Open a connection and run its handshake
+ * @param c         The connection
+ * @param cc        The context
+ * @param timeout   The maximum duration of the handshake in milliseconds
+ * @return          0 on success, -1 on error
+ */
+int client_connexion_connect(client_connexion *c, client_context *cc, int timeout);
+
+/**
+ * Set the function receiving the messages which answer no request
+ * @param c         The connection
+ * @param handler   The function, NULL to only count the messages
+ * @param arg       The argument of the function
+ */
+void client_connexion_set_handler(client_connexion *c, client_handler handler, void *arg);
+
+/**
+ * Queue a frame, sent by the next flush or poll
+ * @param c         The connection
+ * @param type      The frame type
+ * @param stream    The stream of the frame
+ * @param payload   The payload
+ * @param length    The size of the payload, at most FRAME_MAX_PAYLOAD
+ * @return          0 on success, -1 on error
+ */
+int client_connexion_write_frame(client_connexion *c, uint8_t type, uint16_t stream, const uint8_t *payload,
+                                 size_t length);
+
+/**
+ * Queue a message in a data frame, within the window of its stream
+ * @param c         The connection
+ * @param stream    The stream, STREAM_DEFAULT or opened by client_connexion_open_stream
+ * @param data      The message
+ * @param length    The size of the message, at most FRAME_MAX_PAYLOAD
+ * @return          0 on success, -1 on error or if the window of the stream is too small
+ */
+int client_connexion_send(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length);
+
+/**
+ * Queue a message whose response is the next message of the server on the same stream
+ * @param c         The connection
+ * @param stream    The stream
+ * @param data      The message
+ * @param length    The size of the message
+ * @param callback  The function receiving the response
+ * @param arg       The argument of the function
+ * @return          0 on success, -1 on error or if CLIENT_PIPELINE_DEPTH requests are waiting
+ */
+int client_connexion_request(client_connexion *c, uint16_t stream, const uint8_t *data, size_t length,
+                             client_handler callback, void *arg);
+
+/**
+ * Queue the opening of a stream, usable once the server answered
+ * @param c         The connection
+ * @param stream    The stream
+ * @return          0 on success, -1 on error
+ */
+int client_connexion_open_stream(client_connexion *c, uint16_t stream);
+
+/**
+ * Queue a ping measuring the round trip time
+ * @param c         The connection
+ * @return          0 on success, -1 on error or if the last HEARTBEAT_MAX_MISSES pings were not answered
+ */
+int client_connexion_ping(client_connexion *c);
+
+/**
+ * Send the queued frames, waiting while the socket is full
+ * @param c         The connection
+ * @return          0 on success, -1 on error or if the socket stayed full for WRITE_TIMEOUT_MS
+ */
+int client_connexion_flush(client_connexion *c);
+
+/**
+ * Send the queued frames, then handle what the server sends within a delay:
+ * answer its pings, measure the pongs, open the streams, and hand the messages
+ * to the requests or to the handler
+ * @param c         The connection
+ * @param timeout   The delay in milliseconds, 0 to handle only what is already received
+ * @return          0 on success, -1 if the connection is closed
+ */
+int client_connexion_poll(client_connexion *c, int timeout);
+
+/**
+ * Give up the requests still waiting for their response, their callbacks receive NULL
+ * @param c         The connection
+ */
+void client_connexion_cancel(client_connexion *c);
+
+/**
+ * Tell the waiting requests the connection is lost, send the close notify and close the connection
+ * @param c         The connection
+ */
+void client_connexion_close(client_connexion *c);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_CONNEXION_H
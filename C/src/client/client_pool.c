@@ -0,0 +1,111 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdlib.h>
+
+#include "client_pool.h"
+
+
+int client_pool_init(client_pool *pool, client_context *cc, size_t size)
+{
+    pool->entries = calloc(size, sizeof(client_pool_entry));
+    if (pool->entries == NULL) {
+        return -1;
+    }
+    pool->context = cc;
+    pool->size = size;
+    pool->next = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, NULL);
+    return 0;
+}
+
+client_connexion *client_pool_acquire(client_pool *pool, int timeout)
+{
+    client_pool_entry *entry = NULL;
+
+    // Round robin over the idle connections, so every one of them stays warm
+    pthread_mutex_lock(&pool->lock);
+    while (entry == NULL) {
+        for (size_t i = 0; i < pool->size && entry == NULL; ++i) {
+            client_pool_entry *candidate = &pool->entries[(pool->next + i) % pool->size];
+            if (!candidate->busy) {
+                entry = candidate;
+                pool->next = (pool->next + i + 1) % pool->size;
+            }
+        }
+        if (entry == NULL) {
+            pthread_cond_wait(&pool->released, &pool->lock);
+        }
+    }
+    entry->busy = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    // The handshake runs outside of the lock, the other threads go on
+    if (!entry->connected) {
+        if (client_connexion_connect(&entry->conn, pool->context, timeout) == -1) {
+            client_pool_release(pool, &entry->conn, 0);
+            return NULL;
+        }
+        entry->connected = 1;
+    }
+    return &entry->conn;
+}
+
+void client_pool_release(client_pool *pool, client_connexion *c, int healthy)
+{
+    client_pool_entry *entry = (client_pool_entry *)c;
+
+    // Late responses go to the handler of the next user rather than to requests it does not know
+    if (!healthy && entry->connected) {
+        client_connexion_close(c);
+        entry->connected = 0;
+    } else {
+        client_connexion_cancel(c);
+    }
+    client_connexion_set_handler(c, NULL, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    entry->busy = 0;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int client_pool_check(client_pool *pool)
+{
+    int closed = 0;
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        client_pool_entry *entry = &pool->entries[i];
+
+        pthread_mutex_lock(&pool->lock);
+        int idle = !entry->busy && entry->connected;
+        if (idle) {
+            entry->busy = 1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!idle) {
+            continue;
+        }
+
+        // The pong of the previous check is read before the next ping
+        int healthy = client_connexion_poll(&entry->conn, 0) == 0 && client_connexion_ping(&entry->conn) == 0 &&
+                      client_connexion_flush(&entry->conn) == 0;
+        closed += !healthy;
+        client_pool_release(pool, &entry->conn, healthy);
+    }
+    return closed;
+}
+
+void client_pool_free(client_pool *pool)
+{
+    for (size_t i = 0; i < pool->size; ++i) {
+        if (pool->entries[i].connected) {
+            client_connexion_close(&pool->entries[i].conn);
+        }
+    }
+    free(pool->entries);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+}
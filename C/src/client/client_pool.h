@@ -0,0 +1,81 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_POOL_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_POOL_H
+
+#include <pthread.h>
+
+#include "client_connexion.h"
+
+/**
+ * Connections to a server shared by several threads. A thread acquires a
+ * connection, pipelines its requests on it and releases it; a connection lost
+ * meanwhile is reopened by the next acquisition, resuming the TLS session of
+ * the context. The health check pings the idle connections and closes those
+ * whose pings are no longer answered.
+ */
+
+/**
+ * A connection of the pool
+ */
+typedef struct client_pool_entry {
+    client_connexion conn;
+    int connected;
+    int busy;
+} client_pool_entry;
+
+/**
+ * The pool
+ */
+typedef struct client_pool {
+    client_context *context;
+    client_pool_entry *entries;
+    size_t size;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+} client_pool;
+
+/**
+ * Prepare a pool, the connections are opened when first acquired
+ * @param pool      The pool
+ * @param cc        The context of the connections
+ * @param size      The number of connections
+ * @return          0 on success, -1 on error
+ */
+int client_pool_init(client_pool *pool, client_context *cc, size_t size);
+
+/**
+ * Take an idle connection, opening it if it is closed
+ * @param pool      The pool
+ * @param timeout   The maximum duration of the handshake in milliseconds
+ * @return          The connection, NULL if it could not be opened
+ */
+client_connexion *client_pool_acquire(client_pool *pool, int timeout);
+
+/**
+ * Give a connection back, the requests still waiting are cancelled
+ * @param pool      The pool
+ * @param c         The connection given by client_pool_acquire
+ * @param healthy   0 if the connection failed, it is then closed
+ */
+void client_pool_release(client_pool *pool, client_connexion *c, int healthy);
+
+/**
+ * Check the idle connections: handle what they received, ping them and close
+ * those which missed HEARTBEAT_MAX_MISSES pings. Meant to be called every
+ * HEARTBEAT_PERIOD_MS.
+ * @param pool      The pool
+ * @return          The number of connections closed
+ */
+int client_pool_check(client_pool *pool);
+
+/**
+ * Close the connections and free a pool, once every connection is released
+ * @param pool      The pool
+ */
+void client_pool_free(client_pool *pool);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_POOL_H
@@ -4,3 +4,109 @@
 
 #define SERVER_PORT 12344
 #define MAX_MSG_SIZE 27
+
+// Connection lifecycle, MAX_SESSIONS clients for each thread serving them
+#define MAX_SESSIONS 8
+#define TIMER_TICK_MS 1
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define IDLE_TIMEOUT_MS 60000
+#define WRITE_TIMEOUT_MS 5000
+#define KEEPALIVE_IDLE_S 10
+#define KEEPALIVE_INTERVAL_S 5
+#define KEEPALIVE_COUNT 3
+#define STATS_PERIOD_MS 60000
+#define HEARTBEAT_PERIOD_MS 1000
+#define HEARTBEAT_MAX_MISSES 5
+
+// Size of the TLS records: a segment at start and after an idle period, then doubling up to 16 KB
+#define RECORD_DEFAULT_MSS 1460
+#define RECORD_OVERHEAD 29
+#define RECORD_MIN_SIZE 512
+#define RECORD_RAMP_BYTES (16 * 1024)
+#define RECORD_IDLE_MS 1000
+#define RECORD_NOTSENT_LOWAT (32 * 1024)
+
+// Admission of the new clients, before their handshake
+#define LISTEN_BACKLOG 128
+#define ADMISSION_RATE_PER_S 2
+#define ADMISSION_BURST 10
+#define ADMISSION_MAX_HANDSHAKES 32
+#define ADMISSION_TABLE_SIZE 1024
+#define ADMISSION_PROBES 8
+
+// Key exchange groups offered to the clients, warmed up at startup
+#define TLS_GROUPS "X25519:P-256"
+
+// Client authentication, enabled by CONNEXION_CLIENT_CA
+#define VERIFY_CACHE_SIZE 64
+#define VERIFY_CACHE_TTL_S 3600
+
+// OCSP stapling, enabled by CONNEXION_OCSP
+#define OCSP_REFRESH_S 3600
+#define OCSP_RETRY_S 60
+#define OCSP_TIMEOUT_S 5
+#define OCSP_MAX_SKEW_S 300
+#define OCSP_MAX_RESPONSE_SIZE (64 * 1024)
+
+// Batching of the outgoing messages
+#define WRITE_BATCH_SIZE (MAX_MSG_SIZE * 16)
+#define FLUSH_DELAY_MS 2
+
+// Scheduling of the outgoing messages
+#define SCHEDULER_CHUNK_SIZE 4096
+#define SCHEDULER_TELEMETRY_QUANTUM (SCHEDULER_CHUNK_SIZE * 4)
+#define SCHEDULER_MAX_MESSAGES 256
+#define SCHEDULER_MAX_BULK_SIZE (16 * 1024 * 1024)
+
+// Last value of each key, sent to the new clients
+#define LAST_VALUE_KEYS 128
+
+// Flow control of the streams
+#define STREAM_INITIAL_WINDOW (64 * 1024)
+
+// Compression of the data frames
+#define COMPRESS_DICT_PATH "../dictionaries/telemetry.zdict"
+#define COMPRESS_DICT_MAX_SIZE (128 * 1024)
+#define COMPRESS_DICT_FRAME_SIZE 1024
+#define COMPRESS_MIN_SIZE 64
+#define COMPRESS_BACKOFF_FRAMES 8
+#define COMPRESS_ZSTD_LEVEL 1
+
+// Spool of the messages sent while no client is connected
+#define SPOOL_SEGMENT_SIZE (1024 * 1024)
+#define SPOOL_MAX_SEGMENTS 16
+#define SPOOL_KEY_PATH "../certificates/spool.key"
+#define SPOOL_RETRY_MS 10
+
+// Shared memory ring of the producer processes, enabled by CONNEXION_INGEST
+#define INGEST_SLOTS 64
+#define INGEST_SLOT_SIZE (64 * 1024)
+#define INGEST_RETRY_MS 1
+
+// TLS termination for a plaintext backend, enabled by CONNEXION_PROXY
+#define PROXY_PORT (SERVER_PORT + 1)
+#define PROXY_MAX_CONNECTIONS 16
+#define PROXY_BUFFER_SIZE (16 * 1024)
+
+// DTLS datagrams, enabled by CONNEXION_DTLS
+#define DATAGRAM_CHANNELS 16
+#define DATAGRAM_MAX_PAYLOAD 1024
+#define DATAGRAM_MTU 1200
+#define DATAGRAM_QUEUE_MESSAGES 256
+#define DATAGRAM_TICK_MS 100
+
+// Timeline of the messages, enabled by CONNEXION_TRACE
+#define TIMELINE_BUFFER_EVENTS (64 * 1024)
+
+// io_uring backend
+#define URING_ENTRIES 256
+#define URING_ACCEPT_DEPTH 4
+#define URING_ACCEPT_RETRY_MS 100
+#define URING_BUFFER_SIZE 16384
+#define URING_QUEUE_MESSAGES 256
+
+// Sharded backend
+#define SHARDED_MAX_WORKERS 16
+#define SHARDED_DEQUE_SIZE 64
+#define SHARDED_BUFFER_SIZE 16384
+#define SHARDED_QUEUE_MESSAGES 256
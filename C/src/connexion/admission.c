@@ -0,0 +1,119 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "heartbeat.h"
+#include "../conf.c"
+
+// Tokens are counted in millionths, so a refill of a few microseconds is not lost
+#define TOKEN_UNIT 1000000ULL
+
+/**
+ * The handshake budget of a source address
+ */
+typedef struct source_bucket {
+    uint32_t address;
+    int used;
+    uint64_t tokens;
+    uint64_t updated_us;
+} source_bucket;
+
+static source_bucket buckets[ADMISSION_TABLE_SIZE];
+static int handshakes;
+static admission_stats counters;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find the bucket of an address, or take over the least recently used one
+ * of its probe sequence, the lock must be held
+ * @param address   The IPv4 address, in network order
+ * @param now_us    The current time
+ * @return          The bucket
+ */
+static source_bucket *find_bucket(uint32_t address, uint64_t now_us);
+
+
+int admission_check(const struct sockaddr_in *addr)
+{
+    uint32_t address = addr->sin_addr.s_addr;
+    int local = (ntohl(address) >> 24) == 127;
+
+    pthread_mutex_lock(&admission_lock);
+    uint64_t now_us = heartbeat_now_us();
+
+    // The handshakes in progress hold the CPU already
+    if (handshakes >= ADMISSION_MAX_HANDSHAKES) {
+        counters.over_capacity++;
+        pthread_mutex_unlock(&admission_lock);
+        return -1;
+    }
+
+    if (!local) {
+        source_bucket *bucket = find_bucket(address, now_us);
+        uint64_t refill = (now_us - bucket->updated_us) * ADMISSION_RATE_PER_S;
+        uint64_t capacity = (uint64_t)ADMISSION_BURST * TOKEN_UNIT;
+        bucket->tokens = bucket->tokens + refill > capacity ? capacity : bucket->tokens + refill;
+        bucket->updated_us = now_us;
+
+        if (bucket->tokens < TOKEN_UNIT) {
+            counters.rate_limited++;
+            pthread_mutex_unlock(&admission_lock);
+            return -1;
+        }
+        bucket->tokens -= TOKEN_UNIT;
+    }
+
+    handshakes++;
+    pthread_mutex_unlock(&admission_lock);
+    return 0;
+}
+
+void admission_release()
+{
+    pthread_mutex_lock(&admission_lock);
+    handshakes--;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+void admission_refuse(int fd)
+{
+    // A RST instead of a FIN: the client learns it at once and the server keeps nothing
+    struct linger reset = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(fd);
+}
+
+void admission_get_stats(admission_stats *stats)
+{
+    pthread_mutex_lock(&admission_lock);
+    *stats = counters;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+static source_bucket *find_bucket(uint32_t address, uint64_t now_us)
+{
+    uint32_t index = (address * 2654435761U) % ADMISSION_TABLE_SIZE;
+    source_bucket *oldest = &buckets[index];
+
+    for (int i = 0; i < ADMISSION_PROBES; ++i) {
+        source_bucket *bucket = &buckets[(index + i) % ADMISSION_TABLE_SIZE];
+        if (bucket->used && bucket->address == address) {
+            return bucket;
+        }
+        if (!bucket->used || (oldest->used && bucket->updated_us < oldest->updated_us)) {
+            oldest = bucket;
+        }
+    }
+
+    // An address seen long ago has refilled its bucket anyway, a new one starts full
+    oldest->address = address;
+    oldest->used = 1;
+    oldest->tokens = (uint64_t)ADMISSION_BURST * TOKEN_UNIT;
+    oldest->updated_us = now_us;
+    return oldest;
+}
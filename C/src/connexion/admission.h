@@ -0,0 +1,54 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_ADMISSION_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_ADMISSION_H
+
+#include <netinet/in.h>
+
+/**
+ * Admission of the accepted sockets, before their handshake.
+ * The signature of a handshake costs far more than an accept: a client
+ * reconnecting in a loop would keep the CPU busy and delay the real sessions.
+ * Each source address has a token bucket of ADMISSION_BURST handshakes,
+ * refilled by ADMISSION_RATE_PER_S per second, and at most
+ * ADMISSION_MAX_HANDSHAKES handshakes run at the same time. A refused socket
+ * is reset before any SSL object exists. The local tools (loopback) are only
+ * subject to the global cap.
+ */
+
+/**
+ * Counters of the refused sockets
+ */
+typedef struct admission_stats {
+    unsigned long rate_limited;
+    unsigned long over_capacity;
+} admission_stats;
+
+/**
+ * Decide whether an accepted socket may start its handshake.
+ * An admitted handshake must be ended with admission_release.
+ * @param addr      The address of the client
+ * @return          0 if admitted, -1 if the socket must be refused
+ */
+int admission_check(const struct sockaddr_in *addr);
+
+/**
+ * End an admitted handshake, whether it succeeded or not
+ */
+void admission_release();
+
+/**
+ * Reset and close a refused socket, leaving no TIME_WAIT behind
+ * @param fd        The client socket
+ */
+void admission_refuse(int fd);
+
+/**
+ * Read the counters of the refused sockets
+ * @param stats     The counters to fill
+ */
+void admission_get_stats(admission_stats *stats);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_ADMISSION_H
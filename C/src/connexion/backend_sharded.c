@@ -0,0 +1,844 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "openssl/err.h"
+
+#include "admission.h"
+#include "backend_sharded.h"
+#include "last_value.h"
+#include "message_queue.h"
+#include "session.h"
+#include "../conf.c"
+#include "../loop/event_loop.h"
+#include "../loop/work_deque.h"
+#include "../tls/tls_context.h"
+#include "../tls/tls_engine.h"
+#include "../trace/trace.h"
+
+_Static_assert(SHARDED_MAX_WORKERS <= MESSAGE_QUEUE_MAX_OWNERS, "a worker per owner of the inbox");
+
+struct worker;
+
+/**
+ * A socket accepted but not yet handshaked, waiting in a deque
+ */
+typedef struct shard_job {
+    int fd;
+    struct sockaddr_in addr;
+} shard_job;
+
+/**
+ * A client owned by a worker, its session included: the worker opens and closes it without any lock
+ */
+typedef struct shard_conn {
+    struct worker *owner;
+    session *s;
+    session session;
+    tls_engine tls;
+    event_handler handler;
+    wheel_timer handshake_timer;
+    send_scheduler queue;
+    int used;
+    int want_write;
+    int stalled;
+    uint32_t watched;
+    size_t tx_length;
+    size_t tx_offset;
+    uint8_t tx[SHARDED_BUFFER_SIZE];
+} shard_conn;
+
+/**
+ * Last round trip time measured by a worker, published for any thread.
+ * The fields are read one by one: a reader may mix two successive measures.
+ */
+typedef struct rtt_snapshot {
+    _Atomic uint64_t published_us;
+    _Atomic uint32_t last_us;
+    _Atomic uint32_t srtt_us;
+    _Atomic uint32_t rttvar_us;
+    _Atomic uint32_t min_us;
+    atomic_ulong samples;
+    atomic_ulong lost;
+} rtt_snapshot;
+
+/**
+ * A thread with its own event loop and clients
+ */
+typedef struct worker {
+    int index;
+    int work_fd;
+    SSL_CTX *ctx;
+    event_loop loop;
+    event_handler accept_handler;
+    event_handler work_handler;
+    work_deque handshakes;
+    send_scheduler outbox;
+    rtt_snapshot rtt;
+    shard_conn conns[MAX_SESSIONS];
+    uint8_t rx[SHARDED_BUFFER_SIZE];
+    uint8_t frame_buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    uint8_t inflate_buffer[FRAME_MAX_PAYLOAD];
+} worker;
+
+static worker *workers;
+static int worker_count;
+static atomic_int connected;
+static message_queue inbox;
+
+/**
+ * Wake up a worker to handle its queued messages and steal handshakes
+ * @param w         The worker
+ */
+static void signal_worker(worker *w);
+
+/**
+ * Accept the pending clients of the listener
+ * @param fd        The listening socket
+ * @param events    The epoll events
+ * @param arg       The worker
+ */
+static void on_accept(int fd, uint32_t events, void *arg);
+
+/**
+ * Handle the wake-up of a worker: grant the windows of the data read by the
+ * application, resume the clients stalled on the inbox, send the queued messages
+ * and run the handshake jobs
+ * @param fd        The eventfd of the worker
+ * @param events    The epoll events
+ * @param arg       The worker
+ */
+static void on_work(int fd, uint32_t events, void *arg);
+
+/**
+ * Run the handshake jobs of a worker, then steal the jobs of the other workers
+ * @param w         The worker
+ */
+static void run_jobs(worker *w);
+
+/**
+ * Take a client from a handshake job, the worker owns it from now on
+ * @param w         The worker
+ * @param job       The job, freed by the function
+ */
+static void start_conn(worker *w, shard_job *job);
+
+/**
+ * Handle the readiness of a client socket
+ * @param fd        The client socket
+ * @param events    The epoll events
+ * @param arg       The connection
+ */
+static void on_conn_event(int fd, uint32_t events, void *arg);
+
+/**
+ * Read the ciphertext of a client and handle the decrypted frames
+ * @param c         The connection
+ */
+static void receive(shard_conn *c);
+
+/**
+ * Handle the decrypted frames of a connection and decrypt the next ones. When
+ * the application is late and the inbox full, the frame waits in the reader and
+ * the socket is not read until a message is released.
+ * @param c         The connection
+ */
+static void process_frames(shard_conn *c);
+
+/**
+ * Watch the socket of a connection for reception unless it is stalled, and
+ * for writability while the socket is full
+ * @param c         The connection
+ */
+static void watch_conn(shard_conn *c);
+
+/**
+ * Encrypt the next queued chunks of a connection, one chunk ahead of the socket
+ * so that a control message never waits behind more than one bulk chunk
+ * @param c         The connection
+ * @return          The number of encrypted chunks
+ */
+static int schedule_conn(shard_conn *c);
+
+/**
+ * Send the ciphertext produced by the TLS engine
+ * @param c         The connection
+ * @return          0 when everything is sent, 1 if the socket is full, -1 on error
+ */
+static int send_pending(shard_conn *c);
+
+/**
+ * Send the queued messages of a connection, waiting for the socket to be
+ * writable when it is full
+ * @param c         The connection
+ */
+static void flush_conn(shard_conn *c);
+
+/**
+ * Close a connection: send the close notify and release the session
+ * @param c         The connection
+ */
+static void close_conn(shard_conn *c);
+
+/**
+ * Timer callback aborting a handshake which takes too long
+ * @param arg   The connection
+ */
+static void on_handshake_timeout(void *arg);
+
+/**
+ * Timer callback sending a ping and detecting dead peers
+ * @param arg   The connection
+ */
+static void on_heartbeat_timer(void *arg);
+
+
+int backend_sharded_start(SSL_CTX *context, int listener)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cores < 1 ? 1 : cores > SHARDED_MAX_WORKERS ? SHARDED_MAX_WORKERS : (int)cores;
+
+    workers = calloc((size_t)worker_count, sizeof(worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    connected = 0;
+    message_queue_init(&inbox, SHARDED_QUEUE_MESSAGES);
+
+    // The workers share the listener, each accept wakes up a single one of them
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    for (int i = 0; i < worker_count; ++i) {
+        worker *w = &workers[i];
+        w->index = i;
+        w->work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->work_fd == -1 || event_loop_init(&w->loop) == -1 ||
+            work_deque_init(&w->handshakes, SHARDED_DEQUE_SIZE) == -1) {
+            perror("Impossible to create the worker");
+            abort();
+        }
+        send_scheduler_init(&w->outbox, SHARDED_QUEUE_MESSAGES);
+
+        // A context per worker: the handshakes of the workers do not share its session cache and locks
+        w->ctx = tls_context_clone(context, NULL);
+        if (w->ctx == NULL && SSL_CTX_up_ref(context)) {
+            w->ctx = context;
+        }
+
+        w->accept_handler = (event_handler){listener, on_accept, w};
+        w->work_handler = (event_handler){w->work_fd, on_work, w};
+        event_loop_add_fd(&w->loop, &w->accept_handler, EPOLLIN | EPOLLEXCLUSIVE);
+        event_loop_add_fd(&w->loop, &w->work_handler, EPOLLIN);
+    }
+
+    for (int i = 0; i < worker_count; ++i) {
+        event_loop_start(&workers[i].loop);
+
+        // One worker per core
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i, &cpus);
+        pthread_setaffinity_np(workers[i].loop.thread, sizeof(cpus), &cpus);
+    }
+
+    TRACE("Sharded backend started with %d workers\n", worker_count);
+    return 0;
+}
+
+ssize_t backend_sharded_read(uint16_t *stream, uint8_t *buffer, size_t length)
+{
+    message *msg = message_queue_pop(&inbox, 1);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    // Messages longer than the buffer are truncated
+    size_t copied = msg->length < length ? msg->length : length;
+    memcpy(buffer, msg->data, copied);
+    *stream = msg->stream;
+
+    // The window of the stream is granted again by the worker owning the client
+    uint32_t wake = message_queue_release(&inbox, msg);
+    for (int i = 0; i < worker_count; ++i) {
+        if (wake & (1u << i)) {
+            signal_worker(&workers[i]);
+        }
+    }
+
+    return (ssize_t)copied;
+}
+
+ssize_t backend_sharded_send(outgoing_message *msg)
+{
+    // No client to write to
+    if (connected == 0) {
+        TRACE("No client connected\n");
+        return -1;
+    }
+
+    // Each worker sends the message to its own clients
+    int queued = 0;
+    for (int i = 0; i < worker_count; ++i) {
+        if (send_scheduler_push(&workers[i].outbox, msg) != -1) {
+            signal_worker(&workers[i]);
+            queued = 1;
+        }
+    }
+
+    if (!queued) {
+        TRACE("Write queue full\n");
+        return -1;
+    }
+    return (ssize_t)msg->length;
+}
+
+int backend_sharded_connected()
+{
+    return connected > 0;
+}
+
+int backend_sharded_get_rtt(rtt_stats *rtt)
+{
+    if (connected == 0) {
+        return -1;
+    }
+
+    // The most recent measure among the workers
+    rtt_snapshot *latest = NULL;
+    uint64_t latest_us = 0;
+    for (int i = 0; i < worker_count; ++i) {
+        uint64_t published_us = atomic_load_explicit(&workers[i].rtt.published_us, memory_order_acquire);
+        if (published_us > latest_us) {
+            latest = &workers[i].rtt;
+            latest_us = published_us;
+        }
+    }
+    if (latest == NULL) {
+        return -1;
+    }
+
+    rtt->last_us = atomic_load_explicit(&latest->last_us, memory_order_relaxed);
+    rtt->srtt_us = atomic_load_explicit(&latest->srtt_us, memory_order_relaxed);
+    rtt->rttvar_us = atomic_load_explicit(&latest->rttvar_us, memory_order_relaxed);
+    rtt->min_us = atomic_load_explicit(&latest->min_us, memory_order_relaxed);
+    rtt->samples = atomic_load_explicit(&latest->samples, memory_order_relaxed);
+    rtt->lost = atomic_load_explicit(&latest->lost, memory_order_relaxed);
+    return 0;
+}
+
+void backend_sharded_shutdown()
+{
+    message_queue_close(&inbox);
+}
+
+void backend_sharded_stop()
+{
+    for (int i = 0; i < worker_count; ++i) {
+        event_loop_stop(&workers[i].loop);
+    }
+
+    // The workers are stopped, their clients can be closed from here
+    for (int i = 0; i < worker_count; ++i) {
+        worker *w = &workers[i];
+        for (int j = 0; j < MAX_SESSIONS; ++j) {
+            close_conn(&w->conns[j]);
+        }
+
+        shard_job *job;
+        while ((job = work_deque_pop(&w->handshakes)) != NULL) {
+            admission_release();
+            close(job->fd);
+            free(job);
+        }
+
+        work_deque_free(&w->handshakes);
+        send_scheduler_free(&w->outbox);
+        event_loop_free(&w->loop);
+        close(w->work_fd);
+        SSL_CTX_free(w->ctx);
+    }
+
+    message_queue_free(&inbox);
+    free(workers);
+    workers = NULL;
+}
+
+static void signal_worker(worker *w)
+{
+    uint64_t value = 1;
+    if (write(w->work_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("eventfd write");
+    }
+}
+
+static void on_accept(int fd, uint32_t events, void *arg)
+{
+    (void)events;
+    worker *w = arg;
+    int queued = 0;
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int client = accept4(fd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The listener is shut down: stop watching it
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                event_loop_del_fd(&w->loop, &w->accept_handler);
+            }
+            break;
+        }
+
+        // A source reconnecting too fast is refused before any crypto runs
+        if (admission_check(&addr) == -1) {
+            admission_refuse(client);
+            continue;
+        }
+
+        shard_job *job = malloc(sizeof(*job));
+        if (job == NULL) {
+            admission_release();
+            close(client);
+            continue;
+        }
+        job->fd = client;
+        job->addr = addr;
+
+        // A full deque means the other workers are busy too, do the handshake here
+        if (work_deque_push(&w->handshakes, job) == -1) {
+            start_conn(w, job);
+        } else {
+            queued++;
+        }
+    }
+
+    // This worker takes one job, the others are offered to the next workers
+    for (int k = 1; k < queued && k < worker_count; ++k) {
+        signal_worker(&workers[(w->index + k) % worker_count]);
+    }
+    run_jobs(w);
+}
+
+static void on_work(int fd, uint32_t events, void *arg)
+{
+    (void)events;
+    worker *w = arg;
+
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return;
+    }
+
+    // Windows of the data read by the application
+    message_credit credits[STREAM_MAX];
+    size_t count;
+    while ((count = message_queue_take_credits(&inbox, (uint16_t)w->index, credits, STREAM_MAX)) > 0) {
+        for (size_t k = 0; k < count; ++k) {
+            for (int i = 0; i < MAX_SESSIONS; ++i) {
+                shard_conn *c = &w->conns[i];
+                if (c->used && c->s->id == credits[k].session) {
+                    session_consume_data(c->s, credits[k].stream, credits[k].length, w->frame_buffer);
+                }
+            }
+        }
+    }
+
+    // Room was made in the inbox
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (w->conns[i].used && w->conns[i].stalled) {
+            process_frames(&w->conns[i]);
+        }
+    }
+
+    // Queue the new messages for every client of the worker, most urgent first
+    outgoing_message *msg;
+    while ((msg = send_scheduler_take(&w->outbox)) != NULL) {
+        for (int i = 0; i < MAX_SESSIONS; ++i) {
+            shard_conn *c = &w->conns[i];
+            if (!c->used || !c->tls.established) {
+                continue;
+            }
+
+            // Slow client: its queue is full
+            if (send_scheduler_push(&c->queue, msg) == -1) {
+                TRACE("Client too slow, message dropped\n");
+            }
+        }
+        outgoing_message_release(msg);
+    }
+
+    // Then send them, as fast as each client reads
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (w->conns[i].used) {
+            flush_conn(&w->conns[i]);
+        }
+    }
+
+    run_jobs(w);
+}
+
+static void run_jobs(worker *w)
+{
+    while (1) {
+        shard_job *job = work_deque_pop(&w->handshakes);
+
+        // Nothing left here: help the other workers
+        for (int k = 1; job == NULL && k < worker_count; ++k) {
+            job = work_deque_steal(&workers[(w->index + k) % worker_count].handshakes);
+        }
+        if (job == NULL) {
+            return;
+        }
+
+        start_conn(w, job);
+    }
+}
+
+static void start_conn(worker *w, shard_job *job)
+{
+    int fd = job->fd;
+    struct sockaddr_in addr = job->addr;
+    free(job);
+
+    // Display connection detail
+    TRACE("\nNew connection :\n"
+          "- Source : %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    // Detect dead peers at the TCP level
+    session_configure_socket(fd);
+
+    shard_conn *c = NULL;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (!w->conns[i].used) {
+            c = &w->conns[i];
+            break;
+        }
+    }
+    if (c == NULL) {
+        fprintf(stderr, "Too many sessions\n");
+        admission_release();
+        close(fd);
+        return;
+    }
+
+    memset(c, 0, sizeof(*c));
+    if (tls_engine_new(&c->tls, w->ctx, 1) == -1) {
+        ERR_print_errors_fp(stderr);
+        admission_release();
+        close(fd);
+        return;
+    }
+
+    // The session owns the SSL object from now on, its idle timer runs on the loop of the worker
+    c->s = &c->session;
+    session_init(c->s, &w->loop, fd, c->tls.ssl, &addr);
+
+    c->owner = w;
+    send_scheduler_init(&c->queue, SCHEDULER_MAX_MESSAGES);
+    c->used = 1;
+    c->handler = (event_handler){fd, on_conn_event, c};
+    event_loop_add_fd(&w->loop, &c->handler, EPOLLIN);
+    c->watched = EPOLLIN;
+    event_loop_timer_add(&w->loop, &c->handshake_timer, HANDSHAKE_TIMEOUT_MS, on_handshake_timeout, c);
+
+    // The client hello is usually there already, the costly part of the handshake runs now
+    receive(c);
+}
+
+static void on_conn_event(int fd, uint32_t events, void *arg)
+{
+    (void)fd;
+    shard_conn *c = arg;
+
+    // Event of a connection closed earlier in the same batch
+    if (!c->used) {
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        flush_conn(c);
+    }
+
+    // A stalled connection is not read, unless its socket failed
+    if (c->used && c->stalled && (events & (EPOLLHUP | EPOLLERR))) {
+        close_conn(c);
+    } else if (c->used && !c->stalled && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        receive(c);
+    }
+}
+
+static void receive(shard_conn *c)
+{
+    worker *w = c->owner;
+    session *s = c->s;
+
+    ssize_t length = read(s->fd, w->rx, sizeof(w->rx));
+    if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (length <= 0) {
+        if (length == 0) {
+            TRACE("\nConnection closed by client\n");
+        }
+        close_conn(c);
+        return;
+    }
+
+    session_stats.bytes_read += (unsigned long)length;
+    if (tls_engine_feed(&c->tls, w->rx, (size_t)length) == -1) {
+        close_conn(c);
+        return;
+    }
+
+    // Handshake in progress
+    if (!c->tls.established) {
+        int result = tls_engine_handshake(&c->tls);
+        if (result == -1) {
+            ERR_print_errors_fp(stderr);
+            session_stats.handshake_failures++;
+            send_pending(c);
+            close_conn(c);
+            return;
+        } else if (result == 1) {
+            event_loop_timer_cancel(&w->loop, &c->handshake_timer);
+            admission_release();
+            session_stats.accepted++;
+            connected++;
+
+            // The client starts with the last values, sent by the flush below
+            last_value_snapshot(&c->queue, &s->snapshot_sequence);
+
+            // Start measuring the round trip time
+            event_loop_timer_add(&w->loop, &s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, c);
+        }
+    }
+
+    process_frames(c);
+}
+
+static void process_frames(shard_conn *c)
+{
+    worker *w = c->owner;
+    session *s = c->s;
+
+    // Handle the complete frames, then decrypt what is available
+    while (c->tls.established) {
+        frame_header header;
+        const uint8_t *payload;
+        int status;
+        while ((status = session_next_frame(s, &header, &payload)) == 1) {
+            if (header.type != FRAME_DATA) {
+                session_handle_control(s, &header, payload, w->frame_buffer);
+                frame_reader_consume(&s->reader, &header);
+                continue;
+            }
+
+            // Compressed payloads are inflated first
+            size_t size = header.length;
+            if (header.flags & (FRAME_FLAG_LZ4 | FRAME_FLAG_ZSTD)) {
+                ssize_t inflated = decompress_frame(header.flags, payload, header.length,
+                                                    w->inflate_buffer, sizeof(w->inflate_buffer));
+                if (inflated == -1) {
+                    status = -1;
+                    break;
+                }
+                payload = w->inflate_buffer;
+                size = (size_t)inflated;
+            }
+
+            // A frame beyond the window of its stream closes the stream, a stalled frame was accounted already
+            if (!c->stalled && session_receive_data(s, header.stream, size, w->frame_buffer) == -1) {
+                frame_reader_consume(&s->reader, &header);
+                continue;
+            }
+
+            // The window is granted again once the application reads the message
+            uint32_t credited = header.stream == STREAM_DEFAULT ? 0 : s->id;
+            c->stalled = message_queue_push(&inbox, (uint16_t)w->index, credited, header.stream, payload, size) == -1;
+            if (c->stalled) {
+                TRACE("Read queue full, reception paused\n");
+                flush_conn(c);
+                return;
+            }
+            frame_reader_consume(&s->reader, &header);
+            session_touch(s);
+        }
+
+        // The client does not speak the protocol
+        if (status == -1) {
+            TRACE("\nInvalid frame received\n");
+            close_conn(c);
+            return;
+        }
+
+        size_t available;
+        uint8_t *space = frame_reader_space(&s->reader, &available);
+        ssize_t bytes_read = tls_engine_read(&c->tls, space, available);
+
+        if (bytes_read > 0) {
+            frame_reader_commit(&s->reader, (size_t)bytes_read);
+        } else if (bytes_read == 0) {
+            break;
+        } else {
+            if (bytes_read == TLS_ENGINE_CLOSED) {
+                TRACE("\nConnection closed by client\n");
+            } else {
+                ERR_print_errors_fp(stderr);
+            }
+            close_conn(c);
+            return;
+        }
+    }
+
+    flush_conn(c);
+}
+
+static int schedule_conn(shard_conn *c)
+{
+    send_chunk chunk;
+    int count = 0;
+
+    while (tls_engine_pending(&c->tls) < SCHEDULER_CHUNK_SIZE && send_scheduler_peek(&c->queue, &c->s->streams, &chunk)) {
+        if (session_write_chunk(c->s, &chunk, c->owner->frame_buffer) >= 0) {
+            session_touch(c->s);
+        }
+        send_scheduler_consume(&c->queue, &chunk);
+        count++;
+    }
+    return count;
+}
+
+static int send_pending(shard_conn *c)
+{
+    while (1) {
+
+        // Take the next chunk of ciphertext
+        if (c->tx_offset == c->tx_length) {
+            c->tx_length = tls_engine_take(&c->tls, c->tx, sizeof(c->tx));
+            c->tx_offset = 0;
+            if (c->tx_length == 0) {
+                return 0;
+            }
+        }
+
+        ssize_t sent = send(c->s->fd, c->tx + c->tx_offset, c->tx_length - c->tx_offset, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        c->tx_offset += (size_t)sent;
+    }
+}
+
+static void flush_conn(shard_conn *c)
+{
+    // The next chunks are only encrypted once the socket took the previous ones
+    int result;
+    do {
+        result = send_pending(c);
+    } while (result == 0 && c->tls.established && schedule_conn(c) > 0);
+
+    if (result == -1) {
+        close_conn(c);
+        return;
+    }
+
+    // Watch the socket for writability only while it is full
+    c->want_write = result == 1;
+    watch_conn(c);
+}
+
+static void watch_conn(shard_conn *c)
+{
+    uint32_t events = (c->stalled ? 0 : EPOLLIN) | (c->want_write ? EPOLLOUT : 0);
+    if (events != c->watched) {
+        c->watched = events;
+        event_loop_mod_fd(&c->owner->loop, &c->handler, events);
+    }
+}
+
+static void close_conn(shard_conn *c)
+{
+    if (!c->used) {
+        return;
+    }
+    c->used = 0;
+
+    worker *w = c->owner;
+    event_loop_del_fd(&w->loop, &c->handler);
+    event_loop_timer_cancel(&w->loop, &c->handshake_timer);
+    event_loop_timer_cancel(&w->loop, &c->s->heartbeat_timer);
+
+    // Best effort close notify
+    if (c->tls.established) {
+        tls_engine_shutdown(&c->tls);
+        if (send_pending(c) != 0) {
+            TRACE("Close notify not sent\n");
+        }
+        connected--;
+        session_stats.closed++;
+    } else {
+        admission_release();
+    }
+
+    session_finish(c->s);
+    send_scheduler_free(&c->queue);
+}
+
+static void on_handshake_timeout(void *arg)
+{
+    shard_conn *c = arg;
+
+    TRACE("Handshake timeout\n");
+    session_stats.handshake_timeouts++;
+    close_conn(c);
+}
+
+static void on_heartbeat_timer(void *arg)
+{
+    shard_conn *c = arg;
+    worker *w = c->owner;
+
+    if (session_heartbeat(c->s, w->frame_buffer) == -1) {
+        close_conn(c);
+        return;
+    }
+    flush_conn(c);
+    if (!c->used) {
+        return;
+    }
+
+    // Publish the last measure for the statistics, the other workers publish theirs in their own snapshot
+    const rtt_stats *stats = &c->s->heartbeat.rtt;
+    atomic_store_explicit(&w->rtt.last_us, stats->last_us, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.srtt_us, stats->srtt_us, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.rttvar_us, stats->rttvar_us, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.min_us, stats->min_us, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.samples, stats->samples, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.lost, stats->lost, memory_order_relaxed);
+    atomic_store_explicit(&w->rtt.published_us, heartbeat_now_us(), memory_order_release);
+
+    event_loop_timer_add(&w->loop, &c->s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, c);
+}
@@ -0,0 +1,75 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_SHARDED_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_SHARDED_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "openssl/ssl.h"
+
+#include "heartbeat.h"
+#include "scheduler.h"
+
+/**
+ * Sharded backend: one worker per core, each running its own event loop.
+ * A connection belongs to a single worker, which does all its I/O and TLS
+ * work, so no lock is shared on the connections, nor on the SSL context:
+ * each worker has a clone of the context of the server. Accepted sockets are pushed
+ * as handshake jobs on the work-stealing deque of the accepting worker, the
+ * idle workers steal them to spread the handshakes across the cores.
+ * Received data frames are queued for backend_sharded_read, written messages
+ * are sent to every connected client.
+ */
+
+/**
+ * Start the workers
+ * @param context       The SSL context of the server, cloned for each worker
+ * @param listener      The listening socket, switched to non-blocking mode
+ * @return              0 on success, -1 on error
+ */
+int backend_sharded_start(SSL_CTX *context, int listener);
+
+/**
+ * Wait for the next data frame received from any client
+ * @param stream        filled with the stream of the message
+ * @param buffer        the variable used to store the received message
+ * @param length        the size of the buffer, longer messages are truncated
+ * @return              the size of the message, -1 when stopped
+ */
+ssize_t backend_sharded_read(uint16_t *stream, uint8_t *buffer, size_t length);
+
+/**
+ * Queue a message for every connected client, each client sends its queued
+ * messages in the order given by their class
+ * @param msg           the message, a reference is taken for each client
+ * @return              the number of queued bytes, -1 if no client is connected
+ */
+ssize_t backend_sharded_send(outgoing_message *msg);
+
+/**
+ * Tell whether a client is connected
+ * @return              1 if at least one client is connected, 0 otherwise
+ */
+int backend_sharded_connected();
+
+/**
+ * Read the round trip time last measured on a client
+ * @param rtt           the structure filled with the round trip time
+ * @return              0 on success, -1 if no client is connected
+ */
+int backend_sharded_get_rtt(rtt_stats *rtt);
+
+/**
+ * Wake up the threads blocked in backend_sharded_read.
+ * The listening socket must be shut down by the caller.
+ */
+void backend_sharded_shutdown();
+
+/**
+ * Stop the workers, close the clients and free the backend
+ */
+void backend_sharded_stop();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_SHARDED_H
@@ -0,0 +1,814 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "openssl/err.h"
+
+#include "admission.h"
+#include "backend_uring.h"
+#include "last_value.h"
+#include "message_queue.h"
+#include "session.h"
+#include "../conf.c"
+#include "../io/uring.h"
+#include "../tls/tls_engine.h"
+#include "../trace/trace.h"
+
+// Operation stored in the low bits of the user data, the connection pointer in the others
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_WAKE 3
+#define OP_MASK 3
+
+/**
+ * I/O state of a client served by the ring
+ */
+typedef struct uring_conn {
+    session *s;
+    tls_engine tls;
+    int used;
+    int closing;
+    int inflight;
+    int sending;
+    int stalled;
+    atomic_int ping_due;
+    size_t tx_length;
+    size_t tx_offset;
+    wheel_timer handshake_timer;
+    send_scheduler queue;
+    uint8_t rx[URING_BUFFER_SIZE];
+    uint8_t tx[URING_BUFFER_SIZE];
+} uring_conn;
+
+static uring ring;
+static SSL_CTX *ctx;
+static int socket_server;
+static event_loop *timers;
+static pthread_t thread_uring;
+static atomic_int running;
+static int wake_fd;
+static uint64_t wake_value;
+static int accepts_pending;
+static int accepts_paused;
+static atomic_int accept_retry_due;
+static wheel_timer accept_timer;
+
+static uring_conn conns[MAX_SESSIONS];
+static uring_conn *latest;
+static atomic_int connected;
+static pthread_mutex_t latest_lock = PTHREAD_MUTEX_INITIALIZER;
+static message_queue inbox;
+static send_scheduler outbox;
+static uint8_t frame_buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+static uint8_t inflate_buffer[FRAME_MAX_PAYLOAD];
+
+/**
+ * Thread function running the ring
+ * @param arg
+ * @return
+ */
+static void *thread_uring_fct(void *arg);
+
+/**
+ * Queue an operation on the ring
+ * @param opcode    The io_uring operation
+ * @param c         The connection, NULL for the listener and the wake-up eventfd
+ * @param op        The OP_* value given back on completion
+ * @param fd        The file descriptor
+ * @param buffer    The buffer of the operation
+ * @param length    The size of the buffer
+ */
+static void submit(int opcode, uring_conn *c, int op, int fd, void *buffer, size_t length);
+
+/**
+ * Handle a completion
+ * @param cqe       The completion
+ */
+static void on_completion(const struct io_uring_cqe *cqe);
+
+/**
+ * Handle the end of an accept and keep the listener accepting
+ * @param result    The result of the accept, the client socket on success
+ */
+static void on_accept_done(int result);
+
+/**
+ * Set up a new client accepted by the ring
+ * @param fd        The client socket
+ */
+static void on_accept(int fd);
+
+/**
+ * Feed received ciphertext to OpenSSL and handle the decrypted frames
+ * @param c         The connection
+ * @param length    The number of bytes received in c->rx
+ */
+static void on_receive(uring_conn *c, size_t length);
+
+/**
+ * Handle the decrypted frames of a connection and receive the next bytes. When
+ * the application is late and the inbox full, the frame waits in the reader and
+ * nothing more is received until a message is released.
+ * @param c         The connection
+ */
+static void process_frames(uring_conn *c);
+
+/**
+ * Handle the end of a send
+ * @param c         The connection
+ * @param result    The result of the send
+ */
+static void on_send(uring_conn *c, int result);
+
+/**
+ * Handle a wake-up: queued messages, windows of the data read by the application, due pings and shutdown
+ */
+static void on_wake();
+
+/**
+ * Encrypt the next queued chunks of a connection, one chunk ahead of the socket
+ * so that a control message never waits behind more than one bulk chunk
+ * @param c         The connection
+ */
+static void schedule_conn(uring_conn *c);
+
+/**
+ * Send the ciphertext produced by OpenSSL if no send is in flight,
+ * encrypting the next queued messages first
+ * @param c         The connection
+ */
+static void flush_conn(uring_conn *c);
+
+/**
+ * Start closing a connection: send the close notify and abort its operations
+ * @param c         The connection
+ */
+static void close_conn(uring_conn *c);
+
+/**
+ * Free a closing connection once its operations are completed
+ * @param c         The connection
+ */
+static void release_conn(uring_conn *c);
+
+/**
+ * Wake up the ring thread
+ */
+static void wake();
+
+/**
+ * Timer callback aborting a handshake which takes too long
+ * @param arg   The connection
+ */
+static void on_handshake_timeout(void *arg);
+
+/**
+ * Timer callback asking the ring thread to ping a client
+ * @param arg   The connection
+ */
+static void on_heartbeat_timer(void *arg);
+
+/**
+ * Timer callback asking the ring thread to accept again after an accept failure
+ * @param arg
+ */
+static void on_accept_retry(void *arg);
+
+
+int backend_uring_start(SSL_CTX *context, int listener, event_loop *loop)
+{
+    if (uring_init(&ring, URING_ENTRIES) == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        uring_free(&ring);
+        return -1;
+    }
+
+    ctx = context;
+    socket_server = listener;
+    timers = loop;
+    running = 1;
+    connected = 0;
+    accepts_paused = 0;
+    accept_retry_due = 0;
+    message_queue_init(&inbox, URING_QUEUE_MESSAGES);
+    send_scheduler_init(&outbox, URING_QUEUE_MESSAGES);
+
+    // Several accepts are kept in flight so bursts of clients are accepted in one batch
+    for (accepts_pending = 0; accepts_pending < URING_ACCEPT_DEPTH; ++accepts_pending) {
+        submit(IORING_OP_ACCEPT, NULL, OP_ACCEPT, socket_server, NULL, 0);
+    }
+    submit(IORING_OP_READ, NULL, OP_WAKE, wake_fd, &wake_value, sizeof(wake_value));
+
+    if (pthread_create(&thread_uring, NULL, thread_uring_fct, NULL) != 0) {
+        fprintf(stderr, "erreur pthread_create thread_uring\n");
+        exit(-1);
+    }
+
+    TRACE("io_uring backend started\n");
+    return 0;
+}
+
+ssize_t backend_uring_read(uint16_t *stream, uint8_t *buffer, size_t length)
+{
+    message *msg = message_queue_pop(&inbox, 1);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    // Messages longer than the buffer are truncated
+    size_t copied = msg->length < length ? msg->length : length;
+    memcpy(buffer, msg->data, copied);
+    *stream = msg->stream;
+
+    // The window of the stream is granted again by the ring thread
+    if (message_queue_release(&inbox, msg) != 0) {
+        wake();
+    }
+
+    return (ssize_t)copied;
+}
+
+ssize_t backend_uring_send(outgoing_message *msg)
+{
+    // No client to write to
+    if (!backend_uring_connected()) {
+        TRACE("No client connected\n");
+        return -1;
+    }
+
+    if (send_scheduler_push(&outbox, msg) == -1) {
+        TRACE("Write queue full\n");
+        return -1;
+    }
+
+    wake();
+    return (ssize_t)msg->length;
+}
+
+int backend_uring_connected()
+{
+    return connected > 0;
+}
+
+int backend_uring_get_rtt(rtt_stats *rtt)
+{
+    int result = -1;
+
+    // The ring thread updates the statistics, a torn read only gives a slightly old value
+    pthread_mutex_lock(&latest_lock);
+    if (latest != NULL) {
+        *rtt = latest->s->heartbeat.rtt;
+        result = 0;
+    }
+    pthread_mutex_unlock(&latest_lock);
+
+    return result;
+}
+
+void backend_uring_shutdown()
+{
+    running = 0;
+    message_queue_close(&inbox);
+    wake();
+}
+
+void backend_uring_stop()
+{
+    pthread_join(thread_uring, NULL);
+    uring_free(&ring);
+    close(wake_fd);
+    message_queue_free(&inbox);
+    send_scheduler_free(&outbox);
+
+    // Connections whose operations never completed
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (conns[i].used) {
+            send_scheduler_free(&conns[i].queue);
+        }
+    }
+}
+
+static void *thread_uring_fct(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+
+        // Leave once stopped and every operation is completed
+        int busy = accepts_pending > 0;
+        for (int i = 0; i < MAX_SESSIONS && !busy; ++i) {
+            busy = conns[i].used;
+        }
+        if (!running && !busy) {
+            break;
+        }
+
+        // Submit everything prepared during the last batch and wait for the next completion
+        if (uring_submit_and_wait(&ring, 1) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            struct io_uring_cqe completion = *cqe;
+            uring_cqe_seen(&ring);
+            on_completion(&completion);
+        }
+    }
+    return NULL;
+}
+
+static void submit(int opcode, uring_conn *c, int op, int fd, void *buffer, size_t length)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    // The queue is full: push the prepared entries to make room
+    if (sqe == NULL) {
+        uring_submit_and_wait(&ring, 0);
+        sqe = uring_get_sqe(&ring);
+    }
+
+    uint64_t user_data = (uint64_t)(uintptr_t)c | (uint64_t)op;
+    if (opcode == IORING_OP_ACCEPT) {
+        uring_prep_accept(sqe, fd, user_data);
+    } else {
+        uring_prep_rw(sqe, opcode, fd, buffer, length, user_data);
+    }
+
+    if (c != NULL) {
+        c->inflight++;
+    }
+}
+
+static void on_completion(const struct io_uring_cqe *cqe)
+{
+    uring_conn *c = (uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    int op = (int)(cqe->user_data & OP_MASK);
+
+    switch (op) {
+        case OP_ACCEPT:
+            on_accept_done(cqe->res);
+            break;
+
+        case OP_RECV:
+            c->inflight--;
+            if (c->closing) {
+                release_conn(c);
+            } else if (cqe->res <= 0) {
+                if (cqe->res == 0) {
+                    TRACE("\nConnection closed by client\n");
+                }
+                close_conn(c);
+            } else {
+                session_stats.bytes_read += (unsigned long)cqe->res;
+                on_receive(c, (size_t)cqe->res);
+            }
+            break;
+
+        case OP_SEND:
+            c->inflight--;
+            on_send(c, cqe->res);
+            break;
+
+        case OP_WAKE:
+            on_wake();
+            break;
+    }
+}
+
+static void on_accept_done(int result)
+{
+    if (result >= 0) {
+        on_accept(result);
+    }
+
+    // Keep accepting until stopped
+    if (!running) {
+        accepts_pending--;
+    } else if (result >= 0 || result == -EINTR || result == -ECONNABORTED) {
+        submit(IORING_OP_ACCEPT, NULL, OP_ACCEPT, socket_server, NULL, 0);
+    } else {
+        // Out of file descriptors or memory, the accept would fail again at once: it is retried a bit later
+        if (accepts_paused++ == 0) {
+            fprintf(stderr, "accept: %s\n", strerror(-result));
+            event_loop_timer_add(timers, &accept_timer, URING_ACCEPT_RETRY_MS, on_accept_retry, NULL);
+        }
+    }
+}
+
+static void on_accept(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getpeername(fd, (struct sockaddr *)&addr, &len);
+
+    // A source reconnecting too fast is refused before any crypto runs
+    if (admission_check(&addr) == -1) {
+        admission_refuse(fd);
+        return;
+    }
+
+    // Display connection detail
+    TRACE("\nNew connection :\n"
+          "- Source : %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    // Detect dead peers at the TCP level
+    session_configure_socket(fd);
+
+    uring_conn *c = NULL;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (!conns[i].used) {
+            c = &conns[i];
+            break;
+        }
+    }
+
+    if (c == NULL) {
+        fprintf(stderr, "Too many sessions\n");
+        admission_release();
+        close(fd);
+        return;
+    }
+
+    // The TLS engine works in memory, the ring does the socket I/O
+    memset(c, 0, sizeof(*c));
+    if (tls_engine_new(&c->tls, ctx, 1) == -1) {
+        ERR_print_errors_fp(stderr);
+        admission_release();
+        close(fd);
+        return;
+    }
+
+    // The session owns the SSL object from now on
+    c->s = session_open(fd, c->tls.ssl, &addr);
+    if (c->s == NULL) {
+        fprintf(stderr, "Too many sessions\n");
+        tls_engine_free(&c->tls);
+        admission_release();
+        close(fd);
+        return;
+    }
+    send_scheduler_init(&c->queue, SCHEDULER_MAX_MESSAGES);
+    c->used = 1;
+
+    event_loop_timer_add(timers, &c->handshake_timer, HANDSHAKE_TIMEOUT_MS, on_handshake_timeout, c);
+    submit(IORING_OP_RECV, c, OP_RECV, fd, c->rx, sizeof(c->rx));
+}
+
+static void on_receive(uring_conn *c, size_t length)
+{
+    session *s = c->s;
+    if (tls_engine_feed(&c->tls, c->rx, length) == -1) {
+        close_conn(c);
+        return;
+    }
+
+    // Handshake in progress
+    if (!c->tls.established) {
+        int result = tls_engine_handshake(&c->tls);
+        if (result == -1) {
+            ERR_print_errors_fp(stderr);
+            session_stats.handshake_failures++;
+            flush_conn(c);
+            close_conn(c);
+            return;
+        } else if (result == 1) {
+            event_loop_timer_cancel(timers, &c->handshake_timer);
+            admission_release();
+            session_stats.accepted++;
+            connected++;
+
+            pthread_mutex_lock(&latest_lock);
+            latest = c;
+            pthread_mutex_unlock(&latest_lock);
+
+            // The client starts with the last values, sent by the flush below
+            last_value_snapshot(&c->queue, &s->snapshot_sequence);
+
+            // Start measuring the round trip time
+            event_loop_timer_add(timers, &s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, c);
+        }
+    }
+
+    process_frames(c);
+}
+
+static void process_frames(uring_conn *c)
+{
+    session *s = c->s;
+
+    // Handle the complete frames, then decrypt what is available
+    while (c->tls.established) {
+        frame_header header;
+        const uint8_t *payload;
+        int status;
+        while ((status = session_next_frame(s, &header, &payload)) == 1) {
+            if (header.type != FRAME_DATA) {
+                session_handle_control(s, &header, payload, frame_buffer);
+                frame_reader_consume(&s->reader, &header);
+                continue;
+            }
+
+            // Compressed payloads are inflated first
+            size_t size = header.length;
+            if (header.flags & (FRAME_FLAG_LZ4 | FRAME_FLAG_ZSTD)) {
+                ssize_t inflated = decompress_frame(header.flags, payload, header.length,
+                                                    inflate_buffer, sizeof(inflate_buffer));
+                if (inflated == -1) {
+                    status = -1;
+                    break;
+                }
+                payload = inflate_buffer;
+                size = (size_t)inflated;
+            }
+
+            // A frame beyond the window of its stream closes the stream, a stalled frame was accounted already
+            if (!c->stalled && session_receive_data(s, header.stream, size, frame_buffer) == -1) {
+                frame_reader_consume(&s->reader, &header);
+                continue;
+            }
+
+            // The window is granted again once the application reads the message
+            uint32_t credited = header.stream == STREAM_DEFAULT ? 0 : s->id;
+            c->stalled = message_queue_push(&inbox, 0, credited, header.stream, payload, size) == -1;
+            if (c->stalled) {
+                TRACE("Read queue full, reception paused\n");
+                flush_conn(c);
+                return;
+            }
+            frame_reader_consume(&s->reader, &header);
+            session_touch(s);
+        }
+
+        // The client does not speak the protocol
+        if (status == -1) {
+            TRACE("\nInvalid frame received\n");
+            close_conn(c);
+            return;
+        }
+
+        size_t available;
+        uint8_t *space = frame_reader_space(&s->reader, &available);
+        ssize_t bytes_read = tls_engine_read(&c->tls, space, available);
+
+        if (bytes_read > 0) {
+            frame_reader_commit(&s->reader, (size_t)bytes_read);
+        } else if (bytes_read == 0) {
+            break;
+        } else {
+            if (bytes_read == TLS_ENGINE_CLOSED) {
+                TRACE("\nConnection closed by client\n");
+            } else {
+                ERR_print_errors_fp(stderr);
+            }
+            flush_conn(c);
+            close_conn(c);
+            return;
+        }
+    }
+
+    flush_conn(c);
+    submit(IORING_OP_RECV, c, OP_RECV, s->fd, c->rx, sizeof(c->rx));
+}
+
+static void on_send(uring_conn *c, int result)
+{
+    c->sending = 0;
+
+    if (c->closing) {
+        release_conn(c);
+        return;
+    }
+    if (result <= 0) {
+        close_conn(c);
+        return;
+    }
+
+    // Send the rest of a partial write, then what OpenSSL produced in the meantime
+    c->tx_offset += (size_t)result;
+    if (c->tx_offset == c->tx_length) {
+        c->tx_length = 0;
+        c->tx_offset = 0;
+    }
+    flush_conn(c);
+}
+
+static void on_wake()
+{
+    // Re-arm the wake-up read unless stopping
+    if (running) {
+        submit(IORING_OP_READ, NULL, OP_WAKE, wake_fd, &wake_value, sizeof(wake_value));
+    } else {
+        event_loop_timer_cancel(timers, &accept_timer);
+        accepts_pending -= accepts_paused;
+        accepts_paused = 0;
+        for (int i = 0; i < MAX_SESSIONS; ++i) {
+            if (conns[i].used && !conns[i].closing) {
+                flush_conn(&conns[i]);
+                close_conn(&conns[i]);
+            }
+        }
+        return;
+    }
+
+    // Accepts paused after a failure
+    if (atomic_exchange(&accept_retry_due, 0)) {
+        for (; accepts_paused > 0; --accepts_paused) {
+            submit(IORING_OP_ACCEPT, NULL, OP_ACCEPT, socket_server, NULL, 0);
+        }
+    }
+
+    // Queue the new messages for every connected client, most urgent first
+    outgoing_message *msg;
+    while ((msg = send_scheduler_take(&outbox)) != NULL) {
+        for (int i = 0; i < MAX_SESSIONS; ++i) {
+            uring_conn *c = &conns[i];
+            if (!c->used || c->closing || !c->tls.established) {
+                continue;
+            }
+
+            // Slow client: its queue is full
+            if (send_scheduler_push(&c->queue, msg) == -1) {
+                TRACE("Client too slow, message dropped\n");
+            }
+        }
+        outgoing_message_release(msg);
+    }
+
+    // Windows of the data read by the application
+    message_credit credits[STREAM_MAX];
+    size_t count;
+    while ((count = message_queue_take_credits(&inbox, 0, credits, STREAM_MAX)) > 0) {
+        for (size_t k = 0; k < count; ++k) {
+            for (int i = 0; i < MAX_SESSIONS; ++i) {
+                uring_conn *c = &conns[i];
+                if (c->used && !c->closing && c->s->id == credits[k].session) {
+                    session_consume_data(c->s, credits[k].stream, credits[k].length, frame_buffer);
+                }
+            }
+        }
+    }
+
+    // Room was made in the inbox
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (conns[i].used && !conns[i].closing && conns[i].stalled) {
+            process_frames(&conns[i]);
+        }
+    }
+
+    // Pings asked by the heartbeat timers
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        uring_conn *c = &conns[i];
+        if (c->used && !c->closing && atomic_exchange(&c->ping_due, 0)) {
+            if (session_heartbeat(c->s, frame_buffer) == -1) {
+                close_conn(c);
+                continue;
+            }
+        }
+        if (c->used && !c->closing) {
+            flush_conn(c);
+        }
+    }
+}
+
+static void flush_conn(uring_conn *c)
+{
+    if (c->sending || c->closing) {
+        return;
+    }
+
+    // Take the next chunk of ciphertext
+    if (c->tx_length == 0) {
+        schedule_conn(c);
+        c->tx_length = tls_engine_take(&c->tls, c->tx, sizeof(c->tx));
+        c->tx_offset = 0;
+        if (c->tx_length == 0) {
+            return;
+        }
+    }
+
+    c->sending = 1;
+    submit(IORING_OP_SEND, c, OP_SEND, c->s->fd, c->tx + c->tx_offset, c->tx_length - c->tx_offset);
+}
+
+static void schedule_conn(uring_conn *c)
+{
+    send_chunk chunk;
+
+    if (!c->tls.established) {
+        return;
+    }
+    while (tls_engine_pending(&c->tls) < SCHEDULER_CHUNK_SIZE && send_scheduler_peek(&c->queue, &c->s->streams, &chunk)) {
+        if (session_write_chunk(c->s, &chunk, frame_buffer) >= 0) {
+            session_touch(c->s);
+        }
+        send_scheduler_consume(&c->queue, &chunk);
+    }
+}
+
+static void close_conn(uring_conn *c)
+{
+    if (c->closing) {
+        return;
+    }
+    c->closing = 1;
+    if (c->tls.established) {
+        connected--;
+    }
+
+    // The round trip time is taken from another client still connected
+    pthread_mutex_lock(&latest_lock);
+    if (latest == c) {
+        latest = NULL;
+        for (int i = 0; i < MAX_SESSIONS && latest == NULL; ++i) {
+            if (conns[i].used && !conns[i].closing && conns[i].tls.established) {
+                latest = &conns[i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&latest_lock);
+
+    // Best effort close notify, unless it would interleave with a send in flight
+    if (c->tls.established && !c->sending) {
+        tls_engine_shutdown(&c->tls);
+        uint8_t notify[256];
+        size_t length = tls_engine_take(&c->tls, notify, sizeof(notify));
+        if (length > 0 && send(c->s->fd, notify, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            TRACE("Close notify not sent\n");
+        }
+    }
+
+    // Make the pending operations complete
+    shutdown(c->s->fd, SHUT_RDWR);
+    release_conn(c);
+}
+
+static void release_conn(uring_conn *c)
+{
+    if (c->inflight > 0) {
+        return;
+    }
+
+    event_loop_timer_cancel(timers, &c->handshake_timer);
+    event_loop_timer_cancel(timers, &c->s->heartbeat_timer);
+    session_close(c->s);
+    send_scheduler_free(&c->queue);
+    if (c->tls.established) {
+        session_stats.closed++;
+    } else {
+        admission_release();
+    }
+    c->used = 0;
+}
+
+static void wake()
+{
+    uint64_t value = 1;
+    if (write(wake_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("eventfd write");
+    }
+}
+
+static void on_handshake_timeout(void *arg)
+{
+    uring_conn *c = arg;
+
+    // The pending receive completes and the ring thread closes the connection
+    TRACE("Handshake timeout\n");
+    session_stats.handshake_timeouts++;
+    shutdown(c->s->fd, SHUT_RDWR);
+}
+
+static void on_heartbeat_timer(void *arg)
+{
+    uring_conn *c = arg;
+
+    c->ping_due = 1;
+    wake();
+    event_loop_timer_add(timers, &c->s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, c);
+}
+
+static void on_accept_retry(void *arg)
+{
+    (void)arg;
+
+    accept_retry_due = 1;
+    wake();
+}
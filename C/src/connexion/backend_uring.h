@@ -0,0 +1,73 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_URING_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "openssl/ssl.h"
+
+#include "heartbeat.h"
+#include "scheduler.h"
+#include "../loop/event_loop.h"
+
+/**
+ * io_uring backend: one thread batches the accepts, receives and sends of all
+ * the clients through a ring, OpenSSL runs over memory BIOs. Received data
+ * frames are queued for backend_uring_read, written messages are sent to
+ * every connected client.
+ */
+
+/**
+ * Start the backend thread
+ * @param context       The SSL context of the server
+ * @param listener      The listening socket
+ * @param loop          The event loop running the connexion timers
+ * @return              0 on success, -1 if io_uring is not available
+ */
+int backend_uring_start(SSL_CTX *context, int listener, event_loop *loop);
+
+/**
+ * Wait for the next data frame received from any client
+ * @param stream        filled with the stream of the message
+ * @param buffer        the variable used to store the received message
+ * @param length        the size of the buffer, longer messages are truncated
+ * @return              the size of the message, -1 when stopped
+ */
+ssize_t backend_uring_read(uint16_t *stream, uint8_t *buffer, size_t length);
+
+/**
+ * Queue a message for every connected client, each client sends its queued
+ * messages in the order given by their class
+ * @param msg           the message, a reference is taken for each client
+ * @return              the number of queued bytes, -1 if no client is connected
+ */
+ssize_t backend_uring_send(outgoing_message *msg);
+
+/**
+ * Tell whether a client is connected
+ * @return              1 if at least one client is connected, 0 otherwise
+ */
+int backend_uring_connected();
+
+/**
+ * Read the round trip time of the last connected client
+ * @param rtt           the structure filled with the round trip time
+ * @return              0 on success, -1 if no client is connected
+ */
+int backend_uring_get_rtt(rtt_stats *rtt);
+
+/**
+ * Close the clients and wake up the threads blocked in backend_uring_read.
+ * The listening socket must be shut down by the caller.
+ */
+void backend_uring_shutdown();
+
+/**
+ * Wait for the backend thread and free the backend
+ */
+void backend_uring_stop();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_BACKEND_URING_H
@@ -5,20 +5,70 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "openssl/ssl.h"
 #include "openssl/err.h"
+#include "openssl/evp.h"
 
 #include "connexion.h"
+#include "admission.h"
+#include "backend_sharded.h"
+#include "backend_uring.h"
+#include "datagram.h"
+#include "ingest_ring.h"
+#include "last_value.h"
+#include "proxy.h"
+#include "session.h"
 #include "../conf.c"
+#include "../frame/capture.h"
+#include "../frame/spool.h"
+#include "../tls/ocsp_stapling.h"
+#include "../tls/tls_context.h"
+#include "../trace/timeline.h"
 #include "../trace/trace.h"
 
+// Backend serving the clients
+#define BACKEND_BLOCKING 0
+#define BACKEND_URING 1
+#define BACKEND_SHARDED 2
+
 static int socket_server;
 static SSL_CTX *ctx;
-static SSL *ssl;
-int running = 1;
+static session *current;
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int connected;
+static atomic_int ping_due;
+static int session_wake;
+static send_scheduler outgoing;
+static atomic_int running = 1;
+static int backend = BACKEND_BLOCKING;
+static event_loop loop;
+static wheel_timer stats_timer;
+static wheel_timer handshake_timer;
+static uint8_t frame_buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+static uint8_t inflate_buffer[FRAME_MAX_PAYLOAD];
+static struct timespec startup_time;
+static spool backlog;
+static int spooling;
+static pthread_t thread_replay;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+static int datagrams;
+static int proxying;
+static ingest_ring ingest;
+static int ingesting;
+static int ingest_server;
+static event_handler ingest_handler;
+static pthread_t thread_ingest;
 
 
 /**
@@ -35,6 +85,86 @@ SSL_CTX* init_ctx(void);
  */
 void load_certificates(SSL_CTX* context, char* cert_filepath, char* key_filepath);
 
+/**
+ * Run once the key exchanges and the signature of a handshake, so the first
+ * client does not pay for the lazy setup of the algorithms
+ * @param context           The SSL context, with its private key loaded
+ */
+void warm_up_handshake(SSL_CTX* context);
+
+/**
+ * Thread function loading what the handshakes need while the listener is opened
+ * @param arg
+ * @return
+ */
+void *thread_credentials_fct(void *arg);
+
+/**
+ * Open the spool given by CONNEXION_SPOOL, encrypted if SPOOL_KEY_PATH exists
+ * @param directory     The directory of the spool
+ */
+void open_spool(const char *directory);
+
+/**
+ * Thread function sending the spooled messages once a client is connected
+ * @param arg
+ * @return
+ */
+void *thread_replay_fct(void *arg);
+
+/**
+ * Create the ingest ring and the Unix socket given by CONNEXION_INGEST which hands it to the producers
+ * @param path          The path of the socket
+ */
+void open_ingest(const char *path);
+
+/**
+ * Event loop callback handing the ingest ring to a producer connecting to the Unix socket
+ * @param fd        The listening socket
+ * @param events    The epoll events
+ * @param arg
+ */
+void on_ingest_accept(int fd, uint32_t events, void *arg);
+
+/**
+ * Thread function sending the messages of the ingest ring straight from their slots
+ * @param arg
+ * @return
+ */
+void *thread_ingest_fct(void *arg);
+
+/**
+ * Release callback of the messages of the ingest ring, gives their slot back to the producers
+ * @param arg   The slot
+ */
+void release_ingested(void *arg);
+
+/**
+ * Tell whether a client is connected to the selected backend
+ * @return      1 if a client is connected, 0 otherwise
+ */
+int client_connected();
+
+/**
+ * Queue a message for the clients of the selected backend
+ * @param msg   The message
+ * @return      The size of the message, -1 if there is no client or no room left
+ */
+ssize_t send_outgoing(outgoing_message *msg);
+
+/**
+ * Queue a message for the clients, or spool it while no client is connected, see connexion_send_stream
+ * @param msg   The message
+ * @return      The size of the message, -1 on error
+ */
+ssize_t submit_outgoing(outgoing_message *msg);
+
+/**
+ * Trace the time elapsed since the beginning of connexion_init
+ * @param step      The step just completed
+ */
+void trace_startup(const char *step);
+
 /***
  * Show certificate information
  * @param ssl
@@ -50,70 +180,499 @@ int open_listener(int port);
 
 /**
  * Wait for client connection on server
+ * @return      0 when a client is connected, -1 if the server is shutting down
+ */
+int wait_for_connection();
+
+/**
+ * Wait until the socket of the current session is ready, or until a ping is due
+ * @param error     The SSL error telling what the session waits for
+ * @return          0 when ready, -1 if the session failed
  */
-void wait_for_connection();
+int wait_for_session(int error);
+
+/**
+ * Send the messages queued for the current session until the queue is empty.
+ * The session is released between two chunks for the other writers.
+ */
+void drain_outgoing();
+
+/**
+ * Close the current session, if any
+ */
+void drop_connection();
+
+/**
+ * Handle a frame used by the connexion itself on the current session
+ * @param header    The header of the frame
+ * @param payload   The payload of the frame
+ */
+void handle_control_frame(const frame_header *header, const uint8_t *payload);
+
+/**
+ * Send the ping due on the current session, interrupting it if the peer stopped answering
+ */
+void send_heartbeat();
+
+/**
+ * Timer callback asking the reading thread for a ping, a write may block and the timers may not
+ * @param arg   The session
+ */
+void on_heartbeat_timer(void *arg);
+
+/**
+ * Timer callback aborting a handshake which takes too long
+ * @param arg   The client socket
+ */
+void on_handshake_timeout(void *arg);
+
+/**
+ * Timer callback periodically displaying the connexion statistics
+ * @param arg
+ */
+void on_stats_timer(void *arg);
 
 
 void connexion_init()
 {
     char port[16];
     snprintf(port, sizeof(port), "%d", SERVER_PORT);
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
+
+    // Record the timeline of the messages and handshakes, written at close
+    const char *timeline = getenv("CONNEXION_TRACE");
+    int tracing = timeline != NULL && timeline_start(timeline) == 0;
 
-    // Initialize SSL library
-    SSL_library_init();
+    // Initialize SSL library, the algorithms of the handshakes are fetched in a library context of their own
+    OPENSSL_init_ssl(0, NULL);
+    if (tls_context_init() == -1) {
+        abort();
+    }
+    trace_startup("Algorithms fetched");
 
     // Initialize a SSL context
     ctx = init_ctx();
+    if (tracing) {
+        SSL_CTX_set_info_callback(ctx, timeline_handshake_info);
+    }
+    trace_startup("SSL context created");
 
-    // Load and check certificate and key
-    load_certificates(ctx, "../certificates/server.pem", "../certificates/server_key.pem");
+    // Parse the certificate and key while the socket and the timers are set up
+    pthread_t thread_credentials;
+    if (pthread_create(&thread_credentials, NULL, thread_credentials_fct, NULL) != 0) {
+        perror("pthread_create");
+        abort();
+    }
 
-    // Open a listener on socket and port
+    // Messages waiting for the current session of the blocking backend
+    send_scheduler_init(&outgoing, SCHEDULER_MAX_MESSAGES);
+
+    // Record the timing and sizes of the frames, to replay them later
+    const char *capture = getenv("CONNEXION_CAPTURE");
+    if (capture != NULL) {
+        capture_start(capture);
+    }
+
+    // Keep the messages sent while no client is connected
+    const char *spool_directory = getenv("CONNEXION_SPOOL");
+    if (spool_directory != NULL) {
+        open_spool(spool_directory);
+    }
+
+    // Open a listener on socket and port, the clients wait in its backlog from now on
     socket_server = open_listener(atoi(port));
+    trace_startup("Listening");
 
-    // Client connection waiting
-    wait_for_connection();
+    // Start the timers of the connexion
+    session_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (session_wake == -1 || event_loop_init(&loop) == -1) {
+        abort();
+    }
+    event_loop_start(&loop);
+    session_manager_start(&loop);
+    event_loop_timer_add(&loop, &stats_timer, STATS_PERIOD_MS, on_stats_timer, NULL);
+
+    // No handshake before the key is loaded
+    pthread_join(thread_credentials, NULL);
+    trace_startup("Ready to accept");
+
+    // Telemetry which must not wait for lost packets goes over DTLS, on the same port number
+    if (getenv("CONNEXION_DTLS") != NULL) {
+        datagrams = datagram_start(ctx, atoi(port)) == 0;
+    }
+
+    // Plaintext services of the robot behind the TLS of the server, on a port of their own
+    const char *proxy_backend = getenv("CONNEXION_PROXY");
+    if (proxy_backend != NULL) {
+        proxying = proxy_start(ctx, PROXY_PORT, proxy_backend) == 0;
+    }
+
+    // The io_uring and sharded backends serve the clients from their own threads
+    const char *name = getenv("CONNEXION_BACKEND");
+    if (name != NULL && strcmp(name, "uring") == 0) {
+        if (backend_uring_start(ctx, socket_server, &loop) == 0) {
+            backend = BACKEND_URING;
+        } else {
+            fprintf(stderr, "io_uring not available, using blocking sockets\n");
+        }
+    }
+    if (name != NULL && strcmp(name, "sharded") == 0) {
+        if (backend_sharded_start(ctx, socket_server) == 0) {
+            backend = BACKEND_SHARDED;
+        } else {
+            fprintf(stderr, "Sharded backend not available, using blocking sockets\n");
+        }
+    }
+
+    // Send the backlog to the next client
+    if (spooling && pthread_create(&thread_replay, NULL, thread_replay_fct, NULL) != 0) {
+        perror("pthread_create");
+        abort();
+    }
+
+    // Producer processes write their messages in shared memory instead of a message queue
+    const char *ingest_path = getenv("CONNEXION_INGEST");
+    if (ingest_path != NULL) {
+        open_ingest(ingest_path);
+    }
+
+    // The blocking backend accepts the first client in connexion_read, the caller starts its threads meanwhile
 }
 
 ssize_t connexion_read(uint8_t *buffer, size_t length) {
+    uint16_t stream;
+    return connexion_read_stream(&stream, buffer, length);
+}
 
-    // Waiting for a incoming message
-    int bytes_read = SSL_read(ssl, buffer, (int)length);
+ssize_t connexion_read_stream(uint16_t *stream, uint8_t *buffer, size_t length) {
 
-    // If an error occurs
-    if (bytes_read == -1) {
+    if (backend == BACKEND_URING) {
+        return backend_uring_read(stream, buffer, length);
+    }
+    if (backend == BACKEND_SHARDED) {
+        return backend_sharded_read(stream, buffer, length);
+    }
 
-        ERR_print_errors_fp(stderr);
-        fflush(stderr);
+    // No client connected yet
+    if (current == NULL && wait_for_connection() == -1) {
         return -1;
     }
-    // If the connection is closed by the client
-    else if (bytes_read == 0) {
-        TRACE("\nConnection closed by client\n");
-        wait_for_connection();
+
+    while (1) {
+        if (atomic_exchange(&ping_due, 0)) {
+            send_heartbeat();
+        }
+
+        frame_header header;
+        const uint8_t *payload;
+        int status = session_next_frame(current, &header, &payload);
+
+        // The client does not speak the protocol
+        if (status == -1) {
+            TRACE("\nInvalid frame received\n");
+            break;
+        }
+
+        // A whole frame is available
+        if (status == 1) {
+            if (header.type != FRAME_DATA) {
+                handle_control_frame(&header, payload);
+                frame_reader_consume(&current->reader, &header);
+                continue;
+            }
+
+            // Compressed payloads are inflated first
+            size_t size = header.length;
+            if (header.flags & (FRAME_FLAG_LZ4 | FRAME_FLAG_ZSTD)) {
+                ssize_t inflated = decompress_frame(header.flags, payload, header.length,
+                                                    inflate_buffer, sizeof(inflate_buffer));
+                if (inflated == -1) {
+                    TRACE("\nInvalid compressed frame received\n");
+                    break;
+                }
+                payload = inflate_buffer;
+                size = (size_t)inflated;
+            }
+
+            // A frame beyond the window of its stream closes the stream, the data is handed at once otherwise
+            pthread_mutex_lock(&current_lock);
+            int accepted = session_receive_data(current, header.stream, size, frame_buffer) == 0;
+            if (accepted) {
+                session_consume_data(current, header.stream, size, frame_buffer);
+            }
+            pthread_mutex_unlock(&current_lock);
+            if (!accepted) {
+                frame_reader_consume(&current->reader, &header);
+                continue;
+            }
+
+            // Messages longer than the buffer are truncated
+            size_t copied = size < length ? size : length;
+            memcpy(buffer, payload, copied);
+            *stream = header.stream;
+            frame_reader_consume(&current->reader, &header);
+            session_touch(current);
+
+            // Return the number of read bytes
+            return (ssize_t)copied;
+        }
+
+        // Read what is available, the writers use the SSL object in between
+        size_t available;
+        uint8_t *space = frame_reader_space(&current->reader, &available);
+        pthread_mutex_lock(&current_lock);
+        int bytes_read = SSL_read(current->ssl, space, (int)available);
+        int error = SSL_get_error(current->ssl, bytes_read);
+        pthread_mutex_unlock(&current_lock);
+
+        if (bytes_read > 0) {
+            frame_reader_commit(&current->reader, (size_t)bytes_read);
+            session_stats.bytes_read += (unsigned long)bytes_read;
+            continue;
+        }
+
+        // Waiting for a incoming message
+        if ((error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) && wait_for_session(error) == 0) {
+            continue;
+        }
+
+        // If an error occurs
+        if (error != SSL_ERROR_ZERO_RETURN) {
+            ERR_print_errors_fp(stderr);
+            fflush(stderr);
+        }
+        // If the connection is closed by the client
+        else {
+            TRACE("\nConnection closed by client\n");
+        }
+        break;
     }
 
-    // Return the number of read bytes
-    return (ssize_t)bytes_read;
+    // Release the connection and wait for the next client
+    drop_connection();
+    if (!running || wait_for_connection() == -1) {
+        return -1;
+    }
+    return 0;
 }
 
 ssize_t connexion_write(const uint8_t *data, size_t length) {
+    return connexion_send(data, length, TRAFFIC_TELEMETRY);
+}
 
-    // Write a message on the socket
-    ssize_t num_written = SSL_write(ssl, data, length);
-    if (num_written < 0) {
-        ERR_print_errors_fp(stderr);
+ssize_t connexion_send(const uint8_t *data, size_t length, traffic_class cls) {
+    return connexion_send_stream(STREAM_DEFAULT, data, length, cls);
+}
+
+ssize_t connexion_send_stream(uint16_t stream, const uint8_t *data, size_t length, traffic_class cls) {
+
+    // Continue the timeline handed over by the application, the spooled messages leave it
+    uint32_t trace_id = timeline_message_take(length);
+
+    if (length > (cls == TRAFFIC_BULK ? SCHEDULER_MAX_BULK_SIZE : FRAME_MAX_PAYLOAD)) {
+        fprintf(stderr, "Message too long: %zu bytes\n", length);
+        timeline_message_end(trace_id, "dropped");
+        return -1;
+    }
+
+    outgoing_message *msg = outgoing_message_new(cls, stream, data, length);
+    if (msg == NULL) {
+        perror("malloc");
+        timeline_message_end(trace_id, "dropped");
         return -1;
     }
+    atomic_store(&msg->trace_id, trace_id);
+
+    ssize_t result = submit_outgoing(msg);
+    outgoing_message_release(msg);
+    return result;
+}
+
+ssize_t connexion_publish(uint32_t key, const uint8_t *data, size_t length) {
+    uint32_t trace_id = timeline_message_take(length);
 
-    // Return the number of read bytes
-    return num_written;
+    if (length > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Message too long: %zu bytes\n", length);
+        timeline_message_end(trace_id, "dropped");
+        return -1;
+    }
+
+    outgoing_message *msg = outgoing_message_new(TRAFFIC_TELEMETRY, STREAM_DEFAULT, data, length);
+    if (msg == NULL) {
+        perror("malloc");
+        timeline_message_end(trace_id, "dropped");
+        return -1;
+    }
+    if (last_value_store(key, msg) == -1) {
+        fprintf(stderr, "No room for the last value of key %u\n", key);
+        timeline_message_end(trace_id, "dropped");
+        outgoing_message_release(msg);
+        return -1;
+    }
+
+    // Without client, the value waits for the next one in the cache, not in the spool
+    ssize_t result = (ssize_t)length;
+    if (client_connected()) {
+        atomic_store(&msg->trace_id, trace_id);
+        result = send_outgoing(msg);
+    } else {
+        timeline_message_end(trace_id, "cached");
+    }
+    outgoing_message_release(msg);
+    return result;
+}
+
+ssize_t connexion_send_latest(uint16_t channel, const uint8_t *data, size_t length) {
+    if (!datagrams) {
+        return -1;
+    }
+    return datagram_send(channel, data, length);
+}
+
+ssize_t connexion_read_latest(uint16_t *channel, uint8_t *buffer, size_t length) {
+    if (!datagrams) {
+        return -1;
+    }
+    return datagram_read(channel, buffer, length);
+}
+
+int connexion_get_rtt(rtt_stats *rtt) {
+    int result = -1;
+
+    if (backend == BACKEND_URING) {
+        return backend_uring_get_rtt(rtt);
+    }
+    if (backend == BACKEND_SHARDED) {
+        return backend_sharded_get_rtt(rtt);
+    }
+
+    pthread_mutex_lock(&current_lock);
+    if (current != NULL) {
+        *rtt = current->heartbeat.rtt;
+        result = 0;
+    }
+    pthread_mutex_unlock(&current_lock);
+
+    return result;
+}
+
+void connexion_shutdown(){
+    running = 0;
+
+    // Wake up the thread sending the spool
+    pthread_mutex_lock(&replay_lock);
+    pthread_cond_signal(&replay_cond);
+    pthread_mutex_unlock(&replay_lock);
+
+    // Wake up a thread blocked in accept
+    shutdown(socket_server, SHUT_RDWR);
+
+    // Wake up the thread waiting for the producers
+    if (ingesting) {
+        ingest_ring_wake(&ingest);
+    }
+
+    // Wake up the threads waiting for a datagram
+    if (datagrams) {
+        datagram_shutdown();
+    }
+
+    // Wake up the relays of the proxy
+    if (proxying) {
+        proxy_shutdown();
+    }
+
+    if (backend == BACKEND_URING) {
+        backend_uring_shutdown();
+        return;
+    }
+    if (backend == BACKEND_SHARDED) {
+        backend_sharded_shutdown();
+        return;
+    }
+
+    // Wake up a thread blocked in SSL_read, it will close the session
+    pthread_mutex_lock(&current_lock);
+    if (current != NULL) {
+        session_interrupt(current);
+    }
+    pthread_mutex_unlock(&current_lock);
 }
 
 void connexion_close(){
+    running = 0;
+    if (backend == BACKEND_URING) {
+        backend_uring_stop();
+    }
+    if (backend == BACKEND_SHARDED) {
+        backend_sharded_stop();
+    }
+    if (spooling) {
+        pthread_join(thread_replay, NULL);
+    }
+    if (ingesting) {
+        ingest_ring_wake(&ingest);
+        pthread_join(thread_ingest, NULL);
+        event_loop_del_fd(&loop, &ingest_handler);
+        close(ingest_server);
+    }
+    if (datagrams) {
+        datagram_stop();
+    }
+    if (proxying) {
+        proxy_stop();
+    }
+    drop_connection();
+    session_manager_stop();
+    send_scheduler_free(&outgoing);
+    last_value_clear();
+    if (ingesting) {
+        // The messages still queued gave their slots back
+        ingest_ring_unmap(&ingest);
+        ingesting = 0;
+    }
+    if (spooling) {
+        spool_close(&backlog);
+    }
+    capture_stop();
+    event_loop_stop(&loop);
+    event_loop_free(&loop);
+    close(session_wake);
+    compress_free();
     close(socket_server);
-    SSL_free(ssl);
+    ocsp_stapling_stop();
     SSL_CTX_free(ctx);
+    tls_context_free();
+    timeline_stop();
+}
+
+event_loop *connexion_event_loop(){
+    return &loop;
+}
+
+void connexion_get_stats(connexion_stats *stats){
+    stats->accepted = session_stats.accepted;
+    stats->handshake_failures = session_stats.handshake_failures;
+    stats->handshake_timeouts = session_stats.handshake_timeouts;
+    stats->idle_timeouts = session_stats.idle_timeouts;
+    stats->closed = session_stats.closed;
+    stats->bytes_read = session_stats.bytes_read;
+    stats->bytes_written = session_stats.bytes_written;
+
+    client_auth_stats auth;
+    client_auth_get_stats(&auth);
+    stats->clients_verified = auth.verified;
+    stats->clients_from_cache = auth.cache_hits;
+    stats->clients_rejected = auth.rejected;
+
+    admission_stats admission;
+    admission_get_stats(&admission);
+    stats->refused_rate_limited = admission.rate_limited;
+    stats->refused_over_capacity = admission.over_capacity;
+}
+
+void connexion_set_authorizer(client_authorizer authorize, void *arg){
+    client_auth_set_authorizer(authorize, arg);
 }
 
 int open_listener(int port)
@@ -128,12 +687,16 @@ int open_listener(int port)
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = INADDR_ANY;
 
+    // Restarting right after a clean shutdown must not wait for the TIME_WAIT connections
+    int reuse = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
     {
         perror("Impossible to bind port");
         abort();
     }
-    if (listen(sd, 10) != 0)
+    if (listen(sd, LISTEN_BACKLOG) != 0)
     {
         perror("Impossible to configure listening port");
         abort();
@@ -143,21 +706,30 @@ int open_listener(int port)
 
 SSL_CTX* init_ctx(void)
 {
-    // Load available cryptographic algorithms
-    OpenSSL_add_all_algorithms();
+    // Init a new SSL context, in the library context of the server
+    SSL_CTX *ctx;
+    ctx = tls_context_new(TLS_server_method());
 
-    // Load all error strings for OpenSSL
-    SSL_load_error_strings();
+    if ( ctx == NULL )
+    {
+        abort();
+    }
 
-    // Select the protocol method for the server
-    SSL_METHOD *method;
-    method = TLSv1_2_server_method();
+    // Only TLS 1.2, as with the former TLSv1_2_server_method
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
 
-    // Init a new SSL context
-    SSL_CTX *ctx;
-    ctx = SSL_CTX_new(method);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // An interrupted session reads an EOF, it must still be able to send its close notify
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
 
-    if ( ctx == NULL )
+    // Resumed sessions are bound to the server, which client authentication requires
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)TLS_SESSION_ID_CONTEXT,
+                                   sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+
+    // Only the groups warmed up at startup are offered
+    if (SSL_CTX_set1_groups_list(ctx, TLS_GROUPS) != 1)
     {
         ERR_print_errors_fp(stderr);
         abort();
@@ -169,9 +741,9 @@ SSL_CTX* init_ctx(void)
 
 void load_certificates(SSL_CTX* context, char* cert_filepath, char* key_filepath)
 {
-    // Load server certificate
+    // Load server certificate, followed by its chain if the file holds it
     TRACE("Loading certificates %s\n", cert_filepath);
-    if (SSL_CTX_use_certificate_file(context, cert_filepath, SSL_FILETYPE_PEM) <= 0 )
+    if (SSL_CTX_use_certificate_chain_file(context, cert_filepath) <= 0 )
     {
         ERR_print_errors_fp(stderr);
         abort();
@@ -195,15 +767,275 @@ void load_certificates(SSL_CTX* context, char* cert_filepath, char* key_filepath
     TRACE("Certificates successfully loaded\n");
 }
 
+void warm_up_handshake(SSL_CTX* context)
+{
+    // The ephemeral keys are generated for each handshake, but the first one of a
+    // group of TLS_GROUPS sets up its methods and tables
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(tls_context_libctx(), NULL, "X25519");
+    EVP_PKEY_free(key);
+    key = EVP_PKEY_Q_keygen(tls_context_libctx(), NULL, "EC", "P-256");
+    EVP_PKEY_free(key);
+
+    // The first signature caches the Montgomery contexts of the private key
+    EVP_PKEY *private_key = SSL_CTX_get0_privatekey(context);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    size_t length = EVP_PKEY_get_size(private_key);
+    uint8_t *signature = malloc(length);
+    if (md == NULL || signature == NULL
+        || EVP_DigestSignInit_ex(md, NULL, "SHA256", tls_context_libctx(), NULL, private_key, NULL) != 1
+        || EVP_DigestSign(md, signature, &length, (const uint8_t *)"warm up", 7) != 1)
+    {
+        // Not fatal, the first handshake will do it
+        ERR_clear_error();
+    }
+    free(signature);
+    EVP_MD_CTX_free(md);
+}
+
+void *thread_credentials_fct(void *arg)
+{
+    (void)arg;
+
+    // Load and check certificate and key
+    load_certificates(ctx, "../certificates/server.pem", "../certificates/server_key.pem");
+    trace_startup("Certificates loaded");
+
+    // Authenticate the clients with the CA given in the environment
+    const char *client_ca = getenv("CONNEXION_CLIENT_CA");
+    if (client_ca != NULL && client_auth_init(ctx, client_ca) == -1) {
+        abort();
+    }
+
+    // Staple the revocation status of the certificate, fetched in the background
+    const char *ocsp = getenv("CONNEXION_OCSP");
+    if (ocsp != NULL) {
+        ocsp_stapling_start(ctx, ocsp);
+    }
+
+    warm_up_handshake(ctx);
+    trace_startup("Handshake warmed up");
+
+    // Load the compression dictionary
+    compress_init(COMPRESS_DICT_PATH);
+
+    return NULL;
+}
+
+void trace_startup(const char *step)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_us = (now.tv_sec - startup_time.tv_sec) * 1000000L + (now.tv_nsec - startup_time.tv_nsec) / 1000;
+    TRACE("Startup: %s after %ld.%03ld ms\n", step, elapsed_us / 1000, elapsed_us % 1000);
+}
+
+void open_spool(const char *directory)
+{
+    // Without key, the spool is stored in clear
+    uint8_t key[SPOOL_KEY_SIZE];
+    FILE *file = fopen(SPOOL_KEY_PATH, "rb");
+    int keyed = file != NULL && fread(key, sizeof(key), 1, file) == 1;
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (!keyed) {
+        TRACE("No key in %s, the spool is not encrypted\n", SPOOL_KEY_PATH);
+    }
+
+    spooling = spool_open(&backlog, directory, keyed ? key : NULL) == 0;
+    OPENSSL_cleanse(key, sizeof(key));
+}
+
+void *thread_replay_fct(void *arg)
+{
+    (void)arg;
+
+    uint8_t *buffer = malloc(SPOOL_SEGMENT_SIZE);
+    if (buffer == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    while (running) {
+        spool_record record;
+
+        // Wait for a message while a client is connected, for a client otherwise
+        if (!client_connected() || !spool_peek(&backlog, &record, buffer, SPOOL_SEGMENT_SIZE)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SPOOL_RETRY_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            pthread_mutex_lock(&replay_lock);
+            if (running) {
+                pthread_cond_timedwait(&replay_cond, &replay_lock, &deadline);
+            }
+            pthread_mutex_unlock(&replay_lock);
+            continue;
+        }
+
+        outgoing_message *msg = outgoing_message_new((traffic_class)record.cls, record.stream, buffer, record.length);
+        if (msg == NULL) {
+            perror("malloc");
+            break;
+        }
+
+        // The record stays in the spool until the queue of the client has room for it
+        if (send_outgoing(msg) == -1) {
+            usleep(SPOOL_RETRY_MS * 1000);
+        } else {
+            spool_consume(&backlog, &record);
+        }
+        outgoing_message_release(msg);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+void open_ingest(const char *path)
+{
+    if (ingest_ring_create(&ingest, INGEST_SLOTS, INGEST_SLOT_SIZE) == -1) {
+        return;
+    }
+    ingest_server = ingest_ring_listen(path);
+    if (ingest_server == -1) {
+        ingest_ring_unmap(&ingest);
+        return;
+    }
+
+    ingest_handler.fd = ingest_server;
+    ingest_handler.callback = on_ingest_accept;
+    ingest_handler.arg = NULL;
+    if (event_loop_add_fd(&loop, &ingest_handler, EPOLLIN) == -1
+        || pthread_create(&thread_ingest, NULL, thread_ingest_fct, NULL) != 0) {
+        perror("Impossible to start the ingest ring");
+        abort();
+    }
+    ingesting = 1;
+    TRACE("Ingest ring of %d slots of %d bytes on %s\n", INGEST_SLOTS, INGEST_SLOT_SIZE, path);
+}
+
+void on_ingest_accept(int fd, uint32_t events, void *arg)
+{
+    (void)events;
+    (void)arg;
+
+    int producer;
+    while ((producer = accept(fd, NULL, NULL)) != -1) {
+        ingest_ring_send_fd(&ingest, producer);
+        close(producer);
+    }
+}
+
+void *thread_ingest_fct(void *arg)
+{
+    (void)arg;
+    size_t capacity = ingest_ring_capacity(&ingest);
+
+    while (running) {
+        ingest_slot *slot = ingest_ring_next(&ingest, 1);
+        if (slot == NULL) {
+            continue;
+        }
+
+        // The producers share the memory and may still write to it: each field is read once, then only the copy is
+        // checked and used
+        uint32_t length = *(volatile uint32_t *)&slot->length;
+        uint16_t stream = *(volatile uint16_t *)&slot->stream;
+        uint8_t class_index = *(volatile uint8_t *)&slot->cls;
+        if (class_index >= TRAFFIC_CLASS_COUNT || length > capacity
+            || length > (class_index == TRAFFIC_BULK ? SCHEDULER_MAX_BULK_SIZE : FRAME_MAX_PAYLOAD)) {
+            fprintf(stderr, "Invalid ingested message: class %u, %u bytes\n", class_index, length);
+            ingest_ring_release(&ingest, slot);
+            continue;
+        }
+
+        traffic_class cls = (traffic_class)class_index;
+        outgoing_message *msg = outgoing_message_wrap(cls, stream, slot->data, length, release_ingested, slot);
+        if (msg == NULL) {
+            perror("malloc");
+            ingest_ring_release(&ingest, slot);
+            continue;
+        }
+        atomic_store(&msg->trace_id, timeline_message_take(length));
+
+        // The slot stays out of the ring while the queue of the client is full, which holds the producers back
+        while (submit_outgoing(msg) == -1 && running && client_connected()) {
+            usleep(INGEST_RETRY_MS * 1000);
+        }
+        outgoing_message_release(msg);
+    }
+    return NULL;
+}
+
+void release_ingested(void *arg)
+{
+    ingest_ring_release(&ingest, arg);
+}
+
+int client_connected()
+{
+    if (backend == BACKEND_URING) {
+        return backend_uring_connected();
+    }
+    if (backend == BACKEND_SHARDED) {
+        return backend_sharded_connected();
+    }
+    return connected;
+}
+
+ssize_t send_outgoing(outgoing_message *msg)
+{
+    if (backend == BACKEND_URING) {
+        return backend_uring_send(msg);
+    }
+    if (backend == BACKEND_SHARDED) {
+        return backend_sharded_send(msg);
+    }
+
+    // No client to write to
+    if (!connected) {
+        TRACE("No client connected\n");
+        return -1;
+    }
+
+    // The thread finding the queue idle sends it, the other ones return at once
+    int drain = send_scheduler_push(&outgoing, msg);
+    if (drain == -1) {
+        TRACE("Write queue full\n");
+        return -1;
+    }
+    if (drain) {
+        drain_outgoing();
+    }
+    return (ssize_t)msg->length;
+}
+
+ssize_t submit_outgoing(outgoing_message *msg)
+{
+    // Without client, and until the backlog is sent, the messages wait in the spool
+    if (spooling && msg->cls != TRAFFIC_CONTROL && (!client_connected() || spool_pending(&backlog) > 0)) {
+        timeline_message_end(atomic_exchange(&msg->trace_id, 0), "spooled");
+        if (spool_append(&backlog, (uint8_t)msg->cls, msg->stream, msg->data, msg->length) == -1) {
+            return -1;
+        }
+        pthread_cond_signal(&replay_cond);
+        return (ssize_t)msg->length;
+    }
+    return send_outgoing(msg);
+}
+
 void show_certificates()
 {
     X509 *cert;
     char *line;
-    cert = SSL_get_peer_certificate(ssl);
+    cert = SSL_get_peer_certificate(current->ssl);
 
     if (cert != NULL)
     {
-        TRACE("Server certificates:\n");
+        TRACE("Client certificate:\n");
         line = X509_NAME_oneline(X509_get_subject_name(cert), 0, 0);
         TRACE("Subject: %s\n", line);
         free(line);
@@ -219,28 +1051,226 @@ void show_certificates()
 }
 
 
-void wait_for_connection() {
+int wait_for_connection() {
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
 
-    // Wait for a connection
-    TRACE("Waiting for connection\n");
-    int client = accept(socket_server, (struct sockaddr*)&addr, &len);
+    while (running) {
 
-    // Display connection detail
-    TRACE("\nNew connection :\n"
-           "- Source : %s:%d\n"
-           "- Certificate : ",inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-    show_certificates(ssl);
+        // Wait for a connection
+        TRACE("Waiting for connection\n");
+        int client = accept(socket_server, (struct sockaddr*)&addr, &len);
+        if (client == -1) {
+            if (errno != EINTR && running) {
+                perror("accept");
+            }
+            continue;
+        }
 
-    // Instantiate the SSL object
-    ssl = SSL_new(ctx);
+        // A source reconnecting too fast is refused before any crypto runs
+        if (admission_check(&addr) == -1) {
+            admission_refuse(client);
+            continue;
+        }
 
-    // Configures the SSL object to use the client socket for this connection
-    SSL_set_fd(ssl, client);
+        // Display connection detail
+        TRACE("\nNew connection :\n"
+               "- Source : %s:%d\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
 
-    // Verifies and accepts the secure connection with the client
-    if(SSL_accept(ssl) == -1){
-        ERR_print_errors_fp(stderr);
+        // Detect dead peers at the TCP level
+        session_configure_socket(client);
+
+        // Instantiate the SSL object
+        SSL *ssl = SSL_new(ctx);
+
+        // Configures the SSL object to use the client socket for this connection
+        SSL_set_fd(ssl, client);
+
+        // Verifies and accepts the secure connection with the client, within a deadline
+        event_loop_timer_add(&loop, &handshake_timer, HANDSHAKE_TIMEOUT_MS, on_handshake_timeout, &client);
+        int handshake = SSL_accept(ssl);
+        event_loop_timer_cancel(&loop, &handshake_timer);
+        admission_release();
+
+        if (handshake <= 0) {
+            ERR_print_errors_fp(stderr);
+            session_stats.handshake_failures++;
+            SSL_free(ssl);
+            close(client);
+            continue;
+        }
+        session_stats.accepted++;
+
+        // Reads and writes take turns on the SSL object, none of them may block while holding it
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+        // Track the connection
+        session *s = session_open(client, ssl, &addr);
+        if (s == NULL) {
+            fprintf(stderr, "Too many sessions\n");
+            SSL_free(ssl);
+            close(client);
+            continue;
+        }
+
+        // The client starts with the last values, a value published meanwhile is sent after them
+        pthread_mutex_lock(&current_lock);
+        current = s;
+        connected = 1;
+        ping_due = 0;
+        int drain = last_value_snapshot(&outgoing, &s->snapshot_sequence);
+        pthread_mutex_unlock(&current_lock);
+        if (drain) {
+            drain_outgoing();
+        }
+
+        // Start measuring the round trip time
+        event_loop_timer_add(&loop, &s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, s);
+
+        TRACE("- Certificate : ");
+        show_certificates();
+        return 0;
     }
-}
\ No newline at end of file
+
+    return -1;
+}
+
+int wait_for_session(int error) {
+    struct pollfd fds[2] = {
+        {.fd = current->fd, .events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN},
+        {.fd = session_wake, .events = POLLIN},
+    };
+
+    while (poll(fds, 2, -1) == -1) {
+        if (errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    }
+
+    // The caller sends the ping due before waiting again
+    uint64_t count;
+    if ((fds[1].revents & POLLIN) && read(session_wake, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    return 0;
+}
+
+void drain_outgoing() {
+    send_chunk chunk;
+    int written = 0;
+    int corked = 0;
+
+    while (1) {
+        pthread_mutex_lock(&current_lock);
+        if (!send_scheduler_peek(&outgoing, current != NULL ? &current->streams : NULL, &chunk)) {
+            // Send the last partial segment now
+            if (corked && current != NULL) {
+                session_cork(current, 0);
+            }
+            pthread_mutex_unlock(&current_lock);
+            return;
+        }
+
+        // Frames written in a row fill whole segments, a single frame leaves at once
+        if (written && !corked && current != NULL) {
+            corked = session_cork(current, 1) == 0;
+        }
+
+        // Chunks left when the client leaves are dropped
+        if (current != NULL && session_write_chunk(current, &chunk, frame_buffer) >= 0) {
+            session_touch(current);
+            written = 1;
+        }
+        send_scheduler_consume(&outgoing, &chunk);
+        pthread_mutex_unlock(&current_lock);
+    }
+}
+
+void drop_connection() {
+    pthread_mutex_lock(&current_lock);
+    session *s = current;
+    current = NULL;
+    connected = 0;
+
+    // The next client must not receive the end of a bulk transfer
+    send_scheduler_clear(&outgoing);
+    pthread_mutex_unlock(&current_lock);
+
+    if (s != NULL) {
+        event_loop_timer_cancel(&loop, &s->heartbeat_timer);
+        session_close(s);
+        session_stats.closed++;
+    }
+}
+
+void handle_control_frame(const frame_header *header, const uint8_t *payload) {
+    pthread_mutex_lock(&current_lock);
+    session_handle_control(current, header, payload, frame_buffer);
+    pthread_mutex_unlock(&current_lock);
+
+    // Messages may have been waiting for the window of their stream
+    if (header->type == FRAME_WINDOW && send_scheduler_claim(&outgoing)) {
+        drain_outgoing();
+    }
+}
+
+void send_heartbeat() {
+    pthread_mutex_lock(&current_lock);
+
+    // The reading thread closes the session once interrupted
+    if (current != NULL && session_heartbeat(current, frame_buffer) == -1) {
+        session_interrupt(current);
+    }
+
+    pthread_mutex_unlock(&current_lock);
+}
+
+void on_heartbeat_timer(void *arg) {
+    session *s = arg;
+
+    // A writer may hold the session while the peer does not read, the reading thread sends the ping
+    ping_due = 1;
+    uint64_t one = 1;
+    if (write(session_wake, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+
+    // Cancelled by drop_connection before the session is released
+    event_loop_timer_add(&loop, &s->heartbeat_timer, HEARTBEAT_PERIOD_MS, on_heartbeat_timer, s);
+}
+
+void on_handshake_timeout(void *arg) {
+    int client = *(int *)arg;
+
+    // SSL_accept fails as soon as the socket is shut down
+    TRACE("Handshake timeout\n");
+    session_stats.handshake_timeouts++;
+    shutdown(client, SHUT_RDWR);
+}
+
+void on_stats_timer(void *arg) {
+    connexion_stats stats;
+    connexion_get_stats(&stats);
+
+    rtt_stats rtt;
+    if (connexion_get_rtt(&rtt) == 0) {
+        TRACE("\nRound trip time : %u us (jitter %u us, min %u us, %lu lost pings)\n",
+              rtt.srtt_us, rtt.rttvar_us, rtt.min_us, rtt.lost);
+    }
+
+    TRACE("\nConnexion statistics :\n"
+          "- Accepted : %lu\n"
+          "- Handshake failures : %lu (%lu timeouts)\n"
+          "- Closed : %lu (%lu idle)\n"
+          "- Bytes read : %lu\n"
+          "- Bytes written : %lu\n"
+          "- Client certificates : %lu verified, %lu from cache, %lu rejected\n"
+          "- Refused before handshake : %lu rate limited, %lu over capacity\n",
+          stats.accepted, stats.handshake_failures, stats.handshake_timeouts,
+          stats.closed, stats.idle_timeouts, stats.bytes_read, stats.bytes_written,
+          stats.clients_verified, stats.clients_from_cache, stats.clients_rejected,
+          stats.refused_rate_limited, stats.refused_over_capacity);
+
+    event_loop_timer_add(&loop, &stats_timer, STATS_PERIOD_MS, on_stats_timer, arg);
+}
@@ -9,31 +9,168 @@
 #include <inttypes.h>
 #include <stdint.h>
 
+#include "heartbeat.h"
+#include "scheduler.h"
+#include "../loop/event_loop.h"
+#include "../tls/client_auth.h"
+
+/**
+ * Counters of the connexion since its initialization
+ */
+typedef struct connexion_stats {
+    unsigned long accepted;
+    unsigned long handshake_failures;
+    unsigned long handshake_timeouts;
+    unsigned long idle_timeouts;
+    unsigned long closed;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long clients_verified;
+    unsigned long clients_from_cache;
+    unsigned long clients_rejected;
+    unsigned long refused_rate_limited;
+    unsigned long refused_over_capacity;
+} connexion_stats;
+
 /**
- * Initialize SSL connection elements
+ * Initialize SSL connection elements.
+ * With CONNEXION_BACKEND=uring in the environment, the clients are served by
+ * the io_uring backend, otherwise by blocking sockets.
+ * Returns once the server listens, without waiting for a client: the first
+ * connexion_read accepts it with the blocking backend.
+ * With CONNEXION_CLIENT_CA=<file>, the clients must present a certificate
+ * signed by one of the CA of the file.
+ * With CONNEXION_DTLS in the environment, a DTLS client can also connect on
+ * the UDP port SERVER_PORT, see connexion_send_latest.
+ * With CONNEXION_PROXY=<host:port or Unix socket path>, the TLS clients of
+ * PROXY_PORT are relayed to that plaintext backend.
  */
 void connexion_init();
 
 /**
- * Wait for an incoming message on the used socket
+ * Wait for an incoming message on the used socket, from any stream.
+ * Ping and pong frames are handled internally, only data frames are returned.
  * @param buffer        the variable used to store the received message
- * @param length        the size of the buffer
- * @return              the buffer filled with the message
+ * @param length        the size of the buffer, longer messages are truncated
+ * @return              the size of the message, 0 if the client changed, -1 when stopped
  */
 ssize_t connexion_read(uint8_t *buffer, size_t length) ;
 
 /**
- * Write a message on the used socket
+ * Wait for an incoming message on the used socket, see connexion_read.
+ * Handing a message over grants its stream a new window when it is due.
+ * @param stream        filled with the stream the message was received on
+ * @param buffer        the variable used to store the received message
+ * @param length        the size of the buffer, longer messages are truncated
+ * @return              the size of the message, 0 if the client changed, -1 when stopped
+ */
+ssize_t connexion_read_stream(uint16_t *stream, uint8_t *buffer, size_t length);
+
+/**
+ * Write a telemetry message on the used socket, see connexion_send
  * @param data          the data to send
- * @param length        the size of the data
+ * @param length        the size of the data, at most FRAME_MAX_PAYLOAD
  * @return              the number of written bytes
  */
 ssize_t connexion_write(const uint8_t* data, size_t length);
 
 /**
- * Close the SSL connection and free SSL elements
+ * Send a message of a class on the used socket. Each client has a queue per
+ * class: control messages go first, telemetry and bulk transfers share what is
+ * left. Bulk transfers are cut in SCHEDULER_CHUNK_SIZE chunks, sent in bulk
+ * frames, so a control message never waits for more than one chunk.
+ * @param data          the data to send
+ * @param length        the size of the data, at most FRAME_MAX_PAYLOAD,
+ *                      SCHEDULER_MAX_BULK_SIZE for bulk transfers
+ * @param cls           the class of the message
+ * @return              the number of queued bytes, -1 on error
+ */
+ssize_t connexion_send(const uint8_t *data, size_t length, traffic_class cls);
+
+/**
+ * Send a message on a stream opened by the client, see connexion_send.
+ * The messages of a stream wait while the client does not grant it enough
+ * window, without delaying the other streams. They are dropped if the client
+ * did not open the stream or closes it.
+ * @param stream        the stream, STREAM_DEFAULT for the stream without flow control
+ * @param data          the data to send
+ * @param length        the size of the data
+ * @param cls           the class of the message
+ * @return              the number of queued bytes, -1 on error
+ */
+ssize_t connexion_send_stream(uint16_t stream, const uint8_t *data, size_t length, traffic_class cls);
+
+/**
+ * Send the value of a key as telemetry and keep it as the last value of the
+ * key: a client connecting later receives the last value of every key before
+ * the messages sent after it connected.
+ * @param key           the key, the value replaces the previous one of the key
+ * @param data          the value
+ * @param length        the size of the value, at most FRAME_MAX_PAYLOAD
+ * @return              the number of queued bytes, -1 on error or when LAST_VALUE_KEYS keys are already used
+ */
+ssize_t connexion_publish(uint32_t key, const uint8_t *data, size_t length);
+
+/**
+ * Send the latest value of a channel to the DTLS client. Nothing is
+ * retransmitted: a lost value is replaced by the next one, and a value not
+ * sent yet is overwritten by the next one of its channel.
+ * @param channel       the channel, below DATAGRAM_CHANNELS
+ * @param data          the value
+ * @param length        the size of the value, at most DATAGRAM_MAX_PAYLOAD
+ * @return              the size of the value, -1 without DTLS client
+ */
+ssize_t connexion_send_latest(uint16_t channel, const uint8_t *data, size_t length);
+
+/**
+ * Wait for a value sent by the DTLS client. Values older than the last one
+ * received on their channel are dropped.
+ * @param channel       filled with the channel of the value
+ * @param buffer        the variable used to store the received value
+ * @param length        the size of the buffer, longer values are truncated
+ * @return              the size of the value, -1 when stopped or without DTLS
+ */
+ssize_t connexion_read_latest(uint16_t *channel, uint8_t *buffer, size_t length);
+
+/**
+ * Read the round trip time of the current client, measured with ping frames.
+ * Senders can use it to adapt their rate to the quality of the link.
+ * @param rtt           the structure filled with the round trip time
+ * @return              0 on success, -1 if no client is connected
+ */
+int connexion_get_rtt(rtt_stats *rtt);
+
+/**
+ * Stop accepting clients and wake up the threads blocked in connexion_read.
+ * The current session is closed by the reading thread.
+ */
+void connexion_shutdown();
+
+/**
+ * Close the SSL connection and free SSL elements.
+ * The threads using the connexion must have stopped.
  */
 void connexion_close();
 
+/**
+ * Get the event loop running the connexion timers, to share it with other modules
+ * @return              the event loop
+ */
+event_loop *connexion_event_loop();
+
+/**
+ * Set the callback deciding which clients may connect, once their certificate
+ * is verified against CONNEXION_CLIENT_CA
+ * @param authorize     the callback, NULL to accept every verified client
+ * @param arg           the argument given to the callback
+ */
+void connexion_set_authorizer(client_authorizer authorize, void *arg);
+
+/**
+ * Read the counters of the connexion
+ * @param stats         the structure filled with the counters
+ */
+void connexion_get_stats(connexion_stats *stats);
+
 
 #endif //C_CONNEXION_H
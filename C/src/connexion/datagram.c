@@ -0,0 +1,594 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "openssl/err.h"
+#include "openssl/hmac.h"
+#include "openssl/rand.h"
+
+#include "datagram.h"
+#include "heartbeat.h"
+#include "message_queue.h"
+#include "../conf.c"
+#include "../frame/frame.h"
+#include "../tls/tls_context.h"
+#include "../trace/trace.h"
+
+// Sequence number in front of the value in a FRAME_LATEST payload
+#define LATEST_HEADER_SIZE 4
+#define COOKIE_SECRET_SIZE 32
+
+/**
+ * The value of a channel waiting to be sent
+ */
+typedef struct latest_value {
+    uint32_t sequence;
+    int pending;
+    size_t length;
+    uint8_t data[DATAGRAM_MAX_PAYLOAD];
+} latest_value;
+
+/**
+ * A client of the transport, or a client whose handshake is in progress
+ */
+typedef struct datagram_peer {
+    int fd;
+    SSL *ssl;
+    int established;
+    uint64_t deadline_us;
+    uint32_t received[DATAGRAM_CHANNELS];
+    uint8_t seen[DATAGRAM_CHANNELS];
+} datagram_peer;
+
+static SSL_CTX *dtls_ctx;
+static int socket_datagram = -1;
+static int wake_fd = -1;
+static int port_datagram;
+static SSL *listening;
+static datagram_peer peer = {.fd = -1};
+static datagram_peer candidate = {.fd = -1};
+static atomic_int connected;
+static atomic_int running;
+static pthread_t thread_datagram;
+static message_queue inbox;
+static latest_value outgoing[DATAGRAM_CHANNELS];
+static pthread_mutex_t outgoing_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t cookie_secret[COOKIE_SECRET_SIZE];
+static uint8_t frame_buffer[FRAME_HEADER_SIZE + LATEST_HEADER_SIZE + DATAGRAM_MAX_PAYLOAD];
+static uint8_t record_buffer[DATAGRAM_MTU];
+
+/**
+ * Thread function running the handshakes, the reads and the writes of the transport
+ * @param arg
+ * @return
+ */
+static void *thread_datagram_fct(void *arg);
+
+/**
+ * Create the SSL object waiting for the next ClientHello on the shared socket
+ * @return          0 on success, -1 on error
+ */
+static int listen_next();
+
+/**
+ * Answer the ClientHellos received on the shared socket, and start the
+ * handshake of the source which sent back a valid cookie on a socket of its own
+ */
+static void accept_clients();
+
+/**
+ * Go on with the handshake of the candidate, which replaces the client once done
+ */
+static void continue_handshake();
+
+/**
+ * Read the datagrams of the client
+ */
+static void receive_datagrams();
+
+/**
+ * Handle a frame received from the client
+ * @param record    The decrypted datagram
+ * @param length    The size of the datagram
+ */
+static void handle_frame(const uint8_t *record, size_t length);
+
+/**
+ * Send the values waiting for the client, one datagram each
+ */
+static void send_pending();
+
+/**
+ * Close a client, if any
+ * @param p         The client, or the candidate
+ */
+static void drop_peer(datagram_peer *p);
+
+/**
+ * Close the sockets and free the contexts opened by datagram_start
+ */
+static void release_transport();
+
+/**
+ * Cookie callback of the context, a MAC of the address of the client
+ * @param ssl       The SSL object of the handshake
+ * @param cookie    The buffer receiving the cookie
+ * @param length    Filled with the size of the cookie
+ * @return          1 on success, 0 on error
+ */
+static int generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *length);
+
+/**
+ * Cookie callback of the context, checking the cookie sent back by the client
+ * @param ssl       The SSL object of the handshake
+ * @param cookie    The cookie sent back
+ * @param length    The size of the cookie
+ * @return          1 if the cookie was generated for the address of the client, 0 otherwise
+ */
+static int verify_cookie(SSL *ssl, const unsigned char *cookie, unsigned int length);
+
+
+int datagram_start(SSL_CTX *tls_context, int port)
+{
+    TRACE("Opening DTLS listener on port %i\n", port);
+
+    // The credentials and the client authentication of the TLS clients, the passphrase of the key is not asked again
+    dtls_ctx = tls_context_clone(tls_context, DTLS_server_method());
+    if (dtls_ctx == NULL) {
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(dtls_ctx, DTLS1_2_VERSION);
+
+    // The cookies change on every start, a handshake cannot span a restart anyway
+    if (RAND_bytes(cookie_secret, sizeof(cookie_secret)) != 1) {
+        ERR_print_errors_fp(stderr);
+        release_transport();
+        return -1;
+    }
+    SSL_CTX_set_cookie_generate_cb(dtls_ctx, generate_cookie);
+    SSL_CTX_set_cookie_verify_cb(dtls_ctx, verify_cookie);
+
+    // The socket of the client is bound to the same port, the shared one only gets the new clients
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    int reuse = 1;
+    socket_datagram = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    setsockopt(socket_datagram, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(socket_datagram, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Impossible to bind datagram port");
+        release_transport();
+        return -1;
+    }
+    port_datagram = port;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        release_transport();
+        return -1;
+    }
+    if (listen_next() == -1) {
+        ERR_print_errors_fp(stderr);
+        release_transport();
+        return -1;
+    }
+    message_queue_init(&inbox, DATAGRAM_QUEUE_MESSAGES);
+
+    running = 1;
+    if (pthread_create(&thread_datagram, NULL, thread_datagram_fct, NULL) != 0) {
+        perror("pthread_create");
+        running = 0;
+        message_queue_free(&inbox);
+        release_transport();
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t datagram_send(uint16_t channel, const uint8_t *data, size_t length)
+{
+    if (channel >= DATAGRAM_CHANNELS || length > DATAGRAM_MAX_PAYLOAD) {
+        fprintf(stderr, "Invalid datagram: channel %u, %zu bytes\n", channel, length);
+        return -1;
+    }
+
+    // Stale values are worthless, nothing is kept for the next client
+    if (!connected) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&outgoing_lock);
+    latest_value *value = &outgoing[channel];
+    value->sequence++;
+    value->pending = 1;
+    value->length = length;
+    memcpy(value->data, data, length);
+    pthread_mutex_unlock(&outgoing_lock);
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+    return (ssize_t)length;
+}
+
+ssize_t datagram_read(uint16_t *channel, uint8_t *buffer, size_t length)
+{
+    message *msg = message_queue_pop(&inbox, 1);
+    if (msg == NULL) {
+        return -1;
+    }
+
+    // Values longer than the buffer are truncated
+    size_t copied = msg->length < length ? msg->length : length;
+    memcpy(buffer, msg->data, copied);
+    *channel = msg->stream;
+    free(msg);
+    return (ssize_t)copied;
+}
+
+void datagram_shutdown()
+{
+    if (!running) {
+        return;
+    }
+    running = 0;
+    message_queue_close(&inbox);
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+void datagram_stop()
+{
+    if (dtls_ctx == NULL) {
+        return;
+    }
+    datagram_shutdown();
+    pthread_join(thread_datagram, NULL);
+
+    drop_peer(&peer);
+    drop_peer(&candidate);
+    message_queue_free(&inbox);
+    release_transport();
+}
+
+static void *thread_datagram_fct(void *arg)
+{
+    (void)arg;
+
+    while (running) {
+        // The sockets of an absent client or candidate are -1, ignored by poll
+        struct pollfd fds[4] = {
+                {.fd = wake_fd, .events = POLLIN},
+                {.fd = socket_datagram, .events = POLLIN},
+                {.fd = peer.fd, .events = POLLIN},
+                {.fd = candidate.fd, .events = POLLIN},
+        };
+
+        // The handshake retransmits its lost flights on a timer
+        int timeout = DATAGRAM_TICK_MS;
+        struct timeval retransmit;
+        if (candidate.ssl != NULL && DTLSv1_get_timeout(candidate.ssl, &retransmit)) {
+            int delay = (int)(retransmit.tv_sec * 1000 + retransmit.tv_usec / 1000);
+            timeout = delay < timeout ? delay : timeout;
+        }
+
+        if (poll(fds, 4, timeout) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("read");
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_clients();
+        }
+        if (candidate.ssl != NULL && (fds[3].revents & POLLIN)) {
+            continue_handshake();
+        }
+        if (peer.ssl != NULL && (fds[2].revents & POLLIN)) {
+            receive_datagrams();
+        }
+
+        // A failed handshake leaves the client in place
+        if (candidate.ssl != NULL && DTLSv1_handle_timeout(candidate.ssl) < 0) {
+            TRACE("DTLS handshake failed\n");
+            drop_peer(&candidate);
+        }
+        if (candidate.ssl != NULL && heartbeat_now_us() > candidate.deadline_us) {
+            TRACE("DTLS client handshake timeout\n");
+            drop_peer(&candidate);
+        }
+
+        // A client which left without close notify is forgotten after a while
+        if (peer.ssl != NULL && heartbeat_now_us() > peer.deadline_us) {
+            TRACE("DTLS client idle timeout\n");
+            drop_peer(&peer);
+        }
+        if (peer.established) {
+            send_pending();
+        }
+    }
+    return NULL;
+}
+
+static int listen_next()
+{
+    BIO *bio = BIO_new_dgram(socket_datagram, BIO_NOCLOSE);
+    listening = SSL_new(dtls_ctx);
+    if (bio == NULL || listening == NULL) {
+        BIO_free(bio);
+        SSL_free(listening);
+        listening = NULL;
+        return -1;
+    }
+
+    // The records are sized for the usual paths instead of probing the MTU
+    SSL_set_bio(listening, bio, bio);
+    SSL_set_options(listening, SSL_OP_COOKIE_EXCHANGE | SSL_OP_NO_QUERY_MTU);
+    DTLS_set_link_mtu(listening, DATAGRAM_MTU);
+    return 0;
+}
+
+static void accept_clients()
+{
+    BIO_ADDR *address = BIO_ADDR_new();
+    if (address == NULL) {
+        return;
+    }
+
+    // Without a valid cookie, DTLSv1_listen answers with a HelloVerifyRequest and keeps no state
+    int result;
+    while (listening != NULL && (result = DTLSv1_listen(listening, address)) != 0) {
+        if (result < 0) {
+            ERR_print_errors_fp(stderr);
+            break;
+        }
+
+        struct sockaddr_in local;
+        struct sockaddr_in remote;
+        bzero(&local, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port_datagram);
+        local.sin_addr.s_addr = INADDR_ANY;
+        bzero(&remote, sizeof(remote));
+        remote.sin_family = AF_INET;
+        remote.sin_port = BIO_ADDR_rawport(address);
+        size_t length = sizeof(remote.sin_addr);
+        BIO_ADDR_rawaddress(address, &remote.sin_addr, &length);
+
+        // A connected socket receives the next datagrams of the client, the shared one the other clients
+        int reuse = 1;
+        int client = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        setsockopt(client, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(client, (struct sockaddr *)&local, sizeof(local)) != 0
+            || connect(client, (struct sockaddr *)&remote, sizeof(remote)) != 0) {
+            perror("Impossible to connect datagram socket");
+            close(client);
+            continue;
+        }
+
+        TRACE("\nNew DTLS client :\n"
+              "- Source : %s:%d\n", inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
+
+        // The client keeps being served until the handshake succeeds, a newer handshake replaces a pending one
+        drop_peer(&candidate);
+        BIO *bio = SSL_get_rbio(listening);
+        BIO_set_fd(bio, client, BIO_NOCLOSE);
+        BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &remote);
+        candidate.fd = client;
+        candidate.ssl = listening;
+        candidate.deadline_us = heartbeat_now_us() + (uint64_t)HANDSHAKE_TIMEOUT_MS * 1000;
+
+        // The next ClientHello is answered by a new SSL object
+        if (listen_next() == -1) {
+            ERR_print_errors_fp(stderr);
+        }
+        continue_handshake();
+    }
+    BIO_ADDR_free(address);
+}
+
+static void continue_handshake()
+{
+    int result = SSL_accept(candidate.ssl);
+    if (result <= 0) {
+        if (SSL_get_error(candidate.ssl, result) != SSL_ERROR_WANT_READ) {
+            ERR_print_errors_fp(stderr);
+            drop_peer(&candidate);
+        }
+        return;
+    }
+
+    // Only an authenticated client takes the place of the previous one
+    TRACE("DTLS handshake done (%s)\n", SSL_get_version(candidate.ssl));
+    drop_peer(&peer);
+    peer = candidate;
+    peer.established = 1;
+    peer.deadline_us = heartbeat_now_us() + (uint64_t)IDLE_TIMEOUT_MS * 1000;
+    memset(peer.seen, 0, sizeof(peer.seen));
+    candidate = (datagram_peer){.fd = -1};
+    connected = 1;
+
+    // Records which came along with the last flight of the client
+    receive_datagrams();
+}
+
+static void receive_datagrams()
+{
+    while (1) {
+        int length = SSL_read(peer.ssl, record_buffer, sizeof(record_buffer));
+        if (length > 0) {
+            peer.deadline_us = heartbeat_now_us() + (uint64_t)IDLE_TIMEOUT_MS * 1000;
+            handle_frame(record_buffer, (size_t)length);
+            continue;
+        }
+
+        int error = SSL_get_error(peer.ssl, length);
+        if (error == SSL_ERROR_WANT_READ) {
+            return;
+        }
+        if (error == SSL_ERROR_ZERO_RETURN) {
+            TRACE("\nDTLS connection closed by client\n");
+        } else {
+            ERR_print_errors_fp(stderr);
+        }
+        drop_peer(&peer);
+        return;
+    }
+}
+
+static void handle_frame(const uint8_t *record, size_t length)
+{
+    // One whole frame per datagram, anything else is dropped
+    frame_header header;
+    if (length < FRAME_HEADER_SIZE || frame_decode_header(record, &header) == -1
+        || header.length != length - FRAME_HEADER_SIZE || header.type != FRAME_LATEST
+        || header.length < LATEST_HEADER_SIZE || header.stream >= DATAGRAM_CHANNELS) {
+        return;
+    }
+
+    // A value overtaken by a newer one of the same channel is dropped
+    uint32_t sequence = frame_get_u32(record + FRAME_HEADER_SIZE);
+    if (peer.seen[header.stream] && (int32_t)(sequence - peer.received[header.stream]) <= 0) {
+        return;
+    }
+    peer.seen[header.stream] = 1;
+    peer.received[header.stream] = sequence;
+
+    if (message_queue_push(&inbox, 0, 0, header.stream, record + FRAME_HEADER_SIZE + LATEST_HEADER_SIZE,
+                           header.length - LATEST_HEADER_SIZE) == -1) {
+        TRACE("Datagram queue full\n");
+    }
+}
+
+static void send_pending()
+{
+    for (uint16_t channel = 0; channel < DATAGRAM_CHANNELS && peer.established; ++channel) {
+        pthread_mutex_lock(&outgoing_lock);
+        latest_value *value = &outgoing[channel];
+        if (!value->pending) {
+            pthread_mutex_unlock(&outgoing_lock);
+            continue;
+        }
+        frame_encode_header(frame_buffer, FRAME_LATEST, 0, channel, (uint32_t)(LATEST_HEADER_SIZE + value->length));
+        frame_put_u32(frame_buffer + FRAME_HEADER_SIZE, value->sequence);
+        memcpy(frame_buffer + FRAME_HEADER_SIZE + LATEST_HEADER_SIZE, value->data, value->length);
+        int length = (int)(FRAME_HEADER_SIZE + LATEST_HEADER_SIZE + value->length);
+        value->pending = 0;
+        pthread_mutex_unlock(&outgoing_lock);
+
+        // A datagram the socket cannot take now is lost like on the network
+        int written = SSL_write(peer.ssl, frame_buffer, length);
+        if (written <= 0) {
+            int error = SSL_get_error(peer.ssl, written);
+            if (error != SSL_ERROR_WANT_WRITE) {
+                ERR_print_errors_fp(stderr);
+                drop_peer(&peer);
+            }
+            ERR_clear_error();
+        }
+    }
+}
+
+static void drop_peer(datagram_peer *p)
+{
+    if (p->ssl == NULL) {
+        return;
+    }
+
+    // Best effort close notify, the client may be gone already
+    int established = p->established;
+    if (established) {
+        SSL_shutdown(p->ssl);
+    }
+    SSL_free(p->ssl);
+    close(p->fd);
+    p->ssl = NULL;
+    p->fd = -1;
+    p->established = 0;
+    if (!established) {
+        return;
+    }
+    connected = 0;
+
+    // The values of the previous client are not sent to the next one
+    pthread_mutex_lock(&outgoing_lock);
+    for (int i = 0; i < DATAGRAM_CHANNELS; ++i) {
+        outgoing[i].pending = 0;
+    }
+    pthread_mutex_unlock(&outgoing_lock);
+}
+
+static void release_transport()
+{
+    SSL_free(listening);
+    listening = NULL;
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (socket_datagram != -1) {
+        close(socket_datagram);
+        socket_datagram = -1;
+    }
+    SSL_CTX_free(dtls_ctx);
+    dtls_ctx = NULL;
+    OPENSSL_cleanse(cookie_secret, sizeof(cookie_secret));
+}
+
+static int generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *length)
+{
+    BIO_ADDR *address = BIO_ADDR_new();
+    if (address == NULL || BIO_dgram_get_peer(SSL_get_rbio(ssl), address) <= 0) {
+        BIO_ADDR_free(address);
+        return 0;
+    }
+
+    // MAC of the port and the address, the secret never leaves the server
+    uint8_t data[2 + 16];
+    size_t size = sizeof(data) - 2;
+    unsigned short port = BIO_ADDR_rawport(address);
+    memcpy(data, &port, 2);
+    int valid = BIO_ADDR_rawaddress(address, data + 2, &size);
+    BIO_ADDR_free(address);
+    if (!valid) {
+        return 0;
+    }
+
+    return HMAC(EVP_sha256(), cookie_secret, sizeof(cookie_secret), data, 2 + size, cookie, length) != NULL;
+}
+
+static int verify_cookie(SSL *ssl, const unsigned char *cookie, unsigned int length)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned int expected_length;
+    return generate_cookie(ssl, expected, &expected_length)
+           && length == expected_length && CRYPTO_memcmp(cookie, expected, length) == 0;
+}
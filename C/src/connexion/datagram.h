@@ -0,0 +1,61 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_DATAGRAM_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_DATAGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "openssl/ssl.h"
+
+/**
+ * DTLS transport over UDP, next to the TLS one, for telemetry which is
+ * worthless once late. Each datagram carries one FRAME_LATEST frame: a channel
+ * (the stream field of the header), a sequence number and a value. Nothing is
+ * retransmitted: a lost value is replaced by the next one, and a value older
+ * than the last one received on its channel is dropped. On the sending side,
+ * a value not sent yet is overwritten by the next one of its channel.
+ * One client at a time: a client completing its handshake replaces the
+ * previous one. The cookie exchange makes the clients prove their address
+ * before the server keeps any state for them.
+ */
+
+/**
+ * Start serving DTLS clients on a UDP port
+ * @param tls_context   The TLS context, cloned for DTLS
+ * @param port          The UDP port
+ * @return              0 on success, -1 on error
+ */
+int datagram_start(SSL_CTX *tls_context, int port);
+
+/**
+ * Send the latest value of a channel, replacing the one not sent yet
+ * @param channel       The channel, below DATAGRAM_CHANNELS
+ * @param data          The value
+ * @param length        The size of the value, at most DATAGRAM_MAX_PAYLOAD
+ * @return              The size of the value, -1 if no client is connected or on error
+ */
+ssize_t datagram_send(uint16_t channel, const uint8_t *data, size_t length);
+
+/**
+ * Wait for a value received from the client
+ * @param channel       Filled with the channel of the value
+ * @param buffer        The buffer receiving the value
+ * @param length        The size of the buffer, longer values are truncated
+ * @return              The size of the value, -1 when stopped
+ */
+ssize_t datagram_read(uint16_t *channel, uint8_t *buffer, size_t length);
+
+/**
+ * Wake up the threads blocked in datagram_read, which then return -1
+ */
+void datagram_shutdown();
+
+/**
+ * Close the client, stop the DTLS thread and free the transport
+ */
+void datagram_stop();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_DATAGRAM_H
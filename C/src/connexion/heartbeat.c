@@ -0,0 +1,85 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <string.h>
+#include <time.h>
+
+#include "heartbeat.h"
+#include "../frame/frame.h"
+
+
+uint64_t heartbeat_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void heartbeat_init(heartbeat *hb)
+{
+    memset(hb, 0, sizeof(*hb));
+}
+
+unsigned int heartbeat_ping(heartbeat *hb, uint8_t *payload, uint64_t now_us)
+{
+    // The previous ping was never answered
+    if (hb->outstanding) {
+        hb->misses++;
+        hb->rtt.lost++;
+    }
+
+    hb->outstanding_seq = hb->next_seq++;
+    hb->outstanding = 1;
+    hb->sent_us[hb->outstanding_seq % HEARTBEAT_HISTORY] = now_us;
+
+    frame_put_u32(payload, hb->outstanding_seq);
+    frame_put_u32(payload + 4, 0);
+    frame_put_u64(payload + 8, now_us);
+
+    return hb->misses;
+}
+
+int heartbeat_pong(heartbeat *hb, const uint8_t *payload, size_t length, uint64_t now_us)
+{
+    if (length != HEARTBEAT_PAYLOAD_SIZE) {
+        return -1;
+    }
+
+    // Only a recent ping gives a sample, once: unsolicited and replayed pongs can not move the round trip time
+    uint32_t seq = frame_get_u32(payload);
+    uint32_t age = hb->next_seq - seq;
+    uint64_t *sent_us = &hb->sent_us[seq % HEARTBEAT_HISTORY];
+    if (age == 0 || age > HEARTBEAT_HISTORY || *sent_us == 0 || *sent_us > now_us) {
+        return -1;
+    }
+    uint64_t sample = now_us - *sent_us;
+    *sent_us = 0;
+
+    // A late pong still gives a valid sample, but only the last ping clears the misses
+    if (hb->outstanding && seq == hb->outstanding_seq) {
+        hb->outstanding = 0;
+        hb->misses = 0;
+    }
+
+    uint32_t rtt = sample > UINT32_MAX ? UINT32_MAX : (uint32_t)sample;
+    rtt_stats *stats = &hb->rtt;
+
+    // RFC 6298: rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+    if (stats->samples == 0) {
+        stats->srtt_us = rtt;
+        stats->rttvar_us = rtt / 2;
+        stats->min_us = rtt;
+    } else {
+        uint32_t delta = stats->srtt_us > rtt ? stats->srtt_us - rtt : rtt - stats->srtt_us;
+        stats->rttvar_us = (uint32_t)(((uint64_t)stats->rttvar_us * 3 + delta) / 4);
+        stats->srtt_us = (uint32_t)(((uint64_t)stats->srtt_us * 7 + rtt) / 8);
+        if (rtt < stats->min_us) {
+            stats->min_us = rtt;
+        }
+    }
+
+    stats->last_us = rtt;
+    stats->samples++;
+    return 0;
+}
@@ -0,0 +1,78 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_HEARTBEAT_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_HEARTBEAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Ping and pong payload: sequence number (4 bytes), padding (4 bytes) and
+ * the sending date of the ping in microseconds (8 bytes), little-endian.
+ * The pong echoes the payload of the ping.
+ */
+#define HEARTBEAT_PAYLOAD_SIZE 16
+
+// Pings whose sending date is kept, a pong answering an older one is ignored
+#define HEARTBEAT_HISTORY 8
+
+/**
+ * Round trip time of a connection, in microseconds.
+ * srtt and rttvar are smoothed as in RFC 6298, rttvar being the jitter.
+ */
+typedef struct rtt_stats {
+    uint32_t last_us;
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t min_us;
+    unsigned long samples;
+    unsigned long lost;
+} rtt_stats;
+
+/**
+ * Heartbeat state of a connection
+ */
+typedef struct heartbeat {
+    rtt_stats rtt;
+    uint64_t sent_us[HEARTBEAT_HISTORY];
+    uint32_t next_seq;
+    uint32_t outstanding_seq;
+    int outstanding;
+    unsigned int misses;
+} heartbeat;
+
+/**
+ * Get the time of the monotonic clock
+ * @return          The time in microseconds
+ */
+uint64_t heartbeat_now_us();
+
+/**
+ * Initialize the heartbeat state of a new connection
+ * @param hb        The heartbeat state
+ */
+void heartbeat_init(heartbeat *hb);
+
+/**
+ * Build the payload of the next ping
+ * @param hb        The heartbeat state
+ * @param payload   Filled with the HEARTBEAT_PAYLOAD_SIZE bytes of the payload
+ * @param now_us    The current time
+ * @return          The number of consecutive pings left unanswered before this one
+ */
+unsigned int heartbeat_ping(heartbeat *hb, uint8_t *payload, uint64_t now_us);
+
+/**
+ * Update the round trip time with a received pong. The sample is timed with
+ * the sending date kept for its ping, the date echoed by the peer is not trusted.
+ * @param hb        The heartbeat state
+ * @param payload   The payload of the pong
+ * @param length    The size of the payload
+ * @param now_us    The current time
+ * @return          0 on success, -1 if the pong is malformed or answers no recent ping not answered yet
+ */
+int heartbeat_pong(heartbeat *hb, const uint8_t *payload, size_t length, uint64_t now_us);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_HEARTBEAT_H
@@ -0,0 +1,362 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "ingest_ring.h"
+
+/**
+ * Sleep while a futex word of the shared memory keeps its value
+ * @param word      The futex word
+ * @param value     The value seen before deciding to sleep
+ */
+static void futex_wait(_Atomic uint32_t *word, uint32_t value);
+
+/**
+ * Wake up the processes sleeping on a futex word of the shared memory
+ * @param word      The futex word
+ * @param count     The maximum number of processes to wake up
+ */
+static void futex_wake(_Atomic uint32_t *word, int count);
+
+/**
+ * Get the slot of a position
+ * @param ring      The ring
+ * @param position  The position
+ * @return          The slot
+ */
+static ingest_slot *slot_at(const ingest_ring *ring, uint64_t position);
+
+
+int ingest_ring_create(ingest_ring *ring, uint32_t slot_count, uint32_t slot_size)
+{
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || slot_size % 64 != 0
+        || slot_size <= sizeof(ingest_slot)) {
+        fprintf(stderr, "Invalid ingest ring: %u slots of %u bytes\n", slot_count, slot_size);
+        return -1;
+    }
+
+    int fd = memfd_create("ingest_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    // A producer must not shrink the memory under the server, which would fault reading it
+    size_t size = INGEST_RING_HEADER_SIZE + (size_t)slot_count * slot_size;
+    if (ftruncate(fd, (off_t)size) != 0
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        perror("Impossible to size the ingest ring");
+        close(fd);
+        return -1;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+
+    ring->header = memory;
+    ring->slots = (uint8_t *)memory + INGEST_RING_HEADER_SIZE;
+    ring->size = size;
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->next = 0;
+    ring->fd = fd;
+
+    // The memfd is zeroed, only the sequences of the first lap are set
+    for (uint32_t i = 0; i < slot_count; ++i) {
+        atomic_init(&slot_at(ring, i)->sequence, i);
+    }
+    ring->header->slot_count = slot_count;
+    ring->header->slot_size = slot_size;
+    ring->header->version = INGEST_RING_VERSION;
+    atomic_thread_fence(memory_order_release);
+    ring->header->magic = INGEST_RING_MAGIC;
+    return 0;
+}
+
+int ingest_ring_map(ingest_ring *ring, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= INGEST_RING_HEADER_SIZE) {
+        fprintf(stderr, "Invalid ingest ring descriptor\n");
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+
+    // The layout must match the size of the memory
+    ingest_ring_header *header = memory;
+    if (header->magic != INGEST_RING_MAGIC || header->version != INGEST_RING_VERSION
+        || header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0
+        || header->slot_size <= sizeof(ingest_slot)
+        || INGEST_RING_HEADER_SIZE + (size_t)header->slot_count * header->slot_size != size) {
+        fprintf(stderr, "Invalid ingest ring\n");
+        munmap(memory, size);
+        close(fd);
+        return -1;
+    }
+
+    ring->header = header;
+    ring->slots = (uint8_t *)memory + INGEST_RING_HEADER_SIZE;
+    ring->size = size;
+    ring->slot_count = header->slot_count;
+    ring->slot_size = header->slot_size;
+    ring->next = 0;
+    ring->fd = fd;
+    return 0;
+}
+
+void ingest_ring_unmap(ingest_ring *ring)
+{
+    if (ring->header != NULL) {
+        munmap(ring->header, ring->size);
+        ring->header = NULL;
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+size_t ingest_ring_capacity(const ingest_ring *ring)
+{
+    return ring->slot_size - sizeof(ingest_slot);
+}
+
+int ingest_ring_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Ingest socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sd, 8) != 0) {
+        perror("Impossible to open the ingest socket");
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+int ingest_ring_send_fd(const ingest_ring *ring, int client)
+{
+    // One byte carrying the descriptor
+    uint8_t byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    union {
+        struct cmsghdr header;
+        uint8_t buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ring->fd, sizeof(int));
+
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) != 1) {
+        perror("Impossible to hand the ingest ring");
+        return -1;
+    }
+    return 0;
+}
+
+int ingest_ring_connect(ingest_ring *ring, const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Ingest socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Impossible to connect to the ingest socket");
+        close(sd);
+        return -1;
+    }
+
+    uint8_t byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    union {
+        struct cmsghdr header;
+        uint8_t buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    ssize_t received = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+    close(sd);
+    struct cmsghdr *cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        fprintf(stderr, "No ingest ring received\n");
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return ingest_ring_map(ring, fd);
+}
+
+ingest_slot *ingest_ring_reserve(ingest_ring *ring, int wait)
+{
+    ingest_ring_header *header = ring->header;
+    uint64_t position = atomic_load(&header->head);
+
+    while (1) {
+        ingest_slot *slot = slot_at(ring, position);
+        int64_t lag = (int64_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - position);
+
+        if (lag == 0) {
+            // The slot is free for this position, the first producer taking the position owns it
+            if (atomic_compare_exchange_weak(&header->head, &position, position + 1)) {
+                return slot;
+            }
+
+        } else if (lag < 0) {
+            // The server has not released the slot of the previous lap yet
+            if (!wait) {
+                return NULL;
+            }
+            uint32_t released = atomic_load(&header->released);
+            atomic_fetch_add(&header->producers_waiting, 1);
+            if ((int64_t)(atomic_load(&slot->sequence) - position) < 0) {
+                futex_wait(&header->released, released);
+            }
+            atomic_fetch_sub(&header->producers_waiting, 1);
+            position = atomic_load(&header->head);
+
+        } else {
+            // Another producer took the position
+            position = atomic_load(&header->head);
+        }
+    }
+}
+
+void ingest_ring_commit(ingest_ring *ring, ingest_slot *slot, uint8_t cls, uint16_t stream, uint32_t length)
+{
+    ingest_ring_header *header = ring->header;
+    slot->length = length;
+    slot->stream = stream;
+    slot->cls = cls;
+
+    // The sequence of a reserved slot is still its position
+    uint64_t position = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store(&slot->sequence, position + 1);
+
+    atomic_fetch_add(&header->committed, 1);
+    if (atomic_load(&header->consumer_waiting)) {
+        futex_wake(&header->committed, 1);
+    }
+}
+
+ingest_slot *ingest_ring_next(ingest_ring *ring, int wait)
+{
+    ingest_ring_header *header = ring->header;
+    ingest_slot *slot = slot_at(ring, ring->next);
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring->next + 1) {
+        if (!wait) {
+            return NULL;
+        }
+
+        // Check again once the producers know the server sleeps, a commit in between changes the futex word
+        uint32_t committed = atomic_load(&header->committed);
+        atomic_store(&header->consumer_waiting, 1);
+        if (atomic_load(&slot->sequence) != ring->next + 1) {
+            futex_wait(&header->committed, committed);
+        }
+        atomic_store(&header->consumer_waiting, 0);
+
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring->next + 1) {
+            return NULL;
+        }
+    }
+
+    ring->next++;
+    return slot;
+}
+
+void ingest_ring_release(ingest_ring *ring, ingest_slot *slot)
+{
+    ingest_ring_header *header = ring->header;
+
+    // Free for the same slot of the next lap
+    uint64_t position = atomic_load_explicit(&slot->sequence, memory_order_relaxed) - 1;
+    atomic_store(&slot->sequence, position + ring->slot_count);
+
+    atomic_fetch_add(&header->released, 1);
+    if (atomic_load(&header->producers_waiting) > 0) {
+        futex_wake(&header->released, INT_MAX);
+    }
+}
+
+void ingest_ring_wake(ingest_ring *ring)
+{
+    atomic_fetch_add(&ring->header->committed, 1);
+    futex_wake(&ring->header->committed, INT_MAX);
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t value)
+{
+    // Shared between processes, so not FUTEX_PRIVATE_FLAG
+    if (syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR) {
+        perror("futex");
+    }
+}
+
+static void futex_wake(_Atomic uint32_t *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static ingest_slot *slot_at(const ingest_ring *ring, uint64_t position)
+{
+    return (ingest_slot *)(ring->slots + (size_t)(position & (ring->slot_count - 1)) * ring->slot_size);
+}
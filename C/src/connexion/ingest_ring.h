@@ -0,0 +1,162 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_INGEST_RING_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_INGEST_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Ring of message slots in shared memory, fed by producer processes and read
+ * by the server. The server creates it in a sealed memfd and hands the
+ * descriptor to each producer connecting to its Unix socket. A producer
+ * reserves a slot, writes its message in place and commits it; the server
+ * sends the message from the slot and releases it once written to every
+ * client. Both sides sleep on futexes in the shared memory: the server when
+ * the ring is empty, the producers when it is full.
+ * Slots are read in the order of their reservation: a producer dying between
+ * the reservation and the commit of a slot stops the ring.
+ */
+
+// "INGR"
+#define INGEST_RING_MAGIC 0x494e4752u
+#define INGEST_RING_VERSION 1
+#define INGEST_RING_HEADER_SIZE 4096
+
+/**
+ * Header of the shared memory, the counters written by each side on their own cache line
+ */
+typedef struct ingest_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    _Alignas(64) _Atomic uint64_t head;             // Next position reserved by a producer
+    _Alignas(64) _Atomic uint32_t committed;        // Futex of the server, counts the commits
+    _Atomic uint32_t consumer_waiting;
+    _Alignas(64) _Atomic uint32_t released;         // Futex of the producers, counts the releases
+    _Atomic uint32_t producers_waiting;
+} ingest_ring_header;
+
+/**
+ * A slot of the ring. Its sequence is its position when it is free for this
+ * position, the position plus one once the message is committed.
+ */
+typedef struct ingest_slot {
+    _Atomic uint64_t sequence;
+    uint32_t length;
+    uint16_t stream;
+    uint8_t cls;
+    uint8_t reserved;
+    uint8_t data[];
+} ingest_slot;
+
+/**
+ * A mapping of the ring, in the server or in a producer
+ */
+typedef struct ingest_ring {
+    ingest_ring_header *header;
+    uint8_t *slots;
+    size_t size;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint64_t next;
+    int fd;
+} ingest_ring;
+
+/**
+ * Create a ring in a sealed memfd, for the server
+ * @param ring          The ring
+ * @param slot_count    The number of slots, a power of two
+ * @param slot_size     The size of a slot, header included, a multiple of 64
+ * @return              0 on success, -1 on error
+ */
+int ingest_ring_create(ingest_ring *ring, uint32_t slot_count, uint32_t slot_size);
+
+/**
+ * Map a ring created by the server, for a producer
+ * @param ring      The ring
+ * @param fd        The memfd of the ring, owned by the ring from now on
+ * @return          0 on success, -1 on error
+ */
+int ingest_ring_map(ingest_ring *ring, int fd);
+
+/**
+ * Unmap a ring and close its memfd
+ * @param ring      The ring
+ */
+void ingest_ring_unmap(ingest_ring *ring);
+
+/**
+ * Get the largest message of a slot
+ * @param ring      The ring
+ * @return          The size in bytes
+ */
+size_t ingest_ring_capacity(const ingest_ring *ring);
+
+/**
+ * Open the Unix socket handing the ring to the producers, replacing a socket left by a previous server
+ * @param path      The path of the socket
+ * @return          The non-blocking listening socket, -1 on error
+ */
+int ingest_ring_listen(const char *path);
+
+/**
+ * Hand the memfd of a ring to a producer
+ * @param ring      The ring
+ * @param client    The socket of the producer
+ * @return          0 on success, -1 on error
+ */
+int ingest_ring_send_fd(const ingest_ring *ring, int client);
+
+/**
+ * Connect to the Unix socket of the server and map the ring it hands over, for a producer
+ * @param ring      The ring
+ * @param path      The path of the socket
+ * @return          0 on success, -1 on error
+ */
+int ingest_ring_connect(ingest_ring *ring, const char *path);
+
+/**
+ * Reserve the next slot, for a producer
+ * @param ring      The ring
+ * @param wait      1 to wait for a free slot, 0 to return immediately
+ * @return          The slot to write the message in, NULL if the ring is full
+ */
+ingest_slot *ingest_ring_reserve(ingest_ring *ring, int wait);
+
+/**
+ * Hand a written slot to the server, for a producer
+ * @param ring      The ring
+ * @param slot      The slot given by ingest_ring_reserve
+ * @param cls       The traffic class of the message
+ * @param stream    The stream of the message
+ * @param length    The size of the message, at most ingest_ring_capacity
+ */
+void ingest_ring_commit(ingest_ring *ring, ingest_slot *slot, uint8_t cls, uint16_t stream, uint32_t length);
+
+/**
+ * Get the next committed slot, for the single reading thread of the server
+ * @param ring      The ring
+ * @param wait      1 to wait for a commit or ingest_ring_wake, 0 to return immediately
+ * @return          The slot, NULL if none is committed
+ */
+ingest_slot *ingest_ring_next(ingest_ring *ring, int wait);
+
+/**
+ * Give a slot read by ingest_ring_next back to the producers, from any thread of the server
+ * @param ring      The ring
+ * @param slot      The slot
+ */
+void ingest_ring_release(ingest_ring *ring, ingest_slot *slot);
+
+/**
+ * Wake up the thread waiting in ingest_ring_next
+ * @param ring      The ring
+ */
+void ingest_ring_wake(ingest_ring *ring);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_INGEST_RING_H
@@ -0,0 +1,106 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <pthread.h>
+
+#include "last_value.h"
+#include "../conf.c"
+
+/**
+ * The last value of a key, NULL when the slot is free
+ */
+typedef struct last_value {
+    uint32_t key;
+    outgoing_message *msg;
+} last_value;
+
+static last_value values[LAST_VALUE_KEYS];
+static uint64_t last_sequence;
+static pthread_mutex_t values_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find the slot of a key, or the free slot where to add it, the lock must be held
+ * @param key       The key
+ * @return          The slot, NULL if the key is not stored and no slot is free
+ */
+static last_value *find_slot(uint32_t key);
+
+
+int last_value_store(uint32_t key, outgoing_message *msg)
+{
+    pthread_mutex_lock(&values_lock);
+
+    last_value *slot = find_slot(key);
+    if (slot == NULL) {
+        pthread_mutex_unlock(&values_lock);
+        return -1;
+    }
+
+    // The sequence is set before the message is shared with the clients
+    msg->sequence = ++last_sequence;
+    outgoing_message *previous = slot->msg;
+    slot->key = key;
+    slot->msg = outgoing_message_ref(msg);
+
+    pthread_mutex_unlock(&values_lock);
+
+    if (previous != NULL) {
+        outgoing_message_release(previous);
+    }
+    return 0;
+}
+
+int last_value_snapshot(send_scheduler *queue, uint64_t *sequence)
+{
+    int drain = 0;
+
+    pthread_mutex_lock(&values_lock);
+    for (size_t i = 0; i < LAST_VALUE_KEYS; ++i) {
+        outgoing_message *stored = values[i].msg;
+        if (stored == NULL) {
+            continue;
+        }
+
+        // A copy without sequence, so it is not taken for a live message already in the snapshot
+        outgoing_message *copy = outgoing_message_new(stored->cls, stored->stream, stored->data, stored->length);
+        if (copy == NULL) {
+            continue;
+        }
+        int result = send_scheduler_push(queue, copy);
+        outgoing_message_release(copy);
+        if (result == -1) {
+            break;
+        }
+        drain |= result;
+    }
+    *sequence = last_sequence;
+    pthread_mutex_unlock(&values_lock);
+
+    return drain;
+}
+
+void last_value_clear()
+{
+    pthread_mutex_lock(&values_lock);
+    for (size_t i = 0; i < LAST_VALUE_KEYS; ++i) {
+        if (values[i].msg != NULL) {
+            outgoing_message_release(values[i].msg);
+            values[i].msg = NULL;
+        }
+    }
+    pthread_mutex_unlock(&values_lock);
+}
+
+static last_value *find_slot(uint32_t key)
+{
+    // Linear probing from the hash of the key, keys are never removed one by one
+    size_t start = (size_t)((key * 2654435761u) % LAST_VALUE_KEYS);
+    for (size_t i = 0; i < LAST_VALUE_KEYS; ++i) {
+        last_value *slot = &values[(start + i) % LAST_VALUE_KEYS];
+        if (slot->msg == NULL || slot->key == key) {
+            return slot;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,42 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_LAST_VALUE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_LAST_VALUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "scheduler.h"
+
+/**
+ * Last value sent for each key, so a new client starts with the current state
+ * instead of waiting for every producer to send again. Each stored value gets a
+ * sequence number, kept in its outgoing message. When a client connects, a copy
+ * of every value is queued for it, then only the values published later are
+ * written: a live message with a sequence number not above the one of the
+ * snapshot is already in it and is skipped.
+ */
+
+/**
+ * Store the last value of a key, replacing the previous one
+ * @param key       The key
+ * @param msg       The message carrying the value, its sequence number is set
+ * @return          0 on success, -1 if LAST_VALUE_KEYS keys are already stored
+ */
+int last_value_store(uint32_t key, outgoing_message *msg);
+
+/**
+ * Queue a copy of every stored value for a new client
+ * @param queue     The queue of the client
+ * @param sequence  Filled with the sequence number of the last value copied
+ * @return          1 if the caller must drain the queue, 0 otherwise
+ */
+int last_value_snapshot(send_scheduler *queue, uint64_t *sequence);
+
+/**
+ * Forget every stored value
+ */
+void last_value_clear();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_LAST_VALUE_H
@@ -0,0 +1,188 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message_queue.h"
+
+/**
+ * Add the length of a released message to the credit of its stream
+ * @param queue     The queue, locked
+ * @param msg       The message
+ * @return          0 on success, -1 if the credits could not grow
+ */
+static int add_credit(message_queue *queue, const message *msg);
+
+
+void message_queue_init(message_queue *queue, size_t capacity)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->count = 0;
+    queue->capacity = capacity;
+    queue->closed = 0;
+    queue->waiting = 0;
+    queue->credits = NULL;
+    queue->credit_count = 0;
+    queue->credit_capacity = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
+
+int message_queue_push(message_queue *queue, uint16_t owner, uint32_t session, uint16_t stream, const uint8_t *data,
+                       size_t length)
+{
+    message *msg = malloc(sizeof(message) + length);
+    if (msg == NULL) {
+        return -1;
+    }
+    msg->next = NULL;
+    msg->session = session;
+    msg->owner = owner;
+    msg->stream = stream;
+    msg->length = length;
+    memcpy(msg->data, data, length);
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->closed || queue->count >= queue->capacity) {
+        // The owner is woken up by the next release
+        if (!queue->closed) {
+            queue->waiting |= 1u << owner;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        free(msg);
+        return -1;
+    }
+
+    if (queue->tail == NULL) {
+        queue->head = msg;
+    } else {
+        queue->tail->next = msg;
+    }
+    queue->tail = msg;
+    queue->count++;
+
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+message *message_queue_pop(message_queue *queue, int wait)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    while (wait && queue->head == NULL && !queue->closed) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+
+    message *msg = queue->closed ? NULL : queue->head;
+    if (msg != NULL) {
+        queue->head = msg->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->count--;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return msg;
+}
+
+uint32_t message_queue_release(message_queue *queue, message *msg)
+{
+    uint32_t wake = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    // The owner drains all of its credits at once, it is only woken up for the first one
+    if (msg->session != 0) {
+        int first = 1;
+        for (size_t i = 0; i < queue->credit_count && first; ++i) {
+            first = queue->credits[i].owner != msg->owner;
+        }
+        if (add_credit(queue, msg) == 0 && first) {
+            wake |= 1u << msg->owner;
+        }
+    }
+
+    // Room was made for the owners which found the queue full
+    wake |= queue->waiting;
+    queue->waiting = 0;
+
+    pthread_mutex_unlock(&queue->lock);
+    free(msg);
+    return wake;
+}
+
+size_t message_queue_take_credits(message_queue *queue, uint16_t owner, message_credit *credits, size_t max)
+{
+    size_t taken = 0;
+    size_t kept = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < queue->credit_count; ++i) {
+        if (queue->credits[i].owner == owner && taken < max) {
+            credits[taken++] = queue->credits[i];
+        } else {
+            queue->credits[kept++] = queue->credits[i];
+        }
+    }
+    queue->credit_count = kept;
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+void message_queue_close(message_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void message_queue_free(message_queue *queue)
+{
+    while (queue->head != NULL) {
+        message *msg = queue->head;
+        queue->head = msg->next;
+        free(msg);
+    }
+    queue->tail = NULL;
+    queue->count = 0;
+    free(queue->credits);
+    queue->credits = NULL;
+    queue->credit_count = 0;
+    queue->credit_capacity = 0;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+}
+
+static int add_credit(message_queue *queue, const message *msg)
+{
+    for (size_t i = 0; i < queue->credit_count; ++i) {
+        message_credit *credit = &queue->credits[i];
+        if (credit->session == msg->session && credit->owner == msg->owner && credit->stream == msg->stream) {
+            credit->length += msg->length;
+            return 0;
+        }
+    }
+
+    // One credit per stream of a session, the array only grows with the number of streams
+    if (queue->credit_count == queue->credit_capacity) {
+        size_t capacity = queue->credit_capacity == 0 ? 16 : queue->credit_capacity * 2;
+        message_credit *credits = realloc(queue->credits, capacity * sizeof(message_credit));
+        if (credits == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        queue->credits = credits;
+        queue->credit_capacity = capacity;
+    }
+    queue->credits[queue->credit_count++] = (message_credit){msg->session, msg->owner, msg->stream, msg->length};
+    return 0;
+}
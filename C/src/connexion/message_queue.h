@@ -0,0 +1,116 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_MESSAGE_QUEUE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_MESSAGE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Threads pushing in a queue, identified by a bit of a mask
+#define MESSAGE_QUEUE_MAX_OWNERS 32
+
+/**
+ * A message copied in a queue
+ */
+typedef struct message {
+    struct message *next;
+    uint32_t session;
+    uint16_t owner;
+    uint16_t stream;
+    size_t length;
+    uint8_t data[];
+} message;
+
+/**
+ * Bytes consumed by the application on a stream, to grant again to the client
+ */
+typedef struct message_credit {
+    uint32_t session;
+    uint16_t owner;
+    uint16_t stream;
+    size_t length;
+} message_credit;
+
+/**
+ * Bounded FIFO of messages shared between threads. The threads pushing the
+ * messages learn what the application consumed from the credits of the
+ * released messages, and are woken up when a push failed on a full queue.
+ */
+typedef struct message_queue {
+    message *head;
+    message *tail;
+    size_t count;
+    size_t capacity;
+    int closed;
+    uint32_t waiting;
+    message_credit *credits;
+    size_t credit_count;
+    size_t credit_capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} message_queue;
+
+/**
+ * Initialize an empty queue
+ * @param queue     The queue
+ * @param capacity  The maximum number of messages
+ */
+void message_queue_init(message_queue *queue, size_t capacity);
+
+/**
+ * Copy a message at the end of a queue
+ * @param queue     The queue
+ * @param owner     The thread pushing the message, below MESSAGE_QUEUE_MAX_OWNERS
+ * @param session   The session credited once the message is released, 0 if its stream has no flow control
+ * @param stream    The stream the message was received on
+ * @param data      The message
+ * @param length    The size of the message
+ * @return          0 on success, -1 if the queue is full or closed
+ */
+int message_queue_push(message_queue *queue, uint16_t owner, uint32_t session, uint16_t stream, const uint8_t *data,
+                       size_t length);
+
+/**
+ * Take the first message of a queue, the caller frees it
+ * @param queue     The queue
+ * @param wait      1 to wait for a message, 0 to return immediately
+ * @return          The message, NULL if the queue is empty or closed
+ */
+message *message_queue_pop(message_queue *queue, int wait);
+
+/**
+ * Free a message consumed by the application and credit its session
+ * @param queue     The queue
+ * @param msg       The message given by message_queue_pop
+ * @return          The mask of the owners to wake up: the owner of the first credit
+ *                  since its last message_queue_take_credits, and the owners which found the queue full
+ */
+uint32_t message_queue_release(message_queue *queue, message *msg);
+
+/**
+ * Take the credits of the messages an owner pushed and the application released,
+ * the credits of a stream are added up
+ * @param queue     The queue
+ * @param owner     The owner
+ * @param credits   Filled with the credits
+ * @param max       The maximum number of credits
+ * @return          The number of credits taken
+ */
+size_t message_queue_take_credits(message_queue *queue, uint16_t owner, message_credit *credits, size_t max);
+
+/**
+ * Close a queue: pushes fail and waiting threads wake up
+ * @param queue     The queue
+ */
+void message_queue_close(message_queue *queue);
+
+/**
+ * Free a queue and the messages left in it
+ * @param queue     The queue
+ */
+void message_queue_free(message_queue *queue);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_MESSAGE_QUEUE_H
@@ -0,0 +1,597 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "openssl/err.h"
+
+#include "proxy.h"
+#include "admission.h"
+#include "heartbeat.h"
+#include "session.h"
+#include "../conf.c"
+#include "../trace/trace.h"
+
+/**
+ * One direction of a relay. Spliced, the bytes wait in the pipe; otherwise in the buffer.
+ */
+typedef struct proxy_flow {
+    int spliced;
+    int pipe[2];
+    size_t length;
+    size_t offset;
+    unsigned long bytes;
+    uint8_t buffer[PROXY_BUFFER_SIZE];
+} proxy_flow;
+
+/**
+ * A client relayed to the backend
+ */
+typedef struct proxy_conn {
+    int client;
+    int backend;
+    SSL *ssl;
+    struct sockaddr_in addr;
+    pthread_t thread;
+    atomic_int finished;
+    short client_events;
+    short backend_events;
+    int client_closed;
+    proxy_flow up;
+    proxy_flow down;
+} proxy_conn;
+
+static SSL_CTX *proxy_ctx;
+static int socket_proxy = -1;
+static int wake_fd = -1;
+static struct sockaddr_storage backend_addr;
+static socklen_t backend_length;
+static atomic_int running;
+static pthread_t thread_accept;
+static proxy_conn *conns[PROXY_MAX_CONNECTIONS];
+
+/**
+ * Parse the address of the backend
+ * @param backend   "host:port", or the path of a Unix socket
+ * @return          0 on success, -1 if the address is invalid
+ */
+static int parse_backend(const char *backend);
+
+/**
+ * Thread function accepting the clients
+ * @param arg
+ * @return
+ */
+static void *thread_accept_fct(void *arg);
+
+/**
+ * Join the relays which ended, freeing their slot
+ * @param all       1 to wait for every relay, 0 to only join the finished ones
+ */
+static void reap_conns(int all);
+
+/**
+ * Thread function running the handshake of a client, then relaying it
+ * @param arg       The connection
+ * @return
+ */
+static void *thread_relay_fct(void *arg);
+
+/**
+ * Run the handshake of a client, until HANDSHAKE_TIMEOUT_MS
+ * @param p         The connection
+ * @return          0 once established, -1 on failure
+ */
+static int accept_client(proxy_conn *p);
+
+/**
+ * Open a connection to the backend
+ * @return          The non-blocking socket, -1 on error
+ */
+static int connect_backend();
+
+/**
+ * Prepare a direction of the relay, spliced when the kernel handles its records
+ * @param flow      The direction
+ * @param spliced   1 if the records of the client side are handled by the kernel
+ * @return          0 on success, -1 on error
+ */
+static int open_flow(proxy_flow *flow, int spliced);
+
+/**
+ * Move what the client sent to the backend, until a socket would block
+ * @param p         The connection
+ * @return          0 on success, -1 once the relay must end
+ */
+static int relay_up(proxy_conn *p);
+
+/**
+ * Move what the backend sent to the client, until a socket would block
+ * @param p         The connection
+ * @return          0 on success, -1 once the relay must end
+ */
+static int relay_down(proxy_conn *p);
+
+/**
+ * Read the records of a client the kernel could not splice: alerts and close notify
+ * @param p         The connection
+ * @return          The number of bytes read in the pipe of the flow, 0 to wait, -1 once the client ended
+ */
+static ssize_t read_control_record(proxy_conn *p);
+
+/**
+ * Tell whether an error only means a socket would block
+ * @return          1 if the operation must be retried later, 0 otherwise
+ */
+static int would_block();
+
+/**
+ * Close the sockets of a relay and free it
+ * @param p         The connection
+ */
+static void close_conn(proxy_conn *p);
+
+
+int proxy_start(SSL_CTX *tls_context, int port, const char *backend)
+{
+    if (parse_backend(backend) == -1) {
+        fprintf(stderr, "Invalid proxy backend: %s\n", backend);
+        return -1;
+    }
+
+    TRACE("Opening proxy listener on port %i for %s\n", port, backend);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    int reuse = 1;
+    socket_proxy = socket(PF_INET, SOCK_STREAM, 0);
+    setsockopt(socket_proxy, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(socket_proxy, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(socket_proxy, LISTEN_BACKLOG) != 0) {
+        perror("Impossible to open the proxy port");
+        close(socket_proxy);
+        return -1;
+    }
+
+    // Never read, it wakes up every relay at once
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        close(socket_proxy);
+        return -1;
+    }
+
+    proxy_ctx = tls_context;
+    running = 1;
+    if (pthread_create(&thread_accept, NULL, thread_accept_fct, NULL) != 0) {
+        perror("pthread_create");
+        running = 0;
+        close(wake_fd);
+        close(socket_proxy);
+        return -1;
+    }
+    return 0;
+}
+
+void proxy_shutdown()
+{
+    if (!running) {
+        return;
+    }
+    running = 0;
+
+    // Wake up the thread blocked in accept, then the relays
+    shutdown(socket_proxy, SHUT_RDWR);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+void proxy_stop()
+{
+    if (proxy_ctx == NULL) {
+        return;
+    }
+    proxy_shutdown();
+    pthread_join(thread_accept, NULL);
+    reap_conns(1);
+
+    close(wake_fd);
+    close(socket_proxy);
+    proxy_ctx = NULL;
+}
+
+static int parse_backend(const char *backend)
+{
+    memset(&backend_addr, 0, sizeof(backend_addr));
+
+    // A path is a Unix socket
+    if (backend[0] == '/' || backend[0] == '.') {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&backend_addr;
+        if (strlen(backend) >= sizeof(addr->sun_path)) {
+            return -1;
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, backend);
+        backend_length = sizeof(*addr);
+        return 0;
+    }
+
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strrchr(backend, ':');
+    if (colon == NULL || (size_t)(colon - backend) >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, backend, (size_t)(colon - backend));
+    host[colon - backend] = '\0';
+
+    struct sockaddr_in *addr = (struct sockaddr_in *)&backend_addr;
+    int port = atoi(colon + 1);
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    backend_length = sizeof(*addr);
+    return port > 0 && port < 65536 && inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static void *thread_accept_fct(void *arg)
+{
+    (void)arg;
+
+    while (running) {
+        struct sockaddr_in addr;
+        socklen_t length = sizeof(addr);
+        int client = accept(socket_proxy, (struct sockaddr *)&addr, &length);
+        if (client == -1) {
+            if (running && errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        // Same admission as the clients of the server, a free slot is needed too
+        reap_conns(0);
+        int slot = 0;
+        while (slot < PROXY_MAX_CONNECTIONS && conns[slot] != NULL) {
+            slot++;
+        }
+        if (!running || slot == PROXY_MAX_CONNECTIONS || admission_check(&addr) == -1) {
+            admission_refuse(client);
+            continue;
+        }
+
+        proxy_conn *p = calloc(1, sizeof(proxy_conn));
+        if (p == NULL) {
+            perror("malloc");
+            admission_release();
+            admission_refuse(client);
+            continue;
+        }
+        p->client = client;
+        p->backend = -1;
+        p->addr = addr;
+        p->up.pipe[0] = p->up.pipe[1] = -1;
+        p->down.pipe[0] = p->down.pipe[1] = -1;
+        if (pthread_create(&p->thread, NULL, thread_relay_fct, p) != 0) {
+            perror("pthread_create");
+            admission_release();
+            close_conn(p);
+            continue;
+        }
+        conns[slot] = p;
+    }
+    return NULL;
+}
+
+static void reap_conns(int all)
+{
+    for (int i = 0; i < PROXY_MAX_CONNECTIONS; ++i) {
+        if (conns[i] != NULL && (all || conns[i]->finished)) {
+            pthread_join(conns[i]->thread, NULL);
+            close_conn(conns[i]);
+            conns[i] = NULL;
+        }
+    }
+}
+
+static void *thread_relay_fct(void *arg)
+{
+    proxy_conn *p = arg;
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &p->addr.sin_addr, address, sizeof(address));
+
+    session_configure_socket(p->client);
+    fcntl(p->client, F_SETFL, fcntl(p->client, F_GETFL) | O_NONBLOCK);
+    int established = accept_client(p);
+    admission_release();
+    if (established == -1) {
+        TRACE("Proxy handshake of %s failed\n", address);
+        p->finished = 1;
+        return NULL;
+    }
+
+    // The kernel encrypts and decrypts the records of each direction it took over
+    p->backend = connect_backend();
+    if (p->backend == -1 || open_flow(&p->up, (int)BIO_get_ktls_recv(SSL_get_rbio(p->ssl))) == -1
+        || open_flow(&p->down, (int)BIO_get_ktls_send(SSL_get_wbio(p->ssl))) == -1) {
+        SSL_shutdown(p->ssl);
+        p->finished = 1;
+        return NULL;
+    }
+    TRACE("Proxying %s, kTLS %s/%s\n", address, p->up.spliced ? "receive" : "-", p->down.spliced ? "send" : "-");
+
+    while (running) {
+        p->client_events = 0;
+        p->backend_events = 0;
+        if ((!p->client_closed && relay_up(p) == -1) || relay_down(p) == -1) {
+            break;
+        }
+
+        // A closed side would wake the poll up forever, it is only watched when awaited
+        struct pollfd fds[3] = {
+                {.fd = wake_fd, .events = POLLIN},
+                {.fd = p->client_events ? p->client : -1, .events = p->client_events},
+                {.fd = p->backend_events ? p->backend : -1, .events = p->backend_events},
+        };
+        int ready = poll(fds, 3, IDLE_TIMEOUT_MS);
+        if (ready == 0) {
+            TRACE("Proxy client %s idle\n", address);
+            break;
+        }
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+    }
+
+    // Whatever the backend sent is delivered, the close notify ends the session
+    SSL_shutdown(p->ssl);
+    TRACE("Proxy client %s closed, %lu bytes received, %lu bytes sent\n", address, p->up.bytes, p->down.bytes);
+    p->finished = 1;
+    return NULL;
+}
+
+static int accept_client(proxy_conn *p)
+{
+    p->ssl = SSL_new(proxy_ctx);
+    if (p->ssl == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_set_fd(p->ssl, p->client);
+
+    // The records are handed to the kernel once the keys are known, if it supports them
+    SSL_set_options(p->ssl, SSL_OP_ENABLE_KTLS);
+
+    uint64_t deadline_us = heartbeat_now_us() + HANDSHAKE_TIMEOUT_MS * 1000;
+    while (running) {
+        int result = SSL_accept(p->ssl);
+        if (result == 1) {
+            return 0;
+        }
+
+        int error = SSL_get_error(p->ssl, result);
+        uint64_t now_us = heartbeat_now_us();
+        if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || now_us >= deadline_us) {
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+
+        struct pollfd fds[2] = {
+                {.fd = wake_fd, .events = POLLIN},
+                {.fd = p->client, .events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT},
+        };
+        if (poll(fds, 2, (int)((deadline_us - now_us + 999) / 1000)) == -1 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int connect_backend()
+{
+    int fd = socket(backend_addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&backend_addr, backend_length) == -1) {
+        perror("Impossible to connect to the proxy backend");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static int open_flow(proxy_flow *flow, int spliced)
+{
+    flow->spliced = spliced;
+    if (spliced && pipe2(flow->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    return 0;
+}
+
+static int relay_up(proxy_conn *p)
+{
+    proxy_flow *flow = &p->up;
+
+    while (1) {
+        if (flow->length == 0) {
+            ssize_t received;
+            if (flow->spliced) {
+                received = splice(p->client, NULL, flow->pipe[1], NULL, PROXY_BUFFER_SIZE,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+                // Only the application data is spliced, OpenSSL reads the other records
+                if (received == -1 && (errno == EINVAL || errno == EIO)) {
+                    received = read_control_record(p);
+                } else if (received == -1 && would_block()) {
+                    p->client_events |= POLLIN;
+                    received = 0;
+                } else if (received == 0) {
+                    received = -1;
+                }
+            } else {
+                int result = SSL_read(p->ssl, flow->buffer, sizeof(flow->buffer));
+                int error = SSL_get_error(p->ssl, result);
+                received = result > 0 ? result : 0;
+                if (error == SSL_ERROR_WANT_READ) {
+                    p->client_events |= POLLIN;
+                } else if (error == SSL_ERROR_WANT_WRITE) {
+                    p->client_events |= POLLOUT;
+                } else if (error == SSL_ERROR_ZERO_RETURN) {
+                    // The close notify of the client, the backend still answers
+                    p->client_closed = 1;
+                    shutdown(p->backend, SHUT_WR);
+                    return 0;
+                } else if (error != SSL_ERROR_NONE) {
+                    received = -1;
+                }
+            }
+
+            if (received <= 0) {
+                return received == -1 && !p->client_closed ? -1 : 0;
+            }
+            flow->length = (size_t)received;
+            flow->offset = 0;
+            flow->bytes += (unsigned long)received;
+        }
+
+        ssize_t sent;
+        if (flow->spliced) {
+            sent = splice(flow->pipe[0], NULL, p->backend, NULL, flow->length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            sent = send(p->backend, flow->buffer + flow->offset, flow->length, MSG_NOSIGNAL);
+        }
+        if (sent == -1) {
+            if (!would_block()) {
+                perror("Proxy backend");
+                return -1;
+            }
+            p->backend_events |= POLLOUT;
+            return 0;
+        }
+        flow->length -= (size_t)sent;
+        flow->offset += (size_t)sent;
+    }
+}
+
+static int relay_down(proxy_conn *p)
+{
+    proxy_flow *flow = &p->down;
+
+    while (1) {
+        if (flow->length == 0) {
+            ssize_t received;
+            if (flow->spliced) {
+                received = splice(p->backend, NULL, flow->pipe[1], NULL, PROXY_BUFFER_SIZE,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            } else {
+                received = recv(p->backend, flow->buffer, sizeof(flow->buffer), 0);
+            }
+            if (received == -1 && would_block()) {
+                p->backend_events |= POLLIN;
+                return 0;
+            }
+
+            // The backend closed, or failed
+            if (received <= 0) {
+                return -1;
+            }
+            flow->length = (size_t)received;
+            flow->offset = 0;
+            flow->bytes += (unsigned long)received;
+        }
+
+        if (flow->spliced) {
+            ssize_t sent = splice(flow->pipe[0], NULL, p->client, NULL, flow->length,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent == -1) {
+                if (!would_block()) {
+                    return -1;
+                }
+                p->client_events |= POLLOUT;
+                return 0;
+            }
+            flow->length -= (size_t)sent;
+            continue;
+        }
+
+        // A write which would block is retried with the same arguments
+        int sent = SSL_write(p->ssl, flow->buffer + flow->offset, (int)flow->length);
+        if (sent <= 0) {
+            int error = SSL_get_error(p->ssl, sent);
+            if (error == SSL_ERROR_WANT_WRITE) {
+                p->client_events |= POLLOUT;
+            } else if (error == SSL_ERROR_WANT_READ) {
+                p->client_events |= POLLIN;
+            } else {
+                return -1;
+            }
+            return 0;
+        }
+        flow->length -= (size_t)sent;
+        flow->offset += (size_t)sent;
+    }
+}
+
+static ssize_t read_control_record(proxy_conn *p)
+{
+    proxy_flow *flow = &p->up;
+    int result = SSL_read(p->ssl, flow->buffer, sizeof(flow->buffer));
+    int error = SSL_get_error(p->ssl, result);
+
+    if (result > 0) {
+        // The pipe is empty, it takes the whole record
+        return write(flow->pipe[1], flow->buffer, (size_t)result);
+    }
+    if (error == SSL_ERROR_WANT_READ) {
+        p->client_events |= POLLIN;
+        return 0;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        p->client_closed = 1;
+        shutdown(p->backend, SHUT_WR);
+    }
+    return -1;
+}
+
+static int would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static void close_conn(proxy_conn *p)
+{
+    proxy_flow *flows[2] = {&p->up, &p->down};
+    for (int i = 0; i < 2; ++i) {
+        if (flows[i]->pipe[0] != -1) {
+            close(flows[i]->pipe[0]);
+            close(flows[i]->pipe[1]);
+        }
+    }
+    if (p->backend != -1) {
+        close(p->backend);
+    }
+    SSL_free(p->ssl);
+    close(p->client);
+    free(p);
+}
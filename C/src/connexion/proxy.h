@@ -0,0 +1,40 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_PROXY_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_PROXY_H
+
+#include "openssl/ssl.h"
+
+/**
+ * TLS termination in front of a local service speaking plaintext TCP, on a
+ * port of its own. Each client gets a connection to the backend once its
+ * handshake is done: what it sends is decrypted and written to the backend,
+ * what the backend answers is encrypted back to it. No frame is involved.
+ * When the kernel takes over the records (kTLS), the bytes are moved between
+ * the sockets with splice() and never reach user space; otherwise they go
+ * through SSL_read and SSL_write. The end of the client closes the writing
+ * side of the backend, the end of the backend closes the client.
+ */
+
+/**
+ * Start relaying the clients of a port to a backend
+ * @param tls_context   The TLS context of the server
+ * @param port          The TCP port of the clients
+ * @param backend       The backend: "host:port", or the path of a Unix socket
+ * @return              0 on success, -1 on error
+ */
+int proxy_start(SSL_CTX *tls_context, int port, const char *backend);
+
+/**
+ * Stop accepting clients and wake up the relays, which close their connections
+ */
+void proxy_shutdown();
+
+/**
+ * Wait for the relays and close the listener
+ */
+void proxy_stop();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_PROXY_H
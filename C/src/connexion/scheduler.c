@@ -0,0 +1,318 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "../conf.c"
+#include "../trace/timeline.h"
+
+/**
+ * Find the first message of a class which can be sent, the lock must be held.
+ * Messages of closed streams are dropped, a message waiting for the window of
+ * its stream holds back the next messages of the same stream only.
+ * @param s         The scheduler
+ * @param cls       The class
+ * @param streams   The streams of the client, NULL to ignore the windows
+ * @param window    Filled with the window of the stream of the message
+ * @return          The message, NULL if no message of the class can be sent
+ */
+static scheduled_message *find_sendable(send_scheduler *s, traffic_class cls, const stream_table *streams,
+                                        size_t *window);
+
+/**
+ * Remove a message, the lock must be held
+ * @param s         The scheduler
+ * @param cls       The class of the message
+ * @param entry     The message
+ * @return          The message, with the reference of the scheduler
+ */
+static outgoing_message *remove_entry(send_scheduler *s, traffic_class cls, scheduled_message *entry);
+
+
+outgoing_message *outgoing_message_new(traffic_class cls, uint16_t stream, const uint8_t *data, size_t length)
+{
+    outgoing_message *msg = malloc(sizeof(outgoing_message) + length);
+    if (msg == NULL) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    atomic_init(&msg->trace_id, 0);
+    msg->sequence = 0;
+    msg->cls = cls;
+    msg->stream = stream;
+    msg->length = length;
+    memcpy(msg->storage, data, length);
+    msg->data = msg->storage;
+    msg->release = NULL;
+    msg->release_arg = NULL;
+    return msg;
+}
+
+outgoing_message *outgoing_message_wrap(traffic_class cls, uint16_t stream, const uint8_t *data, size_t length,
+                                        void (*release)(void *arg), void *arg)
+{
+    outgoing_message *msg = malloc(sizeof(outgoing_message));
+    if (msg == NULL) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    atomic_init(&msg->trace_id, 0);
+    msg->sequence = 0;
+    msg->cls = cls;
+    msg->stream = stream;
+    msg->length = length;
+    msg->data = data;
+    msg->release = release;
+    msg->release_arg = arg;
+    return msg;
+}
+
+outgoing_message *outgoing_message_ref(outgoing_message *msg)
+{
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+    return msg;
+}
+
+void outgoing_message_release(outgoing_message *msg)
+{
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        // Never written to a client
+        timeline_message_end(atomic_load(&msg->trace_id), "dropped");
+        if (msg->release != NULL) {
+            msg->release(msg->release_arg);
+        }
+        free(msg);
+    }
+}
+
+void send_scheduler_init(send_scheduler *s, size_t capacity)
+{
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; ++i) {
+        s->head[i] = NULL;
+        s->tail[i] = NULL;
+    }
+    s->count = 0;
+    s->capacity = capacity;
+    s->credit = 0;
+    s->draining = 0;
+    pthread_mutex_init(&s->lock, NULL);
+}
+
+int send_scheduler_push(send_scheduler *s, outgoing_message *msg)
+{
+    scheduled_message *entry = malloc(sizeof(scheduled_message));
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->next = NULL;
+    entry->msg = outgoing_message_ref(msg);
+    entry->offset = 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (s->count >= s->capacity) {
+        pthread_mutex_unlock(&s->lock);
+        outgoing_message_release(msg);
+        free(entry);
+        return -1;
+    }
+
+    if (s->tail[msg->cls] == NULL) {
+        s->head[msg->cls] = entry;
+    } else {
+        s->tail[msg->cls]->next = entry;
+    }
+    s->tail[msg->cls] = entry;
+    s->count++;
+
+    // The first thread finding nobody draining does it
+    int drain = !s->draining;
+    s->draining = 1;
+
+    pthread_mutex_unlock(&s->lock);
+    return drain;
+}
+
+outgoing_message *send_scheduler_take(send_scheduler *s)
+{
+    outgoing_message *msg = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT && msg == NULL; ++i) {
+        if (s->head[i] != NULL) {
+            msg = remove_entry(s, (traffic_class)i, s->head[i]);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return msg;
+}
+
+int send_scheduler_claim(send_scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    int drain = !s->draining && s->count > 0;
+    if (drain) {
+        s->draining = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return drain;
+}
+
+int send_scheduler_peek(send_scheduler *s, const stream_table *streams, send_chunk *chunk)
+{
+    pthread_mutex_lock(&s->lock);
+
+    // Control first, then telemetry until it has used its quantum while bulk waits
+    traffic_class order[TRAFFIC_CLASS_COUNT] = {TRAFFIC_CONTROL, TRAFFIC_TELEMETRY, TRAFFIC_BULK};
+    if (s->credit >= SCHEDULER_TELEMETRY_QUANTUM) {
+        order[1] = TRAFFIC_BULK;
+        order[2] = TRAFFIC_TELEMETRY;
+    }
+
+    scheduled_message *entry = NULL;
+    traffic_class cls = TRAFFIC_CONTROL;
+    size_t window = 0;
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT && entry == NULL; ++i) {
+        cls = order[i];
+        entry = find_sendable(s, cls, streams, &window);
+    }
+
+    if (entry == NULL) {
+        s->draining = 0;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    // Bulk messages are cut, the other ones are sent in one frame
+    const outgoing_message *msg = entry->msg;
+    size_t length = msg->length - entry->offset;
+    if (cls == TRAFFIC_BULK && length > SCHEDULER_CHUNK_SIZE) {
+        length = SCHEDULER_CHUNK_SIZE;
+    }
+    if (cls == TRAFFIC_BULK && length > window) {
+        length = window;
+    }
+
+    chunk->entry = entry;
+    chunk->cls = cls;
+    chunk->stream = msg->stream;
+    chunk->data = msg->data + entry->offset;
+    chunk->length = length;
+    chunk->last = entry->offset + length == msg->length;
+
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+void send_scheduler_consume(send_scheduler *s, const send_chunk *chunk)
+{
+    outgoing_message *msg = NULL;
+
+    pthread_mutex_lock(&s->lock);
+
+    // Telemetry earns bulk the right to send its next chunk
+    if (chunk->cls == TRAFFIC_TELEMETRY) {
+        s->credit += chunk->length;
+    } else if (chunk->cls == TRAFFIC_BULK) {
+        s->credit = 0;
+    }
+
+    chunk->entry->offset += chunk->length;
+    if (chunk->last) {
+        msg = remove_entry(s, chunk->cls, chunk->entry);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (msg != NULL) {
+        outgoing_message_release(msg);
+    }
+}
+
+void send_scheduler_clear(send_scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    for (int i = 0; i < TRAFFIC_CLASS_COUNT; ++i) {
+        while (s->head[i] != NULL) {
+            outgoing_message_release(remove_entry(s, (traffic_class)i, s->head[i]));
+        }
+    }
+    s->credit = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void send_scheduler_free(send_scheduler *s)
+{
+    send_scheduler_clear(s);
+    pthread_mutex_destroy(&s->lock);
+}
+
+static scheduled_message *find_sendable(send_scheduler *s, traffic_class cls, const stream_table *streams,
+                                        size_t *window)
+{
+    uint16_t blocked[STREAM_MAX];
+    int blocked_count = 0;
+
+    scheduled_message *entry = s->head[cls];
+    while (entry != NULL) {
+        scheduled_message *next = entry->next;
+        uint16_t stream = entry->msg->stream;
+
+        ssize_t available = streams == NULL ? SSIZE_MAX : stream_send_window(streams, stream);
+        if (available == -1) {
+            // The client closed the stream
+            outgoing_message_release(remove_entry(s, cls, entry));
+            entry = next;
+            continue;
+        }
+
+        int waiting = 0;
+        for (int i = 0; i < blocked_count; ++i) {
+            waiting |= blocked[i] == stream;
+        }
+
+        // Bulk chunks fit in any window, the other messages need room for the whole frame
+        size_t needed = cls == TRAFFIC_BULK ? (entry->msg->length > entry->offset) : entry->msg->length;
+        if (!waiting && (size_t)available >= needed) {
+            *window = (size_t)available;
+            return entry;
+        }
+        if (!waiting && blocked_count < STREAM_MAX) {
+            blocked[blocked_count++] = stream;
+        }
+        entry = next;
+    }
+    return NULL;
+}
+
+static outgoing_message *remove_entry(send_scheduler *s, traffic_class cls, scheduled_message *entry)
+{
+    outgoing_message *msg = entry->msg;
+
+    // Messages are removed at the head, unless a stream is blocked before them
+    scheduled_message *previous = NULL;
+    if (s->head[cls] != entry) {
+        previous = s->head[cls];
+        while (previous->next != entry) {
+            previous = previous->next;
+        }
+    }
+
+    if (previous == NULL) {
+        s->head[cls] = entry->next;
+    } else {
+        previous->next = entry->next;
+    }
+    if (s->tail[cls] == entry) {
+        s->tail[cls] = previous;
+    }
+    s->count--;
+    free(entry);
+    return msg;
+}
@@ -0,0 +1,181 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_SCHEDULER_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_SCHEDULER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "stream.h"
+
+/**
+ * Classes of the outgoing messages, from the most urgent
+ * - control    commands and acknowledgements, always sent first
+ * - telemetry  periodic measures, sent in one data frame
+ * - bulk       large transfers, cut in SCHEDULER_CHUNK_SIZE chunks
+ */
+typedef enum traffic_class {
+    TRAFFIC_CONTROL = 0,
+    TRAFFIC_TELEMETRY = 1,
+    TRAFFIC_BULK = 2,
+    TRAFFIC_CLASS_COUNT
+} traffic_class;
+
+/**
+ * A message shared by the schedulers of the clients it is sent to
+ */
+typedef struct outgoing_message {
+    atomic_uint refs;
+    atomic_uint trace_id;   // Timeline of the message, taken by the first session writing it
+    uint64_t sequence;      // Sequence number of a last value, 0 for the other messages
+    traffic_class cls;
+    uint16_t stream;
+    size_t length;
+    const uint8_t *data;            // The storage of the message, or memory lent until the release
+    void (*release)(void *arg);     // Gives the lent memory back, NULL for a copy
+    void *release_arg;
+    uint8_t storage[];
+} outgoing_message;
+
+/**
+ * A message waiting in a scheduler
+ */
+typedef struct scheduled_message {
+    struct scheduled_message *next;
+    outgoing_message *msg;
+    size_t offset;
+} scheduled_message;
+
+/**
+ * The next piece of a message to send
+ */
+typedef struct send_chunk {
+    scheduled_message *entry;
+    traffic_class cls;
+    uint16_t stream;
+    const uint8_t *data;
+    size_t length;
+    int last;
+} send_chunk;
+
+/**
+ * Outgoing messages of a client, one FIFO per class.
+ * Control messages go first, then telemetry and bulk chunks share the link:
+ * a bulk chunk is sent after each SCHEDULER_TELEMETRY_QUANTUM bytes of telemetry.
+ * A control message thus waits for one bulk chunk at most.
+ * Messages of a stream whose window is exhausted wait without blocking the
+ * messages of the other streams.
+ */
+typedef struct send_scheduler {
+    scheduled_message *head[TRAFFIC_CLASS_COUNT];
+    scheduled_message *tail[TRAFFIC_CLASS_COUNT];
+    size_t count;
+    size_t capacity;
+    size_t credit;
+    int draining;
+    pthread_mutex_t lock;
+} send_scheduler;
+
+/**
+ * Copy a message to send
+ * @param cls       The class of the message
+ * @param stream    The stream of the message
+ * @param data      The message
+ * @param length    The size of the message, at most FRAME_MAX_PAYLOAD unless bulk
+ * @return          The message with one reference, NULL on error
+ */
+outgoing_message *outgoing_message_new(traffic_class cls, uint16_t stream, const uint8_t *data, size_t length);
+
+/**
+ * Send memory without copying it, until the last reference on the message is released
+ * @param cls       The class of the message
+ * @param stream    The stream of the message
+ * @param data      The message
+ * @param length    The size of the message, at most FRAME_MAX_PAYLOAD unless bulk
+ * @param release   Called with arg when the message is freed, the memory is not used anymore
+ * @param arg       The argument of release
+ * @return          The message with one reference, NULL on error
+ */
+outgoing_message *outgoing_message_wrap(traffic_class cls, uint16_t stream, const uint8_t *data, size_t length,
+                                        void (*release)(void *arg), void *arg);
+
+/**
+ * Take a reference on a message
+ * @param msg       The message
+ * @return          The message
+ */
+outgoing_message *outgoing_message_ref(outgoing_message *msg);
+
+/**
+ * Release a reference on a message, the last one frees it
+ * @param msg       The message
+ */
+void outgoing_message_release(outgoing_message *msg);
+
+/**
+ * Initialize an empty scheduler
+ * @param s         The scheduler
+ * @param capacity  The maximum number of messages
+ */
+void send_scheduler_init(send_scheduler *s, size_t capacity);
+
+/**
+ * Queue a message, taking a reference on it
+ * @param s         The scheduler
+ * @param msg       The message
+ * @return          1 if the caller must drain the scheduler, 0 if another thread drains it,
+ *                  -1 if the scheduler is full
+ */
+int send_scheduler_push(send_scheduler *s, outgoing_message *msg);
+
+/**
+ * Take the oldest message of the most urgent class, whole, with its reference.
+ * Used by the queues which only forward the messages to other schedulers.
+ * @param s         The scheduler
+ * @return          The message, NULL if the scheduler is empty
+ */
+outgoing_message *send_scheduler_take(send_scheduler *s);
+
+/**
+ * Take the draining role if nobody has it and messages are queued, when a
+ * stream window opened again
+ * @param s         The scheduler
+ * @return          1 if the caller must drain the scheduler, 0 otherwise
+ */
+int send_scheduler_claim(send_scheduler *s);
+
+/**
+ * Get the next chunk to send, it stays queued until send_scheduler_consume.
+ * Messages of streams which are not opened anymore are dropped.
+ * When nothing can be sent, the draining thread is released.
+ * @param s         The scheduler
+ * @param streams   The streams of the client, NULL to ignore the windows
+ * @param chunk     The chunk, valid until send_scheduler_consume or send_scheduler_clear
+ * @return          1 if a chunk is available, 0 if nothing can be sent
+ */
+int send_scheduler_peek(send_scheduler *s, const stream_table *streams, send_chunk *chunk);
+
+/**
+ * Remove a chunk returned by send_scheduler_peek once sent
+ * @param s         The scheduler
+ * @param chunk     The chunk
+ */
+void send_scheduler_consume(send_scheduler *s, const send_chunk *chunk);
+
+/**
+ * Drop the queued messages, a bulk transfer in progress is abandoned
+ * @param s         The scheduler
+ */
+void send_scheduler_clear(send_scheduler *s);
+
+/**
+ * Free a scheduler and the messages left in it
+ * @param s         The scheduler
+ */
+void send_scheduler_free(send_scheduler *s);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_SCHEDULER_H
@@ -0,0 +1,390 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "openssl/err.h"
+
+#include "session.h"
+#include "../conf.c"
+#include "../frame/capture.h"
+#include "../trace/timeline.h"
+#include "../trace/trace.h"
+
+// Sessions of the blocking and io_uring backends, the workers of the sharded backend keep their own
+static session sessions[MAX_SESSIONS];
+static int sessions_used[MAX_SESSIONS];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static event_loop *timers;
+static atomic_uint next_id;
+
+session_counters session_stats;
+
+/**
+ * Timer callback checking if a session has been idle for too long
+ * @param arg   The session
+ */
+static void on_idle_timer(void *arg);
+
+/**
+ * Build and send a frame, see session_write_frame
+ * @param s         The session
+ * @param type      The frame type
+ * @param extra     Flags added to the compression flags
+ * @param stream    The stream of the frame
+ * @param payload   The payload of the frame
+ * @param length    The size of the payload
+ * @param buffer    The buffer used to build the frame
+ * @param trace_id  The timeline of the message, 0 if none
+ * @return          The number of payload bytes written, -1 on error
+ */
+static ssize_t write_frame(session *s, uint8_t type, uint8_t extra, uint16_t stream, const uint8_t *payload,
+                           size_t length, uint8_t *buffer, uint32_t trace_id);
+
+
+void session_manager_start(event_loop *loop)
+{
+    timers = loop;
+}
+
+void session_manager_stop()
+{
+    // Close the sessions nobody closed
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (sessions_used[i]) {
+            session_close(&sessions[i]);
+        }
+    }
+}
+
+void session_configure_socket(int fd)
+{
+    int enable = 1;
+    int idle = KEEPALIVE_IDLE_S;
+    int interval = KEEPALIVE_INTERVAL_S;
+    int count = KEEPALIVE_COUNT;
+
+    // Detect dead peers even when the application does not send anything
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) != 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) != 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0) {
+        perror("Impossible to configure keepalive");
+    }
+
+    // The size of the records decides when the bytes leave, not Nagle's algorithm
+    int lowat = RECORD_NOTSENT_LOWAT;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) != 0
+        || setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0) {
+        perror("Impossible to configure the send buffer");
+    }
+}
+
+int session_cork(session *s, int enable)
+{
+    return setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &enable, sizeof(enable));
+}
+
+session *session_open(int fd, SSL *ssl, const struct sockaddr_in *addr)
+{
+    pthread_mutex_lock(&sessions_lock);
+
+    // Find a free slot
+    session *s = NULL;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (!sessions_used[i]) {
+            sessions_used[i] = 1;
+            s = &sessions[i];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sessions_lock);
+
+    // The slot is reserved, it is filled without the lock
+    if (s != NULL) {
+        session_init(s, timers, fd, ssl, addr);
+    }
+    return s;
+}
+
+void session_init(session *s, event_loop *loop, int fd, SSL *ssl, const struct sockaddr_in *addr)
+{
+    memset(s, 0, sizeof(*s));
+    s->id = ++next_id;
+    s->fd = fd;
+    s->ssl = ssl;
+    s->addr = *addr;
+    s->loop = loop;
+    s->last_activity = event_loop_now_ms();
+    heartbeat_init(&s->heartbeat);
+    compress_reset(&s->compress);
+    stream_table_reset(&s->streams);
+    frame_reader_reset(&s->reader);
+    timeline_acks_reset(&s->timeline);
+    record_size_init(&s->records, fd);
+    s->snapshot_sequence = 0;
+
+    // Watch the session for inactivity
+    capture_event(s->id, CAPTURE_OPEN, 0, 0, 0);
+    event_loop_timer_add(loop, &s->idle_timer, IDLE_TIMEOUT_MS, on_idle_timer, s);
+}
+
+void session_touch(session *s)
+{
+    // The idle timer checks this date when it expires, no need to re-arm it
+    s->last_activity = event_loop_now_ms();
+}
+
+void session_interrupt(session *s)
+{
+    shutdown(s->fd, SHUT_RD);
+}
+
+int session_next_frame(session *s, frame_header *header, const uint8_t **payload)
+{
+    int status = frame_reader_next(&s->reader, header, payload);
+    if (status == 1) {
+        capture_event(s->id, CAPTURE_RECV, header->type, header->flags, header->length);
+    }
+    return status;
+}
+
+ssize_t session_write_frame(session *s, uint8_t type, const uint8_t *payload, size_t length, uint8_t *buffer)
+{
+    return write_frame(s, type, 0, STREAM_DEFAULT, payload, length, buffer, 0);
+}
+
+ssize_t session_write_chunk(session *s, const send_chunk *chunk, uint8_t *buffer)
+{
+    // Bulk chunks tell the client whether the transfer goes on
+    uint8_t type = chunk->cls == TRAFFIC_BULK ? FRAME_BULK : FRAME_DATA;
+    uint8_t flags = chunk->cls == TRAFFIC_BULK && !chunk->last ? FRAME_FLAG_MORE : 0;
+
+    // A last value published before the client connected is already in its snapshot
+    if (chunk->entry->msg->sequence != 0 && chunk->entry->msg->sequence <= s->snapshot_sequence) {
+        return 0;
+    }
+
+    // The first session writing the last chunk of a message records its timeline, until the next pong
+    uint32_t trace_id = chunk->last ? atomic_exchange(&chunk->entry->msg->trace_id, 0) : 0;
+    timeline_message_step(trace_id, "compress");
+
+    ssize_t written = write_frame(s, type, flags, chunk->stream, chunk->data, chunk->length, buffer, trace_id);
+    if (written >= 0) {
+        stream_sent(&s->streams, chunk->stream, chunk->length);
+        timeline_acks_written(&s->timeline, trace_id, s->heartbeat.next_seq);
+    } else {
+        timeline_message_end(trace_id, "failed");
+    }
+    return written;
+}
+
+int session_receive_data(session *s, uint16_t stream, size_t length, uint8_t *buffer)
+{
+    // Protocol error: the client ignored the window, or the stream is not opened
+    if (stream_receive(&s->streams, stream, length) == -1) {
+        TRACE("Window exceeded on stream %u, stream closed\n", stream);
+        stream_close(&s->streams, stream);
+        write_frame(s, FRAME_STREAM_CLOSE, 0, stream, (const uint8_t *)"", 0, buffer, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void session_consume_data(session *s, uint16_t stream, size_t length, uint8_t *buffer)
+{
+    // The application took the data, the client may send as much again
+    uint32_t increment = stream_consume(&s->streams, stream, length);
+    if (increment > 0) {
+        uint8_t payload[STREAM_WINDOW_SIZE];
+        frame_put_u32(payload, increment);
+        write_frame(s, FRAME_WINDOW, 0, stream, payload, sizeof(payload), buffer, 0);
+    }
+}
+
+void session_handle_control(session *s, const frame_header *header, const uint8_t *payload, uint8_t *buffer)
+{
+    uint8_t hello[COMPRESS_HELLO_SIZE];
+    uint8_t window[STREAM_WINDOW_SIZE];
+
+    switch (header->type) {
+        case FRAME_PING:
+            // Echo the payload so the client measures its own round trip time
+            session_write_frame(s, FRAME_PONG, payload, header->length, buffer);
+            break;
+
+        case FRAME_PONG:
+            if (heartbeat_pong(&s->heartbeat, payload, header->length, heartbeat_now_us()) == -1) {
+                TRACE("Invalid pong received\n");
+            } else {
+                // The client has read everything written before the ping
+                timeline_acks_pong(&s->timeline, frame_get_u32(payload));
+            }
+            break;
+
+        case FRAME_HELLO:
+            // Answer with the codecs both sides support
+            if (compress_negotiate(&s->compress, payload, header->length) == -1) {
+                TRACE("Invalid hello received\n");
+                break;
+            }
+            compress_hello(hello, s->compress.codecs);
+            session_write_frame(s, FRAME_HELLO, hello, sizeof(hello), buffer);
+            TRACE("Compression negotiated : %s%s\n",
+                  s->compress.codecs & COMPRESS_LZ4 ? "lz4 " : "",
+                  s->compress.codecs & COMPRESS_ZSTD ? "zstd" : "");
+            break;
+
+        case FRAME_STREAM_OPEN:
+            // Answer with the window of the server, or refuse the stream
+            if (header->length < STREAM_WINDOW_SIZE
+                || stream_open(&s->streams, header->stream, frame_get_u32(payload)) == -1) {
+                TRACE("Stream %u refused\n", header->stream);
+                stream_close(&s->streams, header->stream);
+                write_frame(s, FRAME_STREAM_CLOSE, 0, header->stream, payload, 0, buffer, 0);
+                break;
+            }
+            frame_put_u32(window, STREAM_INITIAL_WINDOW);
+            write_frame(s, FRAME_STREAM_OPEN, 0, header->stream, window, sizeof(window), buffer, 0);
+            break;
+
+        case FRAME_STREAM_CLOSE:
+            // The messages still queued for the stream are dropped
+            stream_close(&s->streams, header->stream);
+            break;
+
+        case FRAME_WINDOW:
+            if (header->length < STREAM_WINDOW_SIZE
+                || stream_grant(&s->streams, header->stream, frame_get_u32(payload)) == -1) {
+                TRACE("Invalid window received\n");
+            }
+            break;
+
+        default:
+            // Frames of newer protocol versions are ignored
+            break;
+    }
+}
+
+int session_heartbeat(session *s, uint8_t *buffer)
+{
+    uint8_t payload[HEARTBEAT_PAYLOAD_SIZE];
+    unsigned int misses = heartbeat_ping(&s->heartbeat, payload, heartbeat_now_us());
+
+    if (misses >= HEARTBEAT_MAX_MISSES) {
+        TRACE("No answer to the last %u pings\n", misses);
+        return -1;
+    }
+
+    session_write_frame(s, FRAME_PING, payload, sizeof(payload), buffer);
+    return 0;
+}
+
+void session_close(session *s)
+{
+    session_finish(s);
+
+    pthread_mutex_lock(&sessions_lock);
+    sessions_used[s - sessions] = 0;
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+void session_finish(session *s)
+{
+    // Once cancelled, the idle timer can not use the session anymore
+    event_loop_timer_cancel(s->loop, &s->idle_timer);
+
+    TRACE("Closing connection with %s:%d\n", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port));
+    capture_event(s->id, CAPTURE_CLOSE, 0, 0, 0);
+    timeline_acks_close(&s->timeline);
+
+    // Send the close notify, the peer answer is not awaited
+    if (SSL_shutdown(s->ssl) < 0) {
+        ERR_clear_error();
+    }
+
+    SSL_free(s->ssl);
+    close(s->fd);
+}
+
+static void on_idle_timer(void *arg)
+{
+    session *s = arg;
+    uint64_t idle = event_loop_now_ms() - s->last_activity;
+
+    // Activity since the timer was armed, wait for the remaining time
+    if (idle < IDLE_TIMEOUT_MS) {
+        event_loop_timer_add(s->loop, &s->idle_timer, IDLE_TIMEOUT_MS - idle, on_idle_timer, s);
+        return;
+    }
+
+    // The thread reading the session will close it
+    TRACE("Connection with %s:%d idle for %lu ms\n", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port),
+          (unsigned long)idle);
+    session_stats.idle_timeouts++;
+    session_interrupt(s);
+}
+
+static ssize_t write_frame(session *s, uint8_t type, uint8_t extra, uint16_t stream, const uint8_t *payload,
+                           size_t length, uint8_t *buffer, uint32_t trace_id)
+{
+    if (length > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Message too long: %zu bytes\n", length);
+        return -1;
+    }
+
+    // Data is compressed when negotiated and worth it, otherwise copied as is
+    uint8_t flags = 0;
+    ssize_t size = -1;
+    if (type == FRAME_DATA || type == FRAME_BULK) {
+        size = compress_frame(&s->compress, payload, length, buffer + FRAME_HEADER_SIZE, FRAME_MAX_PAYLOAD, &flags);
+    }
+    if (size == -1) {
+        memcpy(buffer + FRAME_HEADER_SIZE, payload, length);
+        size = (ssize_t)length;
+    }
+
+    // Header and payload are written at once, in a single record unless the records are small
+    flags |= extra;
+    frame_encode_header(buffer, type, flags, stream, (uint32_t)size);
+    timeline_message_step(trace_id, "encrypt");
+    record_size_apply(&s->records, s->ssl, FRAME_HEADER_SIZE + (size_t)size, heartbeat_now_us());
+
+    int num_written;
+    uint64_t deadline = heartbeat_now_us() + WRITE_TIMEOUT_MS * 1000ULL;
+    while ((num_written = SSL_write(s->ssl, buffer, (int)(FRAME_HEADER_SIZE + (size_t)size))) <= 0) {
+        if (SSL_get_error(s->ssl, num_written) != SSL_ERROR_WANT_WRITE) {
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+
+        // A peer which stops reading must not hold the writers, the session is given up
+        uint64_t now = heartbeat_now_us();
+        if (now >= deadline) {
+            TRACE("No room to write to %s:%d for %d ms\n", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port),
+                  WRITE_TIMEOUT_MS);
+            shutdown(s->fd, SHUT_RDWR);
+            return -1;
+        }
+
+        // Non-blocking socket full: wait for room and retry with the same record
+        struct pollfd fd = {.fd = s->fd, .events = POLLOUT};
+        if (poll(&fd, 1, (int)((deadline - now + 999) / 1000)) == -1 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+    }
+    session_stats.bytes_written += (unsigned long)num_written;
+    capture_event(s->id, CAPTURE_SEND, type, flags, (uint32_t)length);
+
+    return (ssize_t)length;
+}
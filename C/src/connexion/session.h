@@ -0,0 +1,211 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_SESSION_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_SESSION_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "openssl/ssl.h"
+
+#include "heartbeat.h"
+#include "scheduler.h"
+#include "stream.h"
+#include "../frame/compress.h"
+#include "../frame/frame.h"
+#include "../loop/event_loop.h"
+#include "../tls/record_size.h"
+#include "../trace/timeline.h"
+
+/**
+ * A client connection tracked by the session manager
+ */
+typedef struct session {
+    uint32_t id;
+    int fd;
+    SSL *ssl;
+    struct sockaddr_in addr;
+    _Atomic uint64_t last_activity;
+    event_loop *loop;
+    wheel_timer idle_timer;
+    wheel_timer heartbeat_timer;
+    heartbeat heartbeat;
+    compress_state compress;
+    stream_table streams;
+    frame_reader reader;
+    timeline_acks timeline;
+    record_size records;
+    uint64_t snapshot_sequence;
+} session;
+
+/**
+ * Counters shared by the connexion backends
+ */
+typedef struct session_counters {
+    atomic_ulong accepted;
+    atomic_ulong handshake_failures;
+    atomic_ulong handshake_timeouts;
+    atomic_ulong idle_timeouts;
+    atomic_ulong closed;
+    atomic_ulong bytes_read;
+    atomic_ulong bytes_written;
+} session_counters;
+
+extern session_counters session_stats;
+
+/**
+ * Start watching idle sessions
+ * @param loop      The event loop running the idle timers
+ */
+void session_manager_start(event_loop *loop);
+
+/**
+ * Close the sessions still opened
+ */
+void session_manager_stop();
+
+/**
+ * Apply the TCP settings to a client socket: keepalive, no delay for the small
+ * records, and at most RECORD_NOTSENT_LOWAT bytes waiting in the socket so the
+ * scheduler keeps choosing what is sent next
+ * @param fd        The client socket
+ */
+void session_configure_socket(int fd);
+
+/**
+ * Hold the partial segments of a session while several frames are written in a row,
+ * they are sent at once when released
+ * @param s         The session
+ * @param enable    1 to hold the partial segments, 0 to send them
+ * @return          0 on success, -1 on error
+ */
+int session_cork(session *s, int enable);
+
+/**
+ * Register a new session after a successful handshake, in the table shared by
+ * the threads. Its idle timer runs on the loop given to session_manager_start.
+ * @param fd        The client socket
+ * @param ssl       The SSL object bound to the socket
+ * @param addr      The address of the client
+ * @return          The session, or NULL if MAX_SESSIONS sessions are already opened
+ */
+session *session_open(int fd, SSL *ssl, const struct sockaddr_in *addr);
+
+/**
+ * Start a session stored by the thread owning it, outside of the shared table:
+ * no lock is taken and its idle timer runs on the loop of that thread
+ * @param s         The session
+ * @param loop      The event loop of the owning thread
+ * @param fd        The client socket
+ * @param ssl       The SSL object bound to the socket
+ * @param addr      The address of the client
+ */
+void session_init(session *s, event_loop *loop, int fd, SSL *ssl, const struct sockaddr_in *addr);
+
+/**
+ * Record an application activity on a session, delaying its idle timeout
+ * @param s         The session
+ */
+void session_touch(session *s);
+
+/**
+ * Stop the reception on a session so that a thread blocked on it wakes up.
+ * The session stays valid until session_close is called.
+ * @param s         The session
+ */
+void session_interrupt(session *s);
+
+/**
+ * Get the next complete frame received on a session, see frame_reader_next
+ * @param s         The session
+ * @param header    The header of the frame
+ * @param payload   The payload of the frame
+ * @return          1 if a frame is available, 0 if more bytes are needed, -1 if the frame is invalid
+ */
+int session_next_frame(session *s, frame_header *header, const uint8_t **payload);
+
+/**
+ * Send a frame on the default stream of a session. Data frames are compressed when negotiated.
+ * A frame still waiting for room after WRITE_TIMEOUT_MS shuts the session down.
+ * The caller serializes the writes on the session.
+ * @param s         The session
+ * @param type      The frame type
+ * @param payload   The payload of the frame
+ * @param length    The size of the payload, at most FRAME_MAX_PAYLOAD
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the frame
+ * @return          The number of payload bytes written, -1 on error
+ */
+ssize_t session_write_frame(session *s, uint8_t type, const uint8_t *payload, size_t length, uint8_t *buffer);
+
+/**
+ * Send a chunk taken from a scheduler on its stream: bulk chunks in bulk frames,
+ * flagged FRAME_FLAG_MORE until the last one, the other messages in data frames.
+ * The window of the stream is reduced by the size of the chunk.
+ * The caller serializes the writes on the session.
+ * @param s         The session
+ * @param chunk     The chunk
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the frame
+ * @return          The number of payload bytes written, -1 on error
+ */
+ssize_t session_write_chunk(session *s, const send_chunk *chunk, uint8_t *buffer);
+
+/**
+ * Account for a data frame received on a stream before handing it to the
+ * application. A frame beyond the window of its stream is a protocol error:
+ * the stream is closed and the client told with a FRAME_STREAM_CLOSE frame.
+ * The caller serializes the writes on the session.
+ * @param s         The session
+ * @param stream    The stream of the frame
+ * @param length    The size of the data, once decompressed
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the close frame
+ * @return          0 if the data can be handed, -1 if the stream is not opened or its window is exceeded
+ */
+int session_receive_data(session *s, uint16_t stream, size_t length, uint8_t *buffer);
+
+/**
+ * Account for data of a stream read by the application, and grant the client
+ * a new window when it is due.
+ * The caller serializes the writes on the session.
+ * @param s         The session
+ * @param stream    The stream of the data
+ * @param length    The size of the data
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the window frame
+ */
+void session_consume_data(session *s, uint16_t stream, size_t length, uint8_t *buffer);
+
+/**
+ * Handle a frame used by the connexion itself: answer pings, measure the
+ * round trip time with pongs, negotiate the compression with hellos, and
+ * open, close and refill the windows of the streams.
+ * The caller serializes the writes on the session.
+ * @param s         The session
+ * @param header    The header of the frame
+ * @param payload   The payload of the frame
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the answers
+ */
+void session_handle_control(session *s, const frame_header *header, const uint8_t *payload, uint8_t *buffer);
+
+/**
+ * Send the next ping of a session
+ * @param s         The session
+ * @param buffer    A buffer of FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes used to build the frame
+ * @return          0 if the ping was sent, -1 if the peer did not answer the last HEARTBEAT_MAX_MISSES pings
+ */
+int session_heartbeat(session *s, uint8_t *buffer);
+
+/**
+ * Close a session opened by session_open: send the TLS close notify, free the SSL
+ * object, close the socket and free its slot in the table
+ * @param s         The session
+ */
+void session_close(session *s);
+
+/**
+ * Close a session started by session_init, from the thread owning it
+ * @param s         The session
+ */
+void session_finish(session *s);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_SESSION_H
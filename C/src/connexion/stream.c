@@ -0,0 +1,122 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <limits.h>
+#include <string.h>
+
+#include "stream.h"
+#include "../conf.c"
+
+/**
+ * Find an opened stream
+ * @param table     The streams
+ * @param id        The stream
+ * @return          The stream, NULL if it is not opened
+ */
+static stream_state *find_stream(const stream_table *table, uint16_t id);
+
+
+void stream_table_reset(stream_table *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+int stream_open(stream_table *table, uint16_t id, uint32_t window)
+{
+    if (id == STREAM_DEFAULT || find_stream(table, id) != NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < STREAM_MAX; ++i) {
+        stream_state *stream = &table->streams[i];
+        if (!stream->used) {
+            stream->id = id;
+            stream->used = 1;
+            stream->send_window = window;
+            stream->recv_window = STREAM_INITIAL_WINDOW;
+            stream->recv_consumed = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void stream_close(stream_table *table, uint16_t id)
+{
+    stream_state *stream = find_stream(table, id);
+    if (stream != NULL) {
+        stream->used = 0;
+    }
+}
+
+ssize_t stream_send_window(const stream_table *table, uint16_t id)
+{
+    if (id == STREAM_DEFAULT) {
+        return SSIZE_MAX;
+    }
+
+    const stream_state *stream = find_stream(table, id);
+    return stream == NULL ? -1 : (ssize_t)stream->send_window;
+}
+
+void stream_sent(stream_table *table, uint16_t id, size_t length)
+{
+    stream_state *stream = find_stream(table, id);
+    if (stream != NULL) {
+        stream->send_window -= length < stream->send_window ? (uint32_t)length : stream->send_window;
+    }
+}
+
+int stream_grant(stream_table *table, uint16_t id, uint32_t increment)
+{
+    stream_state *stream = find_stream(table, id);
+    if (stream == NULL || stream->send_window > UINT32_MAX - increment) {
+        return -1;
+    }
+    stream->send_window += increment;
+    return 0;
+}
+
+int stream_receive(stream_table *table, uint16_t id, size_t length)
+{
+    if (id == STREAM_DEFAULT) {
+        return 0;
+    }
+
+    stream_state *stream = find_stream(table, id);
+    if (stream == NULL || length > stream->recv_window) {
+        return -1;
+    }
+    stream->recv_window -= (uint32_t)length;
+    return 0;
+}
+
+uint32_t stream_consume(stream_table *table, uint16_t id, size_t length)
+{
+    stream_state *stream = find_stream(table, id);
+    if (stream == NULL) {
+        return 0;
+    }
+
+    // Granting every frame would double the number of frames, wait for half a window
+    stream->recv_consumed += (uint32_t)length;
+    if (stream->recv_consumed < STREAM_INITIAL_WINDOW / 2) {
+        return 0;
+    }
+
+    uint32_t increment = stream->recv_consumed;
+    stream->recv_window += increment;
+    stream->recv_consumed = 0;
+    return increment;
+}
+
+static stream_state *find_stream(const stream_table *table, uint16_t id)
+{
+    for (int i = 0; i < STREAM_MAX; ++i) {
+        if (table->streams[i].used && table->streams[i].id == id) {
+            return (stream_state *)&table->streams[i];
+        }
+    }
+    return NULL;
+}
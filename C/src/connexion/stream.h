@@ -0,0 +1,111 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_STREAM_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Logical streams multiplexed on a connection, identified by the stream field
+ * of the frame headers. Stream 0 always exists and has no flow control.
+ * The client opens the other streams with a FRAME_STREAM_OPEN frame whose
+ * payload is the window it grants (4 bytes), the server answers with its own
+ * window, or with a FRAME_STREAM_CLOSE frame if it has no room for the stream.
+ * A side sends at most as many data bytes on a stream as its peer granted,
+ * the peer grants more with FRAME_WINDOW frames (4 bytes increment) once its
+ * application consumed them. A stalled stream thus stops on its own while the
+ * other ones go on.
+ */
+#define STREAM_DEFAULT 0
+#define STREAM_WINDOW_SIZE 4
+#define STREAM_MAX 8
+
+/**
+ * Flow control state of a stream
+ */
+typedef struct stream_state {
+    uint16_t id;
+    int used;
+    uint32_t send_window;
+    uint32_t recv_window;
+    uint32_t recv_consumed;
+} stream_state;
+
+/**
+ * Streams opened on a connection
+ */
+typedef struct stream_table {
+    stream_state streams[STREAM_MAX];
+} stream_table;
+
+/**
+ * Close every stream of a new connection
+ * @param table     The streams
+ */
+void stream_table_reset(stream_table *table);
+
+/**
+ * Open a stream asked by the peer
+ * @param table     The streams
+ * @param id        The stream
+ * @param window    The number of bytes the peer accepts on the stream
+ * @return          0 on success, -1 if the identifier is invalid or STREAM_MAX streams are opened
+ */
+int stream_open(stream_table *table, uint16_t id, uint32_t window);
+
+/**
+ * Close a stream
+ * @param table     The streams
+ * @param id        The stream
+ */
+void stream_close(stream_table *table, uint16_t id);
+
+/**
+ * Get the number of bytes which can be sent on a stream
+ * @param table     The streams
+ * @param id        The stream
+ * @return          The window, SSIZE_MAX for the default stream, -1 if the stream is not opened
+ */
+ssize_t stream_send_window(const stream_table *table, uint16_t id);
+
+/**
+ * Account for data sent on a stream
+ * @param table     The streams
+ * @param id        The stream
+ * @param length    The number of bytes sent
+ */
+void stream_sent(stream_table *table, uint16_t id, size_t length);
+
+/**
+ * Add the increment of a FRAME_WINDOW frame to a stream
+ * @param table     The streams
+ * @param id        The stream
+ * @param increment The number of bytes granted by the peer
+ * @return          0 on success, -1 if the stream is not opened or the window overflows
+ */
+int stream_grant(stream_table *table, uint16_t id, uint32_t increment);
+
+/**
+ * Account for data received on a stream
+ * @param table     The streams
+ * @param id        The stream
+ * @param length    The number of bytes received
+ * @return          0 on success, -1 if the stream is not opened or the peer exceeded the window
+ */
+int stream_receive(stream_table *table, uint16_t id, size_t length);
+
+/**
+ * Account for data handed to the application, granting the peer a new window
+ * once half of it is consumed
+ * @param table     The streams
+ * @param id        The stream
+ * @param length    The number of bytes consumed
+ * @return          The increment to send in a FRAME_WINDOW frame, 0 if none is due
+ */
+uint32_t stream_consume(stream_table *table, uint16_t id, size_t length);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_STREAM_H
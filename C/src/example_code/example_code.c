@@ -1,31 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <mqueue.h>
+#include <stdatomic.h>
 
 #include "example_code.h"
 #include "../connexion/connexion.h"
 #include "../conf.c"
+#include "../trace/timeline.h"
 #include "../trace/trace.h"
+#include "telemetry_messages.h"
 
 
 #define MQ_WRITE_NAME "/mq_write"
 
+// The timeline of a queued message follows its bytes
+#define MQ_MESSAGE_SIZE (MAX_MSG_SIZE + sizeof(uint32_t))
+
 static pthread_t thread_read;
 static pthread_t thread_write;
 
+static uint8_t batch[WRITE_BATCH_SIZE];
+static size_t batch_length;
+static int batch_flush_armed;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static wheel_timer flush_timer;
+
 /**
  * Send a message on the socket
  * @param message   The message to send
  * @param size      The size of the message
+ * @param cls       The class of the message, control messages overtake the queued telemetry
  */
-void send_message(u_int8_t *message, ssize_t size);
+void send_message(u_int8_t *message, ssize_t size, traffic_class cls);
 
 /**
- * Build a test message and send it on the socket
+ * Build a test acknowledgement and send it on the socket
+ * @param length    The size of the acknowledged message
  */
-void test_message();
+void test_message(size_t length);
 
 /**
  * Thread function used to regularly read the socket
@@ -41,8 +56,26 @@ void *thread_read_fct(void *arg);
  */
 void *thread_write_fct(void *arg);
 
+/**
+ * Add a message to the batch of outgoing messages, sending the batch when it is full
+ * @param message   The message to add
+ * @param size      The size of the message
+ */
+void batch_message(const uint8_t *message, size_t size);
+
+/**
+ * Send the batch of outgoing messages on the socket, batch_lock must be held
+ */
+void flush_batch();
 
-static int running = 1;
+/**
+ * Timer callback sending the batch FLUSH_DELAY_MS after its first message
+ * @param arg
+ */
+void on_flush_timer(void *arg);
+
+
+static atomic_int running = 1;
 mqd_t mq_write;
 
 void launch() {
@@ -50,7 +83,7 @@ void launch() {
     struct mq_attr attr;
     attr.mq_flags = 0;
     attr.mq_maxmsg = 10;
-    attr.mq_msgsize = MAX_MSG_SIZE;
+    attr.mq_msgsize = MQ_MESSAGE_SIZE;
 
     mq_unlink(MQ_WRITE_NAME);
     mq_write = mq_open(MQ_WRITE_NAME, O_CREAT | O_RDWR | O_EXCL, 0644, &attr);
@@ -76,24 +109,50 @@ void launch() {
     }
 }
 
-void send_message(u_int8_t *message, ssize_t size) {
-    if (mq_send(mq_write, message, size, 0) == -1) {
+void stop() {
+    running = 0;
+
+    // An empty message tells the writing thread the queue is drained
+    if (mq_send(mq_write, "", 0, 0) == -1) {
+        perror("mq_send");
+    }
+    pthread_join(thread_write, NULL);
+
+    // Wake up the reading thread, it closes the current session before leaving
+    connexion_shutdown();
+    pthread_join(thread_read, NULL);
+
+    connexion_close();
+    mq_close(mq_write);
+    mq_unlink(MQ_WRITE_NAME);
+}
+
+void send_message(u_int8_t *message, ssize_t size, traffic_class cls) {
+    uint8_t queued[MQ_MESSAGE_SIZE] = {0};
+    memcpy(queued, message, size < MAX_MSG_SIZE ? (size_t)size : MAX_MSG_SIZE);
+
+    uint32_t trace_id = timeline_message_begin("enqueue", MAX_MSG_SIZE);
+    memcpy(queued + MAX_MSG_SIZE, &trace_id, sizeof(trace_id));
+
+    // The queue delivers the highest priorities first
+    if (mq_send(mq_write, (const char *)queued, sizeof(queued), TRAFFIC_CLASS_COUNT - 1 - cls) == -1) {
         perror("mq_send");
         exit(EXIT_FAILURE);
     }
 }
 
-void test_message(){
+void test_message(size_t length){
+    static uint32_t sequence;
     sleep(1);
-    uint8_t buffer[MAX_MSG_SIZE];
 
-    u_int8_t filler = 0x00;
-    for (int i = 0; i < MAX_MSG_SIZE; ++i) {
-        buffer[i] = filler;
-        filler++;
-    }
+    // The rest of the buffer stays zeroed, readers ignore the bytes beyond the fields they know
+    _Static_assert(TELEMETRY_ACK_SIZE <= MAX_MSG_SIZE, "ack larger than a message");
+    uint8_t buffer[MAX_MSG_SIZE] = {0};
+    telemetry_ack_init(buffer);
+    telemetry_ack_set_sequence(buffer, ++sequence);
+    telemetry_ack_set_length(buffer, (uint32_t)length);
 
-    send_message(buffer, MAX_MSG_SIZE);
+    send_message(buffer, MAX_MSG_SIZE, TRAFFIC_CONTROL);
 }
 
 void *thread_read_fct(void *arg) {
@@ -105,38 +164,64 @@ void *thread_read_fct(void *arg) {
 
         if (bytes_read == -1) {
             break;
-        } else {
+        } else if (bytes_read > 0) {
             // Display received message information
             TRACE("Message received :\n");
             TRACE("- Bytes read : %d\n", bytes_read);
-            TRACE("- Content : %s\n", buffer);
 
-            // Send a response message to the client
-            test_message();
+            // Read in place, other messages are displayed as text
+            telemetry_drive drive;
+            if (telemetry_drive_view(&drive, buffer, (size_t)bytes_read) == 0) {
+                TRACE("- Drive : left %d mm/s, right %d mm/s, for %u ms\n", telemetry_drive_left_mm_s(drive),
+                      telemetry_drive_right_mm_s(drive), telemetry_drive_duration_ms(drive));
+            } else {
+                TRACE("- Content : %.*s\n", (int)bytes_read, buffer);
+            }
+
+            // Acknowledge with a control message, it overtakes the queued telemetry
+            test_message((size_t)bytes_read);
 
         }
     }
+    return NULL;
 }
 
 void *thread_write_fct(void *arg) {
 
-    while (running) {
+    // Run until the empty message sent by stop(), once the queue is drained
+    while (1) {
 
         // Memory allocation for the message
-        uint8_t buffer[MAX_MSG_SIZE];
+        uint8_t buffer[MQ_MESSAGE_SIZE];
+        unsigned int priority;
 
         // Waiting for a message on the message queue
-        ssize_t bytes_read = mq_receive(mq_write, buffer, MAX_MSG_SIZE, NULL);
+        ssize_t bytes_read = mq_receive(mq_write, (char *)buffer, sizeof(buffer), &priority);
         if (bytes_read == -1) {
             perror("mq_receive");
             exit(EXIT_FAILURE);
 
-        } else if (bytes_read > 0) {
-            ssize_t bytes_sent = connexion_write( buffer, MAX_MSG_SIZE);
+        } else if (bytes_read == 0) {
+            break;
+
+        } else {
+            // The timeline of the message goes on in the connexion, or ends in the batch
+            uint32_t trace_id;
+            memcpy(&trace_id, buffer + MAX_MSG_SIZE, sizeof(trace_id));
+            timeline_message_step(trace_id, "dequeue");
+
+            // Only telemetry waits for the batch, the other classes have their own queues
+            traffic_class cls = (traffic_class)(TRAFFIC_CLASS_COUNT - 1 - priority);
+            if (cls == TRAFFIC_TELEMETRY) {
+                batch_message(buffer, MAX_MSG_SIZE);
+                timeline_message_end(trace_id, "batched");
+            } else {
+                timeline_message_adopt(trace_id);
+                connexion_send(buffer, MAX_MSG_SIZE, cls);
+            }
 
             // Display sending information
-            TRACE("\nMessage sent :\n");
-            TRACE("- Bytes_read : %d\n", bytes_sent);
+            TRACE("\nMessage queued :\n");
             TRACE("- Message : ");
 
             for (int i = 0; i < MAX_MSG_SIZE; ++i) {
@@ -144,8 +229,65 @@ void *thread_write_fct(void *arg) {
             }
             TRACE("\n");
         }
-
-        usleep(200);
     }
+
+    // Send what is left in the batch
+    event_loop_timer_cancel(connexion_event_loop(), &flush_timer);
+    pthread_mutex_lock(&batch_lock);
+    flush_batch();
+    pthread_mutex_unlock(&batch_lock);
     return NULL;
 }
+
+void batch_message(const uint8_t *message, size_t size) {
+    int arm_timer = 0;
+
+    pthread_mutex_lock(&batch_lock);
+
+    // No room left for the message
+    if (batch_length + size > WRITE_BATCH_SIZE) {
+        flush_batch();
+    }
+
+    memcpy(batch + batch_length, message, size);
+    batch_length += size;
+
+    // Send a full batch right away, otherwise wait a little for the next messages
+    if (batch_length == WRITE_BATCH_SIZE) {
+        flush_batch();
+    } else if (!batch_flush_armed) {
+        batch_flush_armed = 1;
+        arm_timer = 1;
+    }
+
+    pthread_mutex_unlock(&batch_lock);
+
+    // The timer callback takes batch_lock under the loop lock, arm it without holding batch_lock
+    if (arm_timer) {
+        event_loop_timer_add(connexion_event_loop(), &flush_timer, FLUSH_DELAY_MS, on_flush_timer, NULL);
+    }
+}
+
+void flush_batch() {
+    if (batch_length == 0) {
+        return;
+    }
+
+    ssize_t bytes_sent = connexion_write(batch, batch_length);
+
+    // Display sending information
+    TRACE("\nBatch sent :\n");
+    TRACE("- Bytes_sent : %zd\n", bytes_sent);
+    TRACE("- Messages : %zu\n", batch_length / MAX_MSG_SIZE);
+
+    batch_length = 0;
+}
+
+void on_flush_timer(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&batch_lock);
+    batch_flush_armed = 0;
+    flush_batch();
+    pthread_mutex_unlock(&batch_lock);
+}
@@ -14,5 +14,10 @@
  */
 void launch();
 
+/**
+ * Stop the example code: send the messages still queued, then close the connexion
+ */
+void stop();
+
 
 #endif //C_COM_H
@@ -0,0 +1,93 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdatomic.h>
+
+#include "capture.h"
+#include "frame.h"
+#include "../connexion/heartbeat.h"
+
+static _Atomic(FILE *) capture_file;
+static uint64_t capture_origin_us;
+
+
+int capture_start(const char *filepath)
+{
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL) {
+        perror("Impossible to open the capture file");
+        return -1;
+    }
+
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    frame_put_u32(header, CAPTURE_MAGIC);
+    frame_put_u32(header + 4, CAPTURE_VERSION);
+    fwrite(header, sizeof(header), 1, file);
+
+    capture_origin_us = heartbeat_now_us();
+    capture_file = file;
+    return 0;
+}
+
+void capture_stop()
+{
+    FILE *file = atomic_exchange(&capture_file, NULL);
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+void capture_event(uint32_t connection, uint8_t event, uint8_t type, uint8_t flags, uint32_t length)
+{
+    FILE *file = capture_file;
+    if (file == NULL) {
+        return;
+    }
+
+    uint8_t record[CAPTURE_RECORD_SIZE];
+    frame_put_u64(record, heartbeat_now_us() - capture_origin_us);
+    frame_put_u32(record + 8, connection);
+    record[12] = event;
+    record[13] = type;
+    record[14] = flags;
+    record[15] = 0;
+    frame_put_u32(record + 16, length);
+
+    // stdio locks the stream, concurrent records are not interleaved
+    fwrite(record, sizeof(record), 1, file);
+}
+
+FILE *capture_open(const char *filepath)
+{
+    FILE *file = fopen(filepath, "rb");
+    if (file == NULL) {
+        perror("Impossible to open the capture file");
+        return NULL;
+    }
+
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, file) != 1 || frame_get_u32(header) != CAPTURE_MAGIC ||
+        frame_get_u32(header + 4) != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture file\n", filepath);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+int capture_read(FILE *file, capture_record *record)
+{
+    uint8_t buffer[CAPTURE_RECORD_SIZE];
+    if (fread(buffer, sizeof(buffer), 1, file) != 1) {
+        return 0;
+    }
+
+    record->time_us = frame_get_u64(buffer);
+    record->connection = frame_get_u32(buffer + 8);
+    record->event = buffer[12];
+    record->type = buffer[13];
+    record->flags = (uint16_t)(buffer[14] | buffer[15] << 8);
+    record->length = frame_get_u32(buffer + 16);
+    return 1;
+}
@@ -0,0 +1,87 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_CAPTURE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * A capture file starts with a header:
+ * - magic      (4 bytes, CAPTURE_MAGIC)
+ * - version    (4 bytes, CAPTURE_VERSION)
+ * followed by fixed size little-endian records:
+ * - time       (8 bytes, microseconds since the start of the capture)
+ * - connection (4 bytes, identifier of the session)
+ * - event      (1 byte, CAPTURE_*)
+ * - type       (1 byte, frame type)
+ * - flags      (2 bytes, frame flags)
+ * - length     (4 bytes, size of the plaintext payload)
+ * Only the timing and sizes of the frames are kept, never their content.
+ */
+#define CAPTURE_MAGIC 0x50414335
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_RECORD_SIZE 20
+
+/**
+ * Captured events
+ */
+#define CAPTURE_OPEN 0
+#define CAPTURE_RECV 1
+#define CAPTURE_SEND 2
+#define CAPTURE_CLOSE 3
+
+/**
+ * Decoded record
+ */
+typedef struct capture_record {
+    uint64_t time_us;
+    uint32_t connection;
+    uint8_t event;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t length;
+} capture_record;
+
+/**
+ * Start recording the frames of every session
+ * @param filepath  The path of the capture file, truncated
+ * @return          0 on success, -1 on error
+ */
+int capture_start(const char *filepath);
+
+/**
+ * Stop recording and close the capture file, once the sessions are closed
+ */
+void capture_stop();
+
+/**
+ * Record an event, nothing is done when the capture is not started.
+ * Can be called from any thread.
+ * @param connection    The identifier of the session
+ * @param event         The event, CAPTURE_*
+ * @param type          The frame type
+ * @param flags         The frame flags
+ * @param length        The size of the plaintext payload
+ */
+void capture_event(uint32_t connection, uint8_t event, uint8_t type, uint8_t flags, uint32_t length);
+
+/**
+ * Open a capture file for reading and check its header
+ * @param filepath  The path of the capture file
+ * @return          The file positioned on the first record, NULL on error
+ */
+FILE *capture_open(const char *filepath);
+
+/**
+ * Read the next record of a capture file
+ * @param file      The file returned by capture_open
+ * @param record    The record to fill
+ * @return          1 if a record was read, 0 at the end of the file
+ */
+int capture_read(FILE *file, capture_record *record);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_CAPTURE_H
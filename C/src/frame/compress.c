@@ -0,0 +1,306 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "frame.h"
+#include "../conf.c"
+#include "../trace/trace.h"
+
+#ifdef HAVE_ZSTD
+/**
+ * zstd contexts of a thread, created on first use and freed when the thread exits
+ */
+typedef struct zstd_contexts {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} zstd_contexts;
+
+static ZSTD_CDict *cdict;
+static ZSTD_DDict *ddict;
+
+// zstd contexts are not thread-safe, each thread gets its own
+static pthread_key_t contexts_key;
+static pthread_once_t contexts_once = PTHREAD_ONCE_INIT;
+#endif
+static uint32_t dict_id;
+
+/**
+ * Get the codecs built in
+ * @return  The codecs bit mask
+ */
+static uint32_t local_codecs();
+
+/**
+ * Choose the codec of a frame among the negotiated ones
+ * @param state     The compression state
+ * @param length    The size of the payload
+ * @return          The codec
+ */
+static uint32_t choose_codec(const compress_state *state, size_t length);
+
+#ifdef HAVE_ZSTD
+/**
+ * Create the key of the zstd contexts of the threads
+ */
+static void create_contexts_key();
+
+/**
+ * Get the zstd contexts of the calling thread, creating them on first use
+ * @return          The contexts, NULL if they can not be allocated
+ */
+static zstd_contexts *thread_contexts();
+
+/**
+ * Free the zstd contexts of a thread, called when it exits
+ * @param arg       The contexts
+ */
+static void free_contexts(void *arg);
+#endif
+
+
+void compress_init(const char *dict_filepath)
+{
+#ifdef HAVE_ZSTD
+    FILE *file = fopen(dict_filepath, "rb");
+    if (file == NULL) {
+        TRACE("No compression dictionary %s\n", dict_filepath);
+        return;
+    }
+
+    // Read the whole dictionary
+    uint8_t *dict = malloc(COMPRESS_DICT_MAX_SIZE);
+    if (dict == NULL) {
+        perror("malloc");
+        fclose(file);
+        return;
+    }
+    size_t size = fread(dict, 1, COMPRESS_DICT_MAX_SIZE, file);
+    fclose(file);
+
+    cdict = ZSTD_createCDict(dict, size, COMPRESS_ZSTD_LEVEL);
+    ddict = ZSTD_createDDict(dict, size);
+    dict_id = ZSTD_getDictID_fromDict(dict, size);
+    free(dict);
+
+    if (cdict == NULL || ddict == NULL) {
+        fprintf(stderr, "Invalid compression dictionary %s\n", dict_filepath);
+        compress_free();
+        return;
+    }
+    TRACE("Compression dictionary %s loaded (id %u)\n", dict_filepath, dict_id);
+#else
+    (void)dict_filepath;
+#endif
+}
+
+void compress_free()
+{
+#ifdef HAVE_ZSTD
+    // The other threads free their contexts when they exit, the calling one may not exit before the process
+    pthread_once(&contexts_once, create_contexts_key);
+    free_contexts(pthread_getspecific(contexts_key));
+    pthread_setspecific(contexts_key, NULL);
+
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    cdict = NULL;
+    ddict = NULL;
+#endif
+    dict_id = 0;
+}
+
+void compress_reset(compress_state *state)
+{
+    memset(state, 0, sizeof(*state));
+}
+
+void compress_hello(uint8_t *payload, uint32_t codecs)
+{
+    frame_put_u32(payload, codecs);
+    frame_put_u32(payload + 4, dict_id);
+}
+
+int compress_negotiate(compress_state *state, const uint8_t *payload, size_t length)
+{
+    if (length < COMPRESS_HELLO_SIZE) {
+        return -1;
+    }
+
+    uint32_t codecs = frame_get_u32(payload) & local_codecs();
+
+    // Dictionaries are not interchangeable
+    if (frame_get_u32(payload + 4) != dict_id) {
+        codecs &= ~(uint32_t)COMPRESS_ZSTD;
+    }
+
+    state->codecs = codecs;
+    return 0;
+}
+
+ssize_t compress_frame(compress_state *state, const uint8_t *in, size_t length, uint8_t *out, size_t capacity,
+                       uint8_t *flags)
+{
+    if (state->codecs == 0 || length < COMPRESS_MIN_SIZE) {
+        return -1;
+    }
+
+    // The last frames did not compress, only try from time to time
+    if (state->incompressible >= COMPRESS_BACKOFF_FRAMES && ++state->skipped % COMPRESS_BACKOFF_FRAMES != 0) {
+        return -1;
+    }
+
+    // Compressing is only worth it if it saves an eighth of the payload
+    size_t limit = length - length / 8;
+    if (limit > capacity) {
+        limit = capacity;
+    }
+
+    uint32_t codec = choose_codec(state, length);
+    ssize_t size = -1;
+
+#ifdef HAVE_ZSTD
+    if (codec == COMPRESS_ZSTD) {
+        zstd_contexts *contexts = thread_contexts();
+        if (contexts == NULL) {
+            return -1;
+        }
+        if (contexts->cctx == NULL && (contexts->cctx = ZSTD_createCCtx()) == NULL) {
+            return -1;
+        }
+        size_t result = cdict != NULL
+                        ? ZSTD_compress_usingCDict(contexts->cctx, out, limit, in, length, cdict)
+                        : ZSTD_compressCCtx(contexts->cctx, out, limit, in, length, COMPRESS_ZSTD_LEVEL);
+        if (!ZSTD_isError(result)) {
+            size = (ssize_t)result;
+            *flags = FRAME_FLAG_ZSTD;
+        }
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (codec == COMPRESS_LZ4) {
+        int result = LZ4_compress_default((const char *)in, (char *)out, (int)length, (int)limit);
+        if (result > 0) {
+            size = result;
+            *flags = FRAME_FLAG_LZ4;
+        }
+    }
+#endif
+    (void)codec;
+    (void)in;
+    (void)out;
+    (void)flags;
+
+    // The output buffer was too small: the frame is incompressible
+    if (size == -1) {
+        state->incompressible++;
+    } else {
+        state->incompressible = 0;
+    }
+    return size;
+}
+
+ssize_t decompress_frame(uint8_t flags, const uint8_t *in, size_t length, uint8_t *out, size_t capacity)
+{
+#ifdef HAVE_ZSTD
+    if (flags & FRAME_FLAG_ZSTD) {
+        zstd_contexts *contexts = thread_contexts();
+        if (contexts == NULL) {
+            return -1;
+        }
+        if (contexts->dctx == NULL && (contexts->dctx = ZSTD_createDCtx()) == NULL) {
+            return -1;
+        }
+        size_t result = ddict != NULL
+                        ? ZSTD_decompress_usingDDict(contexts->dctx, out, capacity, in, length, ddict)
+                        : ZSTD_decompressDCtx(contexts->dctx, out, capacity, in, length);
+        return ZSTD_isError(result) ? -1 : (ssize_t)result;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (flags & FRAME_FLAG_LZ4) {
+        int result = LZ4_decompress_safe((const char *)in, (char *)out, (int)length, (int)capacity);
+        return result < 0 ? -1 : result;
+    }
+#endif
+    (void)flags;
+    (void)in;
+    (void)length;
+    (void)out;
+    (void)capacity;
+
+    // Codec not built in, it can not have been negotiated
+    return -1;
+}
+
+static uint32_t local_codecs()
+{
+    uint32_t codecs = 0;
+#ifdef HAVE_LZ4
+    codecs |= COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    codecs |= COMPRESS_ZSTD;
+#endif
+    return codecs;
+}
+
+static uint32_t choose_codec(const compress_state *state, size_t length)
+{
+    // Small frames benefit from the dictionary, large ones from the speed of LZ4
+    if ((state->codecs & COMPRESS_ZSTD)
+        && (!(state->codecs & COMPRESS_LZ4) || (dict_id != 0 && length <= COMPRESS_DICT_FRAME_SIZE))) {
+        return COMPRESS_ZSTD;
+    }
+    return state->codecs & COMPRESS_LZ4;
+}
+
+#ifdef HAVE_ZSTD
+static void create_contexts_key()
+{
+    if (pthread_key_create(&contexts_key, free_contexts) != 0) {
+        fprintf(stderr, "erreur pthread_key_create\n");
+        exit(-1);
+    }
+}
+
+static zstd_contexts *thread_contexts()
+{
+    pthread_once(&contexts_once, create_contexts_key);
+
+    zstd_contexts *contexts = pthread_getspecific(contexts_key);
+    if (contexts == NULL) {
+        contexts = calloc(1, sizeof(*contexts));
+        if (contexts == NULL || pthread_setspecific(contexts_key, contexts) != 0) {
+            fprintf(stderr, "Out of memory for the zstd contexts\n");
+            free(contexts);
+            return NULL;
+        }
+    }
+    return contexts;
+}
+
+static void free_contexts(void *arg)
+{
+    zstd_contexts *contexts = arg;
+    if (contexts == NULL) {
+        return;
+    }
+
+    ZSTD_freeCCtx(contexts->cctx);
+    ZSTD_freeDCtx(contexts->dctx);
+    free(contexts);
+}
+#endif
@@ -0,0 +1,90 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_COMPRESS_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Codecs, used as a bit mask in the hello frames
+ */
+#define COMPRESS_LZ4 0x01
+#define COMPRESS_ZSTD 0x02
+
+/**
+ * Hello payload: supported codecs (4 bytes) and zstd dictionary id (4 bytes),
+ * little-endian. 0 as dictionary id means no dictionary.
+ */
+#define COMPRESS_HELLO_SIZE 8
+
+/**
+ * Compression state of a connection
+ */
+typedef struct compress_state {
+    uint32_t codecs;
+    unsigned int incompressible;
+    unsigned int skipped;
+} compress_state;
+
+/**
+ * Load the zstd dictionary, if the file exists and zstd is available
+ * @param dict_filepath     The path of the dictionary trained with `zstd --train`
+ */
+void compress_init(const char *dict_filepath);
+
+/**
+ * Free the dictionary
+ */
+void compress_free();
+
+/**
+ * Reset the state of a new connection: no compression until negotiated
+ * @param state     The compression state
+ */
+void compress_reset(compress_state *state);
+
+/**
+ * Build the payload of a hello frame announcing the local codecs
+ * @param payload   Filled with the COMPRESS_HELLO_SIZE bytes of the payload
+ * @param codecs    The codecs to announce
+ */
+void compress_hello(uint8_t *payload, uint32_t codecs);
+
+/**
+ * Negotiate the codecs with the hello frame of the peer
+ * @param state     The compression state, its codecs are set to the common codecs
+ * @param payload   The payload of the hello frame received
+ * @param length    The size of the payload
+ * @return          0 on success, -1 if the hello frame is malformed
+ */
+int compress_negotiate(compress_state *state, const uint8_t *payload, size_t length);
+
+/**
+ * Compress a frame payload if it is worth it
+ * @param state     The compression state
+ * @param in        The payload
+ * @param length    The size of the payload
+ * @param out       The buffer receiving the compressed payload
+ * @param capacity  The size of the output buffer
+ * @param flags     Filled with the frame flags of the codec used
+ * @return          The size of the compressed payload, -1 if the payload must be sent as is
+ */
+ssize_t compress_frame(compress_state *state, const uint8_t *in, size_t length, uint8_t *out, size_t capacity,
+                       uint8_t *flags);
+
+/**
+ * Decompress a frame payload
+ * @param flags     The frame flags
+ * @param in        The compressed payload
+ * @param length    The size of the compressed payload
+ * @param out       The buffer receiving the payload
+ * @param capacity  The size of the output buffer
+ * @return          The size of the payload, -1 on error
+ */
+ssize_t decompress_frame(uint8_t flags, const uint8_t *in, size_t length, uint8_t *out, size_t capacity);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_COMPRESS_H
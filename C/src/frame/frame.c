@@ -0,0 +1,107 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <string.h>
+
+#include "frame.h"
+
+
+void frame_encode_header(uint8_t *out, uint8_t type, uint8_t flags, uint16_t stream, uint32_t length)
+{
+    out[0] = type;
+    out[1] = flags;
+    out[2] = (uint8_t)stream;
+    out[3] = (uint8_t)(stream >> 8);
+    frame_put_u32(out + 4, length);
+}
+
+int frame_decode_header(const uint8_t *in, frame_header *header)
+{
+    header->type = in[0];
+    header->flags = in[1];
+    header->stream = (uint16_t)(in[2] | in[3] << 8);
+    header->length = frame_get_u32(in + 4);
+
+    // A frame must fit in the reassembly buffer
+    if (header->length > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    return 0;
+}
+
+void frame_reader_reset(frame_reader *reader)
+{
+    reader->length = 0;
+}
+
+uint8_t *frame_reader_space(frame_reader *reader, size_t *available)
+{
+    *available = sizeof(reader->buffer) - reader->length;
+    return reader->buffer + reader->length;
+}
+
+void frame_reader_commit(frame_reader *reader, size_t length)
+{
+    reader->length += length;
+}
+
+int frame_reader_next(frame_reader *reader, frame_header *header, const uint8_t **payload)
+{
+    if (reader->length < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    if (frame_decode_header(reader->buffer, header) == -1) {
+        return -1;
+    }
+
+    // Wait for the whole payload
+    if (reader->length < FRAME_HEADER_SIZE + (size_t)header->length) {
+        return 0;
+    }
+
+    *payload = reader->buffer + FRAME_HEADER_SIZE;
+    return 1;
+}
+
+void frame_reader_consume(frame_reader *reader, const frame_header *header)
+{
+    size_t size = FRAME_HEADER_SIZE + (size_t)header->length;
+
+    // Move the bytes of the next frames to the start of the buffer
+    memmove(reader->buffer, reader->buffer + size, reader->length - size);
+    reader->length -= size;
+}
+
+void frame_put_u32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+void frame_put_u64(uint8_t *out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+uint32_t frame_get_u32(const uint8_t *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+uint64_t frame_get_u64(const uint8_t *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
@@ -0,0 +1,122 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_FRAME_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Every frame starts with an 8 bytes little-endian header:
+ * - type       (1 byte)
+ * - flags      (1 byte)
+ * - stream     (2 bytes, logical stream of the frame, 0 for the default stream)
+ * - length     (4 bytes, size of the payload)
+ */
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MAX_PAYLOAD 16384
+
+enum frame_type {
+    FRAME_DATA = 0,
+    FRAME_PING = 1,
+    FRAME_PONG = 2,
+    FRAME_HELLO = 3,
+    FRAME_BULK = 4,
+    FRAME_STREAM_OPEN = 5,
+    FRAME_STREAM_CLOSE = 6,
+    FRAME_WINDOW = 7,
+    FRAME_LATEST = 8,
+};
+
+/**
+ * Frame flags: codec used to compress the payload, and for bulk frames,
+ * more chunks of the same transfer follow
+ */
+#define FRAME_FLAG_LZ4 0x01
+#define FRAME_FLAG_ZSTD 0x02
+#define FRAME_FLAG_MORE 0x04
+
+/**
+ * Decoded frame header
+ */
+typedef struct frame_header {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t stream;
+    uint32_t length;
+} frame_header;
+
+/**
+ * Reassembly buffer turning the received bytes into frames
+ */
+typedef struct frame_reader {
+    size_t length;
+    uint8_t buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+} frame_reader;
+
+/**
+ * Write a frame header
+ * @param out       The buffer receiving the FRAME_HEADER_SIZE bytes of the header
+ * @param type      The frame type
+ * @param flags     The frame flags
+ * @param stream    The stream of the frame
+ * @param length    The size of the payload following the header
+ */
+void frame_encode_header(uint8_t *out, uint8_t type, uint8_t flags, uint16_t stream, uint32_t length);
+
+/**
+ * Read a frame header
+ * @param in        The FRAME_HEADER_SIZE bytes of the header
+ * @param header    The decoded header
+ * @return          0 on success, -1 if the header is invalid
+ */
+int frame_decode_header(const uint8_t *in, frame_header *header);
+
+/**
+ * Empty a reassembly buffer
+ * @param reader    The reader
+ */
+void frame_reader_reset(frame_reader *reader);
+
+/**
+ * Get the free space of a reassembly buffer, to receive bytes directly in it
+ * @param reader    The reader
+ * @param available Filled with the number of free bytes
+ * @return          The start of the free space
+ */
+uint8_t *frame_reader_space(frame_reader *reader, size_t *available);
+
+/**
+ * Account for bytes received in the free space
+ * @param reader    The reader
+ * @param length    The number of bytes received
+ */
+void frame_reader_commit(frame_reader *reader, size_t length);
+
+/**
+ * Get the first complete frame of a reassembly buffer
+ * @param reader    The reader
+ * @param header    Filled with the header of the frame
+ * @param payload   Filled with the payload of the frame, valid until frame_reader_consume
+ * @return          1 if a frame is available, 0 if more bytes are needed, -1 on protocol error
+ */
+int frame_reader_next(frame_reader *reader, frame_header *header, const uint8_t **payload);
+
+/**
+ * Remove the frame returned by frame_reader_next
+ * @param reader    The reader
+ * @param header    The header of the frame
+ */
+void frame_reader_consume(frame_reader *reader, const frame_header *header);
+
+/**
+ * Little-endian helpers
+ */
+void frame_put_u32(uint8_t *out, uint32_t value);
+void frame_put_u64(uint8_t *out, uint64_t value);
+uint32_t frame_get_u32(const uint8_t *in);
+uint64_t frame_get_u64(const uint8_t *in);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_FRAME_H
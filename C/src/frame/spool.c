@@ -0,0 +1,419 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "openssl/evp.h"
+#include "openssl/rand.h"
+
+#include "spool.h"
+#include "frame.h"
+#include "../conf.c"
+#include "../trace/trace.h"
+
+// Offsets of the segment header fields
+#define SPOOL_FLAGS_OFFSET 4
+#define SPOOL_WRITE_OFFSET 8
+#define SPOOL_READ_OFFSET 12
+
+/**
+ * Map a segment of the spool directory
+ * @param sp        The spool
+ * @param id        The sequence number of the segment
+ * @param create    1 to create an empty segment, 0 to open an existing one
+ * @param segment   The segment to fill
+ * @return          0 on success, -1 on error
+ */
+static int map_segment(spool *sp, uint32_t id, int create, spool_segment *segment);
+
+/**
+ * Unmap a segment, unless it is still used as the other end of the spool
+ * @param sp        The spool
+ * @param segment   The segment
+ */
+static void unmap_segment(spool *sp, spool_segment *segment);
+
+/**
+ * Remove the segment being read and open the next one, the lock must be held
+ * @param sp        The spool
+ */
+static void next_read_segment(spool *sp);
+
+/**
+ * Start a new segment for the appends, dropping the oldest one if the spool
+ * is full, the lock must be held
+ * @param sp        The spool
+ * @return          0 on success, -1 on error
+ */
+static int next_write_segment(spool *sp);
+
+/**
+ * Count the records not read yet in a segment
+ * @param segment   The segment
+ * @return          The number of records
+ */
+static size_t count_records(const spool_segment *segment);
+
+/**
+ * Get the size of a record in a segment
+ * @param segment   The segment
+ * @param length    The size of the message
+ * @return          The size of the record
+ */
+static size_t record_size(const spool_segment *segment, size_t length);
+
+
+int spool_open(spool *sp, const char *directory, const uint8_t *key)
+{
+    memset(sp, 0, sizeof(*sp));
+    snprintf(sp->directory, sizeof(sp->directory), "%s", directory);
+    if (key != NULL) {
+        sp->encrypted = 1;
+        memcpy(sp->key, key, SPOOL_KEY_SIZE);
+    }
+
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+        perror("Impossible to create the spool directory");
+        return -1;
+    }
+
+    // Find the segments left by the previous run
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        perror("Impossible to open the spool directory");
+        return -1;
+    }
+    int found = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%8u.%7s", &id, suffix) != 2 || strcmp(suffix, "spool") != 0) {
+            continue;
+        }
+        first = !found || id < first ? id : first;
+        last = !found || id > last ? id : last;
+        found = 1;
+    }
+    closedir(dir);
+
+    if (!found) {
+        if (map_segment(sp, 0, 1, &sp->write) == -1) {
+            return -1;
+        }
+        sp->read = sp->write;
+        pthread_mutex_init(&sp->lock, NULL);
+        return 0;
+    }
+
+    // Count what was not sent, the missing segments are skipped
+    for (uint32_t id = first; id <= last; ++id) {
+        spool_segment segment;
+        if (map_segment(sp, id, 0, &segment) == 0) {
+            sp->pending += count_records(&segment);
+            munmap(segment.data, SPOOL_SEGMENT_SIZE);
+        }
+    }
+
+    if (map_segment(sp, last, 0, &sp->write) == -1) {
+        return -1;
+    }
+    sp->read = sp->write;
+    for (uint32_t id = first; id != last; ++id) {
+        if (map_segment(sp, id, 0, &sp->read) == 0) {
+            break;
+        }
+    }
+    pthread_mutex_init(&sp->lock, NULL);
+
+    if (sp->pending > 0) {
+        TRACE("%zu messages left in the spool\n", sp->pending);
+    }
+    return 0;
+}
+
+int spool_append(spool *sp, uint8_t cls, uint16_t stream, const uint8_t *data, size_t length)
+{
+    pthread_mutex_lock(&sp->lock);
+
+    // The segments keep the encryption they were created with
+    size_t size = record_size(&sp->write, length);
+    int encrypted = (frame_get_u32(sp->write.data + SPOOL_FLAGS_OFFSET) & SPOOL_FLAG_ENCRYPTED) != 0;
+    uint32_t offset = frame_get_u32(sp->write.data + SPOOL_WRITE_OFFSET);
+    if (offset + size > SPOOL_SEGMENT_SIZE || encrypted != sp->encrypted) {
+        if (next_write_segment(sp) == -1) {
+            pthread_mutex_unlock(&sp->lock);
+            return -1;
+        }
+        size = record_size(&sp->write, length);
+        offset = frame_get_u32(sp->write.data + SPOOL_WRITE_OFFSET);
+    }
+    if (offset + size > SPOOL_SEGMENT_SIZE) {
+        pthread_mutex_unlock(&sp->lock);
+        fprintf(stderr, "Message too long for the spool: %zu bytes\n", length);
+        return -1;
+    }
+
+    uint8_t *record = sp->write.data + offset;
+    frame_put_u32(record, (uint32_t)length);
+    record[4] = cls;
+    record[5] = 0;
+    record[6] = (uint8_t)stream;
+    record[7] = (uint8_t)(stream >> 8);
+
+    if (!sp->encrypted) {
+        memcpy(record + SPOOL_RECORD_HEADER_SIZE, data, length);
+    } else {
+        // A random nonce stays unique even if the segment numbers start again from 0
+        uint8_t *nonce = record + SPOOL_RECORD_HEADER_SIZE;
+        uint8_t *tag = nonce + SPOOL_NONCE_SIZE;
+        uint8_t *ciphertext = tag + SPOOL_TAG_SIZE;
+        EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+        int out;
+        if (cipher == NULL || RAND_bytes(nonce, SPOOL_NONCE_SIZE) != 1
+            || EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, sp->key, nonce) != 1
+            || EVP_EncryptUpdate(cipher, NULL, &out, record, SPOOL_RECORD_HEADER_SIZE) != 1
+            || EVP_EncryptUpdate(cipher, ciphertext, &out, data, (int)length) != 1
+            || EVP_EncryptFinal_ex(cipher, ciphertext + out, &out) != 1
+            || EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, SPOOL_TAG_SIZE, tag) != 1) {
+            EVP_CIPHER_CTX_free(cipher);
+            pthread_mutex_unlock(&sp->lock);
+            fprintf(stderr, "Impossible to encrypt the spooled message\n");
+            return -1;
+        }
+        EVP_CIPHER_CTX_free(cipher);
+    }
+
+    // The record only exists once complete
+    frame_put_u32(sp->write.data + SPOOL_WRITE_OFFSET, offset + (uint32_t)size);
+    sp->pending++;
+
+    pthread_mutex_unlock(&sp->lock);
+    return 0;
+}
+
+int spool_peek(spool *sp, spool_record *record, uint8_t *buffer, size_t length)
+{
+    pthread_mutex_lock(&sp->lock);
+
+    while (1) {
+        uint32_t offset = frame_get_u32(sp->read.data + SPOOL_READ_OFFSET);
+        uint32_t end = frame_get_u32(sp->read.data + SPOOL_WRITE_OFFSET);
+
+        if (offset >= end) {
+            if (sp->read.id != sp->write.id) {
+                next_read_segment(sp);
+                continue;
+            }
+
+            // Everything was sent, the segment is written again from its start
+            frame_put_u32(sp->read.data + SPOOL_WRITE_OFFSET, SPOOL_HEADER_SIZE);
+            frame_put_u32(sp->read.data + SPOOL_READ_OFFSET, SPOOL_HEADER_SIZE);
+            sp->pending = 0;
+            pthread_mutex_unlock(&sp->lock);
+            return 0;
+        }
+
+        const uint8_t *data = sp->read.data + offset;
+        size_t size = record_size(&sp->read, frame_get_u32(data));
+        if (size > end - offset || frame_get_u32(data) > length) {
+            // Damaged segment, what follows cannot be found
+            fprintf(stderr, "Damaged spool segment %08u dropped\n", sp->read.id);
+            frame_put_u32(sp->read.data + SPOOL_READ_OFFSET, end);
+            continue;
+        }
+
+        record->length = frame_get_u32(data);
+        record->cls = data[4];
+        record->stream = (uint16_t)(data[6] | data[7] << 8);
+        record->segment = sp->read.id;
+        record->offset = offset;
+        record->next = offset + (uint32_t)size;
+
+        int valid = 1;
+        if (!(frame_get_u32(sp->read.data + SPOOL_FLAGS_OFFSET) & SPOOL_FLAG_ENCRYPTED)) {
+            memcpy(buffer, data + SPOOL_RECORD_HEADER_SIZE, record->length);
+        } else {
+            const uint8_t *nonce = data + SPOOL_RECORD_HEADER_SIZE;
+            const uint8_t *tag = nonce + SPOOL_NONCE_SIZE;
+            const uint8_t *ciphertext = tag + SPOOL_TAG_SIZE;
+            EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+            int out;
+            valid = sp->encrypted && cipher != NULL
+                    && EVP_DecryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, sp->key, nonce) == 1
+                    && EVP_DecryptUpdate(cipher, NULL, &out, data, SPOOL_RECORD_HEADER_SIZE) == 1
+                    && EVP_DecryptUpdate(cipher, buffer, &out, ciphertext, (int)record->length) == 1
+                    && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_SET_TAG, SPOOL_TAG_SIZE, (void *)tag) == 1
+                    && EVP_DecryptFinal_ex(cipher, buffer + out, &out) == 1;
+            EVP_CIPHER_CTX_free(cipher);
+        }
+
+        // A record written with another key is dropped
+        if (!valid) {
+            TRACE("Spooled message cannot be decrypted, dropped\n");
+            frame_put_u32(sp->read.data + SPOOL_READ_OFFSET, record->next);
+            sp->pending -= sp->pending > 0;
+            sp->dropped++;
+            continue;
+        }
+
+        pthread_mutex_unlock(&sp->lock);
+        return 1;
+    }
+}
+
+void spool_consume(spool *sp, const spool_record *record)
+{
+    pthread_mutex_lock(&sp->lock);
+    if (sp->read.id == record->segment
+        && frame_get_u32(sp->read.data + SPOOL_READ_OFFSET) == record->offset) {
+        frame_put_u32(sp->read.data + SPOOL_READ_OFFSET, record->next);
+        sp->pending -= sp->pending > 0;
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
+
+size_t spool_pending(spool *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+    size_t pending = sp->pending;
+    pthread_mutex_unlock(&sp->lock);
+    return pending;
+}
+
+void spool_close(spool *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+    msync(sp->write.data, SPOOL_SEGMENT_SIZE, MS_SYNC);
+    unmap_segment(sp, &sp->read);
+    munmap(sp->write.data, SPOOL_SEGMENT_SIZE);
+    pthread_mutex_unlock(&sp->lock);
+    pthread_mutex_destroy(&sp->lock);
+}
+
+static int map_segment(spool *sp, uint32_t id, int create, spool_segment *segment)
+{
+    char path[sizeof(sp->directory) + 16];
+    snprintf(path, sizeof(path), "%s/%08u.spool", sp->directory, id);
+
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd == -1) {
+        perror("Impossible to open the spool segment");
+        return -1;
+    }
+    struct stat st;
+    if ((create && ftruncate(fd, SPOOL_SEGMENT_SIZE) == -1)
+        || fstat(fd, &st) == -1 || st.st_size != SPOOL_SEGMENT_SIZE) {
+        fprintf(stderr, "Invalid spool segment %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // The mapping keeps the file opened
+    uint8_t *data = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    if (create) {
+        frame_put_u32(data, SPOOL_MAGIC);
+        frame_put_u32(data + SPOOL_FLAGS_OFFSET, sp->encrypted ? SPOOL_FLAG_ENCRYPTED : 0);
+        frame_put_u32(data + SPOOL_WRITE_OFFSET, SPOOL_HEADER_SIZE);
+        frame_put_u32(data + SPOOL_READ_OFFSET, SPOOL_HEADER_SIZE);
+    } else if (frame_get_u32(data) != SPOOL_MAGIC
+               || frame_get_u32(data + SPOOL_WRITE_OFFSET) > SPOOL_SEGMENT_SIZE) {
+        fprintf(stderr, "Invalid spool segment %s\n", path);
+        munmap(data, SPOOL_SEGMENT_SIZE);
+        return -1;
+    }
+
+    segment->id = id;
+    segment->data = data;
+    return 0;
+}
+
+static void unmap_segment(spool *sp, spool_segment *segment)
+{
+    if (sp->read.data != sp->write.data) {
+        munmap(segment->data, SPOOL_SEGMENT_SIZE);
+    }
+}
+
+static void next_read_segment(spool *sp)
+{
+    // The segment of the previous run may be missing or damaged
+    if (sp->read.data != sp->write.data) {
+        char path[sizeof(sp->directory) + 16];
+        snprintf(path, sizeof(path), "%s/%08u.spool", sp->directory, sp->read.id);
+        unmap_segment(sp, &sp->read);
+        unlink(path);
+    }
+
+    for (uint32_t id = sp->read.id + 1; id != sp->write.id; ++id) {
+        if (map_segment(sp, id, 0, &sp->read) == 0) {
+            return;
+        }
+    }
+    sp->read = sp->write;
+}
+
+static int next_write_segment(spool *sp)
+{
+    // Bounded disk usage, the oldest messages are lost first
+    if (sp->write.id - sp->read.id + 1 >= SPOOL_MAX_SEGMENTS) {
+        size_t lost = count_records(&sp->read);
+        sp->pending -= lost < sp->pending ? lost : sp->pending;
+        sp->dropped += lost;
+        TRACE("Spool full, %zu messages dropped\n", lost);
+        next_read_segment(sp);
+    }
+
+    spool_segment segment;
+    if (map_segment(sp, sp->write.id + 1, 1, &segment) == -1) {
+        return -1;
+    }
+
+    // Flush the full segment in the background
+    msync(sp->write.data, SPOOL_SEGMENT_SIZE, MS_ASYNC);
+    if (sp->read.data != sp->write.data) {
+        munmap(sp->write.data, SPOOL_SEGMENT_SIZE);
+    }
+    sp->write = segment;
+    return 0;
+}
+
+static size_t count_records(const spool_segment *segment)
+{
+    size_t count = 0;
+    uint32_t offset = frame_get_u32(segment->data + SPOOL_READ_OFFSET);
+    uint32_t end = frame_get_u32(segment->data + SPOOL_WRITE_OFFSET);
+    while (offset < end) {
+        size_t size = record_size(segment, frame_get_u32(segment->data + offset));
+        if (size > end - offset) {
+            break;
+        }
+        offset += (uint32_t)size;
+        count++;
+    }
+    return count;
+}
+
+static size_t record_size(const spool_segment *segment, size_t length)
+{
+    size_t size = SPOOL_RECORD_HEADER_SIZE + length;
+    if (frame_get_u32(segment->data + SPOOL_FLAGS_OFFSET) & SPOOL_FLAG_ENCRYPTED) {
+        size += SPOOL_NONCE_SIZE + SPOOL_TAG_SIZE;
+    }
+    return size;
+}
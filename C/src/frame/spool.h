@@ -0,0 +1,133 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_SPOOL_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * The spool keeps the outgoing messages while no client is connected, in a
+ * directory of memory mapped segments of SPOOL_SEGMENT_SIZE bytes, named after
+ * their sequence number (00000000.spool, 00000001.spool...).
+ * A segment starts with a little-endian header:
+ * - magic          (4 bytes, SPOOL_MAGIC)
+ * - flags          (4 bytes, SPOOL_FLAG_*)
+ * - write offset   (4 bytes, end of the last complete record)
+ * - read offset    (4 bytes, start of the first record not sent yet)
+ * followed by the records, only appended:
+ * - length         (4 bytes, size of the message)
+ * - class          (1 byte, traffic class of the message)
+ * - reserved       (1 byte, 0)
+ * - stream         (2 bytes, stream of the message)
+ * - nonce and tag  (12 + 16 bytes, only in encrypted segments)
+ * - message        (length bytes, encrypted with AES-256-GCM in encrypted segments)
+ * The write offset is updated once the record is complete, a crash loses the
+ * record being written at most. When SPOOL_MAX_SEGMENTS segments are full,
+ * the oldest one is dropped.
+ */
+#define SPOOL_MAGIC 0x4c4f5053
+#define SPOOL_HEADER_SIZE 16
+#define SPOOL_RECORD_HEADER_SIZE 8
+#define SPOOL_NONCE_SIZE 12
+#define SPOOL_TAG_SIZE 16
+#define SPOOL_KEY_SIZE 32
+
+/**
+ * Segment flags
+ */
+#define SPOOL_FLAG_ENCRYPTED 0x01
+
+/**
+ * A mapped segment
+ */
+typedef struct spool_segment {
+    uint32_t id;
+    uint8_t *data;
+} spool_segment;
+
+/**
+ * A record returned by spool_peek, removed by spool_consume
+ */
+typedef struct spool_record {
+    uint8_t cls;
+    uint16_t stream;
+    size_t length;
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t next;
+} spool_record;
+
+/**
+ * Segments of a spool directory.
+ * Appends and reads can be done from different threads.
+ */
+typedef struct spool {
+    char directory[256];
+    int encrypted;
+    uint8_t key[SPOOL_KEY_SIZE];
+    spool_segment read;
+    spool_segment write;
+    size_t pending;
+    unsigned long dropped;
+    pthread_mutex_t lock;
+} spool;
+
+/**
+ * Open a spool directory, creating it if needed, and count the records left
+ * by the previous run
+ * @param sp            The spool
+ * @param directory     The directory of the segments
+ * @param key           The key encrypting the new records, NULL to store them in clear
+ * @return              0 on success, -1 on error
+ */
+int spool_open(spool *sp, const char *directory, const uint8_t *key);
+
+/**
+ * Append a message, dropping the oldest segment if the spool is full
+ * @param sp            The spool
+ * @param cls           The traffic class of the message
+ * @param stream        The stream of the message
+ * @param data          The message
+ * @param length        The size of the message
+ * @return              0 on success, -1 if the message does not fit in a segment or on error
+ */
+int spool_append(spool *sp, uint8_t cls, uint16_t stream, const uint8_t *data, size_t length);
+
+/**
+ * Get the oldest record, it stays in the spool until spool_consume.
+ * Records which cannot be decrypted are dropped.
+ * @param sp            The spool
+ * @param record        The record description
+ * @param buffer        Filled with the message
+ * @param length        The size of the buffer, at least SPOOL_SEGMENT_SIZE
+ * @return              1 if a record was read, 0 if the spool is empty
+ */
+int spool_peek(spool *sp, spool_record *record, uint8_t *buffer, size_t length);
+
+/**
+ * Remove a record returned by spool_peek once sent.
+ * Nothing is done if its segment was dropped in the meantime.
+ * @param sp            The spool
+ * @param record        The record
+ */
+void spool_consume(spool *sp, const spool_record *record);
+
+/**
+ * Get the number of records waiting in the spool
+ * @param sp            The spool
+ * @return              The number of records
+ */
+size_t spool_pending(spool *sp);
+
+/**
+ * Unmap the segments, the records left are kept for the next run
+ * @param sp            The spool
+ */
+void spool_close(spool *sp);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_SPOOL_H
@@ -0,0 +1,135 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+int uring_init(uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    // Map the submission ring, the completion ring and the submission entries
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_free(ring);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Submission entries are always used in order, the indirection array is the identity
+    unsigned int *array = (unsigned int *)(sq + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    return 0;
+}
+
+void uring_free(uring *ring)
+{
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+
+    if (tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring *ring, unsigned int wait_nr)
+{
+    unsigned int submitted = ring->sq_pending;
+
+    // Publish the prepared entries to the kernel
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submitted, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    unsigned int flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (syscall(__NR_io_uring_enter, ring->fd, submitted, wait_nr, flags, NULL, 0) == -1) {
+        return -1;
+    }
+    return (int)submitted;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_rw(struct io_uring_sqe *sqe, int opcode, int fd, void *buffer, size_t length, uint64_t user_data)
+{
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->user_data = user_data;
+}
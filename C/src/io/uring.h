@@ -0,0 +1,97 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_URING_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/**
+ * Minimal io_uring wrapper over the raw system calls: one submission queue,
+ * one completion queue, no SQ polling.
+ */
+typedef struct uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_pending;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+/**
+ * Create a ring
+ * @param ring      The ring to initialize
+ * @param entries   The number of submission entries
+ * @return          0 on success, -1 on error (errno is set)
+ */
+int uring_init(uring *ring, unsigned int entries);
+
+/**
+ * Destroy a ring
+ * @param ring      The ring
+ */
+void uring_free(uring *ring);
+
+/**
+ * Get a free submission entry, cleared
+ * @param ring      The ring
+ * @return          The entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+
+/**
+ * Submit the prepared entries and wait for completions, in one system call
+ * @param ring      The ring
+ * @param wait_nr   The number of completions to wait for
+ * @return          The number of entries submitted, -1 on error (errno is set)
+ */
+int uring_submit_and_wait(uring *ring, unsigned int wait_nr);
+
+/**
+ * Get the next completion without waiting
+ * @param ring      The ring
+ * @return          The completion, NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring *ring);
+
+/**
+ * Release the completion returned by uring_peek_cqe
+ * @param ring      The ring
+ */
+void uring_cqe_seen(uring *ring);
+
+/**
+ * Prepare an accept
+ * @param sqe       The submission entry
+ * @param fd        The listening socket
+ * @param user_data The value given back in the completion
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+/**
+ * Prepare a read, a recv or a send
+ * @param sqe       The submission entry
+ * @param opcode    IORING_OP_READ, IORING_OP_RECV or IORING_OP_SEND
+ * @param fd        The file descriptor
+ * @param buffer    The buffer to read to or write from
+ * @param length    The size of the buffer
+ * @param user_data The value given back in the completion
+ */
+void uring_prep_rw(struct io_uring_sqe *sqe, int opcode, int fd, void *buffer, size_t length, uint64_t user_data);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_URING_H
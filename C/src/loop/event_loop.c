@@ -0,0 +1,213 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+#include "../conf.c"
+
+#define MAX_EVENTS 64
+
+/**
+ * Arm the timerfd on the next expiration of the wheel, the lock must be held
+ * @param loop      The loop
+ */
+static void rearm_timer_fd(event_loop *loop);
+
+/**
+ * Thread function running a loop
+ * @param arg       The loop
+ * @return
+ */
+static void *thread_loop_fct(void *arg);
+
+
+uint64_t event_loop_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int event_loop_init(event_loop *loop)
+{
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd == -1 || loop->timer_fd == -1 || loop->wake_fd == -1) {
+        perror("Impossible to create the event loop");
+        return -1;
+    }
+
+    // The timerfd and the wake-up eventfd are recognized by their data
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.ptr = &loop->timer_fd;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event);
+    event.data.ptr = &loop->wake_fd;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event);
+
+    // Callbacks may re-arm timers while the wheel is turning
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&loop->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    timer_wheel_init(&loop->wheel, event_loop_now_ms() / TIMER_TICK_MS);
+    loop->running = 1;
+    loop->threaded = 0;
+    return 0;
+}
+
+void event_loop_start(event_loop *loop)
+{
+    loop->threaded = 1;
+    if (pthread_create(&loop->thread, NULL, thread_loop_fct, loop) != 0) {
+        fprintf(stderr, "erreur pthread_create thread_loop\n");
+        exit(-1);
+    }
+}
+
+void event_loop_run(event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (loop->running) {
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            void *data = events[i].data.ptr;
+            uint64_t value;
+
+            // Timers: turn the wheel up to now
+            if (data == &loop->timer_fd) {
+                if (read(loop->timer_fd, &value, sizeof(value)) != sizeof(value)) {
+                    continue;
+                }
+                pthread_mutex_lock(&loop->lock);
+                timer_wheel_advance(&loop->wheel, event_loop_now_ms() / TIMER_TICK_MS);
+                rearm_timer_fd(loop);
+                pthread_mutex_unlock(&loop->lock);
+            }
+            // Wake-up: only used to check the running flag
+            else if (data == &loop->wake_fd) {
+                if (read(loop->wake_fd, &value, sizeof(value)) != sizeof(value)) {
+                    continue;
+                }
+            }
+            // File descriptor watched by a module
+            else {
+                event_handler *handler = data;
+                handler->callback(handler->fd, events[i].events, handler->arg);
+            }
+        }
+    }
+}
+
+void event_loop_stop(event_loop *loop)
+{
+    loop->running = 0;
+
+    uint64_t value = 1;
+    if (write(loop->wake_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("event_loop_stop");
+    }
+
+    if (loop->threaded) {
+        pthread_join(loop->thread, NULL);
+        loop->threaded = 0;
+    }
+}
+
+void event_loop_free(event_loop *loop)
+{
+    close(loop->epoll_fd);
+    close(loop->timer_fd);
+    close(loop->wake_fd);
+    pthread_mutex_destroy(&loop->lock);
+}
+
+int event_loop_add_fd(event_loop *loop, event_handler *handler, uint32_t events)
+{
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_mod_fd(event_loop *loop, event_handler *handler, uint32_t events)
+{
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_del_fd(event_loop *loop, event_handler *handler)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+void event_loop_timer_add(event_loop *loop, wheel_timer *timer, uint64_t delay_ms, timer_callback callback, void *arg)
+{
+    pthread_mutex_lock(&loop->lock);
+
+    // The wheel may be late when the loop is busy, count the delay from now
+    uint64_t now = event_loop_now_ms() / TIMER_TICK_MS;
+    uint64_t delay = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (now > loop->wheel.now) {
+        delay += now - loop->wheel.now;
+    }
+
+    timer_wheel_add(&loop->wheel, timer, delay, callback, arg);
+    rearm_timer_fd(loop);
+
+    pthread_mutex_unlock(&loop->lock);
+}
+
+void event_loop_timer_cancel(event_loop *loop, wheel_timer *timer)
+{
+    pthread_mutex_lock(&loop->lock);
+    timer_wheel_cancel(&loop->wheel, timer);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+static void rearm_timer_fd(event_loop *loop)
+{
+    struct itimerspec spec = {0};
+    uint64_t next = timer_wheel_next(&loop->wheel);
+
+    // Wake up at the absolute date of the next tick to process, or never
+    if (next != UINT64_MAX) {
+        uint64_t deadline = (loop->wheel.now + next) * TIMER_TICK_MS;
+        spec.it_value.tv_sec = (time_t)(deadline / 1000);
+        spec.it_value.tv_nsec = (long)(deadline % 1000) * 1000000;
+    }
+
+    timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void *thread_loop_fct(void *arg)
+{
+    event_loop_run(arg);
+    return NULL;
+}
@@ -0,0 +1,128 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_EVENT_LOOP_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_EVENT_LOOP_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../timer/timer_wheel.h"
+
+/**
+ * Function called when a file descriptor is ready
+ * @param fd        The file descriptor
+ * @param events    The epoll events which occurred
+ * @param arg       The argument given when the descriptor was added
+ */
+typedef void (*event_callback)(int fd, uint32_t events, void *arg);
+
+/**
+ * A file descriptor watched by a loop. The structure is owned by the caller
+ * and must stay valid until the descriptor is removed from the loop.
+ */
+typedef struct event_handler {
+    int fd;
+    event_callback callback;
+    void *arg;
+} event_handler;
+
+/**
+ * An epoll based event loop. Timers are kept in a timing wheel and a timerfd
+ * is armed on the next expiration, so an idle loop does not wake up.
+ */
+typedef struct event_loop {
+    int epoll_fd;
+    int timer_fd;
+    int wake_fd;
+    timer_wheel wheel;
+    pthread_mutex_t lock;
+    atomic_int running;
+    int threaded;
+    pthread_t thread;
+} event_loop;
+
+/**
+ * Get the time of the monotonic clock
+ * @return  The time in milliseconds
+ */
+uint64_t event_loop_now_ms();
+
+/**
+ * Initialize an event loop
+ * @param loop      The loop to initialize
+ * @return          0 on success, -1 on error
+ */
+int event_loop_init(event_loop *loop);
+
+/**
+ * Run the loop in a new thread
+ * @param loop      The loop to run
+ */
+void event_loop_start(event_loop *loop);
+
+/**
+ * Run the loop in the calling thread until event_loop_stop is called
+ * @param loop      The loop to run
+ */
+void event_loop_run(event_loop *loop);
+
+/**
+ * Stop a loop and wait for its thread if it was started with event_loop_start
+ * @param loop      The loop to stop
+ */
+void event_loop_stop(event_loop *loop);
+
+/**
+ * Free the resources of a stopped loop
+ * @param loop      The loop to free
+ */
+void event_loop_free(event_loop *loop);
+
+/**
+ * Watch a file descriptor
+ * @param loop      The loop
+ * @param handler   The descriptor and its callback
+ * @param events    The epoll events to watch
+ * @return          0 on success, -1 on error
+ */
+int event_loop_add_fd(event_loop *loop, event_handler *handler, uint32_t events);
+
+/**
+ * Change the events watched on a file descriptor
+ * @param loop      The loop
+ * @param handler   The handler given to event_loop_add_fd
+ * @param events    The epoll events to watch
+ * @return          0 on success, -1 on error
+ */
+int event_loop_mod_fd(event_loop *loop, event_handler *handler, uint32_t events);
+
+/**
+ * Stop watching a file descriptor
+ * @param loop      The loop
+ * @param handler   The handler given to event_loop_add_fd
+ */
+void event_loop_del_fd(event_loop *loop, event_handler *handler);
+
+/**
+ * Arm a timer on the loop, re-arming it if it is already pending.
+ * Can be called from any thread, the callback runs in the loop thread.
+ * @param loop      The loop
+ * @param timer     The timer to arm
+ * @param delay_ms  The delay before expiration in milliseconds
+ * @param callback  The function called on expiration
+ * @param arg       The argument given to the callback
+ */
+void event_loop_timer_add(event_loop *loop, wheel_timer *timer, uint64_t delay_ms, timer_callback callback, void *arg);
+
+/**
+ * Disarm a timer. When it returns, the callback of the timer is not running
+ * unless it is called from the callback itself.
+ * @param loop      The loop
+ * @param timer     The timer to disarm
+ */
+void event_loop_timer_cancel(event_loop *loop, wheel_timer *timer);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_EVENT_LOOP_H
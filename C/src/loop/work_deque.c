@@ -0,0 +1,86 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdlib.h>
+
+#include "work_deque.h"
+
+
+int work_deque_init(work_deque *deque, size_t capacity)
+{
+    deque->items = calloc(capacity, sizeof(*deque->items));
+    if (deque->items == NULL) {
+        return -1;
+    }
+
+    deque->mask = capacity - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+void work_deque_free(work_deque *deque)
+{
+    free(deque->items);
+    deque->items = NULL;
+}
+
+int work_deque_push(work_deque *deque, void *job)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top > (int64_t)deque->mask) {
+        return -1;
+    }
+
+    // The job must be visible before the thieves see the new bottom
+    atomic_store_explicit(&deque->items[bottom & deque->mask], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+void *work_deque_pop(work_deque *deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    // Empty
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *job = atomic_load_explicit(&deque->items[bottom & deque->mask], memory_order_relaxed);
+
+    // Last job: race with the thieves for it
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            job = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+void *work_deque_steal(work_deque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    void *job = atomic_load_explicit(&deque->items[top & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return job;
+}
@@ -0,0 +1,60 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_WORK_DEQUE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_WORK_DEQUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounded work-stealing deque (Chase-Lev). The owner thread pushes and pops
+ * jobs at the bottom, the other threads steal the oldest jobs at the top.
+ * No lock is taken.
+ */
+typedef struct work_deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    size_t mask;
+    _Atomic(void *) *items;
+} work_deque;
+
+/**
+ * Initialize an empty deque
+ * @param deque     The deque
+ * @param capacity  The maximum number of jobs, a power of two
+ * @return          0 on success, -1 on error
+ */
+int work_deque_init(work_deque *deque, size_t capacity);
+
+/**
+ * Free a deque, the jobs left in it are not freed
+ * @param deque     The deque
+ */
+void work_deque_free(work_deque *deque);
+
+/**
+ * Add a job at the bottom, only called by the owner
+ * @param deque     The deque
+ * @param job       The job
+ * @return          0 on success, -1 if the deque is full
+ */
+int work_deque_push(work_deque *deque, void *job);
+
+/**
+ * Take the newest job, only called by the owner
+ * @param deque     The deque
+ * @return          The job, NULL if the deque is empty
+ */
+void *work_deque_pop(work_deque *deque);
+
+/**
+ * Take the oldest job, called by any thread
+ * @param deque     The deque
+ * @return          The job, NULL if the deque is empty or another thread took it first
+ */
+void *work_deque_steal(work_deque *deque);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_WORK_DEQUE_H
@@ -3,12 +3,26 @@
 //
 
 #include "example_code/example_code.h"
+#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
 int main (int argc, char *argv[])
 {
+    // Writing on a socket closed by the client must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Block the stop signals in every thread, they are awaited below
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
     launch();
-    pause();
+
+    int sig;
+    sigwait(&stop_signals, &sig);
+    stop();
     fflush(stdout);
-}
\ No newline at end of file
+}
@@ -0,0 +1,204 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+/**
+ * Insert a timer in the slot matching its expiration tick
+ * @param wheel     The wheel to insert the timer in
+ * @param timer     The timer to insert, its expires field must be set
+ */
+static void insert_timer(timer_wheel *wheel, wheel_timer *timer);
+
+/**
+ * Remove a timer from the list it is linked in
+ * @param timer     The timer to remove
+ */
+static void unlink_timer(wheel_timer *timer);
+
+/**
+ * Move the timers of an upper level slot to the lower levels
+ * @param wheel     The wheel to cascade
+ * @param level     The level of the slot
+ * @param index     The index of the slot
+ */
+static void cascade(timer_wheel *wheel, int level, unsigned int index);
+
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+
+    // Each slot is an empty circular list
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+void timer_wheel_add(timer_wheel *wheel, wheel_timer *timer, uint64_t delay, timer_callback callback, void *arg)
+{
+    // Re-arming a pending timer moves it
+    timer_wheel_cancel(wheel, timer);
+
+    // A timer can not expire during the current tick, which is already processed
+    if (delay == 0) {
+        delay = 1;
+    }
+
+    // Delays beyond the range of the wheel are truncated
+    uint64_t max_delay = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (delay > max_delay) {
+        delay = max_delay;
+    }
+
+    timer->expires = wheel->now + delay;
+    timer->callback = callback;
+    timer->arg = arg;
+
+    insert_timer(wheel, timer);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(timer_wheel *wheel, wheel_timer *timer)
+{
+    if (!timer_wheel_pending(timer)) {
+        return;
+    }
+
+    unlink_timer(timer);
+    wheel->count--;
+}
+
+int timer_wheel_pending(const wheel_timer *timer)
+{
+    return timer->next != NULL;
+}
+
+uint64_t timer_wheel_next(const timer_wheel *wheel)
+{
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+
+    // Level 0 holds the timers of the next TIMER_WHEEL_SLOTS ticks, one slot per tick
+    uint64_t next = UINT64_MAX;
+    for (uint64_t delta = 1; delta <= TIMER_WHEEL_SLOTS; ++delta) {
+        const wheel_timer *slot = &wheel->slots[0][(wheel->now + delta) & TIMER_WHEEL_MASK];
+        if (slot->next != slot) {
+            next = delta;
+            break;
+        }
+    }
+
+    // Upper levels: find the first boundary where a non-empty slot is cascaded
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        unsigned int shift = TIMER_WHEEL_BITS * level;
+        for (uint64_t step = 1; step <= TIMER_WHEEL_SLOTS; ++step) {
+            uint64_t boundary = ((wheel->now >> shift) + step) << shift;
+            if (boundary - wheel->now >= next) {
+                break;
+            }
+
+            const wheel_timer *slot = &wheel->slots[level][(boundary >> shift) & TIMER_WHEEL_MASK];
+            if (slot->next != slot) {
+                next = boundary - wheel->now;
+                break;
+            }
+        }
+    }
+
+    return next;
+}
+
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+
+        // Skip the ticks with nothing to fire nor cascade
+        uint64_t next = timer_wheel_next(wheel);
+        if (next > now - wheel->now) {
+            wheel->now = now;
+            return;
+        }
+
+        wheel->now += next;
+
+        // Cascade the upper levels each time a lower level wraps
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            uint64_t shift = (uint64_t)TIMER_WHEEL_BITS * level;
+            if ((wheel->now & (((uint64_t)1 << shift) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level, (wheel->now >> shift) & TIMER_WHEEL_MASK);
+        }
+
+        // Detach the expired timers so callbacks can safely re-arm them
+        wheel_timer *slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        if (slot->next == slot) {
+            continue;
+        }
+
+        wheel_timer expired;
+        expired.next = slot->next;
+        expired.prev = slot->prev;
+        expired.next->prev = &expired;
+        expired.prev->next = &expired;
+        slot->next = slot;
+        slot->prev = slot;
+
+        // Fire the expired timers
+        while (expired.next != &expired) {
+            wheel_timer *timer = expired.next;
+            unlink_timer(timer);
+            wheel->count--;
+            timer->callback(timer->arg);
+        }
+    }
+}
+
+static void insert_timer(timer_wheel *wheel, wheel_timer *timer)
+{
+    uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+
+    // Find the first level whose range covers the delay
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    // Timers already expired go in the current slot
+    uint64_t expires = delta == 0 ? wheel->now : timer->expires;
+    wheel_timer *slot = &wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+    // Append the timer at the end of the slot list
+    timer->next = slot;
+    timer->prev = slot->prev;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+
+static void unlink_timer(wheel_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void cascade(timer_wheel *wheel, int level, unsigned int index)
+{
+    wheel_timer *slot = &wheel->slots[level][index];
+
+    while (slot->next != slot) {
+        wheel_timer *timer = slot->next;
+        unlink_timer(timer);
+        insert_timer(wheel, timer);
+    }
+}
@@ -0,0 +1,92 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_TIMER_WHEEL_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * Function called when a timer expires
+ * @param arg   The argument given when the timer was armed
+ */
+typedef void (*timer_callback)(void *arg);
+
+/**
+ * A timer stored in the wheel. The structure is owned by the caller (usually
+ * embedded in the object it watches), the wheel only links it in its slots.
+ * It must be zeroed before its first use.
+ */
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires;
+    timer_callback callback;
+    void *arg;
+} wheel_timer;
+
+/**
+ * Hierarchical timing wheel: TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+ * slots. Adding and cancelling a timer are O(1), timers of the upper levels
+ * are cascaded to the lower ones when the wheel turns.
+ */
+typedef struct timer_wheel {
+    uint64_t now;
+    unsigned int count;
+    wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * Initialize an empty wheel
+ * @param wheel     The wheel to initialize
+ * @param now       The current tick
+ */
+void timer_wheel_init(timer_wheel *wheel, uint64_t now);
+
+/**
+ * Arm a timer, re-arming it if it is already pending
+ * @param wheel     The wheel to insert the timer in
+ * @param timer     The timer to arm
+ * @param delay     The number of ticks before expiration (at least 1)
+ * @param callback  The function called on expiration
+ * @param arg       The argument given to the callback
+ */
+void timer_wheel_add(timer_wheel *wheel, wheel_timer *timer, uint64_t delay, timer_callback callback, void *arg);
+
+/**
+ * Disarm a timer, does nothing if the timer is not pending
+ * @param wheel     The wheel the timer was inserted in
+ * @param timer     The timer to disarm
+ */
+void timer_wheel_cancel(timer_wheel *wheel, wheel_timer *timer);
+
+/**
+ * Check if a timer is waiting in a wheel
+ * @param timer     The timer to check
+ * @return          1 if the timer is pending, 0 otherwise
+ */
+int timer_wheel_pending(const wheel_timer *timer);
+
+/**
+ * Get the number of ticks before the wheel has something to do: fire a timer
+ * or cascade a non-empty slot
+ * @param wheel     The wheel
+ * @return          The number of ticks, UINT64_MAX if the wheel is empty
+ */
+uint64_t timer_wheel_next(const timer_wheel *wheel);
+
+/**
+ * Turn the wheel up to a tick and call the callbacks of the expired timers.
+ * A callback may re-arm or cancel any timer of the wheel.
+ * @param wheel     The wheel to turn
+ * @param now       The current tick
+ */
+void timer_wheel_advance(timer_wheel *wheel, uint64_t now);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_TIMER_WHEEL_H
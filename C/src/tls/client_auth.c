@@ -0,0 +1,187 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "openssl/err.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
+
+#include "client_auth.h"
+#include "tls_context.h"
+#include "../conf.c"
+#include "../connexion/heartbeat.h"
+#include "../trace/trace.h"
+
+/**
+ * A certificate whose chain was verified
+ */
+typedef struct verified_certificate {
+    uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+    int used;
+    uint64_t expiry_us;
+} verified_certificate;
+
+static verified_certificate cache[VERIFY_CACHE_SIZE];
+static client_authorizer authorizer;
+static void *authorizer_arg;
+static client_auth_stats counters;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Verification callback of the context, replacing the chain verification of OpenSSL
+ * @param store     The certificate of the client and its chain
+ * @param arg
+ * @return          1 if the client is accepted, 0 otherwise
+ */
+static int verify_client(X509_STORE_CTX *store, void *arg);
+
+/**
+ * Look for a verified certificate, the lock must be held
+ * @param fingerprint   The SHA-256 fingerprint of the certificate
+ * @param now_us        The current time
+ * @return              1 if the certificate was verified recently, 0 otherwise
+ */
+static int cache_lookup(const uint8_t *fingerprint, uint64_t now_us);
+
+/**
+ * Remember a verified certificate, replacing the one expiring first, the lock must be held
+ * @param fingerprint   The SHA-256 fingerprint of the certificate
+ * @param now_us        The current time
+ */
+static void cache_insert(const uint8_t *fingerprint, uint64_t now_us);
+
+
+int client_auth_init(SSL_CTX *context, const char *ca_filepath)
+{
+    TRACE("Loading client CA %s\n", ca_filepath);
+    if (SSL_CTX_load_verify_locations(context, ca_filepath, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    // The CA names are sent to the client to pick its certificate
+    STACK_OF(X509_NAME) *names = SSL_load_client_CA_file(ca_filepath);
+    if (names != NULL) {
+        SSL_CTX_set_client_CA_list(context, names);
+    }
+
+    // The sessions remember the verified certificate, they are resumed within the same context only
+    SSL_CTX_set_session_id_context(context, (const unsigned char *)TLS_SESSION_ID_CONTEXT,
+                                   sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    SSL_CTX_set_cert_verify_callback(context, verify_client, NULL);
+    return 0;
+}
+
+void client_auth_share(SSL_CTX *from, SSL_CTX *to)
+{
+    if (SSL_CTX_get_verify_mode(from) == SSL_VERIFY_NONE) {
+        return;
+    }
+
+    // The store is only read by the handshakes
+    X509_STORE *store = SSL_CTX_get_cert_store(from);
+    if (X509_STORE_up_ref(store)) {
+        SSL_CTX_set_cert_store(to, store);
+    }
+    STACK_OF(X509_NAME) *names = SSL_dup_CA_list(SSL_CTX_get_client_CA_list(from));
+    if (names != NULL) {
+        SSL_CTX_set_client_CA_list(to, names);
+    }
+
+    SSL_CTX_set_verify(to, SSL_CTX_get_verify_mode(from), NULL);
+    SSL_CTX_set_cert_verify_callback(to, verify_client, NULL);
+}
+
+void client_auth_set_authorizer(client_authorizer authorize, void *arg)
+{
+    pthread_mutex_lock(&cache_lock);
+    authorizer = authorize;
+    authorizer_arg = arg;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void client_auth_get_stats(client_auth_stats *stats)
+{
+    pthread_mutex_lock(&cache_lock);
+    *stats = counters;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int verify_client(X509_STORE_CTX *store, void *arg)
+{
+    (void)arg;
+
+    X509 *cert = X509_STORE_CTX_get0_cert(store);
+    uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+    unsigned int length;
+    if (cert == NULL || X509_digest(cert, EVP_sha256(), fingerprint, &length) != 1) {
+        return X509_verify_cert(store) == 1;
+    }
+
+    uint64_t now_us = heartbeat_now_us();
+    pthread_mutex_lock(&cache_lock);
+    int cached = cache_lookup(fingerprint, now_us);
+    pthread_mutex_unlock(&cache_lock);
+
+    // A certificate verified earlier may have expired since
+    int valid;
+    if (cached && X509_cmp_current_time(X509_get0_notAfter(cert)) > 0) {
+        valid = 1;
+    } else {
+        valid = X509_verify_cert(store) == 1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (!valid) {
+        counters.rejected++;
+    } else if (cached) {
+        counters.cache_hits++;
+    } else {
+        counters.verified++;
+        cache_insert(fingerprint, now_us);
+    }
+    client_authorizer authorize = authorizer;
+    void *authorize_arg = authorizer_arg;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (valid && authorize != NULL && !authorize(cert, authorize_arg)) {
+        X509_STORE_CTX_set_error(store, X509_V_ERR_APPLICATION_VERIFICATION);
+        pthread_mutex_lock(&cache_lock);
+        counters.rejected++;
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    return valid;
+}
+
+static int cache_lookup(const uint8_t *fingerprint, uint64_t now_us)
+{
+    for (int i = 0; i < VERIFY_CACHE_SIZE; ++i) {
+        if (cache[i].used && cache[i].expiry_us > now_us
+            && memcmp(cache[i].fingerprint, fingerprint, SHA256_DIGEST_LENGTH) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void cache_insert(const uint8_t *fingerprint, uint64_t now_us)
+{
+    verified_certificate *entry = &cache[0];
+    for (int i = 0; i < VERIFY_CACHE_SIZE; ++i) {
+        if (!cache[i].used || cache[i].expiry_us < entry->expiry_us) {
+            entry = &cache[i];
+            if (!entry->used) {
+                break;
+            }
+        }
+    }
+
+    memcpy(entry->fingerprint, fingerprint, SHA256_DIGEST_LENGTH);
+    entry->used = 1;
+    entry->expiry_us = now_us + (uint64_t)VERIFY_CACHE_TTL_S * 1000000;
+}
@@ -0,0 +1,67 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_AUTH_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_AUTH_H
+
+#include "openssl/ssl.h"
+
+/**
+ * Authentication of the clients by certificate (mutual TLS).
+ * Building and checking the chain of a certificate up to the CA is the most
+ * expensive step of the handshake: the certificates which passed it are
+ * remembered by their SHA-256 fingerprint for VERIFY_CACHE_TTL_S seconds, a
+ * client reconnecting with the same certificate skips it. Failures are not
+ * remembered, a client rejected because the clock was not set yet can retry.
+ * The authorization callback is called on every handshake.
+ */
+
+/**
+ * Decide whether a verified client may connect
+ * @param cert      The certificate of the client, its chain is valid
+ * @param arg       The argument given with the callback
+ * @return          1 to accept the client, 0 to reject it
+ */
+typedef int (*client_authorizer)(X509 *cert, void *arg);
+
+/**
+ * Counters of the client authentication
+ */
+typedef struct client_auth_stats {
+    unsigned long verified;
+    unsigned long cache_hits;
+    unsigned long rejected;
+} client_auth_stats;
+
+/**
+ * Require a certificate signed by a CA from the clients of a context
+ * @param context       The SSL context
+ * @param ca_filepath   The PEM file of the trusted CA certificates
+ * @return              0 on success, -1 on error
+ */
+int client_auth_init(SSL_CTX *context, const char *ca_filepath);
+
+/**
+ * Apply the client authentication of a context to another one, sharing its
+ * CA and its cache of verified certificates. Nothing is done if the first
+ * context does not authenticate its clients.
+ * @param from          The context set up with client_auth_init
+ * @param to            The context authenticating the same clients
+ */
+void client_auth_share(SSL_CTX *from, SSL_CTX *to);
+
+/**
+ * Set the callback deciding which verified clients may connect, all of them by default
+ * @param authorize     The callback, NULL to accept every verified client
+ * @param arg           The argument given to the callback
+ */
+void client_auth_set_authorizer(client_authorizer authorize, void *arg);
+
+/**
+ * Read the counters of the client authentication
+ * @param stats         The counters to fill
+ */
+void client_auth_get_stats(client_auth_stats *stats);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_CLIENT_AUTH_H
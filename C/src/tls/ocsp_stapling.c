@@ -0,0 +1,318 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "openssl/err.h"
+#include "openssl/http.h"
+#include "openssl/ocsp.h"
+
+#include "ocsp_stapling.h"
+#include "../conf.c"
+#include "../trace/trace.h"
+
+static char source[256];
+static X509 *issuer;
+static OCSP_CERTID *cert_id;
+static uint8_t *response;
+static int response_length;
+static time_t response_expiry;
+static int running;
+static pthread_t thread_refresh;
+static pthread_mutex_t response_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Status callback of the context, stapling the cached response
+ * @param ssl       The SSL object of the handshake
+ * @param arg
+ * @return          SSL_TLSEXT_ERR_OK if a response is stapled, SSL_TLSEXT_ERR_NOACK otherwise
+ */
+static int staple_response(SSL *ssl, void *arg);
+
+/**
+ * Thread function refreshing the cached response
+ * @param arg
+ * @return
+ */
+static void *thread_refresh_fct(void *arg);
+
+/**
+ * Fetch the response from the source and cache it if it is valid
+ * @param expiry    Filled with the end of validity of the response
+ * @return          0 on success, -1 on error
+ */
+static int refresh_response(time_t *expiry);
+
+/**
+ * Send an OCSP request for the certificate to a responder
+ * @param url       The URL of the responder
+ * @return          The response, NULL on error
+ */
+static OCSP_RESPONSE *query_responder(const char *url);
+
+/**
+ * Check that a response is signed by the issuer and still valid for the certificate
+ * @param resp      The response
+ * @param expiry    Filled with the end of validity of the response
+ * @return          0 if the response can be stapled, -1 otherwise
+ */
+static int check_response(OCSP_RESPONSE *resp, time_t *expiry);
+
+
+int ocsp_stapling_start(SSL_CTX *context, const char *ocsp_source)
+{
+    X509 *cert = SSL_CTX_get0_certificate(context);
+    if (cert == NULL) {
+        fprintf(stderr, "No certificate to staple\n");
+        return -1;
+    }
+
+    // The response is identified by the certificate and the key of its issuer
+    STACK_OF(X509) *chain = NULL;
+    SSL_CTX_get0_chain_certs(context, &chain);
+    for (int i = 0; i < sk_X509_num(chain) && issuer == NULL; ++i) {
+        if (X509_check_issued(sk_X509_value(chain, i), cert) == X509_V_OK) {
+            issuer = sk_X509_value(chain, i);
+        }
+    }
+    if (issuer == NULL && X509_check_issued(cert, cert) == X509_V_OK) {
+        issuer = cert;
+    }
+    if (issuer == NULL) {
+        fprintf(stderr, "Issuer of the certificate not found, OCSP stapling disabled\n");
+        return -1;
+    }
+    X509_up_ref(issuer);
+
+    cert_id = OCSP_cert_to_id(NULL, cert, issuer);
+    if (cert_id == NULL) {
+        ERR_print_errors_fp(stderr);
+        X509_free(issuer);
+        issuer = NULL;
+        return -1;
+    }
+
+    snprintf(source, sizeof(source), "%s", ocsp_source);
+    SSL_CTX_set_tlsext_status_cb(context, staple_response);
+
+    // The first response is fetched in the background too, the first clients may get none
+    running = 1;
+    if (pthread_create(&thread_refresh, NULL, thread_refresh_fct, NULL) != 0) {
+        perror("pthread_create");
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void ocsp_stapling_stop()
+{
+    pthread_mutex_lock(&response_lock);
+    int started = running;
+    running = 0;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&response_lock);
+
+    if (!started) {
+        return;
+    }
+    pthread_join(thread_refresh, NULL);
+
+    OPENSSL_free(response);
+    response = NULL;
+    OCSP_CERTID_free(cert_id);
+    X509_free(issuer);
+    issuer = NULL;
+}
+
+static int staple_response(SSL *ssl, void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&response_lock);
+    if (response == NULL || time(NULL) >= response_expiry) {
+        pthread_mutex_unlock(&response_lock);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    uint8_t *copy = OPENSSL_memdup(response, response_length);
+    int length = response_length;
+    pthread_mutex_unlock(&response_lock);
+
+    // The SSL object frees its copy
+    if (copy == NULL || SSL_set_tlsext_status_ocsp_resp(ssl, copy, length) != 1) {
+        OPENSSL_free(copy);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void *thread_refresh_fct(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&response_lock);
+    while (running) {
+        pthread_mutex_unlock(&response_lock);
+
+        // Refresh halfway to the expiry of the response, a failure is retried sooner
+        time_t expiry;
+        long delay = OCSP_RETRY_S;
+        if (refresh_response(&expiry) == 0) {
+            delay = (expiry - time(NULL)) / 2;
+            delay = delay > OCSP_REFRESH_S ? OCSP_REFRESH_S : delay;
+            delay = delay < OCSP_RETRY_S ? OCSP_RETRY_S : delay;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += delay;
+
+        pthread_mutex_lock(&response_lock);
+        if (running) {
+            pthread_cond_timedwait(&refresh_cond, &response_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&response_lock);
+    return NULL;
+}
+
+static int refresh_response(time_t *expiry)
+{
+    OCSP_RESPONSE *resp = NULL;
+    if (strncmp(source, "http://", 7) == 0 || strncmp(source, "https://", 8) == 0) {
+        resp = query_responder(source);
+    } else {
+        BIO *file = BIO_new_file(source, "rb");
+        if (file != NULL) {
+            resp = d2i_OCSP_RESPONSE_bio(file, NULL);
+            BIO_free(file);
+        }
+    }
+    if (resp == NULL) {
+        fprintf(stderr, "No OCSP response from %s\n", source);
+        ERR_clear_error();
+        return -1;
+    }
+
+    if (check_response(resp, expiry) == -1) {
+        OCSP_RESPONSE_free(resp);
+        ERR_clear_error();
+        return -1;
+    }
+
+    // The handshakes only see the DER encoding
+    uint8_t *der = NULL;
+    int length = i2d_OCSP_RESPONSE(resp, &der);
+    OCSP_RESPONSE_free(resp);
+    if (length <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&response_lock);
+    OPENSSL_free(response);
+    response = der;
+    response_length = length;
+    response_expiry = *expiry;
+    pthread_mutex_unlock(&response_lock);
+
+    TRACE("OCSP response refreshed, valid for %ld s\n", (long)(*expiry - time(NULL)));
+    return 0;
+}
+
+static OCSP_RESPONSE *query_responder(const char *url)
+{
+    char *host = NULL;
+    char *port = NULL;
+    char *path = NULL;
+    int use_ssl = 0;
+    if (OSSL_HTTP_parse_url(url, &use_ssl, NULL, &host, &port, NULL, &path, NULL, NULL) != 1) {
+        return NULL;
+    }
+
+    // No nonce, the same response is sent to every client
+    OCSP_REQUEST *req = OCSP_REQUEST_new();
+    BIO *request = BIO_new(BIO_s_mem());
+    OCSP_RESPONSE *resp = NULL;
+    if (req != NULL && request != NULL && OCSP_request_add0_id(req, OCSP_CERTID_dup(cert_id)) != NULL
+        && i2d_OCSP_REQUEST_bio(request, req) == 1) {
+        BIO *answer = OSSL_HTTP_transfer(NULL, host, port, path, use_ssl, NULL, NULL, NULL, NULL, NULL, NULL,
+                                         0, NULL, "application/ocsp-request", request,
+                                         "application/ocsp-response", 1, OCSP_MAX_RESPONSE_SIZE,
+                                         OCSP_TIMEOUT_S, 0);
+        if (answer != NULL) {
+            resp = d2i_OCSP_RESPONSE_bio(answer, NULL);
+            BIO_free(answer);
+        }
+    }
+
+    BIO_free(request);
+    OCSP_REQUEST_free(req);
+    OPENSSL_free(host);
+    OPENSSL_free(port);
+    OPENSSL_free(path);
+    return resp;
+}
+
+static int check_response(OCSP_RESPONSE *resp, time_t *expiry)
+{
+    if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+        fprintf(stderr, "OCSP responder error: %s\n",
+                OCSP_response_status_str(OCSP_response_status(resp)));
+        return -1;
+    }
+
+    OCSP_BASICRESP *basic = OCSP_response_get1_basic(resp);
+    STACK_OF(X509) *signers = sk_X509_new_null();
+    X509_STORE *store = X509_STORE_new();
+    int result = basic != NULL && signers != NULL && store != NULL ? 0 : -1;
+
+    // Signed by the issuer itself, or by a responder it delegated
+    if (result == 0) {
+        sk_X509_push(signers, issuer);
+        X509_STORE_add_cert(store, issuer);
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+        if (OCSP_basic_verify(basic, signers, store, OCSP_TRUSTOTHER) <= 0) {
+            fprintf(stderr, "Invalid OCSP response signature\n");
+            result = -1;
+        }
+    }
+
+    int status;
+    int reason;
+    ASN1_GENERALIZEDTIME *revoked;
+    ASN1_GENERALIZEDTIME *this_update;
+    ASN1_GENERALIZEDTIME *next_update;
+    if (result == 0
+        && OCSP_resp_find_status(basic, cert_id, &status, &reason, &revoked, &this_update, &next_update) != 1) {
+        fprintf(stderr, "OCSP response for another certificate\n");
+        result = -1;
+    }
+    if (result == 0 && OCSP_check_validity(this_update, next_update, OCSP_MAX_SKEW_S, -1) != 1) {
+        fprintf(stderr, "Outdated OCSP response\n");
+        result = -1;
+    }
+
+    if (result == 0) {
+        // A response without next update is kept until the next refresh
+        struct tm tm;
+        if (next_update != NULL && ASN1_TIME_to_tm(next_update, &tm) == 1) {
+            *expiry = timegm(&tm);
+        } else {
+            *expiry = time(NULL) + OCSP_REFRESH_S;
+        }
+
+        // A revoked status is stapled as well, the clients must learn it
+        if (status != V_OCSP_CERTSTATUS_GOOD) {
+            fprintf(stderr, "OCSP status of the certificate: %s\n", OCSP_cert_status_str(status));
+        }
+    }
+
+    X509_STORE_free(store);
+    sk_X509_free(signers);
+    OCSP_BASICRESP_free(basic);
+    return result;
+}
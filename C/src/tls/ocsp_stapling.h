@@ -0,0 +1,38 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_OCSP_STAPLING_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_OCSP_STAPLING_H
+
+#include "openssl/ssl.h"
+
+/**
+ * OCSP stapling: the server sends the revocation status of its certificate
+ * in the handshake, the clients checking revocation do not contact the CA.
+ * A background thread fetches the OCSP response every OCSP_REFRESH_S seconds,
+ * sooner if it expires before, from a file kept up to date by another tool
+ * (`openssl ocsp -respout`) or from an HTTP responder. The response is checked
+ * (signature of the issuer or of its delegated responder, validity period,
+ * certificate) before replacing the cached one. The handshake only copies the
+ * cached response, it never waits for the responder. Nothing is stapled when
+ * no valid response is available.
+ */
+
+/**
+ * Staple the OCSP response of the certificate of a context.
+ * The issuer of the certificate must be in the chain of the context, or the
+ * certificate must be self-signed.
+ * @param context   The SSL context, with its certificate loaded
+ * @param source    The path of a DER response file, or the URL of a responder (http://host:port/path)
+ * @return          0 on success, -1 on error
+ */
+int ocsp_stapling_start(SSL_CTX *context, const char *source);
+
+/**
+ * Stop refreshing the response, before freeing the context.
+ * A request in progress is waited for, OCSP_TIMEOUT_S seconds at most.
+ */
+void ocsp_stapling_stop();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_OCSP_STAPLING_H
@@ -0,0 +1,51 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "record_size.h"
+#include "../conf.c"
+
+void record_size_init(record_size *r, int fd)
+{
+    // The MSS of the connection, options removed, once established
+    int mss = RECORD_DEFAULT_MSS;
+    socklen_t len = sizeof(mss);
+    if (fd == -1 || getsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) != 0 || mss <= 0) {
+        mss = RECORD_DEFAULT_MSS;
+    }
+
+    // Loopback and jumbo frames have segments larger than the largest record
+    size_t small = (size_t)mss > RECORD_OVERHEAD ? (size_t)mss - RECORD_OVERHEAD : 0;
+    small = small < RECORD_MIN_SIZE ? RECORD_MIN_SIZE : small;
+    r->small = small > SSL3_RT_MAX_PLAIN_LENGTH ? SSL3_RT_MAX_PLAIN_LENGTH : small;
+    r->current = 0;
+    r->sent = 0;
+    r->last_write_us = 0;
+}
+
+size_t record_size_apply(record_size *r, SSL *ssl, size_t length, uint64_t now_us)
+{
+    // After an idle period the congestion window has shrunk again
+    if (r->current == 0 || now_us - r->last_write_us > (uint64_t)RECORD_IDLE_MS * 1000) {
+        r->sent = 0;
+    }
+
+    size_t size = r->small;
+    for (uint64_t step = r->sent / RECORD_RAMP_BYTES; step > 0 && size < SSL3_RT_MAX_PLAIN_LENGTH; --step) {
+        size *= 2;
+    }
+    size = size > SSL3_RT_MAX_PLAIN_LENGTH ? SSL3_RT_MAX_PLAIN_LENGTH : size;
+
+    // OpenSSL cuts the writes in records of the split size, lowered with the maximum but never raised back
+    if (size != r->current && SSL_set_max_send_fragment(ssl, (long)size) == 1
+        && SSL_set_split_send_fragment(ssl, (long)size) == 1) {
+        r->current = size;
+    }
+    r->sent += length;
+    r->last_write_us = now_us;
+    return r->current;
+}
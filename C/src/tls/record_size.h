@@ -0,0 +1,45 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_RECORD_SIZE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_RECORD_SIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "openssl/ssl.h"
+
+/**
+ * Size of the TLS records sent on a connection. A record can only be
+ * decrypted once all of it is received: when the connection starts or wakes
+ * up after an idle period, the congestion window is small and a 16 KB record
+ * needs several round trips before its first byte reaches the application.
+ * The records then fill a single TCP segment, and double in size every
+ * RECORD_RAMP_BYTES written until the maximum, which costs the least per byte
+ * during sustained transfers.
+ */
+typedef struct record_size {
+    size_t small;
+    size_t current;
+    uint64_t sent;
+    uint64_t last_write_us;
+} record_size;
+
+/**
+ * Start with the records fitting in a segment of a socket
+ * @param r         The record size of the connection
+ * @param fd        The socket, -1 to assume RECORD_DEFAULT_MSS
+ */
+void record_size_init(record_size *r, int fd);
+
+/**
+ * Set the size of the records of the next write, before SSL_write
+ * @param r         The record size of the connection
+ * @param ssl       The connection
+ * @param length    The size of the write
+ * @param now_us    The current monotonic date, in microseconds
+ * @return          The size of the records, plaintext included
+ */
+size_t record_size_apply(record_size *r, SSL *ssl, size_t length, uint64_t now_us);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_RECORD_SIZE_H
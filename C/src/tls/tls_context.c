@@ -0,0 +1,200 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include "openssl/err.h"
+#include "openssl/evp.h"
+#include "openssl/kdf.h"
+#include "openssl/provider.h"
+
+#include "tls_context.h"
+#include "client_auth.h"
+#include "../conf.c"
+
+// Size of the ticket keys of a context: name, HMAC key and AES key
+#define TICKET_KEYS_SIZE 80
+
+static const char *cipher_names[] = {"AES-128-GCM", "AES-256-GCM", "CHACHA20-POLY1305"};
+static const char *digest_names[] = {"SHA256", "SHA384", "SHA512"};
+static const char *keymgmt_names[] = {"X25519", "EC", "RSA"};
+static const char *exchange_names[] = {"X25519", "ECDH"};
+static const char *signature_names[] = {"RSA", "ECDSA"};
+static const char *kdf_names[] = {"TLS1-PRF", "HKDF", "TLS13-KDF"};
+static const char *mac_names[] = {"HMAC"};
+
+#define COUNT(names) (sizeof(names) / sizeof((names)[0]))
+
+static OSSL_LIB_CTX *libctx;
+static OSSL_PROVIDER *provider;
+static EVP_CIPHER *ciphers[COUNT(cipher_names)];
+static EVP_MD *digests[COUNT(digest_names)];
+static EVP_KEYMGMT *keymgmts[COUNT(keymgmt_names)];
+static EVP_KEYEXCH *exchanges[COUNT(exchange_names)];
+static EVP_SIGNATURE *signatures[COUNT(signature_names)];
+static EVP_KDF *kdfs[COUNT(kdf_names)];
+static EVP_MAC *macs[COUNT(mac_names)];
+
+/**
+ * Report an algorithm the provider does not have, the handshakes will not offer it
+ * @param fetched   The fetched algorithm, NULL if not available
+ * @param name      The name of the algorithm
+ */
+static void check_fetched(const void *fetched, const char *name);
+
+
+int tls_context_init()
+{
+    libctx = OSSL_LIB_CTX_new();
+    provider = libctx != NULL ? OSSL_PROVIDER_load(libctx, "default") : NULL;
+    if (provider == NULL) {
+        ERR_print_errors_fp(stderr);
+        OSSL_LIB_CTX_free(libctx);
+        libctx = NULL;
+        return -1;
+    }
+
+    // Kept referenced until tls_context_free, the method store never builds them again
+    for (size_t i = 0; i < COUNT(cipher_names); ++i) {
+        ciphers[i] = EVP_CIPHER_fetch(libctx, cipher_names[i], NULL);
+        check_fetched(ciphers[i], cipher_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(digest_names); ++i) {
+        digests[i] = EVP_MD_fetch(libctx, digest_names[i], NULL);
+        check_fetched(digests[i], digest_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(keymgmt_names); ++i) {
+        keymgmts[i] = EVP_KEYMGMT_fetch(libctx, keymgmt_names[i], NULL);
+        check_fetched(keymgmts[i], keymgmt_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(exchange_names); ++i) {
+        exchanges[i] = EVP_KEYEXCH_fetch(libctx, exchange_names[i], NULL);
+        check_fetched(exchanges[i], exchange_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(signature_names); ++i) {
+        signatures[i] = EVP_SIGNATURE_fetch(libctx, signature_names[i], NULL);
+        check_fetched(signatures[i], signature_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(kdf_names); ++i) {
+        kdfs[i] = EVP_KDF_fetch(libctx, kdf_names[i], NULL);
+        check_fetched(kdfs[i], kdf_names[i]);
+    }
+    for (size_t i = 0; i < COUNT(mac_names); ++i) {
+        macs[i] = EVP_MAC_fetch(libctx, mac_names[i], NULL);
+        check_fetched(macs[i], mac_names[i]);
+    }
+    ERR_clear_error();
+    return 0;
+}
+
+OSSL_LIB_CTX *tls_context_libctx()
+{
+    return libctx;
+}
+
+SSL_CTX *tls_context_new(const SSL_METHOD *method)
+{
+    // The SSL context fetches its record ciphers and digests from the library context once
+    SSL_CTX *context = SSL_CTX_new_ex(libctx, NULL, method);
+    if (context == NULL) {
+        ERR_print_errors_fp(stderr);
+    }
+    return context;
+}
+
+SSL_CTX *tls_context_clone(SSL_CTX *context, const SSL_METHOD *method)
+{
+    SSL_CTX *clone = tls_context_new(method != NULL ? method : SSL_CTX_get_ssl_method(context));
+    if (clone == NULL) {
+        return NULL;
+    }
+
+    // The versions of another protocol do not apply
+    if (method == NULL) {
+        SSL_CTX_set_min_proto_version(clone, SSL_CTX_get_min_proto_version(context));
+        SSL_CTX_set_max_proto_version(clone, SSL_CTX_get_max_proto_version(context));
+    }
+    SSL_CTX_set_options(clone, SSL_CTX_get_options(context));
+    SSL_CTX_set_session_cache_mode(clone, SSL_CTX_get_session_cache_mode(context));
+    SSL_CTX_set_session_id_context(clone, (const unsigned char *)TLS_SESSION_ID_CONTEXT,
+                                   sizeof(TLS_SESSION_ID_CONTEXT) - 1);
+
+    // The key is shared, not loaded again
+    STACK_OF(X509) *chain = NULL;
+    SSL_CTX_get0_chain_certs(context, &chain);
+    if (SSL_CTX_set1_groups_list(clone, TLS_GROUPS) != 1
+        || SSL_CTX_use_certificate(clone, SSL_CTX_get0_certificate(context)) != 1
+        || SSL_CTX_use_PrivateKey(clone, SSL_CTX_get0_privatekey(context)) != 1
+        || (chain != NULL && SSL_CTX_set1_chain(clone, chain) != 1)) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(clone);
+        return NULL;
+    }
+
+    // A ticket issued by a clone is accepted by the others
+    unsigned char keys[TICKET_KEYS_SIZE];
+    if (SSL_CTX_get_tlsext_ticket_keys(context, keys, sizeof(keys)) == 1) {
+        SSL_CTX_set_tlsext_ticket_keys(clone, keys, sizeof(keys));
+    }
+    OPENSSL_cleanse(keys, sizeof(keys));
+
+    // The stapled response comes from the same cache
+    int (*status)(SSL *, void *) = NULL;
+    SSL_CTX_get_tlsext_status_cb(context, &status);
+    if (status != NULL) {
+        void *arg = NULL;
+        SSL_CTX_get_tlsext_status_arg(context, &arg);
+        SSL_CTX_set_tlsext_status_cb(clone, status);
+        SSL_CTX_set_tlsext_status_arg(clone, arg);
+    }
+
+    // The handshakes of the clones are traced as well
+    SSL_CTX_set_info_callback(clone, SSL_CTX_get_info_callback(context));
+
+    client_auth_share(context, clone);
+    return clone;
+}
+
+void tls_context_free()
+{
+    for (size_t i = 0; i < COUNT(ciphers); ++i) {
+        EVP_CIPHER_free(ciphers[i]);
+        ciphers[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(digests); ++i) {
+        EVP_MD_free(digests[i]);
+        digests[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(keymgmts); ++i) {
+        EVP_KEYMGMT_free(keymgmts[i]);
+        keymgmts[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(exchanges); ++i) {
+        EVP_KEYEXCH_free(exchanges[i]);
+        exchanges[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(signatures); ++i) {
+        EVP_SIGNATURE_free(signatures[i]);
+        signatures[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(kdfs); ++i) {
+        EVP_KDF_free(kdfs[i]);
+        kdfs[i] = NULL;
+    }
+    for (size_t i = 0; i < COUNT(macs); ++i) {
+        EVP_MAC_free(macs[i]);
+        macs[i] = NULL;
+    }
+
+    OSSL_PROVIDER_unload(provider);
+    provider = NULL;
+    OSSL_LIB_CTX_free(libctx);
+    libctx = NULL;
+}
+
+static void check_fetched(const void *fetched, const char *name)
+{
+    if (fetched == NULL) {
+        fprintf(stderr, "Algorithm %s not available\n", name);
+    }
+}
@@ -0,0 +1,58 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_CONTEXT_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_CONTEXT_H
+
+#include "openssl/ssl.h"
+
+/**
+ * OpenSSL library context of the server.
+ * With OpenSSL 3, every handshake looks its algorithms up in the method
+ * store of a library context, and builds the ones not used yet. The server
+ * gets its own library context, whose cipher, digest, key exchange,
+ * signature and key derivation algorithms are all fetched at startup and kept
+ * referenced: the handshakes only find them, they never build them under the
+ * lock of the store, and the other users of the default library context do
+ * not share that lock. Contexts cloned for the worker threads share the
+ * credentials but not the session cache and its lock.
+ */
+
+// Session id context of the server: without it, a session of a verified client cannot be resumed
+#define TLS_SESSION_ID_CONTEXT "exploration_securite"
+
+/**
+ * Create the library context and fetch the algorithms of the handshakes
+ * @return          0 on success, -1 on error
+ */
+int tls_context_init();
+
+/**
+ * Get the library context of the server, NULL before tls_context_init
+ * @return          The library context
+ */
+OSSL_LIB_CTX *tls_context_libctx();
+
+/**
+ * Create an SSL context in the library context of the server
+ * @param method    The protocol method
+ * @return          The context, NULL on error
+ */
+SSL_CTX *tls_context_new(const SSL_METHOD *method);
+
+/**
+ * Create a context with the credentials, the client authentication, the
+ * stapling and the ticket keys of another one, for another thread or protocol
+ * @param context   The context to clone, with its credentials loaded
+ * @param method    The protocol method of the clone, NULL for the method of the context
+ * @return          The clone, NULL on error
+ */
+SSL_CTX *tls_context_clone(SSL_CTX *context, const SSL_METHOD *method);
+
+/**
+ * Release the algorithms and the library context, once every SSL context is freed
+ */
+void tls_context_free();
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_CONTEXT_H
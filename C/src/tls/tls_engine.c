@@ -0,0 +1,116 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include "openssl/err.h"
+
+#include "tls_engine.h"
+
+
+int tls_engine_new(tls_engine *engine, SSL_CTX *context, int server)
+{
+    engine->established = 0;
+    engine->ssl = SSL_new(context);
+    if (engine->ssl == NULL) {
+        return -1;
+    }
+
+    BIO *rbio = BIO_new(BIO_s_mem());
+    BIO *wbio = BIO_new(BIO_s_mem());
+    if (rbio == NULL || wbio == NULL) {
+        BIO_free(rbio);
+        BIO_free(wbio);
+        SSL_free(engine->ssl);
+        engine->ssl = NULL;
+        return -1;
+    }
+
+    // The SSL object owns the BIOs from now on
+    SSL_set_bio(engine->ssl, rbio, wbio);
+
+    if (server) {
+        SSL_set_accept_state(engine->ssl);
+    } else {
+        SSL_set_connect_state(engine->ssl);
+    }
+    return 0;
+}
+
+void tls_engine_free(tls_engine *engine)
+{
+    SSL_free(engine->ssl);
+    engine->ssl = NULL;
+}
+
+int tls_engine_feed(tls_engine *engine, const uint8_t *data, size_t length)
+{
+    if (BIO_write(SSL_get_rbio(engine->ssl), data, (int)length) != (int)length) {
+        return -1;
+    }
+    return 0;
+}
+
+int tls_engine_handshake(tls_engine *engine)
+{
+    if (engine->established) {
+        return 1;
+    }
+
+    int result = SSL_do_handshake(engine->ssl);
+    if (result == 1) {
+        engine->established = 1;
+        return 1;
+    }
+
+    int error = SSL_get_error(engine->ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return 0;
+    }
+    return -1;
+}
+
+ssize_t tls_engine_read(tls_engine *engine, uint8_t *buffer, size_t length)
+{
+    int result = SSL_read(engine->ssl, buffer, (int)length);
+    if (result > 0) {
+        return result;
+    }
+
+    switch (SSL_get_error(engine->ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+        case SSL_ERROR_ZERO_RETURN:
+            return TLS_ENGINE_CLOSED;
+        default:
+            return -1;
+    }
+}
+
+ssize_t tls_engine_write(tls_engine *engine, const uint8_t *data, size_t length)
+{
+    // Memory BIOs always accept the records, the write is never partial
+    int result = SSL_write(engine->ssl, data, (int)length);
+    if (result <= 0) {
+        return -1;
+    }
+    return result;
+}
+
+void tls_engine_shutdown(tls_engine *engine)
+{
+    if (engine->established && SSL_shutdown(engine->ssl) < 0) {
+        ERR_clear_error();
+    }
+}
+
+size_t tls_engine_pending(const tls_engine *engine)
+{
+    return BIO_ctrl_pending(SSL_get_wbio(engine->ssl));
+}
+
+size_t tls_engine_take(tls_engine *engine, uint8_t *buffer, size_t length)
+{
+    int result = BIO_read(SSL_get_wbio(engine->ssl), buffer, (int)length);
+    return result > 0 ? (size_t)result : 0;
+}
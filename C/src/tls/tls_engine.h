@@ -0,0 +1,102 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_ENGINE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "openssl/ssl.h"
+
+/**
+ * Result of tls_engine_read when the peer sent its close notify
+ */
+#define TLS_ENGINE_CLOSED (-2)
+
+/**
+ * TLS engine independent of any transport: ciphertext received by the
+ * transport is fed in, plaintext is read out, and the ciphertext produced
+ * (handshake, records, alerts) is taken out to be sent by the transport.
+ * OpenSSL runs over a pair of memory BIOs and never touches a socket.
+ */
+typedef struct tls_engine {
+    SSL *ssl;
+    int established;
+} tls_engine;
+
+/**
+ * Create an engine
+ * @param engine    The engine to initialize
+ * @param context   The SSL context
+ * @param server    1 for the server side of the handshake, 0 for the client side
+ * @return          0 on success, -1 on error
+ */
+int tls_engine_new(tls_engine *engine, SSL_CTX *context, int server);
+
+/**
+ * Free an engine and its SSL object.
+ * Not needed when the SSL object was handed over to a session, which frees it.
+ * @param engine    The engine
+ */
+void tls_engine_free(tls_engine *engine);
+
+/**
+ * Feed ciphertext received from the transport
+ * @param engine    The engine
+ * @param data      The ciphertext
+ * @param length    The size of the ciphertext
+ * @return          0 on success, -1 on error
+ */
+int tls_engine_feed(tls_engine *engine, const uint8_t *data, size_t length);
+
+/**
+ * Make the handshake progress with the ciphertext fed so far
+ * @param engine    The engine
+ * @return          1 once established, 0 if more ciphertext is needed, -1 on failure
+ */
+int tls_engine_handshake(tls_engine *engine);
+
+/**
+ * Decrypt the next plaintext bytes
+ * @param engine    The engine
+ * @param buffer    The buffer receiving the plaintext
+ * @param length    The size of the buffer
+ * @return          The number of bytes read, 0 if more ciphertext is needed,
+ *                  TLS_ENGINE_CLOSED if the peer closed the connection, -1 on error
+ */
+ssize_t tls_engine_read(tls_engine *engine, uint8_t *buffer, size_t length);
+
+/**
+ * Encrypt plaintext, the records are appended to the pending ciphertext
+ * @param engine    The engine
+ * @param data      The plaintext
+ * @param length    The size of the plaintext
+ * @return          The number of bytes encrypted, -1 on error
+ */
+ssize_t tls_engine_write(tls_engine *engine, const uint8_t *data, size_t length);
+
+/**
+ * Queue the close notify in the pending ciphertext
+ * @param engine    The engine
+ */
+void tls_engine_shutdown(tls_engine *engine);
+
+/**
+ * Get the number of ciphertext bytes waiting to be sent
+ * @param engine    The engine
+ * @return          The number of bytes
+ */
+size_t tls_engine_pending(const tls_engine *engine);
+
+/**
+ * Take ciphertext to send
+ * @param engine    The engine
+ * @param buffer    The buffer receiving the ciphertext
+ * @param length    The size of the buffer
+ * @return          The number of bytes taken
+ */
+size_t tls_engine_take(tls_engine *engine, uint8_t *buffer, size_t length);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_TLS_ENGINE_H
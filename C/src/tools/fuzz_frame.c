@@ -0,0 +1,132 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../connexion/heartbeat.h"
+#include "../frame/compress.h"
+#include "../frame/frame.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/**
+ * Handle a parsed frame the way the server does, checking the compression round trip
+ * @param header    The header of the frame
+ * @param payload   The payload of the frame
+ */
+static void handle_frame(const frame_header *header, const uint8_t *payload);
+
+static frame_reader reader;
+static heartbeat hb;
+static compress_state state;
+static uint8_t inflated[FRAME_MAX_PAYLOAD];
+static uint8_t deflated[FRAME_MAX_PAYLOAD];
+
+
+/**
+ * libFuzzer entry point: the input is cut in chunks fed to the frame reader,
+ * like the records decrypted by the server. The first byte gives the chunk
+ * size so partial headers and payloads are exercised.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    size_t chunk = (size_t)data[0] + 1;
+    data++;
+    size--;
+
+    frame_reader_reset(&reader);
+    heartbeat_init(&hb);
+    compress_reset(&state);
+
+    while (size > 0) {
+        size_t available;
+        uint8_t *space = frame_reader_space(&reader, &available);
+        size_t length = chunk < size ? chunk : size;
+        length = length < available ? length : available;
+
+        memcpy(space, data, length);
+        frame_reader_commit(&reader, length);
+        data += length;
+        size -= length;
+
+        frame_header header;
+        const uint8_t *payload;
+        int status;
+        while ((status = frame_reader_next(&reader, &header, &payload)) == 1) {
+            handle_frame(&header, payload);
+            frame_reader_consume(&reader, &header);
+        }
+
+        // The server closes the connection on an invalid frame
+        if (status == -1) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static void handle_frame(const frame_header *header, const uint8_t *payload)
+{
+    switch (header->type) {
+        case FRAME_DATA:
+            if (header->flags & (FRAME_FLAG_LZ4 | FRAME_FLAG_ZSTD)) {
+                decompress_frame(header->flags, payload, header->length, inflated, sizeof(inflated));
+                break;
+            }
+
+            // Whatever the codec chosen, decompressing gives the payload back
+            state.codecs = COMPRESS_LZ4 | COMPRESS_ZSTD;
+            uint8_t flags;
+            ssize_t length = compress_frame(&state, payload, header->length, deflated, sizeof(deflated), &flags);
+            if (length >= 0) {
+                ssize_t restored = decompress_frame(flags, deflated, (size_t)length, inflated, sizeof(inflated));
+                if (restored != (ssize_t)header->length || memcmp(inflated, payload, header->length) != 0) {
+                    abort();
+                }
+            }
+            break;
+
+        case FRAME_PONG:
+            heartbeat_pong(&hb, payload, header->length, heartbeat_now_us());
+            break;
+
+        case FRAME_HELLO:
+            compress_negotiate(&state, payload, header->length);
+            break;
+
+        default:
+            break;
+    }
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * Without libFuzzer, run the inputs given as files, e.g. a corpus or crashes
+ * found on another machine
+ */
+int main(int argc, char **argv)
+{
+    static uint8_t input[1 << 20];
+
+    for (int i = 1; i < argc; ++i) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        size_t size = fread(input, 1, sizeof(input), file);
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(input, size);
+    }
+
+    printf("%d inputs run\n", argc - 1);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,71 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../conf.c"
+#include "../connexion/ingest_ring.h"
+#include "../connexion/scheduler.h"
+
+/**
+ * Get a monotonic date in seconds
+ * @return          The date
+ */
+static double now_s();
+
+
+/**
+ * Producer process writing messages in the ingest ring of a local server
+ * started with CONNEXION_INGEST, as the sensor and mapping daemons do. Each
+ * message is written in place in its slot and starts with its number. The
+ * producer waits when the ring is full, so the rate is the one the server sends.
+ * Usage: ingest_producer <socket> [messages] [size] [class]
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "Usage: %s <socket> [messages] [size] [class]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long messages = argc > 2 ? atol(argv[2]) : 100000;
+    long size = argc > 3 ? atol(argv[3]) : 1024;
+    long cls = argc > 4 ? atol(argv[4]) : TRAFFIC_TELEMETRY;
+
+    ingest_ring ring;
+    if (ingest_ring_connect(&ring, argv[1]) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (messages < 1 || size < 4 || (size_t)size > ingest_ring_capacity(&ring) || cls < 0
+        || cls >= TRAFFIC_CLASS_COUNT) {
+        fprintf(stderr, "Invalid messages: %ld of %ld bytes (at most %zu), class %ld\n", messages, size,
+                ingest_ring_capacity(&ring), cls);
+        ingest_ring_unmap(&ring);
+        return EXIT_FAILURE;
+    }
+
+    double start = now_s();
+    for (long i = 0; i < messages; ++i) {
+        ingest_slot *slot = ingest_ring_reserve(&ring, 1);
+        uint32_t number = (uint32_t)i;
+        memcpy(slot->data, &number, sizeof(number));
+        memset(slot->data + sizeof(number), 'A' + (int)(i % 26), (size_t)size - sizeof(number));
+        ingest_ring_commit(&ring, slot, (uint8_t)cls, STREAM_DEFAULT, (uint32_t)size);
+    }
+    double elapsed = now_s() - start;
+
+    printf("Ingest     : %ld messages of %ld bytes in %.3f s, %.0f/s, %.2f MB/s\n", messages, size, elapsed,
+           messages / elapsed, messages * (double)size / elapsed / 1e6);
+    ingest_ring_unmap(&ring);
+    return EXIT_SUCCESS;
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,320 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../conf.c"
+#include "../client/client_connexion.h"
+#include "../frame/capture.h"
+
+/**
+ * Frames sent by a recorded client, in the order of the capture
+ */
+typedef struct replay_session {
+    uint32_t id;
+    uint64_t open_us;
+    uint64_t close_us;
+    capture_record *frames;
+    size_t count;
+    size_t capacity;
+} replay_session;
+
+/**
+ * Metrics of the whole replay
+ */
+typedef struct replay_stats {
+    unsigned long connections;
+    unsigned long failures;
+    unsigned long frames_sent;
+    unsigned long bytes_sent;
+    unsigned long frames_received;
+    unsigned long bytes_received;
+    uint64_t lag_total_us;
+    uint64_t lag_max_us;
+    uint64_t rtt_total_us;
+    unsigned long rtt_samples;
+    uint32_t rtt_min_us;
+    unsigned long lost;
+} replay_stats;
+
+static replay_session *sessions;
+static size_t session_count;
+static double speed = 1.0;
+static uint64_t origin_us;
+static client_context context;
+static replay_stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Load the frames sent by the clients of a capture
+ * @param filepath  The path of the capture file
+ * @return          0 on success, -1 on error
+ */
+static int load_capture(const char *filepath);
+
+/**
+ * Find the session of a connection, adding it if needed
+ * @param id        The identifier of the connection
+ * @return          The session
+ */
+static replay_session *find_session(uint32_t id);
+
+/**
+ * Thread function replaying a session
+ * @param arg       The session
+ * @return
+ */
+static void *thread_replay_fct(void *arg);
+
+/**
+ * Wait until a date of the capture, scaled by the speed
+ * @param time_us   The date, relative to the start of the capture
+ */
+static void wait_until(uint64_t time_us);
+
+
+/**
+ * Replay the sessions recorded with CONNEXION_CAPTURE against a local server.
+ * The frames sent by the clients are sent again at the recorded dates, divided
+ * by the speed, with the recorded sizes.
+ * Usage: replay <capture file> [speed]
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <capture file> [speed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc == 3) {
+        speed = atof(argv[2]);
+        if (speed <= 0) {
+            fprintf(stderr, "Invalid speed %s\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (load_capture(argv[1]) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // The local server of the tests is not verified, its certificate is not issued for 127.0.0.1
+    if (client_context_init(&context, "127.0.0.1", SERVER_PORT, NULL, CLIENT_NO_VERIFY) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Replaying %zu sessions at %gx\n", session_count, speed);
+
+    pthread_t *threads = calloc(session_count, sizeof(pthread_t));
+    stats.rtt_min_us = UINT32_MAX;
+    origin_us = heartbeat_now_us();
+    for (size_t i = 0; i < session_count; ++i) {
+        if (pthread_create(&threads[i], NULL, thread_replay_fct, &sessions[i]) != 0) {
+            fprintf(stderr, "erreur pthread_create thread_replay\n");
+            exit(-1);
+        }
+    }
+    for (size_t i = 0; i < session_count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (double)(heartbeat_now_us() - origin_us) / 1e6;
+
+    // Same figures as the statistics of the server
+    printf("\nReplay statistics :\n"
+           "- Connections : %lu (%lu failures)\n"
+           "- Duration : %.3f s\n"
+           "- Frames sent : %lu (%.0f/s, %.0f bytes/s)\n"
+           "- Frames received : %lu (%.0f/s, %.0f bytes/s)\n",
+           stats.connections, stats.failures, elapsed,
+           stats.frames_sent, stats.frames_sent / elapsed, stats.bytes_sent / elapsed,
+           stats.frames_received, stats.frames_received / elapsed, stats.bytes_received / elapsed);
+    if (stats.frames_sent > 0) {
+        printf("- Send lag : %.0f us average, %lu us max\n",
+               (double)stats.lag_total_us / (double)stats.frames_sent, (unsigned long)stats.lag_max_us);
+    }
+    if (stats.rtt_samples > 0) {
+        printf("- Round trip time : %lu us average, min %u us, %lu lost pings\n",
+               (unsigned long)(stats.rtt_total_us / stats.rtt_samples), stats.rtt_min_us, stats.lost);
+    }
+    printf("- Resumed sessions : %lu of %lu handshakes\n", (unsigned long)context.resumptions,
+           (unsigned long)context.handshakes);
+
+    for (size_t i = 0; i < session_count; ++i) {
+        free(sessions[i].frames);
+    }
+    free(sessions);
+    free(threads);
+    client_context_free(&context);
+    return stats.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int load_capture(const char *filepath)
+{
+    FILE *file = capture_open(filepath);
+    if (file == NULL) {
+        return -1;
+    }
+
+    capture_record record;
+    while (capture_read(file, &record)) {
+        replay_session *session = find_session(record.connection);
+
+        switch (record.event) {
+            case CAPTURE_OPEN:
+                session->open_us = record.time_us;
+                break;
+
+            case CAPTURE_CLOSE:
+                session->close_us = record.time_us;
+                break;
+
+            case CAPTURE_RECV:
+                // Pongs answer the pings of the server, they are sent when the server pings
+                if (record.type != FRAME_DATA && record.type != FRAME_PING) {
+                    break;
+                }
+                if (session->count == session->capacity) {
+                    session->capacity = session->capacity == 0 ? 64 : session->capacity * 2;
+                    session->frames = realloc(session->frames, session->capacity * sizeof(capture_record));
+                }
+                session->frames[session->count++] = record;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static replay_session *find_session(uint32_t id)
+{
+    for (size_t i = 0; i < session_count; ++i) {
+        if (sessions[i].id == id) {
+            return &sessions[i];
+        }
+    }
+
+    sessions = realloc(sessions, (session_count + 1) * sizeof(replay_session));
+    replay_session *session = &sessions[session_count++];
+    memset(session, 0, sizeof(*session));
+    session->id = id;
+    return session;
+}
+
+static void *thread_replay_fct(void *arg)
+{
+    replay_session *session = arg;
+    replay_stats metrics = {0};
+    client_connexion c;
+
+    wait_until(session->open_us);
+    if (client_connexion_connect(&c, &context, HANDSHAKE_TIMEOUT_MS) == -1) {
+        fprintf(stderr, "Session %u: connection failed\n", session->id);
+        pthread_mutex_lock(&stats_lock);
+        stats.failures++;
+        pthread_mutex_unlock(&stats_lock);
+        return NULL;
+    }
+
+    uint8_t payload[FRAME_MAX_PAYLOAD];
+    int failed = 0;
+
+    for (size_t i = 0; i < session->count && !failed; ++i) {
+        const capture_record *frame = &session->frames[i];
+
+        // Serve the server until the frame is due
+        uint64_t due_us = origin_us + (uint64_t)((double)frame->time_us / speed);
+        uint64_t now_us;
+        while ((now_us = heartbeat_now_us()) < due_us) {
+            if (client_connexion_poll(&c, (int)((due_us - now_us + 999) / 1000)) == -1) {
+                failed = 1;
+                break;
+            }
+        }
+        if (failed) {
+            break;
+        }
+
+        // Late frames show a server which does not keep up
+        uint64_t lag_us = now_us - due_us;
+        metrics.lag_total_us += lag_us;
+        if (lag_us > metrics.lag_max_us) {
+            metrics.lag_max_us = lag_us;
+        }
+
+        // Pings carry the timestamp used to measure the round trip time
+        size_t length = frame->length < FRAME_MAX_PAYLOAD ? frame->length : FRAME_MAX_PAYLOAD;
+        if (frame->type == FRAME_PING) {
+            heartbeat_ping(&c.heartbeat, payload, heartbeat_now_us());
+            length = HEARTBEAT_PAYLOAD_SIZE;
+        } else {
+            for (size_t j = 0; j < length; ++j) {
+                payload[j] = (uint8_t)j;
+            }
+        }
+
+        if (client_connexion_write_frame(&c, frame->type, STREAM_DEFAULT, payload, length) == -1 ||
+            client_connexion_flush(&c) == -1) {
+            failed = 1;
+            break;
+        }
+        metrics.frames_sent++;
+        metrics.bytes_sent += length;
+    }
+
+    // Stay connected until the recorded end of the session
+    uint64_t end_us = origin_us + (uint64_t)((double)session->close_us / speed);
+    uint64_t now_us;
+    while (!failed && (now_us = heartbeat_now_us()) < end_us) {
+        if (client_connexion_poll(&c, (int)((end_us - now_us + 999) / 1000)) == -1) {
+            break;
+        }
+    }
+
+    metrics.frames_received = c.frames_received;
+    metrics.bytes_received = c.bytes_received;
+    client_connexion_close(&c);
+
+    pthread_mutex_lock(&stats_lock);
+    stats.connections++;
+    stats.failures += (unsigned long)failed;
+    stats.frames_sent += metrics.frames_sent;
+    stats.bytes_sent += metrics.bytes_sent;
+    stats.frames_received += metrics.frames_received;
+    stats.bytes_received += metrics.bytes_received;
+    stats.lag_total_us += metrics.lag_total_us;
+    if (metrics.lag_max_us > stats.lag_max_us) {
+        stats.lag_max_us = metrics.lag_max_us;
+    }
+    if (c.heartbeat.rtt.samples > 0) {
+        stats.rtt_total_us += (uint64_t)c.heartbeat.rtt.srtt_us * c.heartbeat.rtt.samples;
+        stats.rtt_samples += c.heartbeat.rtt.samples;
+        if (c.heartbeat.rtt.min_us < stats.rtt_min_us) {
+            stats.rtt_min_us = c.heartbeat.rtt.min_us;
+        }
+    }
+    stats.lost += c.heartbeat.rtt.lost;
+    pthread_mutex_unlock(&stats_lock);
+
+    return NULL;
+}
+
+static void wait_until(uint64_t time_us)
+{
+    uint64_t due_us = origin_us + (uint64_t)((double)time_us / speed);
+    uint64_t now_us = heartbeat_now_us();
+    if (now_us < due_us) {
+        struct timespec delay = {
+                .tv_sec = (time_t)((due_us - now_us) / 1000000),
+                .tv_nsec = (long)((due_us - now_us) % 1000000) * 1000
+        };
+        nanosleep(&delay, NULL);
+    }
+}
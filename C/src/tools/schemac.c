@@ -0,0 +1,651 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME 64
+#define MAX_DOC 256
+#define MAX_LINE 512
+#define MAX_FIELDS 64
+#define MAX_MESSAGES 256
+
+// Identifier, version and reserved byte
+#define HEADER_SIZE 4
+// Every message is padded to this alignment
+#define MESSAGE_ALIGNMENT 8
+
+typedef enum field_type {
+    TYPE_U8, TYPE_I8, TYPE_U16, TYPE_I16, TYPE_U32, TYPE_I32, TYPE_U64, TYPE_I64, TYPE_F32, TYPE_F64, TYPE_BYTES
+} field_type;
+
+/**
+ * Spelling of a type in the schema and in C, with its size
+ */
+typedef struct type_info {
+    const char *schema;
+    const char *c;
+    size_t size;
+} type_info;
+
+static const type_info types[] = {
+        [TYPE_U8] = {"u8", "uint8_t", 1},
+        [TYPE_I8] = {"i8", "int8_t", 1},
+        [TYPE_U16] = {"u16", "uint16_t", 2},
+        [TYPE_I16] = {"i16", "int16_t", 2},
+        [TYPE_U32] = {"u32", "uint32_t", 4},
+        [TYPE_I32] = {"i32", "int32_t", 4},
+        [TYPE_U64] = {"u64", "uint64_t", 8},
+        [TYPE_I64] = {"i64", "int64_t", 8},
+        [TYPE_F32] = {"f32", "float", 4},
+        [TYPE_F64] = {"f64", "double", 8},
+        [TYPE_BYTES] = {"bytes", "uint8_t", 1},
+};
+
+typedef struct schema_field {
+    char name[MAX_NAME];
+    char doc[MAX_DOC];
+    field_type type;
+    size_t count;       // Number of bytes of a bytes field, 1 otherwise
+    int version;
+    size_t offset;
+} schema_field;
+
+typedef struct schema_message {
+    char name[MAX_NAME];
+    char doc[MAX_DOC];
+    unsigned id;
+    schema_field fields[MAX_FIELDS];
+    size_t field_count;
+    int version;        // Highest version of its fields
+    size_t min_size;    // End of the fields of version 1
+    size_t size;        // End of all the fields, padded
+} schema_message;
+
+typedef struct schema {
+    const char *filepath;
+    schema_message messages[MAX_MESSAGES];
+    size_t message_count;
+} schema;
+
+/**
+ * Parse a schema file and compute the layout of its messages
+ * @param filepath  The path of the schema
+ * @param result    Filled with the messages
+ * @return          0 on success, -1 on error
+ */
+static int parse_schema(const char *filepath, schema *result);
+
+/**
+ * Parse a field declaration: "type name;" or "bytes name[N];", with an optional "@version" before the ';'
+ * @param text      The declaration, without its comment
+ * @param field     Filled with the field
+ * @return          0 on success, -1 on error
+ */
+static int parse_field(char *text, schema_field *field);
+
+/**
+ * Place the fields of a message, each one aligned on its own size
+ * @param message   The message
+ */
+static void layout_message(schema_message *message);
+
+/**
+ * Check that a schema only appends to the previous one, see the versioning rules
+ * @param current   The new schema
+ * @param previous  The previous schema
+ * @return          0 if compatible, -1 otherwise
+ */
+static int check_compatible(const schema *current, const schema *previous);
+
+/**
+ * Write the header of the accessors
+ * @param definitions   The schema
+ * @param prefix        The prefix of the generated names, the name of the schema file
+ * @param out           The header file
+ */
+static void generate_header(const schema *definitions, const char *prefix, FILE *out);
+
+/**
+ * Write the accessors of a message
+ * @param message   The message
+ * @param prefix    The prefix of the generated names
+ * @param upper     The prefix in uppercase
+ * @param out       The header file
+ */
+static void generate_message(const schema_message *message, const char *prefix, const char *upper, FILE *out);
+
+/**
+ * Remove the blanks around a string
+ * @param text      The string, modified
+ * @return          The start of the trimmed string
+ */
+static char *trim(char *text);
+
+/**
+ * Check that a string can be used as a C identifier
+ * @param name      The string
+ * @return          1 if valid, 0 otherwise
+ */
+static int valid_name(const char *name);
+
+/**
+ * Copy a string in uppercase
+ * @param to        The destination, MAX_NAME bytes
+ * @param from      The source
+ */
+static void to_upper(char *to, const char *from);
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <schema> <header> [previous schema]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Too big for the stack
+    static schema current;
+    static schema previous;
+    if (parse_schema(argv[1], &current) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (argc == 4 && (parse_schema(argv[3], &previous) == -1 || check_compatible(&current, &previous) == -1)) {
+        return EXIT_FAILURE;
+    }
+
+    // The prefix is the name of the schema file, without its directory and extension
+    char prefix[MAX_NAME];
+    const char *base = strrchr(argv[1], '/');
+    base = base != NULL ? base + 1 : argv[1];
+    size_t length = strcspn(base, ".");
+    if (length == 0 || length >= sizeof(prefix)) {
+        fprintf(stderr, "%s: invalid schema name\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    memcpy(prefix, base, length);
+    prefix[length] = '\0';
+    if (!valid_name(prefix)) {
+        fprintf(stderr, "%s: invalid schema name\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+    generate_header(&current, prefix, out);
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        remove(argv[2]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int parse_schema(const char *filepath, schema *result)
+{
+    FILE *file = fopen(filepath, "r");
+    if (file == NULL) {
+        perror(filepath);
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->filepath = filepath;
+    schema_message *message = NULL;
+    char doc[MAX_DOC] = "";
+    char line[MAX_LINE];
+    int number = 0;
+    int status = 0;
+
+    while (status == 0 && fgets(line, sizeof(line), file) != NULL) {
+        ++number;
+
+        // The comment of a line documents what the line declares
+        char comment[MAX_DOC] = "";
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+            snprintf(comment, sizeof(comment), "%s", trim(hash + 1));
+        }
+        char *text = trim(line);
+
+        if (*text == '\0') {
+            // A comment alone documents the next message, a blank line forgets it
+            if (hash != NULL && message == NULL) {
+                snprintf(doc, sizeof(doc), "%s", comment);
+            } else if (hash == NULL) {
+                doc[0] = '\0';
+            }
+
+        } else if (message == NULL) {
+            // message name = id {
+            char name[MAX_NAME];
+            unsigned id;
+            char brace;
+            if (sscanf(text, "message %63[A-Za-z0-9_] = %u %c", name, &id, &brace) != 3 || brace != '{'
+                || !valid_name(name) || id == 0 || id > 0xFFFF) {
+                fprintf(stderr, "%s:%d: expected \"message name = id {\" with id in 1..65535\n", filepath, number);
+                status = -1;
+            } else if (result->message_count == MAX_MESSAGES) {
+                fprintf(stderr, "%s:%d: too many messages\n", filepath, number);
+                status = -1;
+            } else {
+                for (size_t i = 0; i < result->message_count && status == 0; ++i) {
+                    if (strcmp(result->messages[i].name, name) == 0 || result->messages[i].id == id) {
+                        fprintf(stderr, "%s:%d: name or id already used by %s\n",
+                                filepath, number, result->messages[i].name);
+                        status = -1;
+                    }
+                }
+                message = &result->messages[result->message_count++];
+                snprintf(message->name, sizeof(message->name), "%s", name);
+                snprintf(message->doc, sizeof(message->doc), "%s", doc);
+                message->id = id;
+                message->version = 1;
+                doc[0] = '\0';
+            }
+
+        } else if (strcmp(text, "}") == 0) {
+            layout_message(message);
+            message = NULL;
+
+        } else {
+            if (message->field_count == MAX_FIELDS) {
+                fprintf(stderr, "%s:%d: too many fields in %s\n", filepath, number, message->name);
+                status = -1;
+            } else if (parse_field(text, &message->fields[message->field_count]) == -1) {
+                fprintf(stderr, "%s:%d: expected \"type name [@version];\" "
+                                "or \"bytes name[size] [@version];\"\n", filepath, number);
+                status = -1;
+            } else {
+                schema_field *field = &message->fields[message->field_count++];
+                snprintf(field->doc, sizeof(field->doc), "%s", comment);
+
+                // Fields are appended, never inserted between the fields of a previous version
+                if (field->version < message->version) {
+                    fprintf(stderr, "%s:%d: %s of version %d follows fields of version %d\n",
+                            filepath, number, field->name, field->version, message->version);
+                    status = -1;
+                }
+                for (size_t i = 0; i + 1 < message->field_count && status == 0; ++i) {
+                    if (strcmp(message->fields[i].name, field->name) == 0) {
+                        fprintf(stderr, "%s:%d: field %s already declared\n", filepath, number, field->name);
+                        status = -1;
+                    }
+                }
+                if (field->version > message->version) {
+                    message->version = field->version;
+                }
+            }
+        }
+    }
+
+    if (status == 0 && message != NULL) {
+        fprintf(stderr, "%s: message %s not closed\n", filepath, message->name);
+        status = -1;
+    }
+    fclose(file);
+    return status;
+}
+
+static int parse_field(char *text, schema_field *field)
+{
+    memset(field, 0, sizeof(*field));
+    field->version = 1;
+
+    char *at = strchr(text, '@');
+    if (at != NULL) {
+        char *end;
+        long version = strtol(at + 1, &end, 10);
+        if (end == at + 1 || version < 1 || version > 255) {
+            return -1;
+        }
+        field->version = (int)version;
+        memmove(at, end, strlen(end) + 1);
+        text = trim(text);
+    }
+
+    size_t length = strlen(text);
+    if (length == 0 || text[length - 1] != ';') {
+        return -1;
+    }
+    text[length - 1] = '\0';
+
+    char type[MAX_NAME];
+    char name[MAX_NAME];
+    int consumed = 0;
+    if (sscanf(text, "%63s %63[A-Za-z0-9_]%n", type, name, &consumed) != 2 || !valid_name(name)) {
+        return -1;
+    }
+    char *rest = trim(text + consumed);
+
+    size_t index = 0;
+    while (index < sizeof(types) / sizeof(types[0]) && strcmp(types[index].schema, type) != 0) {
+        ++index;
+    }
+    if (index == sizeof(types) / sizeof(types[0])) {
+        return -1;
+    }
+    field->type = (field_type)index;
+
+    // Only the bytes have a size, and they must have one
+    if (field->type == TYPE_BYTES) {
+        unsigned count;
+        char bracket;
+        if (sscanf(rest, "[%u %c", &count, &bracket) != 2 || bracket != ']' || count == 0 || count > 0xFFFF) {
+            return -1;
+        }
+        field->count = count;
+    } else if (*rest != '\0') {
+        return -1;
+    } else {
+        field->count = 1;
+    }
+
+    snprintf(field->name, sizeof(field->name), "%s", name);
+    return 0;
+}
+
+static void layout_message(schema_message *message)
+{
+    size_t offset = HEADER_SIZE;
+    message->min_size = HEADER_SIZE;
+
+    for (size_t i = 0; i < message->field_count; ++i) {
+        schema_field *field = &message->fields[i];
+        size_t align = types[field->type].size;
+        offset = (offset + align - 1) / align * align;
+        field->offset = offset;
+        offset += types[field->type].size * field->count;
+        if (field->version == 1) {
+            message->min_size = offset;
+        }
+    }
+    message->size = (offset + MESSAGE_ALIGNMENT - 1) / MESSAGE_ALIGNMENT * MESSAGE_ALIGNMENT;
+}
+
+static int check_compatible(const schema *current, const schema *previous)
+{
+    int status = 0;
+
+    for (size_t i = 0; i < previous->message_count; ++i) {
+        const schema_message *old = &previous->messages[i];
+        const schema_message *new = NULL;
+        for (size_t j = 0; j < current->message_count && new == NULL; ++j) {
+            if (strcmp(current->messages[j].name, old->name) == 0) {
+                new = &current->messages[j];
+            }
+        }
+
+        if (new == NULL) {
+            fprintf(stderr, "%s: message %s removed\n", current->filepath, old->name);
+            status = -1;
+            continue;
+        }
+        if (new->id != old->id) {
+            fprintf(stderr, "%s: id of %s changed from %u to %u\n", current->filepath, old->name, old->id, new->id);
+            status = -1;
+        }
+        if (new->field_count < old->field_count) {
+            fprintf(stderr, "%s: fields of %s removed\n", current->filepath, old->name);
+            status = -1;
+            continue;
+        }
+
+        // The old fields keep their place, the new ones come with a new version
+        for (size_t j = 0; j < old->field_count; ++j) {
+            const schema_field *a = &old->fields[j];
+            const schema_field *b = &new->fields[j];
+            if (strcmp(a->name, b->name) != 0 || a->type != b->type || a->count != b->count
+                || a->version != b->version) {
+                fprintf(stderr, "%s: field %s.%s changed, fields are only appended\n",
+                        current->filepath, old->name, a->name);
+                status = -1;
+            }
+        }
+        for (size_t j = old->field_count; j < new->field_count; ++j) {
+            if (new->fields[j].version <= old->version) {
+                fprintf(stderr, "%s: new field %s.%s needs a version above %d\n",
+                        current->filepath, new->name, new->fields[j].name, old->version);
+                status = -1;
+            }
+        }
+    }
+
+    // An id once given to a message is not given to another one
+    for (size_t i = 0; i < current->message_count; ++i) {
+        for (size_t j = 0; j < previous->message_count; ++j) {
+            if (current->messages[i].id == previous->messages[j].id
+                && strcmp(current->messages[i].name, previous->messages[j].name) != 0) {
+                fprintf(stderr, "%s: id %u of %s reused by %s\n", current->filepath, current->messages[i].id,
+                        previous->messages[j].name, current->messages[i].name);
+                status = -1;
+            }
+        }
+    }
+    return status;
+}
+
+static void generate_header(const schema *definitions, const char *prefix, FILE *out)
+{
+    char upper[MAX_NAME];
+    to_upper(upper, prefix);
+
+    const char *base = strrchr(definitions->filepath, '/');
+    fprintf(out, "//\n// Generated by schemac from %s, do not edit.\n//\n\n",
+            base != NULL ? base + 1 : definitions->filepath);
+    fprintf(out, "#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_%s_MESSAGES_H\n", upper);
+    fprintf(out, "#define E5A_ISE_C_SSL_SECURE_CONNECTION_%s_MESSAGES_H\n\n", upper);
+    fprintf(out, "#include <endian.h>\n#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+
+    // Shared by every generated header, the compiler turns each one into a single load or store
+    fprintf(out,
+            "#ifndef SCHEMA_RUNTIME\n"
+            "#define SCHEMA_RUNTIME\n\n"
+            "/**\n"
+            " * Little-endian loads and stores at any address\n"
+            " */\n"
+            "static inline uint8_t schema_load_u8(const uint8_t *at) { return *at; }\n"
+            "static inline uint16_t schema_load_u16(const uint8_t *at) { uint16_t v; memcpy(&v, at, 2); return le16toh(v); }\n"
+            "static inline uint32_t schema_load_u32(const uint8_t *at) { uint32_t v; memcpy(&v, at, 4); return le32toh(v); }\n"
+            "static inline uint64_t schema_load_u64(const uint8_t *at) { uint64_t v; memcpy(&v, at, 8); return le64toh(v); }\n"
+            "static inline float schema_load_f32(const uint8_t *at) { uint32_t v = schema_load_u32(at); float f; memcpy(&f, &v, 4); return f; }\n"
+            "static inline double schema_load_f64(const uint8_t *at) { uint64_t v = schema_load_u64(at); double f; memcpy(&f, &v, 8); return f; }\n"
+            "static inline void schema_store_u8(uint8_t *at, uint8_t v) { *at = v; }\n"
+            "static inline void schema_store_u16(uint8_t *at, uint16_t v) { v = htole16(v); memcpy(at, &v, 2); }\n"
+            "static inline void schema_store_u32(uint8_t *at, uint32_t v) { v = htole32(v); memcpy(at, &v, 4); }\n"
+            "static inline void schema_store_u64(uint8_t *at, uint64_t v) { v = htole64(v); memcpy(at, &v, 8); }\n"
+            "static inline void schema_store_f32(uint8_t *at, float f) { uint32_t v; memcpy(&v, &f, 4); schema_store_u32(at, v); }\n"
+            "static inline void schema_store_f64(uint8_t *at, double f) { uint64_t v; memcpy(&v, &f, 8); schema_store_u64(at, v); }\n\n"
+            "/**\n"
+            " * Identifier of a message, 0 if too short to have one\n"
+            " * @param data      The message\n"
+            " * @param length    The size of the message\n"
+            " * @return          The identifier\n"
+            " */\n"
+            "static inline uint16_t schema_message_id(const uint8_t *data, size_t length)\n"
+            "{\n"
+            "    return length >= %d ? schema_load_u16(data) : 0;\n"
+            "}\n\n"
+            "#endif //SCHEMA_RUNTIME\n", HEADER_SIZE);
+
+    for (size_t i = 0; i < definitions->message_count; ++i) {
+        generate_message(&definitions->messages[i], prefix, upper, out);
+    }
+
+    fprintf(out, "\n#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_%s_MESSAGES_H\n", upper);
+}
+
+static void generate_message(const schema_message *message, const char *prefix, const char *upper, FILE *out)
+{
+    char name[MAX_NAME];
+    to_upper(name, message->name);
+    const char *m = message->name;
+
+    fprintf(out, "\n\n");
+    if (message->doc[0] != '\0') {
+        fprintf(out, "// %s\n", message->doc);
+    }
+    fprintf(out, "#define %s_%s_ID %u\n", upper, name, message->id);
+    fprintf(out, "#define %s_%s_VERSION %d\n", upper, name, message->version);
+    fprintf(out, "#define %s_%s_MIN_SIZE %zu\n", upper, name, message->min_size);
+    fprintf(out, "#define %s_%s_SIZE %zu\n", upper, name, message->size);
+    for (size_t i = 0; i < message->field_count; ++i) {
+        const schema_field *field = &message->fields[i];
+        if (field->type == TYPE_BYTES) {
+            char field_name[MAX_NAME];
+            to_upper(field_name, field->name);
+            fprintf(out, "#define %s_%s_%s_LENGTH %zu\n", upper, name, field_name, field->count);
+        }
+    }
+
+    // Read side: a view on the received bytes
+    fprintf(out,
+            "\n/**\n"
+            " * Message %s read in place, valid as long as its bytes\n"
+            " */\n"
+            "typedef struct %s_%s {\n"
+            "    const uint8_t *data;\n"
+            "    size_t length;\n"
+            "} %s_%s;\n\n", m, prefix, m, prefix, m);
+    fprintf(out,
+            "/**\n"
+            " * Check that bytes hold a %s message, of this version or another one\n"
+            " * @param view      Filled with the view on the message\n"
+            " * @param data      The bytes\n"
+            " * @param length    The size of the bytes\n"
+            " * @return          0 on success, -1 if not a %s message\n"
+            " */\n"
+            "static inline int %s_%s_view(%s_%s *view, const uint8_t *data, size_t length)\n"
+            "{\n"
+            "    if (length < %s_%s_MIN_SIZE || schema_load_u16(data) != %s_%s_ID) {\n"
+            "        return -1;\n"
+            "    }\n"
+            "    view->data = data;\n"
+            "    view->length = length;\n"
+            "    return 0;\n"
+            "}\n", m, m, prefix, m, prefix, m, upper, name, upper, name);
+
+    for (size_t i = 0; i < message->field_count; ++i) {
+        const schema_field *field = &message->fields[i];
+        const type_info *type = &types[field->type];
+        const char *doc = field->doc[0] != '\0' ? field->doc : field->name;
+
+        fprintf(out, "\n/**\n * %s%s\n",
+                doc, field->version > 1 ? field->type == TYPE_BYTES ? ", NULL if the sender is older"
+                                                                   : ", 0 if the sender is older" : "");
+        fprintf(out, " * @param message   The message\n * @return          The %s\n */\n",
+                field->type == TYPE_BYTES ? "first byte" : "value");
+        if (field->type == TYPE_BYTES) {
+            fprintf(out, "static inline const uint8_t *%s_%s_%s(%s_%s message)\n{\n", prefix, m, field->name, prefix, m);
+        } else {
+            fprintf(out, "static inline %s %s_%s_%s(%s_%s message)\n{\n", type->c, prefix, m, field->name, prefix, m);
+        }
+        if (field->version > 1) {
+            fprintf(out, "    if (message.length < %zu) {\n        return %s;\n    }\n",
+                    field->offset + type->size * field->count, field->type == TYPE_BYTES ? "NULL" : "0");
+        }
+        switch (field->type) {
+            case TYPE_BYTES:
+                fprintf(out, "    return message.data + %zu;\n", field->offset);
+                break;
+            case TYPE_F32:
+            case TYPE_F64:
+                fprintf(out, "    return schema_load_%s(message.data + %zu);\n", type->schema, field->offset);
+                break;
+            default:
+                // The signed types are read as unsigned and converted
+                fprintf(out, "    return (%s)schema_load_u%zu(message.data + %zu);\n",
+                        type->c, type->size * 8, field->offset);
+                break;
+        }
+        fprintf(out, "}\n");
+    }
+
+    // Write side: the fields are set in a buffer of SIZE bytes
+    fprintf(out,
+            "\n/**\n"
+            " * Start a %s message, the fields not set are 0\n"
+            " * @param message   The buffer, %s_%s_SIZE bytes\n"
+            " */\n"
+            "static inline void %s_%s_init(uint8_t *message)\n"
+            "{\n"
+            "    memset(message, 0, %s_%s_SIZE);\n"
+            "    schema_store_u16(message, %s_%s_ID);\n"
+            "    message[2] = %s_%s_VERSION;\n"
+            "}\n", m, upper, name, prefix, m, upper, name, upper, name, upper, name);
+
+    for (size_t i = 0; i < message->field_count; ++i) {
+        const schema_field *field = &message->fields[i];
+        const type_info *type = &types[field->type];
+        const char *doc = field->doc[0] != '\0' ? field->doc : field->name;
+
+        fprintf(out, "\n/**\n * Set: %s\n * @param message   The buffer, started by %s_%s_init\n", doc, prefix, m);
+        if (field->type == TYPE_BYTES) {
+            fprintf(out,
+                    " * @param value     The bytes\n"
+                    " * @param length    The size of the bytes, truncated to %zu, the rest is zeroed\n"
+                    " */\n"
+                    "static inline void %s_%s_set_%s(uint8_t *message, const uint8_t *value, size_t length)\n"
+                    "{\n"
+                    "    if (length > %zu) {\n"
+                    "        length = %zu;\n"
+                    "    }\n"
+                    "    memcpy(message + %zu, value, length);\n"
+                    "    memset(message + %zu + length, 0, %zu - length);\n"
+                    "}\n", field->count, prefix, m, field->name, field->count, field->count,
+                    field->offset, field->offset, field->count);
+        } else {
+            fprintf(out, " * @param value     The value\n */\n"
+                         "static inline void %s_%s_set_%s(uint8_t *message, %s value)\n{\n",
+                    prefix, m, field->name, type->c);
+            if (field->type == TYPE_F32 || field->type == TYPE_F64) {
+                fprintf(out, "    schema_store_%s(message + %zu, value);\n", type->schema, field->offset);
+            } else {
+                fprintf(out, "    schema_store_u%zu(message + %zu, (uint%zu_t)value);\n",
+                        type->size * 8, field->offset, type->size * 8);
+            }
+            fprintf(out, "}\n");
+        }
+    }
+}
+
+static char *trim(char *text)
+{
+    while (isspace((unsigned char)*text)) {
+        ++text;
+    }
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1])) {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+static int valid_name(const char *name)
+{
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+        return 0;
+    }
+    for (const char *c = name; *c != '\0'; ++c) {
+        if (!isalnum((unsigned char)*c) && *c != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void to_upper(char *to, const char *from)
+{
+    size_t i = 0;
+    for (; from[i] != '\0' && i + 1 < MAX_NAME; ++i) {
+        to[i] = (char)toupper((unsigned char)from[i]);
+    }
+    to[i] = '\0';
+}
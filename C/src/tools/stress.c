@@ -0,0 +1,326 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../conf.c"
+#include "../client/client_connexion.h"
+#include "../client/client_pool.h"
+
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_DURATION_S 10
+#define CLIENT_TIMEOUT_MS 2000
+#define PIPELINED_REQUESTS 16
+
+/**
+ * Behaviours of the clients
+ */
+enum scenario {
+    SCENARIO_NORMAL,
+    SCENARIO_RESET,
+    SCENARIO_PARTIAL_RECORD,
+    SCENARIO_STALLED_HANDSHAKE,
+    SCENARIO_INVALID_FRAME,
+    SCENARIO_GARBAGE,
+    SCENARIO_PIPELINED,
+    SCENARIO_COUNT
+};
+
+static const char *scenario_names[SCENARIO_COUNT] = {
+        "Normal sessions",
+        "Reset connections",
+        "Partial records",
+        "Stalled handshakes",
+        "Invalid frames",
+        "Garbage before TLS",
+        "Pipelined requests",
+};
+
+static client_context context;
+static client_pool pool;
+static uint64_t deadline_us;
+static atomic_ulong runs[SCENARIO_COUNT];
+static atomic_ulong normal_failures;
+static atomic_ulong requests_sent;
+static atomic_ulong requests_answered;
+
+/**
+ * Thread function running random scenarios until the deadline
+ * @param arg       The seed of the thread
+ * @return
+ */
+static void *thread_client_fct(void *arg);
+
+/**
+ * Run a scenario once
+ * @param s         The scenario
+ * @param seed      The random state of the thread
+ * @return          0 if the server behaved, -1 if a normal session failed
+ */
+static int run_scenario(enum scenario s, unsigned int *seed);
+
+/**
+ * Pipeline requests on a connection of the pool and wait for their first response
+ * @param seed      The random state of the thread
+ * @return          0 if the connection was opened, -1 otherwise
+ */
+static int run_pipelined(unsigned int *seed);
+
+/**
+ * Count the response of a pipelined request
+ * @param arg       The number of requests answered on the connection
+ * @param stream    The stream of the response
+ * @param data      The response, NULL if the connection closed
+ * @param length    The size of the response
+ * @param last      0 while more chunks follow
+ */
+static void on_response(void *arg, uint16_t stream, const uint8_t *data, size_t length, int last);
+
+/**
+ * Close a socket with a TCP reset instead of a FIN
+ * @param fd        The socket
+ */
+static void reset_socket(int fd);
+
+/**
+ * Sleep a few milliseconds
+ * @param ms        The delay
+ */
+static void sleep_ms(unsigned int ms);
+
+
+/**
+ * Hammer a local server with concurrent clients which disconnect abruptly, send
+ * partial records, stall in the handshake, send invalid frames or pipeline
+ * requests on pooled connections, then check the server still serves a normal
+ * session. Meant to run against a server built with -DSANITIZE=thread or
+ * -DSANITIZE=address.
+ * Usage: stress [clients] [seconds]
+ */
+int main(int argc, char **argv)
+{
+    int clients = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    int duration = argc > 2 ? atoi(argv[2]) : DEFAULT_DURATION_S;
+    if (clients <= 0 || duration <= 0) {
+        fprintf(stderr, "Usage: %s [clients] [seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The clients resume the session of the previous ones, as the peers of the robot do. The local server of the
+    // tests is not verified, its certificate is not issued for 127.0.0.1
+    if (client_context_init(&context, "127.0.0.1", SERVER_PORT, NULL, CLIENT_NO_VERIFY) == -1 ||
+        client_pool_init(&pool, &context, (size_t)clients / 4 + 1) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Stressing the server with %d clients for %d s\n", clients, duration);
+    deadline_us = heartbeat_now_us() + (uint64_t)duration * 1000000;
+
+    pthread_t *threads = calloc((size_t)clients, sizeof(pthread_t));
+    for (int i = 0; i < clients; ++i) {
+        if (pthread_create(&threads[i], NULL, thread_client_fct, (void *)(uintptr_t)(i + 1)) != 0) {
+            fprintf(stderr, "erreur pthread_create thread_client\n");
+            exit(-1);
+        }
+    }
+
+    // The idle connections of the pool answer the pings of the server meanwhile
+    unsigned long pool_closed = 0;
+    while (heartbeat_now_us() < deadline_us) {
+        sleep_ms(HEARTBEAT_PERIOD_MS);
+        pool_closed += (unsigned long)client_pool_check(&pool);
+    }
+    for (int i = 0; i < clients; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    printf("\nStress statistics :\n");
+    for (int i = 0; i < SCENARIO_COUNT; ++i) {
+        printf("- %s : %lu\n", scenario_names[i], (unsigned long)runs[i]);
+    }
+    printf("- Normal sessions failed : %lu\n", (unsigned long)normal_failures);
+    printf("- Requests answered : %lu of %lu, %lu pooled connections lost\n", (unsigned long)requests_answered,
+           (unsigned long)requests_sent, pool_closed);
+    printf("- Resumed sessions : %lu of %lu handshakes\n", (unsigned long)context.resumptions,
+           (unsigned long)context.handshakes);
+
+    // The server must have survived, give it time to release the stalled clients
+    int alive = 0;
+    unsigned int seed = 0;
+    for (int attempt = 0; attempt < 10 && !alive; ++attempt) {
+        alive = run_scenario(SCENARIO_NORMAL, &seed) == 0;
+        if (!alive) {
+            sleep_ms(1000);
+        }
+    }
+    printf("- Server : %s\n", alive ? "alive" : "NOT RESPONDING");
+
+    client_pool_free(&pool);
+    client_context_free(&context);
+    return alive ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void *thread_client_fct(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg ^ (unsigned int)time(NULL);
+
+    while (heartbeat_now_us() < deadline_us) {
+        enum scenario s = (enum scenario)(rand_r(&seed) % SCENARIO_COUNT);
+        if (run_scenario(s, &seed) == -1) {
+            normal_failures++;
+        }
+        runs[s]++;
+    }
+    return NULL;
+}
+
+static int run_scenario(enum scenario s, unsigned int *seed)
+{
+    client_connexion c;
+    uint8_t payload[MAX_MSG_SIZE];
+
+    if (s == SCENARIO_PIPELINED) {
+        return run_pipelined(seed);
+    }
+
+    memset(payload, 0x5A, sizeof(payload));
+    if (client_connexion_open(&c, &context) == -1) {
+        return -1;
+    }
+
+    // Scenarios failing before the end of the handshake
+    if (s == SCENARIO_GARBAGE) {
+        send(c.fd, payload, sizeof(payload), MSG_NOSIGNAL);
+        sleep_ms((unsigned int)rand_r(seed) % 100);
+        close(c.fd);
+        return 0;
+    }
+
+    if (s == SCENARIO_STALLED_HANDSHAKE) {
+        uint8_t hello[FRAME_MAX_PAYLOAD];
+        tls_engine_new(&c.tls, context.ctx, 0);
+        tls_engine_handshake(&c.tls);
+        size_t length = tls_engine_take(&c.tls, hello, sizeof(hello));
+
+        // Half of the client hello, then silence
+        send(c.fd, hello, length / 2, MSG_NOSIGNAL);
+        sleep_ms((unsigned int)rand_r(seed) % CLIENT_TIMEOUT_MS);
+        tls_engine_free(&c.tls);
+        close(c.fd);
+        return 0;
+    }
+
+    if (client_connexion_handshake(&c, CLIENT_TIMEOUT_MS) == -1) {
+        return s == SCENARIO_NORMAL ? -1 : 0;
+    }
+
+    switch (s) {
+        case SCENARIO_NORMAL:
+            for (int i = rand_r(seed) % 4; i >= 0; --i) {
+                if (client_connexion_send(&c, STREAM_DEFAULT, payload, sizeof(payload)) == -1) {
+                    break;
+                }
+            }
+            client_connexion_poll(&c, 10 + rand_r(seed) % 100);
+            client_connexion_close(&c);
+            return 0;
+
+        case SCENARIO_RESET:
+            client_connexion_send(&c, STREAM_DEFAULT, payload, sizeof(payload));
+            client_connexion_flush(&c);
+            tls_engine_free(&c.tls);
+            reset_socket(c.fd);
+            return 0;
+
+        case SCENARIO_PARTIAL_RECORD: {
+            // A record cut in the middle, the rest never comes
+            uint8_t record[FRAME_MAX_PAYLOAD];
+            frame_encode_header(c.buffer, FRAME_DATA, 0, 0, sizeof(payload));
+            memcpy(c.buffer + FRAME_HEADER_SIZE, payload, sizeof(payload));
+            tls_engine_write(&c.tls, c.buffer, FRAME_HEADER_SIZE + sizeof(payload));
+            size_t length = tls_engine_take(&c.tls, record, sizeof(record));
+            send(c.fd, record, 1 + (size_t)rand_r(seed) % (length - 1), MSG_NOSIGNAL);
+            sleep_ms((unsigned int)rand_r(seed) % 200);
+            tls_engine_free(&c.tls);
+            close(c.fd);
+            return 0;
+        }
+
+        case SCENARIO_INVALID_FRAME:
+            // A length beyond FRAME_MAX_PAYLOAD, the server must drop the client
+            frame_encode_header(c.buffer, FRAME_DATA, 0, 0, FRAME_MAX_PAYLOAD + 1 + (uint32_t)rand_r(seed) % 1024);
+            tls_engine_write(&c.tls, c.buffer, FRAME_HEADER_SIZE);
+            for (int i = 0; i < 3 && client_connexion_poll(&c, CLIENT_TIMEOUT_MS) == 0; ++i) {
+            }
+            tls_engine_free(&c.tls);
+            close(c.fd);
+            return 0;
+
+        default:
+            client_connexion_close(&c);
+            return 0;
+    }
+}
+
+static int run_pipelined(unsigned int *seed)
+{
+    client_connexion *c = client_pool_acquire(&pool, CLIENT_TIMEOUT_MS);
+    if (c == NULL) {
+        return -1;
+    }
+
+    // Every request is written before the first response is read
+    uint8_t payload[MAX_MSG_SIZE];
+    int answered = 0;
+    memset(payload, 0x5A, sizeof(payload));
+    for (int i = 1 + rand_r(seed) % PIPELINED_REQUESTS; i > 0; --i) {
+        if (client_connexion_request(c, STREAM_DEFAULT, payload, sizeof(payload), on_response, &answered) == -1) {
+            break;
+        }
+        requests_sent++;
+    }
+
+    // The example server batches its acknowledgments, a response may answer several requests
+    uint64_t timeout_us = heartbeat_now_us() + CLIENT_TIMEOUT_MS * 1000;
+    int healthy = 1;
+    while (answered == 0 && healthy && heartbeat_now_us() < timeout_us) {
+        healthy = client_connexion_poll(c, 10) == 0;
+    }
+
+    client_pool_release(&pool, c, healthy);
+    return 0;
+}
+
+static void on_response(void *arg, uint16_t stream, const uint8_t *data, size_t length, int last)
+{
+    int *answered = arg;
+
+    (void)stream;
+    (void)length;
+    if (data != NULL && last) {
+        (*answered)++;
+        requests_answered++;
+    }
+}
+
+static void reset_socket(int fd)
+{
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec delay = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    nanosleep(&delay, NULL);
+}
@@ -0,0 +1,401 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "openssl/err.h"
+#include "openssl/ssl.h"
+#include "openssl/ui.h"
+
+#include "../conf.c"
+#include "../tls/record_size.h"
+#include "../tls/tls_context.h"
+#include "../tls/tls_engine.h"
+
+#define HANDSHAKES 200
+#define MESSAGES 100000
+#define MESSAGE_SIZE 27
+#define SCALING_HANDSHAKES 100
+#define BULK_BYTES (64 * 1024 * 1024)
+#define BULK_WRITE_SIZE (8 + 16384)
+#define INITIAL_WINDOW_SEGMENTS 10
+
+/**
+ * Handshakes run by a thread of the scaling benchmark
+ */
+typedef struct handshake_run {
+    pthread_t thread;
+    SSL_CTX *server_ctx;
+    SSL_CTX *client_ctx;
+    int failed;
+} handshake_run;
+
+static char passphrase[256];
+static int passphrase_length = -1;
+
+/**
+ * Get a monotonic date in seconds
+ * @return          The date
+ */
+static double now_s();
+
+/**
+ * Move the ciphertext produced by an engine to its peer
+ * @param from      The engine producing the ciphertext
+ * @param to        The engine receiving it
+ */
+static void transfer(tls_engine *from, tls_engine *to);
+
+/**
+ * Run a handshake between two engines in memory
+ * @param client    The client engine
+ * @param server    The server engine
+ * @return          0 on success, -1 on failure
+ */
+static int handshake(tls_engine *client, tls_engine *server);
+
+/**
+ * Passphrase callback asking for the passphrase of the key once for every context
+ * @param buffer    The buffer receiving the passphrase
+ * @param size      The size of the buffer
+ * @param rwflag
+ * @param arg
+ * @return          The size of the passphrase, -1 on error
+ */
+static int read_passphrase(char *buffer, int size, int rwflag, void *arg);
+
+/**
+ * Measure the records of a bulk transfer, then of a write after an idle period, on the same connection
+ * @param client    The client engine
+ * @param server    The server engine
+ * @param size      The size of the records, 0 for the adaptive size of record_size
+ * @return          0 on success, -1 on failure
+ */
+static int measure_records(tls_engine *client, tls_engine *server, size_t size);
+
+/**
+ * Thread function running SCALING_HANDSHAKES handshakes
+ * @param arg       The run
+ * @return
+ */
+static void *thread_handshakes_fct(void *arg);
+
+/**
+ * Measure the handshakes per second of several threads
+ * @param server_ctx    The server context, shared by the threads or cloned for each of them
+ * @param threads       The number of threads
+ * @param per_thread    1 for a server and a client context per thread in the library context of the server,
+ *                      0 for contexts shared by the threads in the default library context
+ * @return              The handshakes per second, -1 on failure
+ */
+static double measure_scaling(SSL_CTX *server_ctx, int threads, int per_thread);
+
+
+/**
+ * Measure the cost of TLS without any network: handshakes and records are
+ * exchanged between two engines in memory. The handshakes are then run by
+ * 1 to <threads> threads (the number of cores by default), sharing one
+ * context as OpenSSL 3 does implicitly, then with a context per thread in the
+ * preloaded library context of the server.
+ * Usage: tls_bench <certificate> <key> [threads]
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <certificate> <key> [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long max_threads = argc == 4 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = max_threads < 1 ? 1 : max_threads;
+
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_default_passwd_cb(server_ctx, read_passphrase);
+    if (SSL_CTX_use_certificate_file(server_ctx, argv[1], SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(server_ctx, argv[2], SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+
+    // Full handshakes, no session resumption
+    SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+
+    double start = now_s();
+    for (int i = 0; i < HANDSHAKES; ++i) {
+        tls_engine client, server;
+        if (tls_engine_new(&client, client_ctx, 0) == -1 || tls_engine_new(&server, server_ctx, 1) == -1 ||
+            handshake(&client, &server) == -1) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        tls_engine_free(&client);
+        tls_engine_free(&server);
+    }
+    double elapsed = now_s() - start;
+    printf("Handshakes : %d in %.3f s, %.0f/s\n", HANDSHAKES, elapsed, HANDSHAKES / elapsed);
+
+    // Records of the size of the application messages
+    tls_engine client, server;
+    if (tls_engine_new(&client, client_ctx, 0) == -1 || tls_engine_new(&server, server_ctx, 1) == -1 ||
+        handshake(&client, &server) == -1) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t message[MESSAGE_SIZE];
+    uint8_t received[MESSAGE_SIZE];
+    memset(message, 0xA5, sizeof(message));
+
+    start = now_s();
+    for (int i = 0; i < MESSAGES; ++i) {
+        if (tls_engine_write(&server, message, sizeof(message)) == -1) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        transfer(&server, &client);
+        if (tls_engine_read(&client, received, sizeof(received)) != sizeof(received)) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    elapsed = now_s() - start;
+    printf("Records    : %d of %d bytes in %.3f s, %.0f/s, %.2f MB/s\n", MESSAGES, MESSAGE_SIZE, elapsed,
+           MESSAGES / elapsed, MESSAGES * (double)MESSAGE_SIZE / elapsed / 1e6);
+
+    tls_engine_free(&client);
+    tls_engine_free(&server);
+
+    // Fixed records of both extremes, then the adaptive size, each on a new connection
+    record_size reference;
+    record_size_init(&reference, -1);
+    size_t sizes[] = {SSL3_RT_MAX_PLAIN_LENGTH, reference.small, 0};
+    printf("Record size: bulk transfer of %d MB in writes of %d bytes, then a write after an idle period\n",
+           BULK_BYTES / (1024 * 1024), BULK_WRITE_SIZE);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        if (tls_engine_new(&client, client_ctx, 0) == -1 || tls_engine_new(&server, server_ctx, 1) == -1 ||
+            handshake(&client, &server) == -1 || measure_records(&client, &server, sizes[i]) == -1) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        tls_engine_free(&client);
+        tls_engine_free(&server);
+    }
+    SSL_CTX_free(client_ctx);
+
+    // The same credentials in the library context of the server
+    SSL_CTX *preloaded_ctx = NULL;
+    if (tls_context_init() == 0 && (preloaded_ctx = tls_context_new(TLS_server_method())) != NULL) {
+        SSL_CTX_set_default_passwd_cb(preloaded_ctx, read_passphrase);
+        if (SSL_CTX_use_certificate_file(preloaded_ctx, argv[1], SSL_FILETYPE_PEM) <= 0 ||
+            SSL_CTX_use_PrivateKey_file(preloaded_ctx, argv[2], SSL_FILETYPE_PEM) <= 0) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        SSL_CTX_set_session_cache_mode(preloaded_ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(preloaded_ctx, SSL_OP_NO_TICKET);
+    }
+    if (preloaded_ctx == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Scaling    : handshakes/s, shared context / context per thread\n");
+    // Powers of two, then the maximum
+    for (long threads = 1; threads > 0; threads = threads == max_threads ? 0 : threads * 2) {
+        threads = threads > max_threads ? max_threads : threads;
+        double shared = measure_scaling(server_ctx, (int)threads, 0);
+        double per_thread = measure_scaling(preloaded_ctx, (int)threads, 1);
+        if (shared < 0 || per_thread < 0) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        printf("  %3ld threads : %6.0f/s  %6.0f/s\n", threads, shared, per_thread);
+    }
+
+    SSL_CTX_free(preloaded_ctx);
+    SSL_CTX_free(server_ctx);
+    tls_context_free();
+    OPENSSL_cleanse(passphrase, sizeof(passphrase));
+    return EXIT_SUCCESS;
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void transfer(tls_engine *from, tls_engine *to)
+{
+    uint8_t buffer[16384];
+    size_t length;
+    while ((length = tls_engine_take(from, buffer, sizeof(buffer))) > 0) {
+        tls_engine_feed(to, buffer, length);
+    }
+}
+
+static int handshake(tls_engine *client, tls_engine *server)
+{
+    // Each flight of one side unblocks the other side
+    for (int round = 0; round < 10; ++round) {
+        int client_done = tls_engine_handshake(client);
+        transfer(client, server);
+        int server_done = tls_engine_handshake(server);
+        transfer(server, client);
+
+        if (client_done == -1 || server_done == -1) {
+            return -1;
+        }
+        if (client_done == 1 && server_done == 1) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int read_passphrase(char *buffer, int size, int rwflag, void *arg)
+{
+    (void)rwflag;
+    (void)arg;
+
+    if (passphrase_length == -1) {
+        if (EVP_read_pw_string(passphrase, sizeof(passphrase), "Enter PEM pass phrase:", 0) != 0) {
+            return -1;
+        }
+        passphrase_length = (int)strlen(passphrase);
+    }
+    int length = passphrase_length < size ? passphrase_length : size;
+    memcpy(buffer, passphrase, (size_t)length);
+    return length;
+}
+
+static int measure_records(tls_engine *client, tls_engine *server, size_t size)
+{
+    static uint8_t data[BULK_WRITE_SIZE];
+    static uint8_t plaintext[BULK_WRITE_SIZE];
+    static uint8_t ciphertext[2 * BULK_WRITE_SIZE];
+    memset(data, 0xA5, sizeof(data));
+
+    // The adaptive size follows a simulated clock, the bulk writes come without pause
+    record_size adaptive;
+    record_size_init(&adaptive, -1);
+    uint64_t clock_us = 0;
+    if (size != 0 && (SSL_set_max_send_fragment(server->ssl, (long)size) != 1
+                      || SSL_set_split_send_fragment(server->ssl, (long)size) != 1)) {
+        return -1;
+    }
+
+    size_t sent = 0;
+    size_t encrypted = 0;
+    double start = now_s();
+    while (sent < BULK_BYTES) {
+        if (size == 0) {
+            record_size_apply(&adaptive, server->ssl, sizeof(data), clock_us);
+        }
+        if (tls_engine_write(server, data, sizeof(data)) == -1) {
+            return -1;
+        }
+        encrypted += tls_engine_pending(server);
+        transfer(server, client);
+        ssize_t received;
+        while ((received = tls_engine_read(client, plaintext, sizeof(plaintext))) > 0) {
+            sent += (size_t)received;
+        }
+        if (received == -1) {
+            return -1;
+        }
+    }
+    double elapsed = now_s() - start;
+
+    // The first record of the next write is decrypted once all its segments are received
+    clock_us += 2 * (uint64_t)RECORD_IDLE_MS * 1000;
+    if (size == 0) {
+        record_size_apply(&adaptive, server->ssl, sizeof(data), clock_us);
+    }
+    if (tls_engine_write(server, data, sizeof(data)) == -1) {
+        return -1;
+    }
+    size_t taken = tls_engine_take(server, ciphertext, sizeof(ciphertext));
+    if (taken < SSL3_RT_HEADER_LENGTH) {
+        return -1;
+    }
+    size_t first = SSL3_RT_HEADER_LENGTH + ((size_t)ciphertext[3] << 8 | ciphertext[4]);
+    size_t segments = (first + RECORD_DEFAULT_MSS - 1) / RECORD_DEFAULT_MSS;
+
+    // Round trips of the slow start, from its initial window, before the last of these segments is sent
+    int round_trips = 1;
+    for (size_t window = INITIAL_WINDOW_SEGMENTS, total = window; total < segments; window *= 2, total += window) {
+        round_trips++;
+    }
+
+    printf("  %-8s : %7.1f MB/s, %5.2f %% overhead, first byte after %5zu bytes (%2zu segments, %d round trip%s)\n",
+           size == 0 ? "adaptive" : size == SSL3_RT_MAX_PLAIN_LENGTH ? "16 KB" : "segment",
+           (double)sent / elapsed / 1e6, 100.0 * ((double)encrypted / (double)sent - 1), first, segments,
+           round_trips, round_trips > 1 ? "s" : "");
+    return 0;
+}
+
+static void *thread_handshakes_fct(void *arg)
+{
+    handshake_run *run = arg;
+
+    for (int i = 0; i < SCALING_HANDSHAKES && !run->failed; ++i) {
+        tls_engine client, server;
+        if (tls_engine_new(&client, run->client_ctx, 0) == -1) {
+            run->failed = 1;
+            break;
+        }
+        if (tls_engine_new(&server, run->server_ctx, 1) == -1) {
+            tls_engine_free(&client);
+            run->failed = 1;
+            break;
+        }
+        run->failed = handshake(&client, &server) == -1;
+        tls_engine_free(&client);
+        tls_engine_free(&server);
+    }
+    return NULL;
+}
+
+static double measure_scaling(SSL_CTX *server_ctx, int threads, int per_thread)
+{
+    handshake_run *runs = calloc((size_t)threads, sizeof(handshake_run));
+    SSL_CTX *shared_client = per_thread ? NULL : SSL_CTX_new(TLS_client_method());
+    if (runs == NULL || (!per_thread && shared_client == NULL)) {
+        free(runs);
+        return -1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < threads; ++i) {
+        runs[i].server_ctx = per_thread ? tls_context_clone(server_ctx, NULL) : server_ctx;
+        runs[i].client_ctx = per_thread ? tls_context_new(TLS_client_method()) : shared_client;
+        failed |= runs[i].server_ctx == NULL || runs[i].client_ctx == NULL;
+    }
+
+    double start = now_s();
+    int started = 0;
+    while (!failed && started < threads) {
+        failed = pthread_create(&runs[started].thread, NULL, thread_handshakes_fct, &runs[started]) != 0;
+        started += !failed;
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(runs[i].thread, NULL);
+        failed |= runs[i].failed;
+    }
+    double elapsed = now_s() - start;
+
+    for (int i = 0; i < threads && per_thread; ++i) {
+        SSL_CTX_free(runs[i].server_ctx);
+        SSL_CTX_free(runs[i].client_ctx);
+    }
+    SSL_CTX_free(shared_client);
+    free(runs);
+    return failed ? -1 : threads * SCALING_HANDSHAKES / elapsed;
+}
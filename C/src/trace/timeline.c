@@ -0,0 +1,361 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "timeline.h"
+#include "../conf.c"
+#include "../connexion/heartbeat.h"
+
+#define CATEGORY_MESSAGE "message"
+#define CATEGORY_HANDSHAKE "handshake"
+
+/**
+ * Recorded event, its strings are static
+ */
+typedef struct timeline_event {
+    uint64_t time_us;
+    const char *category;
+    const char *name;
+    const char *reason;
+    uint64_t length;
+    uint32_t id;
+    char phase;
+} timeline_event;
+
+/**
+ * Events of a thread, only written by this thread
+ */
+typedef struct timeline_buffer {
+    struct timeline_buffer *next;
+    pid_t tid;
+    char name[16];
+    size_t count;
+    unsigned long dropped;
+    timeline_event events[];
+} timeline_buffer;
+
+static atomic_int enabled;
+static atomic_uint generation;
+static atomic_uint next_message;
+static atomic_uint next_handshake;
+static uint64_t origin_us;
+static char *trace_path;
+static int handshake_index = -1;
+static timeline_buffer *buffers;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local timeline_buffer *local;
+static _Thread_local unsigned int local_generation;
+static _Thread_local uint32_t adopted;
+
+/**
+ * Record an event in the buffer of the calling thread
+ * @param phase     The Chrome trace phase: 'b' begins an asynchronous slice, 'e' ends it
+ * @param category  The category, the identifiers are unique within it
+ * @param name      The name of the slice
+ * @param id        The identifier of the message or handshake
+ * @param length    The size of the message, 0 if none
+ * @param reason    Why the slice ends, NULL if none
+ */
+static void record(char phase, const char *category, const char *name, uint32_t id, uint64_t length,
+                   const char *reason);
+
+/**
+ * Get the buffer of the calling thread, registering it on first use
+ * @return          The buffer, NULL if it can not be allocated
+ */
+static timeline_buffer *thread_buffer();
+
+/**
+ * Write the events of every thread as a Chrome trace
+ * @param file      The trace file
+ * @return          The number of events dropped because a buffer was full
+ */
+static unsigned long write_trace(FILE *file);
+
+/**
+ * Free function of the SSL ex data, ends a handshake which never completed
+ */
+static void on_ssl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+
+
+int timeline_start(const char *filepath)
+{
+    // Fail now rather than after the whole run
+    FILE *file = fopen(filepath, "w");
+    if (file == NULL) {
+        perror("Impossible to open the trace file");
+        return -1;
+    }
+    fclose(file);
+
+    if (handshake_index == -1) {
+        handshake_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, on_ssl_free);
+    }
+    free(trace_path);
+    trace_path = strdup(filepath);
+    origin_us = heartbeat_now_us();
+
+    // The buffers of a previous timeline are not used anymore
+    atomic_fetch_add(&generation, 1);
+    enabled = 1;
+    return 0;
+}
+
+void timeline_stop()
+{
+    if (!atomic_exchange(&enabled, 0)) {
+        return;
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL) {
+        perror("Impossible to write the trace file");
+    } else {
+        unsigned long dropped = write_trace(file);
+        fclose(file);
+        if (dropped > 0) {
+            fprintf(stderr, "Timeline: %lu events dropped, TIMELINE_BUFFER_EVENTS is too small\n", dropped);
+        }
+    }
+
+    while (buffers != NULL) {
+        timeline_buffer *next = buffers->next;
+        free(buffers);
+        buffers = next;
+    }
+    pthread_mutex_unlock(&buffers_lock);
+}
+
+uint32_t timeline_message_begin(const char *stage, size_t length)
+{
+    if (!enabled) {
+        return 0;
+    }
+
+    // 0 means untraced
+    uint32_t id = atomic_fetch_add(&next_message, 1) + 1;
+    if (id == 0) {
+        id = atomic_fetch_add(&next_message, 1) + 1;
+    }
+    record('b', CATEGORY_MESSAGE, "message", id, length, NULL);
+    record('b', CATEGORY_MESSAGE, stage, id, 0, NULL);
+    return id;
+}
+
+void timeline_message_step(uint32_t id, const char *stage)
+{
+    if (id == 0 || !enabled) {
+        return;
+    }
+    record('e', CATEGORY_MESSAGE, NULL, id, 0, NULL);
+    record('b', CATEGORY_MESSAGE, stage, id, 0, NULL);
+}
+
+void timeline_message_end(uint32_t id, const char *reason)
+{
+    if (id == 0 || !enabled) {
+        return;
+    }
+    record('e', CATEGORY_MESSAGE, NULL, id, 0, NULL);
+    record('e', CATEGORY_MESSAGE, "message", id, 0, reason);
+}
+
+void timeline_message_adopt(uint32_t id)
+{
+    adopted = id;
+}
+
+uint32_t timeline_message_take(size_t length)
+{
+    uint32_t id = adopted;
+    adopted = 0;
+    if (id == 0) {
+        return timeline_message_begin("scheduled", length);
+    }
+    timeline_message_step(id, "scheduled");
+    return id;
+}
+
+void timeline_acks_reset(timeline_acks *acks)
+{
+    acks->head = 0;
+    acks->count = 0;
+}
+
+void timeline_acks_written(timeline_acks *acks, uint32_t id, uint32_t ping)
+{
+    if (id == 0) {
+        return;
+    }
+
+    // The oldest message gives its place, its acknowledgment is not measured
+    if (acks->count == TIMELINE_ACK_WINDOW) {
+        timeline_message_end(acks->ids[acks->head], "unmeasured");
+        acks->head = (acks->head + 1) % TIMELINE_ACK_WINDOW;
+        acks->count--;
+    }
+
+    size_t tail = (acks->head + acks->count) % TIMELINE_ACK_WINDOW;
+    acks->ids[tail] = id;
+    acks->pings[tail] = ping;
+    acks->count++;
+    timeline_message_step(id, "written");
+}
+
+void timeline_acks_pong(timeline_acks *acks, uint32_t ping)
+{
+    // The messages are in the order of the pings following them
+    while (acks->count > 0 && (int32_t)(ping - acks->pings[acks->head]) >= 0) {
+        timeline_message_end(acks->ids[acks->head], "ack");
+        acks->head = (acks->head + 1) % TIMELINE_ACK_WINDOW;
+        acks->count--;
+    }
+}
+
+void timeline_acks_close(timeline_acks *acks)
+{
+    while (acks->count > 0) {
+        timeline_message_end(acks->ids[acks->head], "closed");
+        acks->head = (acks->head + 1) % TIMELINE_ACK_WINDOW;
+        acks->count--;
+    }
+}
+
+void timeline_handshake_info(const SSL *ssl, int where, int ret)
+{
+    if (!enabled || handshake_index == -1) {
+        return;
+    }
+
+    // The identifier of the handshake lives with the connection
+    SSL *connection = (SSL *)ssl;
+    uint32_t id = (uint32_t)(uintptr_t)SSL_get_ex_data(connection, handshake_index);
+
+    if (where & SSL_CB_HANDSHAKE_START) {
+        if (id == 0) {
+            id = atomic_fetch_add(&next_handshake, 1) + 1;
+            SSL_set_ex_data(connection, handshake_index, (void *)(uintptr_t)id);
+            record('b', CATEGORY_HANDSHAKE, "handshake", id, 0, NULL);
+            record('b', CATEGORY_HANDSHAKE, SSL_state_string_long(ssl), id, 0, NULL);
+        }
+
+    } else if (id != 0 && (where & SSL_CB_LOOP)) {
+        // Each state lasts until the next one
+        record('e', CATEGORY_HANDSHAKE, NULL, id, 0, NULL);
+        record('b', CATEGORY_HANDSHAKE, SSL_state_string_long(ssl), id, 0, NULL);
+
+    } else if (id != 0 && ((where & SSL_CB_HANDSHAKE_DONE)
+                           || ((where & SSL_CB_ALERT) && (ret >> 8) == SSL3_AL_FATAL))) {
+        SSL_set_ex_data(connection, handshake_index, NULL);
+        record('e', CATEGORY_HANDSHAKE, NULL, id, 0, NULL);
+        record('e', CATEGORY_HANDSHAKE, "handshake", id, 0,
+               (where & SSL_CB_HANDSHAKE_DONE) ? "done" : SSL_alert_desc_string_long(ret));
+    }
+}
+
+static void record(char phase, const char *category, const char *name, uint32_t id, uint64_t length,
+                   const char *reason)
+{
+    timeline_buffer *buffer = thread_buffer();
+    if (buffer == NULL) {
+        return;
+    }
+    if (buffer->count == TIMELINE_BUFFER_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+
+    timeline_event *event = &buffer->events[buffer->count++];
+    event->time_us = heartbeat_now_us() - origin_us;
+    event->category = category;
+    event->name = name;
+    event->reason = reason;
+    event->length = length;
+    event->id = id;
+    event->phase = phase;
+}
+
+static timeline_buffer *thread_buffer()
+{
+    unsigned int current = generation;
+    if (local != NULL && local_generation == current) {
+        return local;
+    }
+
+    local = malloc(sizeof(timeline_buffer) + TIMELINE_BUFFER_EVENTS * sizeof(timeline_event));
+    local_generation = current;
+    if (local == NULL) {
+        return NULL;
+    }
+    local->tid = (pid_t)syscall(SYS_gettid);
+    local->count = 0;
+    local->dropped = 0;
+    if (pthread_getname_np(pthread_self(), local->name, sizeof(local->name)) != 0) {
+        snprintf(local->name, sizeof(local->name), "%d", (int)local->tid);
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    local->next = buffers;
+    buffers = local;
+    pthread_mutex_unlock(&buffers_lock);
+    return local;
+}
+
+static unsigned long write_trace(FILE *file)
+{
+    unsigned long dropped = 0;
+    int pid = (int)getpid();
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"exploration_securite\"}}", pid);
+
+    for (timeline_buffer *buffer = buffers; buffer != NULL; buffer = buffer->next) {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                pid, (int)buffer->tid, buffer->name);
+
+        for (size_t i = 0; i < buffer->count; ++i) {
+            const timeline_event *event = &buffer->events[i];
+            // The end of a nested slice closes the last one begun, whatever its name
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"cat\":\"%s\",\"id\":\"0x%x\",\"ts\":%llu,"
+                          "\"pid\":%d,\"tid\":%d", event->name != NULL ? event->name : "", event->phase,
+                    event->category, event->id, (unsigned long long)event->time_us, pid, (int)buffer->tid);
+            if (event->length > 0) {
+                fprintf(file, ",\"args\":{\"length\":%llu}", (unsigned long long)event->length);
+            } else if (event->reason != NULL) {
+                fprintf(file, ",\"args\":{\"end\":\"%s\"}", event->reason);
+            }
+            fprintf(file, "}");
+        }
+        dropped += buffer->dropped;
+    }
+
+    fprintf(file, "\n]}\n");
+    return dropped;
+}
+
+static void on_ssl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    (void)parent;
+    (void)ad;
+    (void)idx;
+    (void)argl;
+    (void)argp;
+
+    // Connection freed during its handshake
+    uint32_t id = (uint32_t)(uintptr_t)ptr;
+    if (id != 0 && enabled) {
+        record('e', CATEGORY_HANDSHAKE, NULL, id, 0, NULL);
+        record('e', CATEGORY_HANDSHAKE, "handshake", id, 0, "aborted");
+    }
+}
@@ -0,0 +1,120 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#ifndef E5A_ISE_C_SSL_SECURE_CONNECTION_TIMELINE_H
+#define E5A_ISE_C_SSL_SECURE_CONNECTION_TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "openssl/ssl.h"
+
+/**
+ * Timeline of the messages and handshakes, written as a Chrome trace (JSON)
+ * that Perfetto and chrome://tracing open. Each thread records its events in a
+ * buffer of its own, without lock, and the file is written when the timeline
+ * stops.
+ * A message is an asynchronous slice, from its enqueue to its acknowledgment,
+ * cut in stages: enqueue and dequeue in the application, then scheduled,
+ * compress, encrypt and written in the connexion. A message written before a
+ * ping is acknowledged by its pong, the client has read everything before it.
+ * A handshake is an asynchronous slice cut in the states of the TLS state machine.
+ */
+
+// Messages written and waiting for a pong, per session
+#define TIMELINE_ACK_WINDOW 64
+
+/**
+ * Messages of a session waiting for their acknowledgment
+ */
+typedef struct timeline_acks {
+    uint32_t ids[TIMELINE_ACK_WINDOW];
+    uint32_t pings[TIMELINE_ACK_WINDOW];
+    size_t head;
+    size_t count;
+} timeline_acks;
+
+/**
+ * Start recording the timeline
+ * @param filepath  The path of the trace file, written by timeline_stop
+ * @return          0 on success, -1 on error
+ */
+int timeline_start(const char *filepath);
+
+/**
+ * Stop recording and write the trace file, once the threads recording events are stopped
+ */
+void timeline_stop();
+
+/**
+ * Start the timeline of a message, nothing is recorded when the timeline is not started
+ * @param stage     The first stage
+ * @param length    The size of the message
+ * @return          The identifier of the message, 0 when the timeline is not started
+ */
+uint32_t timeline_message_begin(const char *stage, size_t length);
+
+/**
+ * Enter the next stage of a message
+ * @param id        The identifier of the message, nothing is done for 0
+ * @param stage     The stage
+ */
+void timeline_message_step(uint32_t id, const char *stage);
+
+/**
+ * End the timeline of a message
+ * @param id        The identifier of the message, nothing is done for 0
+ * @param reason    Why the timeline ends: ack, closed...
+ */
+void timeline_message_end(uint32_t id, const char *reason);
+
+/**
+ * Hand a message over to the next timeline_message_take of the calling thread,
+ * the stages recorded by the connexion follow the ones of the application
+ * @param id        The identifier of the message
+ */
+void timeline_message_adopt(uint32_t id);
+
+/**
+ * Enter the scheduled stage of the message handed over by timeline_message_adopt, or start a new one there
+ * @param length    The size of the message
+ * @return          The identifier of the message, 0 when the timeline is not started
+ */
+uint32_t timeline_message_take(size_t length);
+
+/**
+ * Forget the messages waiting for an acknowledgment
+ * @param acks      The messages of a session
+ */
+void timeline_acks_reset(timeline_acks *acks);
+
+/**
+ * Wait for the acknowledgment of a written message
+ * @param acks      The messages of the session
+ * @param id        The identifier of the message, nothing is done for 0
+ * @param ping      The sequence number of the next ping of the session
+ */
+void timeline_acks_written(timeline_acks *acks, uint32_t id, uint32_t ping);
+
+/**
+ * Acknowledge the messages written before a ping
+ * @param acks      The messages of the session
+ * @param ping      The sequence number of the ping, echoed by the pong
+ */
+void timeline_acks_pong(timeline_acks *acks, uint32_t ping);
+
+/**
+ * End the messages of a closed session
+ * @param acks      The messages of the session
+ */
+void timeline_acks_close(timeline_acks *acks);
+
+/**
+ * SSL info callback recording the states of the handshakes
+ * @param ssl       The connection
+ * @param where     The event, SSL_CB_*
+ * @param ret       The return value or alert of the event
+ */
+void timeline_handshake_info(const SSL *ssl, int where, int ret);
+
+#endif //E5A_ISE_C_SSL_SECURE_CONNECTION_TIMELINE_H
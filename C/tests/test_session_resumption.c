@@ -0,0 +1,202 @@
+//
+// Created by jordan on 19/10/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "openssl/err.h"
+#include "openssl/evp.h"
+#include "openssl/pem.h"
+#include "openssl/x509.h"
+#include "openssl/x509v3.h"
+
+#include "../src/tls/client_auth.h"
+#include "../src/tls/tls_context.h"
+#include "../src/tls/tls_engine.h"
+
+/**
+ * Create a certificate for a new P-256 key
+ * @param name      The common name of the certificate
+ * @param issuer    The certificate of the issuer, NULL for a self-signed one
+ * @param signer    The key of the issuer, NULL for a self-signed one
+ * @param key       Filled with the new key
+ * @return          The certificate, NULL on error
+ */
+static X509 *make_certificate(const char *name, X509 *issuer, EVP_PKEY *signer, EVP_PKEY **key);
+
+/**
+ * Run a handshake between two engines fed by each other
+ * @param client    The client engine
+ * @param server    The server engine
+ * @return          0 once established, -1 on failure
+ */
+static int handshake(tls_engine *client, tls_engine *server);
+
+/**
+ * Connect a client to a server context, resuming a session if given
+ * @param client_ctx    The client context
+ * @param server_ctx    The server context
+ * @param session       The session to resume, NULL for a full handshake
+ * @param resumed       Filled with 1 if the session was resumed
+ * @return              The session of the connection, NULL if the handshake failed
+ */
+static SSL_SESSION *connect_once(SSL_CTX *client_ctx, SSL_CTX *server_ctx, SSL_SESSION *session, int *resumed);
+
+
+/**
+ * A client presenting a certificate resumes its session, on the context which
+ * issued it and on a clone of it as the sharded backend does
+ */
+int main()
+{
+    if (tls_context_init() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    EVP_PKEY *ca_key, *server_key, *client_key;
+    X509 *ca = make_certificate("test CA", NULL, NULL, &ca_key);
+    X509 *server_cert = make_certificate("server", ca, ca_key, &server_key);
+    X509 *client_cert = make_certificate("client", ca, ca_key, &client_key);
+    if (ca == NULL || server_cert == NULL || client_cert == NULL) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+
+    // client_auth_init reads the authorities from a file
+    char ca_path[] = "/tmp/test_session_resumption_XXXXXX";
+    int fd = mkstemp(ca_path);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+    if (file == NULL || PEM_write_X509(file, ca) != 1) {
+        perror("CA file");
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+
+    // Same protocol as the server
+    SSL_CTX *server_ctx = tls_context_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(server_ctx, TLS1_2_VERSION);
+    SSL_CTX_use_certificate(server_ctx, server_cert);
+    SSL_CTX_use_PrivateKey(server_ctx, server_key);
+    int auth = client_auth_init(server_ctx, ca_path);
+    unlink(ca_path);
+    SSL_CTX *clone_ctx = auth == 0 ? tls_context_clone(server_ctx, NULL) : NULL;
+
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_use_certificate(client_ctx, client_cert);
+    SSL_CTX_use_PrivateKey(client_ctx, client_key);
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT);
+
+    int resumed = 0;
+    int resumed_clone = 0;
+    SSL_SESSION *session = clone_ctx != NULL ? connect_once(client_ctx, server_ctx, NULL, &resumed) : NULL;
+    SSL_SESSION *again = session != NULL ? connect_once(client_ctx, server_ctx, session, &resumed) : NULL;
+    SSL_SESSION *cloned = session != NULL ? connect_once(client_ctx, clone_ctx, session, &resumed_clone) : NULL;
+
+    printf("Resumption with a client certificate : %s\n", resumed ? "ok" : "FAILED");
+    printf("Resumption on a cloned context : %s\n", resumed_clone ? "ok" : "FAILED");
+
+    SSL_SESSION_free(session);
+    SSL_SESSION_free(again);
+    SSL_SESSION_free(cloned);
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(clone_ctx);
+    SSL_CTX_free(server_ctx);
+    X509_free(ca);
+    X509_free(server_cert);
+    X509_free(client_cert);
+    EVP_PKEY_free(ca_key);
+    EVP_PKEY_free(server_key);
+    EVP_PKEY_free(client_key);
+    tls_context_free();
+    return resumed && resumed_clone ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static X509 *make_certificate(const char *name, X509 *issuer, EVP_PKEY *signer, EVP_PKEY **key)
+{
+    static long serial = 1;
+
+    *key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    X509 *cert = X509_new();
+    if (*key == NULL || cert == NULL) {
+        X509_free(cert);
+        return NULL;
+    }
+
+    X509_set_version(cert, X509_VERSION_3);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial++);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, *key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)name, -1, -1,
+                               0);
+    X509_set_issuer_name(cert, X509_get_subject_name(issuer != NULL ? issuer : cert));
+
+    // OpenSSL only accepts a version 3 issuer marked as an authority
+    if (issuer == NULL) {
+        X509_EXTENSION *constraints = X509V3_EXT_conf_nid(NULL, NULL, NID_basic_constraints, "critical,CA:TRUE");
+        X509_add_ext(cert, constraints, -1);
+        X509_EXTENSION_free(constraints);
+    }
+    if (X509_sign(cert, signer != NULL ? signer : *key, EVP_sha256()) == 0) {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+static int handshake(tls_engine *client, tls_engine *server)
+{
+    uint8_t buffer[16384];
+    size_t length;
+
+    // Each flight of one side unblocks the other side
+    for (int round = 0; round < 10; ++round) {
+        int client_done = tls_engine_handshake(client);
+        while ((length = tls_engine_take(client, buffer, sizeof(buffer))) > 0) {
+            tls_engine_feed(server, buffer, length);
+        }
+        int server_done = tls_engine_handshake(server);
+        while ((length = tls_engine_take(server, buffer, sizeof(buffer))) > 0) {
+            tls_engine_feed(client, buffer, length);
+        }
+
+        if (client_done == -1 || server_done == -1) {
+            return -1;
+        }
+        if (client_done == 1 && server_done == 1) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static SSL_SESSION *connect_once(SSL_CTX *client_ctx, SSL_CTX *server_ctx, SSL_SESSION *session, int *resumed)
+{
+    tls_engine client, server;
+    if (tls_engine_new(&client, client_ctx, 0) == -1) {
+        return NULL;
+    }
+    if (tls_engine_new(&server, server_ctx, 1) == -1) {
+        tls_engine_free(&client);
+        return NULL;
+    }
+    if (session != NULL) {
+        SSL_set_session(client.ssl, session);
+    }
+
+    SSL_SESSION *result = NULL;
+    if (handshake(&client, &server) == 0) {
+        *resumed = SSL_session_reused(client.ssl);
+        result = SSL_get1_session(client.ssl);
+
+        // A session closed without close notify is no longer resumable
+        tls_engine_shutdown(&client);
+    } else {
+        ERR_print_errors_fp(stderr);
+    }
+    tls_engine_free(&client);
+    tls_engine_free(&server);
+    return result;
+}